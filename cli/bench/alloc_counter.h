@@ -0,0 +1,67 @@
+// Heap allocation counting for the benchmarks.
+//
+// Defines malloc, calloc and realloc for the whole program, forwarding to
+// glibc's allocator, so every heap allocation is counted whoever makes it:
+// operator new, OpenSSL, zlib. free() is left alone, as the memory still
+// comes from glibc. Replacing operator new and delete instead would have
+// GCC see the replaced delete's free() inlined wherever a container drops
+// memory from new, and report each as -Wmismatched-new-delete.
+//
+// Defines those functions, so include it in one translation unit only;
+// each benchmark is one. Elsewhere than glibc nothing is counted.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+
+namespace bench {
+
+// Allocations by every thread so far
+inline std::atomic<size_t> heap_allocations_total{0};
+
+// Allocations by the calling thread so far
+inline thread_local size_t heap_allocations_here = 0;
+
+inline size_t heap_allocations() {
+    return heap_allocations_total.load(std::memory_order_relaxed);
+}
+
+inline size_t thread_heap_allocations() {
+    return heap_allocations_here;
+}
+
+inline void count_heap_allocation() {
+    heap_allocations_total.fetch_add(1, std::memory_order_relaxed);
+    ++heap_allocations_here;
+}
+
+} // namespace bench
+
+#if defined(__GLIBC__)
+
+extern "C" {
+
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+
+void* malloc(size_t size) noexcept {
+    bench::count_heap_allocation();
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) noexcept {
+    bench::count_heap_allocation();
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) noexcept {
+    bench::count_heap_allocation();
+    return __libc_realloc(ptr, size);
+}
+
+} // extern "C"
+
+#endif
@@ -0,0 +1,338 @@
+// Micro-benchmarks for the crypto primitives behind the vault.
+//
+// Covers encrypt_data/decrypt_data for both ciphers, CryptoImpl::sha256 and
+// CryptoImpl::hmac_sha256 over payloads from 64 B to 64 MB, and
+// derive_key_from_password over a grid of Argon2id parameters, the
+// buffered CSPRNG (UUIDs, nonces, salts per second) against the per-call
+// generators it replaced, and secure arena allocation, alone and with other
+// threads allocating at the same time. Each case reports ns/byte, throughput, latency
+// percentiles and allocations per operation (heap allocations from anywhere,
+// C++ and OpenSSL alike, plus secure arena allocations) as JSON, so runs on
+// different platforms can be diffed.
+//
+// Usage: bench_crypto [--quick] [--max-size BYTES] [--min-time SECONDS]
+//                     [--kdf none|default|grid] [--out FILE]
+
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <atomic>
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
+#include "../../core/src/crypto/secure_memory.cpp"
+#include "../../core/src/crypto/random.cpp"
+#include "../../core/src/crypto/crypto.cpp"
+#include "alloc_counter.h"
+
+using namespace localpdub;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+const char* build_arch() {
+#if defined(__x86_64__)
+    return "x86_64";
+#elif defined(__aarch64__)
+    return "arm64";
+#elif defined(__arm__)
+    return "arm32";
+#else
+    return "unknown";
+#endif
+}
+
+struct Options {
+    size_t max_size = size_t(64) << 20;
+    double min_time = 0.25;              // Seconds per case
+    std::string kdf = "grid";
+    std::string out;
+};
+
+constexpr size_t MIN_ITERATIONS = 5;
+constexpr size_t MAX_ITERATIONS = 200000;
+
+double percentile(const std::vector<double>& sorted, double p) {
+    size_t idx = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(idx, sorted.size() - 1)];
+}
+
+// Time fn until min_time has passed (and at least MIN_ITERATIONS samples),
+// after one untimed warm-up call. Each sample times `batch` calls so that
+// operations far shorter than a clock read can still be resolved.
+template<typename Fn>
+nlohmann::json measure(const Options& opts, size_t bytes, Fn&& fn, size_t batch = 1) {
+    fn();
+
+    std::vector<double> samples;
+    size_t heap_before = bench::heap_allocations();
+    size_t secure_before = crypto::SecureArena::instance().stats().allocations;
+    auto deadline = Clock::now() + std::chrono::duration<double>(opts.min_time);
+
+    while (samples.size() < MIN_ITERATIONS ||
+           (Clock::now() < deadline && samples.size() < MAX_ITERATIONS)) {
+        auto start = Clock::now();
+        for (size_t i = 0; i < batch; ++i) {
+            fn();
+        }
+        samples.push_back(std::chrono::duration<double, std::nano>(Clock::now() - start).count() / batch);
+    }
+
+    size_t heap = bench::heap_allocations() - heap_before;
+    size_t secure = crypto::SecureArena::instance().stats().allocations - secure_before;
+    size_t n = samples.size() * batch;
+
+    std::sort(samples.begin(), samples.end());
+    double p50 = percentile(samples, 0.50);
+
+    nlohmann::json result;
+    result["bytes"] = bytes;
+    result["iterations"] = n;
+    if (bytes > 0) {
+        result["ns_per_byte"] = p50 / bytes;
+        result["mb_per_s"] = bytes / p50 * 1e3;
+    }
+    result["ops_per_s"] = 1e9 / p50;
+    result["latency_ns"] = {
+        {"p50", p50},
+        {"p90", percentile(samples, 0.90)},
+        {"p99", percentile(samples, 0.99)},
+        {"max", samples.back()}
+    };
+    result["heap_allocs_per_op"] = static_cast<double>(heap) / n;
+    result["secure_allocs_per_op"] = static_cast<double>(secure) / n;
+    return result;
+}
+
+std::vector<size_t> payload_sizes(size_t max_size) {
+    std::vector<size_t> sizes;
+    for (size_t size = 64; size <= max_size; size *= 4) {
+        sizes.push_back(size);
+    }
+    return sizes;
+}
+
+std::vector<crypto::KdfParams> kdf_grid(const std::string& mode) {
+    if (mode == "none") {
+        return {};
+    }
+    if (mode == "default") {
+        return {crypto::default_kdf_params()};
+    }
+    std::vector<crypto::KdfParams> grid;
+    for (uint32_t t : {1u, 3u}) {
+        for (uint32_t m : {16384u, 65536u}) {
+            for (uint32_t p : {1u, 4u}) {
+                grid.push_back({t, m, p});
+            }
+        }
+    }
+    return grid;
+}
+
+// UUID generation as vault_storage did it before the buffered CSPRNG
+std::string uuid_mt19937() {
+    std::random_device rd;
+    std::mt19937 gen(rd());
+    std::uniform_int_distribution<> dis(0, 15);
+
+    std::stringstream ss;
+    for (int i = 0; i < 36; i++) {
+        if (i == 8 || i == 13 || i == 18 || i == 23) {
+            ss << "-";
+        } else if (i == 14) {
+            ss << "4";
+        } else {
+            ss << std::hex << dis(gen);
+        }
+    }
+    return ss.str();
+}
+
+// Nonce generation as crypto.cpp did it before: one RAND_bytes per nonce
+std::vector<uint8_t> nonce_rand_bytes() {
+    std::vector<uint8_t> nonce(crypto::AEAD_NONCE_SIZE);
+    if (RAND_bytes(nonce.data(), crypto::AEAD_NONCE_SIZE) != 1) {
+        throw std::runtime_error("RAND_bytes failed");
+    }
+    return nonce;
+}
+
+bool parse_args(int argc, char* argv[], Options& opts) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--quick") {
+            opts.max_size = size_t(1) << 20;
+            opts.min_time = 0.05;
+            opts.kdf = "default";
+        } else if (arg == "--max-size" && has_value) {
+            opts.max_size = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--min-time" && has_value) {
+            opts.min_time = std::atof(argv[++i]);
+        } else if (arg == "--kdf" && has_value) {
+            opts.kdf = argv[++i];
+            if (opts.kdf != "none" && opts.kdf != "default" && opts.kdf != "grid") {
+                return false;
+            }
+        } else if (arg == "--out" && has_value) {
+            opts.out = argv[++i];
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    Options opts;
+    if (!parse_args(argc, argv, opts)) {
+        std::cerr << "Usage: " << argv[0]
+                  << " [--quick] [--max-size BYTES] [--min-time SECONDS]"
+                     " [--kdf none|default|grid] [--out FILE]\n";
+        return 2;
+    }
+
+    const auto salt = crypto::generate_salt();
+    const crypto::SecureBytes key(salt.begin(), salt.end());
+    const std::vector<uint8_t> mac_key(salt.begin(), salt.end());
+
+    nlohmann::json report;
+    report["platform"] = {
+        {"arch", build_arch()},
+        {"compiler", __VERSION__},
+        {"openssl", OpenSSL_version(OPENSSL_VERSION)},
+        {"hardware_aes", crypto::has_hardware_aes()},
+        {"preferred_cipher", crypto::cipher_name(crypto::preferred_cipher())}
+    };
+    report["config"] = {
+        {"max_size", opts.max_size},
+        {"min_time_s", opts.min_time},
+        {"kdf", opts.kdf}
+    };
+    report["results"] = nlohmann::json::array();
+
+    auto record = [&](const char* op, const char* variant, nlohmann::json result) {
+        std::cerr << "  " << op << (variant[0] ? " " : "") << variant
+                  << " " << result["bytes"].get<size_t>() << " B: "
+                  << result["latency_ns"]["p50"].get<double>() << " ns p50\n";
+        result["op"] = op;
+        if (variant[0]) {
+            result["variant"] = variant;
+        }
+        report["results"].push_back(std::move(result));
+    };
+
+    for (size_t size : payload_sizes(opts.max_size)) {
+        crypto::SecureString plaintext(size, 'x');
+        std::vector<uint8_t> data(size, 0x5a);
+
+        for (auto cipher : {crypto::Cipher::AES_256_GCM, crypto::Cipher::CHACHA20_POLY1305}) {
+            const char* name = crypto::cipher_name(cipher);
+            auto sealed = crypto::encrypt_data(plaintext, key, cipher);
+
+            record("encrypt_data", name, measure(opts, size, [&]() {
+                auto out = crypto::encrypt_data(plaintext, key, cipher);
+            }));
+            record("decrypt_data", name, measure(opts, size, [&]() {
+                auto out = crypto::decrypt_data(sealed, key, cipher);
+            }));
+        }
+
+        record("sha256", "", measure(opts, size, [&]() {
+            auto out = crypto::CryptoImpl::sha256(data);
+        }));
+        record("hmac_sha256", "", measure(opts, size, [&]() {
+            auto out = crypto::CryptoImpl::hmac_sha256(data, mac_key);
+        }));
+    }
+
+    // Random IDs, nonces and salts: buffered CSPRNG vs per-call generators
+    constexpr size_t RNG_BATCH = 256;
+    record("generate_uuid", "buffered", measure(opts, 0, []() {
+        auto id = crypto::generate_uuid();
+    }, RNG_BATCH));
+    record("generate_uuid", "mt19937", measure(opts, 0, []() {
+        auto id = uuid_mt19937();
+    }, RNG_BATCH));
+    record("generate_nonce", "buffered", measure(opts, 0, []() {
+        auto nonce = crypto::generate_nonce();
+    }, RNG_BATCH));
+    record("generate_nonce", "RAND_bytes", measure(opts, 0, []() {
+        auto nonce = nonce_rand_bytes();
+    }, RNG_BATCH));
+    record("generate_salt", "buffered", measure(opts, 0, []() {
+        auto salt = crypto::generate_salt();
+    }, RNG_BATCH));
+
+    // Secure arena: one operation is a burst of blocks allocated then
+    // released, as a JSON DOM or a decrypted payload would; then with other
+    // threads doing the same
+    constexpr size_t ARENA_BURST = 64;
+    constexpr size_t ARENA_BATCH = 16;
+    constexpr int ARENA_THREADS = 3;
+    for (size_t size : {64, 1024, 16384}) {
+        auto burst = [size]() {
+            void* blocks[ARENA_BURST];
+            auto& arena = crypto::SecureArena::instance();
+            for (auto& block : blocks) {
+                block = arena.allocate(size);
+            }
+            for (auto* block : blocks) {
+                arena.deallocate(block, size);
+            }
+        };
+        record("secure_arena", "alone", measure(opts, size, burst, ARENA_BATCH));
+
+        std::atomic<bool> stop{false};
+        std::vector<std::thread> others;
+        for (int i = 0; i < ARENA_THREADS; ++i) {
+            others.emplace_back([&stop, &burst]() {
+                while (!stop.load(std::memory_order_relaxed)) {
+                    burst();
+                }
+            });
+        }
+        record("secure_arena", "contended", measure(opts, size, burst, ARENA_BATCH));
+        stop = true;
+        for (auto& thread : others) {
+            thread.join();
+        }
+    }
+
+    const crypto::SecureString password("correct horse battery staple");
+    for (const auto& params : kdf_grid(opts.kdf)) {
+        auto result = measure(opts, 0, [&]() {
+            auto out = crypto::derive_key_from_password(password, salt, params);
+        });
+        result["kdf"] = {
+            {"time_cost", params.time_cost},
+            {"memory_kib", params.memory_kib},
+            {"parallelism", params.parallelism}
+        };
+        record("derive_key_from_password", "argon2id", std::move(result));
+    }
+
+    if (opts.out.empty()) {
+        std::cout << report.dump(2) << "\n";
+    } else {
+        std::ofstream file(opts.out);
+        if (!file) {
+            std::cerr << "Cannot write " << opts.out << "\n";
+            return 1;
+        }
+        file << report.dump(2) << "\n";
+        std::cerr << "Wrote " << opts.out << "\n";
+    }
+
+    return 0;
+}
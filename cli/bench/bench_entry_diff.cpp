@@ -0,0 +1,265 @@
+// Sync diff and apply: the hash-join engine in entry_diff.cpp against the
+// nested scans SyncManager used before.
+//
+// For n entries per side, the vaults share ids with 1% changed on each side
+// and 1% unique to each side. "diff" finds what to send and receive and
+// fetches the bodies to send; "apply" merges n/10 incoming entries, half of
+// them new. The old scans are O(n·m) and skipped above --baseline-max.
+//
+// Usage: bench_entry_diff [--repeats N] [--baseline-max N]
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include "../../core/src/crypto/secure_memory.cpp"
+#include "../../core/src/crypto/random.cpp"
+#include "../../core/src/sync/entry_diff.cpp"
+
+using namespace localpdub;
+using sync::json;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+struct Workload {
+    json local_entries = json::array();
+    std::vector<sync::EntryDigest> local;
+    std::vector<sync::EntryDigest> remote;
+    std::vector<json> incoming;
+};
+
+json make_entry(const std::string& id, long modified) {
+    return {
+        {"id", id},
+        {"title", "Account " + id.substr(0, 8)},
+        {"username", "user@example.com"},
+        {"password", "correct horse battery staple"},
+        {"modified", modified}
+    };
+}
+
+sync::EntryDigest make_digest(const std::string& id, long modified, const std::string& hash) {
+    sync::EntryDigest digest;
+    digest.id = id;
+    digest.modified = std::chrono::system_clock::from_time_t(modified);
+    digest.hash = hash;
+    return digest;
+}
+
+Workload make_workload(size_t n) {
+    Workload w;
+    size_t percent = std::max<size_t>(n / 100, 1);
+
+    for (size_t i = 0; i < n; ++i) {
+        std::string id = crypto::generate_uuid();
+        std::string hash = std::to_string(i);
+        long local_time = 1000;
+        long remote_time = 1000;
+        std::string remote_hash = hash;
+
+        if (i < percent) {
+            local_time = 2000;           // Changed locally
+            hash += "l";
+        } else if (i < 2 * percent) {
+            remote_time = 2000;          // Changed remotely
+            remote_hash += "r";
+        }
+
+        if (i >= n - percent) {
+            // Unique to the local side
+            w.local.push_back(make_digest(id, local_time, hash));
+            w.local_entries.push_back(make_entry(id, local_time));
+            w.remote.push_back(make_digest(crypto::generate_uuid(), remote_time, remote_hash));
+            continue;
+        }
+
+        w.local.push_back(make_digest(id, local_time, hash));
+        w.local_entries.push_back(make_entry(id, local_time));
+        w.remote.push_back(make_digest(id, remote_time, remote_hash));
+    }
+
+    // Apply input: n/10 entries, half updates of existing ids, half new
+    size_t count = std::max<size_t>(n / 10, 2);
+    for (size_t i = 0; i < count; ++i) {
+        std::string id = (i % 2 == 0) ? w.local[(i * 7919) % n].id : crypto::generate_uuid();
+        w.incoming.push_back(make_entry(id, 3000));
+    }
+    return w;
+}
+
+json newest(const json& local_entry, const json& remote_entry) {
+    return local_entry["modified"].get<long>() >= remote_entry["modified"].get<long>() ?
+        local_entry : remote_entry;
+}
+
+// What SyncManager::find_entries_to_send did: find_if over the remote
+// digest per local entry, then a linear scan of the vault for the body
+std::vector<json> nested_send(const json& vault,
+                              const std::vector<sync::EntryDigest>& local,
+                              const std::vector<sync::EntryDigest>& remote) {
+    std::vector<json> out;
+    for (const auto& local_entry : local) {
+        auto remote_it = std::find_if(remote.begin(), remote.end(),
+            [&local_entry](const sync::EntryDigest& rd) { return rd.id == local_entry.id; });
+
+        bool should_send = remote_it == remote.end() ||
+            (local_entry.hash != remote_it->hash && local_entry.modified > remote_it->modified);
+        if (should_send) {
+            for (const auto& entry : vault) {
+                if (entry.is_object() && entry.contains("id") && entry["id"] == local_entry.id) {
+                    out.push_back(entry);
+                    break;
+                }
+            }
+        }
+    }
+    return out;
+}
+
+// The receive side of the same diff, as a mirror of the above
+std::vector<std::string> nested_receive(const std::vector<sync::EntryDigest>& local,
+                                        const std::vector<sync::EntryDigest>& remote) {
+    std::vector<std::string> out;
+    for (const auto& remote_entry : remote) {
+        auto local_it = std::find_if(local.begin(), local.end(),
+            [&remote_entry](const sync::EntryDigest& ld) { return ld.id == remote_entry.id; });
+        if (local_it == local.end() ||
+            (remote_entry.hash != local_it->hash && remote_entry.modified > local_it->modified)) {
+            out.push_back(remote_entry.id);
+        }
+    }
+    return out;
+}
+
+std::vector<json> hashed_send(const json& vault, const std::vector<std::string>& ids) {
+    sync::EntryIndex index(vault);
+    std::vector<json> out;
+    out.reserve(ids.size());
+    for (const auto& id : ids) {
+        size_t position = index.find(id);
+        if (position != sync::EntryIndex::npos) {
+            out.push_back(vault[position]);
+        }
+    }
+    return out;
+}
+
+// What SyncManager::apply_changes did: find_if over the vault per entry
+void nested_apply(json& vault, const std::vector<json>& incoming) {
+    for (const auto& remote_entry : incoming) {
+        std::string entry_id = remote_entry["id"];
+        auto local_it = std::find_if(vault.begin(), vault.end(),
+            [&entry_id](const json& e) { return e["id"] == entry_id; });
+        if (local_it == vault.end()) {
+            vault.push_back(remote_entry);
+        } else {
+            *local_it = newest(*local_it, remote_entry);
+        }
+    }
+}
+
+template<typename Fn>
+double best_seconds(int repeats, Fn&& fn) {
+    double best = 1e30;
+    for (int r = 0; r < repeats; ++r) {
+        auto start = Clock::now();
+        fn();
+        double s = std::chrono::duration<double>(Clock::now() - start).count();
+        best = std::min(best, s);
+    }
+    return best;
+}
+
+void report(const char* label, double seconds, double baseline) {
+    std::cout << "    " << std::left << std::setw(18) << label
+              << std::right << std::setw(12) << std::fixed << std::setprecision(3)
+              << (seconds * 1e3) << " ms";
+    if (baseline > 0) {
+        std::cout << std::setw(10) << std::setprecision(1) << (baseline / seconds) << "x";
+    }
+    std::cout << "\n";
+}
+
+void report_skipped(const char* label) {
+    std::cout << "    " << std::left << std::setw(18) << label
+              << std::right << std::setw(15) << "skipped" << "\n";
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    int repeats = 3;
+    size_t baseline_max = 10000;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--repeats") == 0 && i + 1 < argc) {
+            repeats = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--baseline-max") == 0 && i + 1 < argc) {
+            baseline_max = std::strtoull(argv[++i], nullptr, 10);
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--repeats N] [--baseline-max N]\n";
+            return 2;
+        }
+    }
+
+    std::cout << "Sync diff/apply: hash join vs nested scans (best of " << repeats << ")\n";
+
+    for (size_t n : {size_t(1000), size_t(10000), size_t(100000)}) {
+        Workload w = make_workload(n);
+        bool baseline = n <= baseline_max;
+        std::cout << "\n  " << n << " entries per side, " << w.incoming.size() << " incoming\n";
+
+        // Diff: what to send (with bodies) and what to request
+        auto diff = sync::diff_digests(w.local, w.remote);
+        auto sent = hashed_send(w.local_entries, diff.to_send);
+        double nested_diff = 0;
+        if (baseline) {
+            if (nested_send(w.local_entries, w.local, w.remote) != sent ||
+                nested_receive(w.local, w.remote) != diff.to_receive) {
+                std::cerr << "Hash join diff differs from nested scan\n";
+                return 1;
+            }
+            nested_diff = best_seconds(repeats, [&]() {
+                nested_send(w.local_entries, w.local, w.remote);
+                nested_receive(w.local, w.remote);
+            });
+            report("diff, nested", nested_diff, nested_diff);
+        } else {
+            report_skipped("diff, nested");
+        }
+        report("diff, hash join", best_seconds(repeats, [&]() {
+            auto d = sync::diff_digests(w.local, w.remote);
+            hashed_send(w.local_entries, d.to_send);
+        }), nested_diff);
+
+        // Apply: merge incoming entries into a copy of the vault
+        json merged = w.local_entries;
+        sync::merge_entries(merged, w.incoming, newest);
+        double nested_apply_s = 0;
+        if (baseline) {
+            json expected = w.local_entries;
+            nested_apply(expected, w.incoming);
+            if (expected != merged) {
+                std::cerr << "Merged entries differ from nested apply\n";
+                return 1;
+            }
+            nested_apply_s = best_seconds(repeats, [&]() {
+                json vault = w.local_entries;
+                nested_apply(vault, w.incoming);
+            });
+            report("apply, nested", nested_apply_s, nested_apply_s);
+        } else {
+            report_skipped("apply, nested");
+        }
+        report("apply, hash join", best_seconds(repeats, [&]() {
+            json vault = w.local_entries;
+            sync::merge_entries(vault, w.incoming, newest);
+        }), nested_apply_s);
+    }
+
+    return 0;
+}
@@ -0,0 +1,220 @@
+// Sending entry batches: the ENTRIES message built as one JSON document
+// and dumped to a string, as sync used to, against the message gathered
+// from each entry's cached JSON text (EncodedEntry) and sent through
+// FrameChannel without copying the pieces together.
+//
+// Batches go over a socketpair to a thread that reads and discards them, on
+// a sealed channel with and without deflate. Each case runs twice over the
+// same entries: the first gathered pass encodes every entry, the second
+// finds them all cached. Reports throughput and allocations per batch on
+// the sending thread, heap and secure arena together; an unchanged resend
+// should allocate nothing.
+//
+// Usage: bench_entry_send [--entries N] [--notes BYTES]
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <thread>
+#include <cstdlib>
+#include <cstring>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "../../core/src/crypto/secure_memory.cpp"
+#include "../../core/src/crypto/random.cpp"
+#include "../../core/src/storage/entry_hash.cpp"
+#include "../../core/src/storage/change_feed.cpp"
+#include "../../core/src/crypto/crypto.cpp"
+#include "../../core/src/sync/compression.cpp"
+#include "../../core/src/sync/secure_channel.cpp"
+#include "../../core/src/sync/framing.cpp"
+#include "../../core/src/sync/digest_tree.cpp"
+#include "../../core/src/sync/entry_diff.cpp"
+#include "../../core/src/sync/entry_delta.cpp"
+#include "../../core/src/sync/entry_store.cpp"
+#include "alloc_counter.h"
+
+using namespace localpdub;
+using sync::json;
+using sync::EntryRef;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+constexpr size_t BATCH_SIZE = 1000;  // SyncManager::ENTRY_BATCH_SIZE
+
+size_t allocations() {
+    return bench::thread_heap_allocations() + crypto::SecureArena::instance().stats().allocations;
+}
+
+std::vector<EntryRef> make_entries(size_t count, size_t notes) {
+    std::vector<EntryRef> entries;
+    entries.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        std::string n = std::to_string(i);
+        entries.push_back(std::make_shared<const sync::EncodedEntry>(json{
+            {"id", "entry-" + n},
+            {"title", "Account " + n},
+            {"username", "user" + n + "@example.com"},
+            {"password", "p@ss-" + n + "-" + std::to_string(i * 7919 % 100003)},
+            {"url", "https://site" + n + ".example.com/login"},
+            {"notes", std::string(notes, static_cast<char>('a' + i % 26))},
+            {"modified", 1700000000 + static_cast<int64_t>(i)}
+        }));
+    }
+    return entries;
+}
+
+// How sync built a batch before: copy the entries into one document, dump it
+crypto::SecureString whole_batch(const std::vector<EntryRef>& entries, size_t& position) {
+    size_t end = std::min(entries.size(), position + BATCH_SIZE);
+    json batch = json::array();
+    for (size_t i = position; i < end; ++i) {
+        batch.push_back(entries[i]->value());
+    }
+    position = end;
+    json msg = {{"entries", std::move(batch)}, {"more", end < entries.size()}};
+    return msg.dump();
+}
+
+// The same message as pieces, the way SyncManager::next_entry_batch lays it out
+void gathered_batch(const std::vector<EntryRef>& entries, size_t& position, std::vector<struct iovec>& pieces) {
+    static const char OPEN[] = "{\"entries\":[";
+    static const char COMMA[] = ",";
+    static const char CLOSE_MORE[] = "],\"more\":true}";
+    static const char CLOSE_LAST[] = "],\"more\":false}";
+    size_t end = std::min(entries.size(), position + BATCH_SIZE);
+    pieces.clear();
+    pieces.push_back({const_cast<char*>(OPEN), sizeof(OPEN) - 1});
+    for (size_t i = position; i < end; ++i) {
+        if (i > position) {
+            pieces.push_back({const_cast<char*>(COMMA), 1});
+        }
+        const auto& text = entries[i]->encoded();
+        pieces.push_back({const_cast<char*>(text.data()), text.size()});
+    }
+    const char* close = end < entries.size() ? CLOSE_MORE : CLOSE_LAST;
+    pieces.push_back({const_cast<char*>(close), std::strlen(close)});
+    position = end;
+}
+
+struct Pass {
+    double seconds = 0;
+    size_t payload = 0;
+    size_t allocations = 0;
+    size_t batches = 0;
+};
+
+template<typename SendAll>
+Pass run_pass(bool compress, SendAll&& send_all) {
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0) {
+        std::cerr << "socketpair failed\n";
+        std::exit(1);
+    }
+    std::thread drain([fd = sockets[1]]() {
+        std::vector<uint8_t> buffer(256 * 1024);
+        while (read(fd, buffer.data(), buffer.size()) > 0) {
+        }
+    });
+
+    Pass pass;
+    {
+        crypto::SecureBytes shared(32, 0x42);
+        uint8_t transcript[sync::TRANSCRIPT_HASH_SIZE] = {};
+        auto keys = sync::derive_session_keys(crypto::Cipher::AES_256_GCM, sync::empty_psk(), shared, transcript);
+        sync::FrameChannel channel(sockets[0]);
+        channel.set_ciphers(keys.client_cipher(), keys.server_cipher());
+        channel.set_compression(compress ? sync::Compression::DEFLATE : sync::Compression::NONE);
+
+        // A full frame in as many pieces as a batch first, so buffers the
+        // channel sizes on first use are not counted against the batches
+        std::vector<char> filler(sync::MAX_FRAME_PAYLOAD);
+        uint32_t noise = 1;
+        for (char& c : filler) {
+            noise = noise * 1664525 + 1013904223;  // Incompressible, so deflate fills whole chunks too
+            c = static_cast<char>(noise >> 24);
+        }
+        std::vector<struct iovec> warm;
+        size_t step = filler.size() / (2 * BATCH_SIZE + 1);
+        for (size_t offset = 0; offset < filler.size(); offset += step) {
+            warm.push_back({filler.data() + offset, std::min(step, filler.size() - offset)});
+        }
+        channel.send_message(sync::FrameType::ENTRIES, warm.data(), warm.size());
+
+        size_t before = allocations();
+        auto start = Clock::now();
+        send_all(channel, pass);
+        pass.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        pass.allocations = allocations() - before;
+    }
+    shutdown(sockets[0], SHUT_WR);
+    drain.join();
+    close(sockets[0]);
+    close(sockets[1]);
+    return pass;
+}
+
+void report(const char* label, const Pass& pass) {
+    std::cout << "  " << std::left << std::setw(28) << label << std::right << std::fixed
+              << std::setprecision(1) << std::setw(10) << pass.payload / pass.seconds / 1e6
+              << std::setw(16) << std::setprecision(1)
+              << static_cast<double>(pass.allocations) / pass.batches << "\n";
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    size_t count = 10000;
+    size_t notes = 200;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--entries") == 0 && i + 1 < argc) {
+            count = std::max(1, std::atoi(argv[++i]));
+        } else if (std::strcmp(argv[i], "--notes") == 0 && i + 1 < argc) {
+            notes = std::max(0, std::atoi(argv[++i]));
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--entries N] [--notes BYTES]\n";
+            return 2;
+        }
+    }
+
+    std::cout << count << " entries, " << notes << " bytes of notes each, batches of " << BATCH_SIZE << "\n";
+
+    for (bool compress : {false, true}) {
+        // Fresh entries, so the first gathered pass encodes them
+        auto entries = make_entries(count, notes);
+        std::cout << "\nSealed" << (compress ? ", deflate" : "") << "\n"
+                  << "  " << std::left << std::setw(28) << "path" << std::right << std::setw(10)
+                  << "MB/s" << std::setw(16) << "allocs/batch" << "\n";
+
+        auto whole = [&](sync::FrameChannel& channel, Pass& pass) {
+            size_t position = 0;
+            do {
+                auto payload = whole_batch(entries, position);
+                pass.payload += payload.size();
+                ++pass.batches;
+                channel.send_message(sync::FrameType::ENTRIES, payload);
+            } while (position < entries.size());
+        };
+        std::vector<struct iovec> pieces;
+        pieces.reserve(2 * BATCH_SIZE + 1);
+        auto gathered = [&](sync::FrameChannel& channel, Pass& pass) {
+            size_t position = 0;
+            do {
+                gathered_batch(entries, position, pieces);
+                for (const auto& piece : pieces) {
+                    pass.payload += piece.iov_len;
+                }
+                ++pass.batches;
+                channel.send_message(sync::FrameType::ENTRIES, pieces.data(), pieces.size());
+            } while (position < entries.size());
+        };
+
+        report("whole message", run_pass(compress, whole));
+        report("gathered, first send", run_pass(compress, gathered));
+        report("gathered, cached", run_pass(compress, gathered));
+    }
+    return 0;
+}
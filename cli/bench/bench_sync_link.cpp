@@ -0,0 +1,673 @@
+// First-time sync of a large vault over a throttled loopback link, with and
+// without payload compression.
+//
+// A relay thread sits between client and server, forwarding both directions
+// at a fixed bandwidth and counting the bytes on the wire. Each case syncs
+// an empty vault against a full one (pull: the server has the entries;
+// push: the client has them), or two full vaults with no entries in common
+// (both), and reports wire bytes and wall time until both peers are done.
+// Each direction has the full link rate, so "both" should take about as
+// long as the slower one-way case, not their sum.
+//
+// A rotation case starts from two synced vaults whose entries carry long
+// notes, changes the password of one entry in ten on the server and pulls,
+// with and without field deltas.
+//
+// A re-sync case starts from two synced vaults, changes a handful of
+// entries on the server and pulls, reconciling by descending the digest
+// trees and from the change feed.
+//
+// An interrupted case cuts the link once halfway through a first-time sync
+// in both directions. With checkpoints the client reconnects and resumes
+// the exchange; without, the sync fails and is run again.
+//
+// A last case pulls from several peers, each behind its own relay, first one
+// device at a time and then in a single fan-out call; the fan-out should take
+// about as long as one peer.
+//
+// Usage: bench_sync_link [--entries N] [--mbit RATE] [--peers P]
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <cstdlib>
+#include <cstring>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "../../core/src/crypto/secure_memory.cpp"
+#include "../../core/src/crypto/random.cpp"
+#include "../../core/src/storage/entry_hash.cpp"
+#include "../../core/src/storage/change_feed.cpp"
+#include "../../core/src/crypto/crypto.cpp"
+#include "../../core/src/sync/compression.cpp"
+#include "../../core/src/sync/secure_channel.cpp"
+#include "../../core/src/sync/framing.cpp"
+#include "../../core/src/sync/digest_tree.cpp"
+#include "../../core/src/sync/entry_diff.cpp"
+#include "../../core/src/sync/entry_delta.cpp"
+#include "../../core/src/sync/entry_store.cpp"
+#include "../../core/src/sync/sync_server.cpp"
+#include "../../core/src/sync/sync_manager.cpp"
+
+using namespace localpdub;
+using sync::json;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+constexpr int BASE_PORT = 52700;
+constexpr size_t RELAY_CHUNK = 16 * 1024;
+
+// Entries shaped like the CLI's: short strings, a random password
+json make_vault(size_t count) {
+    static const char charset[] =
+        "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789!@#$%^&*";
+    json entries = json::array();
+    for (size_t i = 0; i < count; ++i) {
+        uint8_t random[20];
+        crypto::random_bytes(random, sizeof(random));
+        std::string password;
+        for (uint8_t r : random) {
+            password += charset[r % (sizeof(charset) - 1)];
+        }
+
+        std::string n = std::to_string(i);
+        entries.push_back({
+            {"id", crypto::generate_uuid()},
+            {"type", "login"},
+            {"title", "Account " + n},
+            {"username", "user" + n + "@example.com"},
+            {"password", password},
+            {"url", "https://site" + n + ".example.com/login"},
+            {"notes", ""},
+            {"tags", json::array({"personal"})},
+            {"created_at", "2024-01-01T00:00:00Z"},
+            {"modified_at", "2024-06-01T12:00:00Z"},
+            {"modified", 1717243200 + static_cast<long>(i)}
+        });
+    }
+    return entries;
+}
+
+int listen_on(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int connect_to(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Forwards connections to target_port, pacing each direction to the link
+// rate. Small socket buffers keep the pacing honest. Serves one connection;
+// with cut_after set, cuts it once that many bytes went down and, if it
+// did, serves one more.
+class ThrottledRelay {
+public:
+    ThrottledRelay(int port, int target_port, double mbit, uint64_t cut_after = 0)
+        : listen_fd_(listen_on(port))
+        , target_port_(target_port)
+        , bytes_per_second_(mbit * 1e6 / 8)
+        , cut_after_(cut_after) {
+        if (listen_fd_ < 0) {
+            throw std::runtime_error("Relay could not listen on port " + std::to_string(port));
+        }
+        thread_ = std::thread([this]() { serve(); });
+    }
+
+    ~ThrottledRelay() {
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+        close(listen_fd_);
+    }
+
+    void wait() {
+        thread_.join();
+    }
+
+    uint64_t wire_bytes() const { return up_ + down_; }
+    bool was_cut() const { return cut_; }
+
+private:
+    void serve() {
+        relay_one();
+        if (cut_) {
+            cut_after_ = 0;
+            relay_one();
+        }
+    }
+
+    void relay_one() {
+        int client = accept(listen_fd_, nullptr, nullptr);
+        int server = connect_to(target_port_);
+        if (client < 0 || server < 0) {
+            std::cerr << "Relay failed to connect\n";
+            return;
+        }
+        for (int fd : {client, server}) {
+            int size = 64 * 1024;
+            setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        }
+
+        std::thread upstream([&]() { pump(client, server, up_, false); });
+        pump(server, client, down_, cut_after_ > 0);
+        upstream.join();
+        close(client);
+        close(server);
+    }
+
+    void pump(int from, int to, std::atomic<uint64_t>& counter, bool cut) {
+        std::vector<uint8_t> buffer(RELAY_CHUNK);
+        auto next = Clock::now();
+        while (true) {
+            ssize_t n = recv(from, buffer.data(), buffer.size(), 0);
+            if (n <= 0) {
+                break;
+            }
+            next = std::max(next, Clock::now()) +
+                   std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(n / bytes_per_second_));
+            std::this_thread::sleep_until(next);
+
+            for (ssize_t off = 0; off < n;) {
+                ssize_t sent = send(to, buffer.data() + off, n - off, MSG_NOSIGNAL);
+                if (sent <= 0) {
+                    return;
+                }
+                off += sent;
+            }
+            counter += n;
+
+            // The link drops: both ends see the connection go away
+            if (cut && counter >= cut_after_) {
+                cut_ = true;
+                shutdown(from, SHUT_RDWR);
+                shutdown(to, SHUT_RDWR);
+                return;
+            }
+        }
+        shutdown(to, SHUT_WR);
+    }
+
+    int listen_fd_;
+    int target_port_;
+    double bytes_per_second_;
+    uint64_t cut_after_;
+    bool cut_ = false;
+    std::atomic<uint64_t> up_{0};
+    std::atomic<uint64_t> down_{0};
+    std::thread thread_;
+};
+
+// SyncManager logs progress to stdout; keep it out of the report
+class QuietStdout {
+public:
+    QuietStdout() : saved_(std::cout.rdbuf(nullptr)) {}
+    ~QuietStdout() { std::cout.rdbuf(saved_); }
+
+private:
+    std::streambuf* saved_;
+};
+
+enum class Direction { PULL, PUSH, BOTH };
+
+const char* direction_name(Direction direction) {
+    switch (direction) {
+        case Direction::PULL: return "pull";
+        case Direction::PUSH: return "push";
+        case Direction::BOTH: return "both";
+    }
+    return "";
+}
+
+struct Outcome {
+    uint64_t wire_bytes = 0;
+    double seconds = 0;
+    bool ok = false;
+};
+
+Outcome run_case(int case_index, const json& server_vault, const json& client_vault,
+                 size_t expected, bool compression, double mbit, bool field_deltas = true) {
+    int server_port = BASE_PORT + 2 * case_index;
+    int relay_port = server_port + 1;
+    Outcome outcome;
+
+    QuietStdout quiet;
+    sync::SyncManager server("bench-server");
+    server.set_vault_entries(server_vault);
+    server.set_compression_enabled(compression);
+    server.set_field_deltas_enabled(field_deltas);
+    if (!server.start_sync_server(server_port)) {
+        return outcome;
+    }
+
+    ThrottledRelay relay(relay_port, server_port, mbit);
+    sync::SyncManager client("bench-client");
+    client.set_vault_entries(client_vault);
+    client.set_compression_enabled(compression);
+    client.set_field_deltas_enabled(field_deltas);
+
+    sync::Device device;
+    device.id = "bench";
+    device.name = "relay";
+    device.ip_address = "127.0.0.1";
+    device.port = relay_port;
+
+    auto start = Clock::now();
+    auto result = client.sync_with_devices({device}, sync::SyncStrategy::NEWEST_WINS, sync::AuthMethod::NONE);
+    relay.wait();  // Server has applied the client's entries and closed
+    outcome.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    outcome.wire_bytes = relay.wire_bytes();
+    server.stop_sync_server();
+
+    outcome.ok = result.errors.empty() &&
+                 client.get_vault_entries().size() == expected &&
+                 server.get_vault_entries().size() == expected;
+    return outcome;
+}
+
+// The vault with 1.5 KB of recovery codes in each entry's notes
+json with_long_notes(json entries) {
+    static const char charset[] = "ABCDEFGHJKLMNPQRSTUVWXYZ23456789";
+    for (auto& entry : entries) {
+        uint8_t random[1500];
+        crypto::random_bytes(random, sizeof(random));
+        std::string notes;
+        for (size_t i = 0; i < sizeof(random); ++i) {
+            notes += (i % 11 == 10) ? ' ' : charset[random[i] % (sizeof(charset) - 1)];
+        }
+        entry["notes"] = notes;
+    }
+    return entries;
+}
+
+// Sync two peers that already hold the same vault, change `changed` entries
+// on the server and time the next sync through the relay. Two direct syncs
+// first leave the client with a watermark in the server's change feed and
+// settle the echo of the initial exchange.
+Outcome run_resync(int& case_index, const json& vault, size_t changed, bool change_feed, double mbit) {
+    int server_port = BASE_PORT + 2 * case_index++;
+    int relay_port = server_port + 1;
+    Outcome outcome;
+
+    QuietStdout quiet;
+    sync::SyncManager server("bench-server");
+    server.set_vault_entries(vault);
+    if (!server.start_sync_server(server_port)) {
+        return outcome;
+    }
+    sync::SyncManager client("bench-client");
+    client.set_vault_entries(vault);
+    client.set_change_feed_enabled(change_feed);
+
+    sync::Device device;
+    device.id = "bench";
+    device.name = "server";
+    device.ip_address = "127.0.0.1";
+    device.port = server_port;
+    for (int i = 0; i < 2; ++i) {
+        client.sync_with_devices({device}, sync::SyncStrategy::NEWEST_WINS, sync::AuthMethod::NONE);
+        server.wait_for_sessions(std::chrono::seconds(10));
+    }
+
+    json edited = server.get_vault_entries();
+    storage::ChangeFeed feed = server.get_change_feed();
+    std::vector<std::string> edited_ids;
+    for (size_t i = 0; i < changed && i < edited.size(); ++i) {
+        json& entry = edited[i * (edited.size() / changed)];
+        entry["password"] = "changed-" + std::to_string(i);
+        entry["modified"] = entry["modified"].get<long>() + 86400;
+        edited_ids.push_back(entry["id"].get<std::string>());
+        feed.touch(edited_ids.back());
+    }
+    server.set_vault_entries(edited);
+    server.set_change_feed(feed);
+
+    ThrottledRelay relay(relay_port, server_port, mbit);
+    device.port = relay_port;
+    auto start = Clock::now();
+    auto result = client.sync_with_devices({device}, sync::SyncStrategy::NEWEST_WINS, sync::AuthMethod::NONE);
+    relay.wait();
+    outcome.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    outcome.wire_bytes = relay.wire_bytes();
+    server.stop_sync_server();
+
+    outcome.ok = result.success && result.entries_received == static_cast<int>(edited_ids.size()) &&
+                 result.devices.front().incremental == change_feed &&
+                 client.get_vault_entries() == server.get_vault_entries();
+    return outcome;
+}
+
+// Sync two full vaults with no entries in common through a relay that cuts
+// the link once cut_after bytes went down. Without checkpoints the failed
+// sync is run again, as a user would. Fails unless the cut happened.
+Outcome run_interrupted(int& case_index, const json& server_vault, const json& client_vault,
+                        uint64_t cut_after, bool checkpoints, double mbit) {
+    int server_port = BASE_PORT + 2 * case_index++;
+    int relay_port = server_port + 1;
+    Outcome outcome;
+
+    QuietStdout quiet;
+    sync::SyncManager server("bench-server");
+    server.set_vault_entries(server_vault);
+    if (!server.start_sync_server(server_port)) {
+        return outcome;
+    }
+    ThrottledRelay relay(relay_port, server_port, mbit, cut_after);
+    sync::SyncManager client("bench-client");
+    client.set_vault_entries(client_vault);
+    client.set_checkpoints_enabled(checkpoints);
+
+    sync::Device device;
+    device.id = "bench";
+    device.name = "relay";
+    device.ip_address = "127.0.0.1";
+    device.port = relay_port;
+
+    auto start = Clock::now();
+    auto result = client.sync_with_devices({device}, sync::SyncStrategy::NEWEST_WINS, sync::AuthMethod::NONE);
+    bool resumed = result.success;
+    if (!result.success) {
+        server.wait_for_sessions(std::chrono::seconds(10));
+        result = client.sync_with_devices({device}, sync::SyncStrategy::NEWEST_WINS, sync::AuthMethod::NONE);
+    }
+    relay.wait();
+    outcome.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    outcome.wire_bytes = relay.wire_bytes();
+    server.wait_for_sessions(std::chrono::seconds(10));
+    server.stop_sync_server();
+
+    size_t expected = server_vault.size() + client_vault.size();
+    outcome.ok = result.success && relay.was_cut() && resumed == checkpoints &&
+                 client.get_vault_entries().size() == expected &&
+                 server.get_vault_entries().size() == expected;
+    return outcome;
+}
+
+// Pull every peer's vault, through one relay per peer: into one empty vault
+// in a single call, or (the baseline) into a fresh empty vault per peer, one
+// peer after another
+Outcome run_fanout(int& case_index, const std::vector<json>& peer_vaults, bool parallel, double mbit) {
+    Outcome outcome;
+    QuietStdout quiet;
+
+    std::vector<std::unique_ptr<sync::SyncManager>> servers;
+    std::vector<std::unique_ptr<ThrottledRelay>> relays;
+    std::vector<sync::Device> devices;
+    size_t expected = 0;
+    for (size_t i = 0; i < peer_vaults.size(); ++i) {
+        int server_port = BASE_PORT + 2 * case_index++;
+        servers.push_back(std::make_unique<sync::SyncManager>("bench-server"));
+        servers.back()->set_vault_entries(peer_vaults[i]);
+        if (!servers.back()->start_sync_server(server_port)) {
+            return outcome;
+        }
+        relays.push_back(std::make_unique<ThrottledRelay>(server_port + 1, server_port, mbit));
+
+        sync::Device device;
+        device.id = "peer-" + std::to_string(i);
+        device.name = "relay " + std::to_string(i);
+        device.ip_address = "127.0.0.1";
+        device.port = server_port + 1;
+        devices.push_back(device);
+        expected += peer_vaults[i].size();
+    }
+
+    auto pull = [](const std::vector<sync::Device>& from, size_t expected) {
+        sync::SyncManager client("bench-client");
+        client.set_vault_entries(json::array());
+        auto result = client.sync_with_devices(from, sync::SyncStrategy::NEWEST_WINS, sync::AuthMethod::NONE);
+        return result.success && client.get_vault_entries().size() == expected;
+    };
+
+    auto start = Clock::now();
+    bool ok = true;
+    if (parallel) {
+        ok = pull(devices, expected);
+    } else {
+        for (size_t i = 0; i < devices.size(); ++i) {
+            ok = pull({devices[i]}, peer_vaults[i].size()) && ok;
+        }
+    }
+    for (auto& relay : relays) {
+        relay->wait();
+        outcome.wire_bytes += relay->wire_bytes();
+    }
+    outcome.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    for (auto& server : servers) {
+        server->stop_sync_server();
+    }
+
+    outcome.ok = ok;
+    return outcome;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    std::vector<size_t> sizes = {10000, 50000};
+    double mbit = 20;
+    size_t peers = 3;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--entries") == 0 && i + 1 < argc) {
+            sizes = {static_cast<size_t>(std::strtoull(argv[++i], nullptr, 10))};
+        } else if (std::strcmp(argv[i], "--mbit") == 0 && i + 1 < argc) {
+            mbit = std::atof(argv[++i]);
+        } else if (std::strcmp(argv[i], "--peers") == 0 && i + 1 < argc) {
+            peers = std::max<size_t>(1, std::strtoull(argv[++i], nullptr, 10));
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--entries N] [--mbit RATE] [--peers P]\n";
+            return 2;
+        }
+    }
+
+    std::cout << "First-time sync over a " << mbit << " Mbit/s loopback link\n";
+
+    int case_index = 0;
+    for (size_t n : sizes) {
+        json full = make_vault(n);
+        json empty = json::array();
+        std::cout << "\n  " << n << " entries (" << full.dump().size() / 1024 << " KB of JSON)\n";
+        std::cout << "    " << std::left << std::setw(16) << "direction" << std::setw(12) << "compression"
+                  << std::right << std::setw(14) << "wire bytes" << std::setw(11) << "time" << "\n";
+
+        json other = make_vault(n);
+        for (Direction direction : {Direction::PULL, Direction::PUSH, Direction::BOTH}) {
+            Outcome baseline;
+            for (bool compression : {false, true}) {
+                Outcome outcome;
+                switch (direction) {
+                    case Direction::PULL:
+                        outcome = run_case(case_index++, full, empty, n, compression, mbit);
+                        break;
+                    case Direction::PUSH:
+                        outcome = run_case(case_index++, empty, full, n, compression, mbit);
+                        break;
+                    case Direction::BOTH:
+                        outcome = run_case(case_index++, full, other, 2 * n, compression, mbit);
+                        break;
+                }
+                if (!outcome.ok) {
+                    std::cerr << "Sync failed or vaults differ\n";
+                    return 1;
+                }
+
+                std::cout << "    " << std::left << std::setw(16) << direction_name(direction)
+                          << std::setw(12) << (compression ? "deflate" : "none")
+                          << std::right << std::setw(14) << outcome.wire_bytes
+                          << std::setw(9) << std::fixed << std::setprecision(2) << outcome.seconds << " s";
+                if (compression) {
+                    std::cout << std::setw(8) << std::setprecision(1)
+                              << static_cast<double>(baseline.wire_bytes) / outcome.wire_bytes << "x bytes"
+                              << std::setw(7) << baseline.seconds / outcome.seconds << "x time";
+                } else {
+                    baseline = outcome;
+                }
+                std::cout << "\n";
+            }
+        }
+    }
+
+    {
+        size_t n = sizes.front();
+        json synced = with_long_notes(make_vault(n));
+        json rotated = synced;
+        for (size_t i = 0; i < n; i += 10) {
+            rotated[i]["password"] = "rotated-" + std::to_string(i);
+            rotated[i]["modified"] = rotated[i]["modified"].get<long>() + 86400;
+        }
+        std::cout << "\n  Password rotation: " << (n + 9) / 10 << " of " << n
+                  << " entries with 1.5 KB notes, deflate on\n";
+        std::cout << "    " << std::left << std::setw(28) << "field deltas"
+                  << std::right << std::setw(14) << "wire bytes" << std::setw(11) << "time" << "\n";
+
+        Outcome baseline;
+        for (bool field_deltas : {false, true}) {
+            Outcome outcome = run_case(case_index++, rotated, synced, n, true, mbit, field_deltas);
+            if (!outcome.ok) {
+                std::cerr << "Rotation sync failed or vaults differ\n";
+                return 1;
+            }
+            std::cout << "    " << std::left << std::setw(28) << (field_deltas ? "on" : "off")
+                      << std::right << std::setw(14) << outcome.wire_bytes
+                      << std::setw(9) << std::fixed << std::setprecision(2) << outcome.seconds << " s";
+            if (field_deltas) {
+                std::cout << std::setw(8) << std::setprecision(1)
+                          << static_cast<double>(baseline.wire_bytes) / outcome.wire_bytes << "x bytes"
+                          << std::setw(7) << baseline.seconds / outcome.seconds << "x time";
+            } else {
+                baseline = outcome;
+            }
+            std::cout << "\n";
+        }
+    }
+
+    {
+        size_t n = sizes.front();
+        const size_t changed = 10;
+        json vault = make_vault(n);
+        std::cout << "\n  Re-sync after " << changed << " of " << n << " entries changed on the server\n";
+        std::cout << "    " << std::left << std::setw(28) << "reconciliation"
+                  << std::right << std::setw(14) << "wire bytes" << std::setw(11) << "time" << "\n";
+
+        Outcome baseline;
+        for (bool change_feed : {false, true}) {
+            Outcome outcome = run_resync(case_index, vault, changed, change_feed, mbit);
+            if (!outcome.ok) {
+                std::cerr << "Re-sync failed or vaults differ\n";
+                return 1;
+            }
+            std::cout << "    " << std::left << std::setw(28) << (change_feed ? "change feed" : "digest trees")
+                      << std::right << std::setw(14) << outcome.wire_bytes
+                      << std::setw(9) << std::fixed << std::setprecision(2) << outcome.seconds << " s";
+            if (change_feed) {
+                std::cout << std::setw(8) << std::setprecision(1)
+                          << static_cast<double>(baseline.wire_bytes) / outcome.wire_bytes << "x bytes"
+                          << std::setw(7) << baseline.seconds / outcome.seconds << "x time";
+            } else {
+                baseline = outcome;
+            }
+            std::cout << "\n";
+        }
+    }
+
+    {
+        size_t n = sizes.front();
+        json server_vault = make_vault(n);
+        json client_vault = make_vault(n);
+        Outcome whole = run_case(case_index++, server_vault, client_vault, 2 * n, true, mbit);
+        if (!whole.ok) {
+            std::cerr << "Sync failed or vaults differ\n";
+            return 1;
+        }
+
+        // Each direction carries about half; cut three quarters of the way
+        // down, well into the entry exchange
+        uint64_t cut_after = whole.wire_bytes * 3 / 8;
+        std::cout << "\n  Link cut after " << cut_after / 1024 << " KB down, both sides with " << n
+                  << " entries\n";
+        std::cout << "    " << std::left << std::setw(28) << "recovery"
+                  << std::right << std::setw(14) << "wire bytes" << std::setw(11) << "time" << "\n";
+        std::cout << "    " << std::left << std::setw(28) << "(not cut)"
+                  << std::right << std::setw(14) << whole.wire_bytes
+                  << std::setw(9) << std::fixed << std::setprecision(2) << whole.seconds << " s\n";
+
+        Outcome baseline;
+        for (bool checkpoints : {false, true}) {
+            Outcome outcome = run_interrupted(case_index, server_vault, client_vault, cut_after,
+                                              checkpoints, mbit);
+            if (!outcome.ok) {
+                std::cerr << "Interrupted sync failed or vaults differ\n";
+                return 1;
+            }
+            std::cout << "    " << std::left << std::setw(28) << (checkpoints ? "resume from checkpoint" : "sync again")
+                      << std::right << std::setw(14) << outcome.wire_bytes
+                      << std::setw(9) << std::fixed << std::setprecision(2) << outcome.seconds << " s";
+            if (checkpoints) {
+                std::cout << std::setw(8) << std::setprecision(1)
+                          << static_cast<double>(baseline.wire_bytes) / outcome.wire_bytes << "x bytes"
+                          << std::setw(7) << baseline.seconds / outcome.seconds << "x time";
+            } else {
+                baseline = outcome;
+            }
+            std::cout << "\n";
+        }
+    }
+
+    std::vector<json> peer_vaults;
+    for (size_t i = 0; i < peers; ++i) {
+        peer_vaults.push_back(make_vault(sizes.front()));
+    }
+    std::cout << "\n  Pull from " << peers << " peers, " << sizes.front() << " entries each\n";
+    std::cout << "    " << std::left << std::setw(28) << "devices"
+              << std::right << std::setw(14) << "wire bytes" << std::setw(11) << "time" << "\n";
+
+    Outcome serial;
+    for (bool parallel : {false, true}) {
+        Outcome outcome = run_fanout(case_index, peer_vaults, parallel, mbit);
+        if (!outcome.ok) {
+            std::cerr << "Fan-out sync failed or vaults differ\n";
+            return 1;
+        }
+
+        std::cout << "    " << std::left << std::setw(28) << (parallel ? "all at once" : "one at a time")
+                  << std::right << std::setw(14) << outcome.wire_bytes
+                  << std::setw(9) << std::fixed << std::setprecision(2) << outcome.seconds << " s";
+        if (parallel) {
+            std::cout << std::setw(8) << std::setprecision(1) << serial.seconds / outcome.seconds << "x time";
+        } else {
+            serial = outcome;
+        }
+        std::cout << "\n";
+    }
+
+    return 0;
+}
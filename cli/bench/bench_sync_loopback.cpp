@@ -0,0 +1,870 @@
+// Several peers syncing with each other in one process, over loopback.
+//
+// Every peer is a SyncManager with its own server, reached through a wire
+// tap: a relay that forwards each connection and reads the frame headers
+// going past (they stay in the clear when the payload is sealed). From them
+// it reports, per session, the bytes each way, the round trips before the
+// entry transfer and one for the transfer, and how long each phase took on
+// the wire:
+//
+//   handshake  SYNC_REQUEST until the first reconciliation frame
+//   reconcile  FEED_QUERY or TREE_QUERY until ENTRY_REQUEST
+//   request    ENTRY_REQUEST and ENTRY_BASES until the first ENTRIES
+//   transfer   the first ENTRIES frame until both sides have closed
+//
+// The peers start from one vault of --entries entries, then each edits a
+// --divergence fraction of it, deletes as many and adds as many entries of
+// its own. Four passes follow, each peer in turn syncing with all the
+// others: the diverged vaults, a repeat with no changes, one after --edits
+// edits and a deletion on every peer, and one more with no changes. Where
+// edits add deletions, one peer also deletes an entry that another edits
+// afterwards, and the edit must survive. After each pass every peer must
+// hold each entry once, at its newest version, and no deleted one. Peers
+// collect their tombstones whenever sessions close, as vault writes do.
+//
+// A chain follows, where each peer pulls from the next and serves the one
+// before, so most peers are client to one and server to another. The peers
+// forget their watermarks first, as if they had only ever synced so, and
+// one pass lets each learn its client. Rounds of edits and deletions follow,
+// each with a pass along the chain from its far end, so the first peer
+// pulls last and must be level after every pass: a deletion its server
+// collected the tombstone of before it pulled would stay in its vault. More
+// passes let changes travel the chain's length, then the same checks.
+//
+// With --seconds, a soak follows: rounds of edits and deletions on every
+// peer, then every peer syncing with all the others at once, so each peer
+// serves sessions while its own run, until the time is up. It reports
+// progress and resident memory every few seconds, then settles and checks
+// the vaults again. Build with -fsanitize=address or -fsanitize=thread to
+// catch leaks and races.
+//
+// Exits 1 if a sync fails or the vaults do not converge.
+//
+// Usage: bench_sync_loopback [--peers P] [--entries N] [--divergence F]
+//                            [--edits E] [--seconds S]
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <random>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstdlib>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "../../core/src/crypto/secure_memory.cpp"
+#include "../../core/src/crypto/random.cpp"
+#include "../../core/src/storage/entry_hash.cpp"
+#include "../../core/src/storage/change_feed.cpp"
+#include "../../core/src/crypto/crypto.cpp"
+#include "../../core/src/sync/compression.cpp"
+#include "../../core/src/sync/secure_channel.cpp"
+#include "../../core/src/sync/framing.cpp"
+#include "../../core/src/sync/digest_tree.cpp"
+#include "../../core/src/sync/entry_diff.cpp"
+#include "../../core/src/sync/entry_delta.cpp"
+#include "../../core/src/sync/entry_store.cpp"
+#include "../../core/src/sync/sync_server.cpp"
+#include "../../core/src/sync/sync_manager.cpp"
+
+using namespace localpdub;
+using sync::json;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+constexpr int BASE_PORT = 53000;
+constexpr size_t RELAY_CHUNK = 64 * 1024;
+constexpr long BASE_STAMP = 1717243200;
+constexpr auto SESSION_WAIT = std::chrono::seconds(30);
+constexpr auto REPORT_INTERVAL = std::chrono::seconds(5);
+constexpr size_t MAX_PEERS = 11;  // A server takes 10 connections at once
+
+// SyncManager logs progress to stdout; keep it out of the report
+class QuietStdout {
+public:
+    QuietStdout() : saved_(std::cout.rdbuf(nullptr)) {}
+    ~QuietStdout() { std::cout.rdbuf(saved_); }
+
+    std::streambuf* saved() const { return saved_; }
+
+private:
+    std::streambuf* saved_;
+};
+
+enum Phase { HANDSHAKE, RECONCILE, REQUEST, TRANSFER, PHASE_COUNT };
+
+const char* const PHASE_NAMES[PHASE_COUNT] = {"handshake", "reconcile", "request", "transfer"};
+
+// The phase a frame type belongs to; -1 for ERROR and unknown types
+int phase_of(uint8_t type) {
+    switch (static_cast<sync::FrameType>(type)) {
+        case sync::FrameType::SYNC_REQUEST:
+        case sync::FrameType::SYNC_ACCEPT:
+        case sync::FrameType::AUTH_CHALLENGE:
+        case sync::FrameType::AUTH_RESPONSE:
+        case sync::FrameType::AUTH_CONFIRM:
+        case sync::FrameType::SESSION_TICKET:
+            return HANDSHAKE;
+        case sync::FrameType::FEED_QUERY:
+        case sync::FrameType::FEED:
+        case sync::FrameType::TREE_QUERY:
+        case sync::FrameType::TREE_NODES:
+            return RECONCILE;
+        case sync::FrameType::ENTRY_REQUEST:
+        case sync::FrameType::ENTRY_BASES:
+        case sync::FrameType::RESUME:
+        case sync::FrameType::RESUMED:
+            return REQUEST;
+        case sync::FrameType::ENTRIES:
+            return TRANSFER;
+        case sync::FrameType::ERROR:
+            break;
+    }
+    return -1;
+}
+
+struct SessionStats {
+    uint64_t bytes_up = 0;    // Client to server
+    uint64_t bytes_down = 0;
+    int round_trips = 0;
+    double phase_seconds[PHASE_COUNT] = {};
+    double seconds = 0;
+};
+
+int listen_on(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(fd, 64) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int connect_to(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Forwards every connection on port to target_port and reads the frame
+// headers in both directions, without touching payloads
+class WireTap {
+public:
+    WireTap(int port, int target_port)
+        : listen_fd_(listen_on(port))
+        , target_port_(target_port) {
+        if (listen_fd_ < 0) {
+            throw std::runtime_error("Tap could not listen on port " + std::to_string(port));
+        }
+        thread_ = std::thread([this]() { accept_loop(); });
+    }
+
+    ~WireTap() {
+        shutdown(listen_fd_, SHUT_RDWR);  // Wakes accept()
+        thread_.join();
+        wait_idle();
+        close(listen_fd_);
+    }
+
+    // Wait until every connection has closed
+    void wait_idle() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        idle_.wait(lock, [this]() { return open_ == 0; });
+    }
+
+    // Sessions that closed since the last call
+    std::vector<SessionStats> take() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return std::move(finished_);
+    }
+
+private:
+    // Both directions of one connection
+    struct Connection {
+        std::mutex mutex;
+        Clock::time_point first_byte;
+        Clock::time_point phase_start[PHASE_COUNT];
+        int phase = -1;
+        bool started = false;
+        bool last_from_client = false;
+        SessionStats stats;
+    };
+
+    // Finds frame boundaries in one direction of a stream
+    struct HeaderScanner {
+        uint8_t header[sync::FRAME_HEADER_SIZE];
+        size_t header_len = 0;
+        size_t skip = 0;  // Payload bytes left in the current frame
+    };
+
+    void accept_loop() {
+        while (true) {
+            int client = accept(listen_fd_, nullptr, nullptr);
+            if (client < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                ++open_;
+            }
+            std::thread([this, client]() { relay(client); }).detach();
+        }
+    }
+
+    void relay(int client) {
+        int server = connect_to(target_port_);
+        Connection connection;
+        if (server >= 0) {
+            int nodelay = 1;
+            setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+            setsockopt(server, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+            std::thread upstream([&]() { pump(client, server, connection, true); });
+            pump(server, client, connection, false);
+            upstream.join();
+            close(server);
+        }
+        close(client);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (connection.started) {
+            auto end = Clock::now();
+            SessionStats& stats = connection.stats;
+            stats.seconds = std::chrono::duration<double>(end - connection.first_byte).count();
+            // Each phase lasts until the next one the session reached
+            for (int p = 0; p < PHASE_COUNT; ++p) {
+                if (connection.phase_start[p] == Clock::time_point()) {
+                    continue;
+                }
+                auto until = end;
+                for (int q = p + 1; q < PHASE_COUNT; ++q) {
+                    if (connection.phase_start[q] != Clock::time_point()) {
+                        until = connection.phase_start[q];
+                        break;
+                    }
+                }
+                stats.phase_seconds[p] = std::chrono::duration<double>(until - connection.phase_start[p]).count();
+            }
+            finished_.push_back(stats);
+        }
+        --open_;
+        idle_.notify_all();
+    }
+
+    void pump(int from, int to, Connection& connection, bool from_client) {
+        std::vector<uint8_t> buffer(RELAY_CHUNK);
+        HeaderScanner scanner;
+        while (true) {
+            ssize_t n = recv(from, buffer.data(), buffer.size(), 0);
+            if (n <= 0) {
+                break;
+            }
+            observe(buffer.data(), static_cast<size_t>(n), scanner, connection, from_client);
+            for (ssize_t off = 0; off < n;) {
+                ssize_t sent = send(to, buffer.data() + off, n - off, MSG_NOSIGNAL);
+                if (sent <= 0) {
+                    shutdown(from, SHUT_RD);
+                    return;
+                }
+                off += sent;
+            }
+        }
+        shutdown(to, SHUT_WR);
+    }
+
+    void observe(const uint8_t* data, size_t len, HeaderScanner& scanner, Connection& connection,
+                 bool from_client) {
+        auto now = Clock::now();
+        std::lock_guard<std::mutex> lock(connection.mutex);
+        if (!connection.started) {
+            connection.started = true;
+            connection.first_byte = now;
+        }
+        (from_client ? connection.stats.bytes_up : connection.stats.bytes_down) += len;
+
+        while (len > 0) {
+            if (scanner.skip > 0) {
+                size_t n = std::min(scanner.skip, len);
+                scanner.skip -= n;
+                data += n;
+                len -= n;
+                continue;
+            }
+            size_t n = std::min(sync::FRAME_HEADER_SIZE - scanner.header_len, len);
+            std::memcpy(scanner.header + scanner.header_len, data, n);
+            scanner.header_len += n;
+            data += n;
+            len -= n;
+            if (scanner.header_len < sync::FRAME_HEADER_SIZE) {
+                break;
+            }
+            scanner.header_len = 0;
+            scanner.skip = (static_cast<size_t>(scanner.header[2]) << 24) |
+                           (static_cast<size_t>(scanner.header[3]) << 16) |
+                           (static_cast<size_t>(scanner.header[4]) << 8) |
+                           static_cast<size_t>(scanner.header[5]);
+            on_frame(connection, scanner.header[0], from_client, now);
+        }
+    }
+
+    static void on_frame(Connection& connection, uint8_t type, bool from_client, Clock::time_point now) {
+        int phase = phase_of(type);
+        // A server frame after client frames answers them: one round trip,
+        // until the transfer, where both sides stream at once and the whole
+        // exchange counts as one
+        if (!from_client && connection.last_from_client && connection.phase < TRANSFER) {
+            ++connection.stats.round_trips;
+        }
+        connection.last_from_client = from_client;
+        if (phase > connection.phase) {
+            connection.phase = phase;
+            connection.phase_start[phase] = now;
+            if (phase == TRANSFER) {
+                ++connection.stats.round_trips;
+            }
+        }
+    }
+
+    int listen_fd_;
+    int target_port_;
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable idle_;
+    int open_ = 0;
+    std::vector<SessionStats> finished_;
+};
+
+size_t resident_kb() {
+    std::ifstream statm("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    statm >> pages >> resident;
+    return resident * (static_cast<size_t>(sysconf(_SC_PAGESIZE)) / 1024);
+}
+
+size_t peak_resident_kb() {
+    struct rusage usage {};
+    getrusage(RUSAGE_SELF, &usage);
+    return static_cast<size_t>(usage.ru_maxrss);
+}
+
+json make_entry(const std::string& id, size_t n, long stamp) {
+    static const char charset[] =
+        "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789!@#$%^&*";
+    uint8_t random[20];
+    crypto::random_bytes(random, sizeof(random));
+    std::string password;
+    for (uint8_t r : random) {
+        password += charset[r % (sizeof(charset) - 1)];
+    }
+
+    std::string number = std::to_string(n);
+    return {
+        {"id", id},
+        {"type", "login"},
+        {"title", "Account " + number},
+        {"username", "user" + number + "@example.com"},
+        {"password", password},
+        {"url", "https://site" + number + ".example.com/login"},
+        {"notes", ""},
+        {"tags", json::array({"personal"})},
+        {"modified", stamp}
+    };
+}
+
+std::string id_string(const json& entry) {
+    return entry["id"].get_ref<const json::string_t&>().c_str();
+}
+
+// The newest stamp of each id written so far, and the ids deleted since.
+// A deletion buries versions modified at or before it, as sync does. Edits
+// happen between passes, from one thread.
+class Expected {
+public:
+    void record(const json& entry) {
+        std::string id = id_string(entry);
+        long modified = entry["modified"].get<long>();
+        auto deleted = deleted_.find(id);
+        if (deleted != deleted_.end()) {
+            if (modified <= deleted->second) {
+                return;
+            }
+            deleted_.erase(deleted);
+        }
+        long& newest = newest_[id];
+        newest = std::max(newest, modified);
+    }
+
+    // A deletion at deleted, in seconds since the epoch
+    void bury(const std::string& id, long deleted) {
+        auto it = newest_.find(id);
+        if (it != newest_.end() && it->second <= deleted) {
+            newest_.erase(it);
+            deleted_[id] = deleted;
+        } else if (it == newest_.end()) {
+            long& latest = deleted_[id];
+            latest = std::max(latest, deleted);
+        }
+    }
+
+    size_t deleted() const { return deleted_.size(); }
+
+    // Empty if entries hold every recorded id once, at its newest stamp,
+    // and no deleted one
+    std::string mismatch(const json& entries) const {
+        std::unordered_set<std::string> seen;
+        for (const auto& entry : entries) {
+            std::string id = id_string(entry);
+            if (!seen.insert(id).second) {
+                return "duplicate id " + id;
+            }
+            if (deleted_.count(id)) {
+                return "deleted id " + id + " came back";
+            }
+            auto it = newest_.find(id);
+            if (it == newest_.end()) {
+                return "unexpected id " + id;
+            }
+            if (entry["modified"].get<long>() != it->second) {
+                return "stale version of " + id;
+            }
+        }
+        if (seen.size() != newest_.size()) {
+            return std::to_string(newest_.size() - seen.size()) + " entries missing";
+        }
+        return "";
+    }
+
+private:
+    std::unordered_map<std::string, long> newest_;
+    std::unordered_map<std::string, long> deleted_;  // Id to when, in seconds
+};
+
+struct Peer {
+    std::unique_ptr<sync::SyncManager> manager;
+    std::unique_ptr<WireTap> tap;
+    sync::Device device;  // As the other peers reach it: through the tap
+    std::mt19937 rng;
+};
+
+// Seconds since the epoch of a deletion stamp
+long deletion_seconds(storage::Hlc deleted) {
+    return static_cast<long>(storage::hlc_millis(deleted) / 1000);
+}
+
+// Edit `edits` random entries of a peer's vault, delete `deletes` and add
+// `added` new ones, stamping and burying them in its change feed as the
+// CLI's vault would
+void edit(Peer& peer, size_t edits, size_t added, std::atomic<long>& next_stamp, Expected& expected,
+          size_t deletes = 0) {
+    json entries = peer.manager->get_vault_entries();
+    storage::ChangeFeed feed = peer.manager->get_change_feed();
+    if (!entries.empty()) {
+        std::uniform_int_distribution<size_t> pick(0, entries.size() - 1);
+        for (size_t i = 0; i < edits; ++i) {
+            json& entry = entries[pick(peer.rng)];
+            long stamp = next_stamp++;
+            entry["password"] = "edit-" + std::to_string(stamp);
+            entry["modified"] = stamp;
+            expected.record(entry);
+            feed.touch(id_string(entry));
+        }
+    }
+    for (size_t i = 0; i < deletes && !entries.empty(); ++i) {
+        size_t victim = std::uniform_int_distribution<size_t>(0, entries.size() - 1)(peer.rng);
+        std::string id = id_string(entries[victim]);
+        expected.bury(id, deletion_seconds(feed.bury(id)));
+        entries.erase(victim);
+    }
+    for (size_t i = 0; i < added; ++i) {
+        json entry = make_entry(crypto::generate_uuid(), entries.size(), next_stamp++);
+        expected.record(entry);
+        feed.touch(id_string(entry));
+        entries.push_back(std::move(entry));
+    }
+    peer.manager->set_vault_entries(entries);
+    peer.manager->set_change_feed(feed);
+}
+
+// One peer deletes an entry, then another edits it: the edit is newer than
+// the deletion, so the entry must survive everywhere
+void delete_then_edit(Peer& deleter, Peer& editor, Expected& expected) {
+    json entries = deleter.manager->get_vault_entries();
+    if (entries.empty()) {
+        return;
+    }
+    size_t victim = std::uniform_int_distribution<size_t>(0, entries.size() - 1)(deleter.rng);
+    std::string id = id_string(entries[victim]);
+    storage::ChangeFeed feed = deleter.manager->get_change_feed();
+    long deleted = deletion_seconds(feed.bury(id));
+    expected.bury(id, deleted);
+    entries.erase(victim);
+    deleter.manager->set_vault_entries(entries);
+    deleter.manager->set_change_feed(feed);
+
+    entries = editor.manager->get_vault_entries();
+    feed = editor.manager->get_change_feed();
+    for (auto& entry : entries) {
+        if (id_string(entry) == id) {
+            entry["password"] = "after-deletion";
+            entry["modified"] = deleted + 1;
+            expected.record(entry);
+            feed.touch(id);
+            break;
+        }
+    }
+    editor.manager->set_vault_entries(entries);
+    editor.manager->set_change_feed(feed);
+}
+
+// Drop the tombstones every peer was offered, as writing the vault does
+void collect_tombstones(Peer& peer) {
+    storage::ChangeFeed feed = peer.manager->get_change_feed();
+    feed.collect_tombstones();
+    peer.manager->set_change_feed(feed);
+}
+
+// Forget every peer the feed synced with, so the next sessions start over
+void forget_watermarks(Peer& peer) {
+    storage::ChangeFeed feed = peer.manager->get_change_feed();
+    std::vector<std::string> known;
+    for (const auto& watermark : feed.watermarks()) {
+        known.push_back(watermark.first);
+    }
+    for (const auto& other : known) {
+        feed.erase_watermark(other);
+    }
+    peer.manager->set_change_feed(feed);
+}
+
+struct PassStats {
+    double seconds = 0;
+    size_t incremental = 0;  // Sessions reconciled from the change feed
+    std::vector<std::string> errors;
+    std::vector<SessionStats> sessions;
+};
+
+// Every peer syncs with all the others, one peer after another or all at
+// once; or, along a chain, with the next one only, from the far end. Once
+// sessions close every peer collects its tombstones, after each peer's
+// turn when they go one after another, as vaults are written after each
+// sync; that time is not counted. Returns when every session has closed.
+PassStats sync_pass(std::vector<Peer>& peers, bool concurrent, bool chain = false) {
+    PassStats pass;
+    std::mutex mutex;
+    auto sync_peer = [&](size_t i) {
+        std::vector<sync::Device> others;
+        for (size_t j = 0; j < peers.size(); ++j) {
+            if (chain ? j == i + 1 : j != i) {
+                others.push_back(peers[j].device);
+            }
+        }
+        if (others.empty()) {
+            return;
+        }
+        auto result = peers[i].manager->sync_with_devices(others, sync::SyncStrategy::NEWEST_WINS,
+                                                          sync::AuthMethod::NONE);
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto& device : result.devices) {
+            pass.incremental += device.incremental ? 1 : 0;
+        }
+        pass.errors.insert(pass.errors.end(), result.errors.begin(), result.errors.end());
+    };
+
+    Clock::duration collecting{0};
+    auto settle = [&]() {
+        for (auto& peer : peers) {
+            if (!peer.manager->wait_for_sessions(SESSION_WAIT)) {
+                pass.errors.push_back("Sessions on " + peer.device.name + " did not finish");
+            }
+        }
+        auto start = Clock::now();
+        for (auto& peer : peers) {
+            collect_tombstones(peer);
+        }
+        collecting += Clock::now() - start;
+    };
+
+    auto start = Clock::now();
+    if (concurrent) {
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < peers.size(); ++i) {
+            threads.emplace_back(sync_peer, i);
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        settle();
+    } else {
+        for (size_t n = 0; n < peers.size(); ++n) {
+            sync_peer(chain ? peers.size() - 1 - n : n);
+            settle();
+        }
+    }
+    for (auto& peer : peers) {
+        peer.tap->wait_idle();
+    }
+    pass.seconds = std::chrono::duration<double>(Clock::now() - start - collecting).count();
+
+    for (auto& peer : peers) {
+        auto sessions = peer.tap->take();
+        pass.sessions.insert(pass.sessions.end(), sessions.begin(), sessions.end());
+    }
+    return pass;
+}
+
+std::string mismatch(const std::vector<Peer>& peers, const Expected& expected) {
+    for (const auto& peer : peers) {
+        std::string problem = expected.mismatch(peer.manager->get_vault_entries());
+        if (!problem.empty()) {
+            return peer.device.name + ": " + problem;
+        }
+    }
+    return "";
+}
+
+void print_header(std::ostream& out) {
+    out << "    " << std::left << std::setw(12) << "pass" << std::right << std::setw(9) << "sessions"
+        << std::setw(6) << "feed" << std::setw(13) << "wire bytes" << std::setw(8) << "trips";
+    for (const char* name : PHASE_NAMES) {
+        out << std::setw(11) << name;
+    }
+    out << std::setw(11) << "session" << std::setw(10) << "wall" << "\n";
+}
+
+// Totals over the pass's sessions; trips and times are per session, times
+// in milliseconds
+void print_pass(std::ostream& out, const char* name, const PassStats& pass) {
+    uint64_t bytes = 0;
+    double trips = 0, session = 0, phases[PHASE_COUNT] = {};
+    for (const auto& stats : pass.sessions) {
+        bytes += stats.bytes_up + stats.bytes_down;
+        trips += stats.round_trips;
+        session += stats.seconds;
+        for (int p = 0; p < PHASE_COUNT; ++p) {
+            phases[p] += stats.phase_seconds[p];
+        }
+    }
+    double count = std::max<size_t>(1, pass.sessions.size());
+    out << "    " << std::left << std::setw(12) << name << std::right << std::setw(9) << pass.sessions.size()
+        << std::setw(6) << pass.incremental << std::setw(13) << bytes << std::fixed << std::setprecision(1)
+        << std::setw(8) << trips / count << std::setprecision(2);
+    for (double phase : phases) {
+        out << std::setw(8) << phase / count * 1e3 << " ms";
+    }
+    out << std::setw(8) << session / count * 1e3 << " ms" << std::setw(8) << pass.seconds << " s\n";
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    size_t peer_count = 3;
+    size_t entries = 10000;
+    double divergence = 0.01;
+    size_t edits = 10;
+    double soak_seconds = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--peers") == 0 && i + 1 < argc) {
+            peer_count = std::max<size_t>(2, std::strtoull(argv[++i], nullptr, 10));
+        } else if (std::strcmp(argv[i], "--entries") == 0 && i + 1 < argc) {
+            entries = std::max<size_t>(1, std::strtoull(argv[++i], nullptr, 10));
+        } else if (std::strcmp(argv[i], "--divergence") == 0 && i + 1 < argc) {
+            divergence = std::min(1.0, std::max(0.0, std::atof(argv[++i])));
+        } else if (std::strcmp(argv[i], "--edits") == 0 && i + 1 < argc) {
+            edits = std::strtoull(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            soak_seconds = std::max(0.0, std::atof(argv[++i]));
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--peers P] [--entries N] [--divergence F]"
+                      << " [--edits E] [--seconds S]\n";
+            return 2;
+        }
+    }
+    if (peer_count > MAX_PEERS) {
+        std::cerr << "At most " << MAX_PEERS << " peers: each serves all the others at once\n";
+        return 2;
+    }
+
+    QuietStdout quiet;
+    std::ostream out(quiet.saved());
+
+    Expected expected;
+    std::atomic<long> next_stamp{BASE_STAMP + static_cast<long>(entries)};
+    json shared = json::array();
+    for (size_t i = 0; i < entries; ++i) {
+        shared.push_back(make_entry(crypto::generate_uuid(), i, BASE_STAMP + static_cast<long>(i)));
+        expected.record(shared.back());
+    }
+
+    std::vector<Peer> peers(peer_count);
+    size_t diverged = static_cast<size_t>(entries * divergence + 0.5);
+    for (size_t i = 0; i < peer_count; ++i) {
+        Peer& peer = peers[i];
+        int server_port = BASE_PORT + 2 * static_cast<int>(i);
+        peer.manager = std::make_unique<sync::SyncManager>("loopback-" + std::to_string(i));
+        peer.manager->set_vault_entries(shared);
+        if (!peer.manager->start_sync_server(server_port)) {
+            std::cerr << "Could not start a server on port " << server_port << "\n";
+            return 1;
+        }
+        peer.tap = std::make_unique<WireTap>(server_port + 1, server_port);
+        peer.device.id = "peer-" + std::to_string(i);
+        peer.device.name = "peer " + std::to_string(i);
+        peer.device.ip_address = "127.0.0.1";
+        peer.device.port = server_port + 1;
+        peer.rng.seed(static_cast<unsigned>(i));
+        edit(peer, diverged, diverged, next_stamp, expected, diverged);
+    }
+
+    out << peer_count << " peers, " << entries << " entries, each edits, deletes and adds " << diverged
+        << "\n\n";
+    print_header(out);
+
+    bool failed = false;
+    auto check = [&](const char* name, const PassStats& pass) {
+        print_pass(out, name, pass);
+        for (const auto& error : pass.errors) {
+            out << "      error: " << error << "\n";
+        }
+        std::string problem = mismatch(peers, expected);
+        if (!problem.empty()) {
+            out << "      vaults differ: " << problem << "\n";
+        }
+        failed = failed || !pass.errors.empty() || !problem.empty();
+    };
+
+    check("diverged", sync_pass(peers, false));
+    check("repeat", sync_pass(peers, false));
+    for (auto& peer : peers) {
+        edit(peer, edits, 1, next_stamp, expected, edits > 0 ? 1 : 0);
+    }
+    if (edits > 0) {
+        delete_then_edit(peers[0], peers[1], expected);
+    }
+    check("edited", sync_pass(peers, false));
+    check("unchanged", sync_pass(peers, false));
+
+    // Along the chain, the first pass only leaves every server a watermark
+    // for its client, as earlier syncs would have
+    for (auto& peer : peers) {
+        forget_watermarks(peer);
+    }
+    check("chain", sync_pass(peers, false, true));
+    // Changes reach the far end of the chain one pass at a time, but the
+    // head pulls last, so it must be level after every pass. A deletion it
+    // never saw shows there first: its server collected the tombstone.
+    std::vector<std::string> chain_errors;
+    for (size_t round = 0; round < peer_count + peer_count - 2; ++round) {
+        if (round < peer_count) {
+            for (auto& peer : peers) {
+                edit(peer, edits, 1, next_stamp, expected, 1);
+            }
+        }
+        PassStats pass = sync_pass(peers, false, true);
+        chain_errors.insert(chain_errors.end(), pass.errors.begin(), pass.errors.end());
+        std::string problem = expected.mismatch(peers[0].manager->get_vault_entries());
+        if (!problem.empty()) {
+            chain_errors.push_back(peers[0].device.name + " after pass " + std::to_string(round + 1) + ": " +
+                                   problem);
+        }
+    }
+    PassStats settled = sync_pass(peers, false, true);
+    settled.errors.insert(settled.errors.begin(), chain_errors.begin(), chain_errors.end());
+    check("chain end", settled);
+    check("chain again", sync_pass(peers, false, true));
+    out << "    " << expected.deleted() << " ids deleted so far\n";
+
+    if (soak_seconds > 0 && !failed) {
+        out << "\n  Soak: " << soak_seconds << " s of rounds of " << edits
+            << " edits and a deletion per peer, then all peers syncing at once\n";
+        out << "    " << std::right << std::setw(8) << "time" << std::setw(9) << "rounds" << std::setw(10)
+            << "sessions" << std::setw(8) << "errors" << std::setw(13) << "wire bytes" << std::setw(13)
+            << "resident" << "\n";
+
+        auto start = Clock::now();
+        auto deadline = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(soak_seconds));
+        auto next_report = start + REPORT_INTERVAL;
+        size_t rounds = 0, sessions = 0, errors = 0, warm_kb = 0;
+        uint64_t bytes = 0;
+        while (Clock::now() < deadline) {
+            for (auto& peer : peers) {
+                edit(peer, edits, 1, next_stamp, expected, 1);
+            }
+            size_t deleter = std::uniform_int_distribution<size_t>(0, peer_count - 1)(peers[0].rng);
+            delete_then_edit(peers[deleter], peers[(deleter + 1) % peer_count], expected);
+            PassStats pass = sync_pass(peers, true);
+            ++rounds;
+            sessions += pass.sessions.size();
+            errors += pass.errors.size();
+            for (const auto& stats : pass.sessions) {
+                bytes += stats.bytes_up + stats.bytes_down;
+            }
+            if (rounds == 1) {
+                warm_kb = resident_kb();
+            }
+
+            auto now = Clock::now();
+            if (now >= next_report || now >= deadline) {
+                out << "    " << std::setw(6) << std::fixed << std::setprecision(1)
+                    << std::chrono::duration<double>(now - start).count() << " s" << std::setw(9) << rounds
+                    << std::setw(10) << sessions << std::setw(8) << errors << std::setw(13) << bytes
+                    << std::setw(10) << resident_kb() / 1024.0 << " MB" << std::endl;
+                next_report = now + REPORT_INTERVAL;
+            }
+        }
+
+        // Sessions that ran at once resolved against different versions;
+        // one more pass, peer after peer, brings everyone level
+        out << "\n";
+        print_header(out);
+        check("settle", sync_pass(peers, false));
+        check("settled", sync_pass(peers, false));
+        failed = failed || errors > 0;
+        double growth = rounds > 1 ? (static_cast<double>(resident_kb()) - warm_kb) / (rounds - 1) : 0;
+        out << "    resident after the first round " << std::setprecision(1) << warm_kb / 1024.0
+            << " MB, at the end " << resident_kb() / 1024.0 << " MB (" << std::setprecision(2)
+            << growth << " KB per round)\n";
+    }
+
+    out << "\n  Peak resident memory " << std::fixed << std::setprecision(1) << peak_resident_kb() / 1024.0
+        << " MB\n";
+
+    for (auto& peer : peers) {
+        peer.manager->stop_sync_server();
+    }
+    peers.clear();
+
+    if (failed) {
+        std::cerr << "Sync failed or vaults differ\n";
+        return 1;
+    }
+    return 0;
+}
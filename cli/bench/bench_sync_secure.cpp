@@ -0,0 +1,218 @@
+// Cost of encrypting sync connections.
+//
+// Three parts:
+//   - the record layer: messages framed and read back through FrameEncoder
+//     and FrameReader, in the clear and sealed with each cipher, with the
+//     bytes the tags add on the wire
+//   - the handshake's pieces: an X25519 key share and agreement, the HKDF
+//     key schedule, and the Argon2id derivation of the passphrase key
+//   - whole sessions against an empty vault over loopback, so the time is
+//     the handshake: without a passphrase, with one, and resumed from a
+//     session ticket
+//
+// Usage: bench_sync_secure [--sessions N]
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include "../../core/src/crypto/secure_memory.cpp"
+#include "../../core/src/crypto/random.cpp"
+#include "../../core/src/storage/entry_hash.cpp"
+#include "../../core/src/storage/change_feed.cpp"
+#include "../../core/src/crypto/crypto.cpp"
+#include "../../core/src/sync/compression.cpp"
+#include "../../core/src/sync/secure_channel.cpp"
+#include "../../core/src/sync/framing.cpp"
+#include "../../core/src/sync/digest_tree.cpp"
+#include "../../core/src/sync/entry_diff.cpp"
+#include "../../core/src/sync/entry_delta.cpp"
+#include "../../core/src/sync/entry_store.cpp"
+#include "../../core/src/sync/sync_server.cpp"
+#include "../../core/src/sync/sync_manager.cpp"
+
+using namespace localpdub;
+using sync::json;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+constexpr int SERVER_PORT = 52950;
+
+// SyncManager logs progress to stdout; keep it out of the report
+class QuietStdout {
+public:
+    QuietStdout() : saved_(std::cout.rdbuf(nullptr)) {}
+    ~QuietStdout() { std::cout.rdbuf(saved_); }
+
+private:
+    std::streambuf* saved_;
+};
+
+template<typename Fn>
+double best_seconds(int repeats, Fn&& fn) {
+    double best = 1e30;
+    for (int r = 0; r < repeats; ++r) {
+        auto start = Clock::now();
+        fn();
+        best = std::min(best, std::chrono::duration<double>(Clock::now() - start).count());
+    }
+    return best;
+}
+
+sync::SessionKeys test_keys(crypto::Cipher cipher) {
+    crypto::SecureBytes shared(32, 0x42);
+    uint8_t transcript[sync::TRANSCRIPT_HASH_SIZE] = {};
+    return sync::derive_session_keys(cipher, sync::empty_psk(), shared, transcript);
+}
+
+// Frames count messages of size bytes and reads them back; returns the
+// bytes that went over the wire
+size_t round_trip(size_t size, size_t count, const sync::SessionKeys* keys) {
+    sync::FrameEncoder encoder;
+    sync::FrameReader reader;
+    if (keys) {
+        encoder.set_cipher(keys->client_cipher());
+        reader.enable_decryption(keys->client_cipher());
+    }
+
+    std::vector<uint8_t> payload(size, 0x5a);
+    crypto::SecureBytes wire;
+    sync::Message message;
+    size_t total = 0;
+    for (size_t i = 0; i < count; ++i) {
+        wire.clear();
+        encoder.encode(sync::FrameType::ENTRIES, payload.data(), payload.size(), wire);
+        total += wire.size();
+        reader.feed(wire.data(), wire.size());
+        if (!reader.next(message) || message.payload.size() != size) {
+            std::cerr << "Record layer round trip failed\n";
+            std::exit(1);
+        }
+    }
+    return total;
+}
+
+void record_layer() {
+    const size_t sizes[] = {1024, 16 * 1024, 1024 * 1024};
+    const auto aes = test_keys(crypto::Cipher::AES_256_GCM);
+    const auto chacha = test_keys(crypto::Cipher::CHACHA20_POLY1305);
+
+    std::cout << "Record layer (encode + read back, best of 5)\n";
+    std::cout << "  " << std::left << std::setw(10) << "message" << std::setw(20) << "cipher"
+              << std::right << std::setw(12) << "MB/s" << std::setw(14) << "wire bytes" << "\n";
+    for (size_t size : sizes) {
+        size_t count = std::max<size_t>(16, (64u << 20) / size);
+        const std::pair<const char*, const sync::SessionKeys*> modes[] = {
+            {"none", nullptr}, {"aes-256-gcm", &aes}, {"chacha20-poly1305", &chacha}
+        };
+        for (const auto& mode : modes) {
+            size_t wire = 0;
+            double seconds = best_seconds(5, [&]() { wire = round_trip(size, count, mode.second); });
+            std::string label = size >= 1024 * 1024 ? std::to_string(size >> 20) + " MB" :
+                                                      std::to_string(size >> 10) + " KB";
+            std::cout << "  " << std::left << std::setw(10) << label << std::setw(20) << mode.first
+                      << std::right << std::setw(12) << std::fixed << std::setprecision(1)
+                      << (size * count / seconds / 1e6) << std::setw(14) << wire / count << "\n";
+        }
+    }
+}
+
+void handshake_pieces() {
+    const int rounds = 200;
+    crypto::SecureBytes shared;
+    double agree = best_seconds(3, [&]() {
+        for (int i = 0; i < rounds; ++i) {
+            sync::KeyShare client, server;
+            client.agree(server.public_key(), shared);
+            server.agree(client.public_key(), shared);
+        }
+    }) / rounds;
+
+    uint8_t transcript[sync::TRANSCRIPT_HASH_SIZE] = {};
+    double schedule = best_seconds(3, [&]() {
+        for (int i = 0; i < rounds; ++i) {
+            sync::derive_session_keys(crypto::Cipher::AES_256_GCM, sync::empty_psk(), shared, transcript);
+        }
+    }) / rounds;
+
+    auto salt = crypto::generate_salt();
+    double kdf = best_seconds(1, [&]() { sync::derive_sync_psk(crypto::SecureString("passphrase"), salt); });
+
+    std::cout << "\nHandshake pieces\n" << std::fixed << std::setprecision(1)
+              << "  key shares + agreement (both sides)  " << std::setw(9) << agree * 1e6 << " us\n"
+              << "  key schedule                         " << std::setw(9) << schedule * 1e6 << " us\n"
+              << "  passphrase key (Argon2id)            " << std::setw(9) << kdf * 1e6 << " us\n";
+}
+
+// Mean time of a sync with an empty vault
+double session_seconds(sync::SyncManager& client, const sync::Device& server, sync::AuthMethod auth,
+                       const crypto::SecureString& passphrase, int sessions) {
+    // The first session issues the ticket later ones resume from
+    client.sync_with_devices({server}, sync::SyncStrategy::NEWEST_WINS, auth, passphrase);
+    auto start = Clock::now();
+    for (int i = 0; i < sessions; ++i) {
+        auto result = client.sync_with_devices({server}, sync::SyncStrategy::NEWEST_WINS, auth, passphrase);
+        if (!result.success) {
+            std::cerr << "Sync failed: " << (result.errors.empty() ? "" : result.errors.front()) << "\n";
+            std::exit(1);
+        }
+    }
+    return std::chrono::duration<double>(Clock::now() - start).count() / sessions;
+}
+
+void sessions(int count) {
+    const crypto::SecureString passphrase("correct horse battery staple");
+    sync::Device device;
+    device.id = "secure-server";
+    device.name = "server";
+    device.ip_address = "127.0.0.1";
+    device.port = SERVER_PORT;
+
+    double open = 0, full = 0, resumed = 0;
+    {
+        QuietStdout quiet;
+        sync::SyncManager server("secure-server");
+        if (!server.start_sync_server(SERVER_PORT)) {
+            std::cerr << "Could not start the server on port " << SERVER_PORT << "\n";
+            std::exit(1);
+        }
+        sync::SyncManager client("secure-client");
+        open = session_seconds(client, device, sync::AuthMethod::NONE, crypto::SecureString(), count);
+
+        server.set_passphrase(passphrase);
+        client.set_session_resumption_enabled(false);
+        full = session_seconds(client, device, sync::AuthMethod::PASSPHRASE, passphrase, count);
+        client.set_session_resumption_enabled(true);
+        resumed = session_seconds(client, device, sync::AuthMethod::PASSPHRASE, passphrase, count);
+        server.stop_sync_server();
+    }
+
+    std::cout << "\nSessions with an empty vault (mean of " << count << ")\n" << std::fixed
+              << std::setprecision(2)
+              << "  no passphrase                        " << std::setw(9) << open * 1e3 << " ms\n"
+              << "  passphrase, full handshake           " << std::setw(9) << full * 1e3 << " ms\n"
+              << "  passphrase, resumed from ticket      " << std::setw(9) << resumed * 1e3 << " ms\n";
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    int count = 20;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--sessions") == 0 && i + 1 < argc) {
+            count = std::max(1, std::atoi(argv[++i]));
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--sessions N]\n";
+            return 2;
+        }
+    }
+
+    record_layer();
+    handshake_pieces();
+    sessions(count);
+    return 0;
+}
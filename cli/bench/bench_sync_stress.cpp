@@ -0,0 +1,316 @@
+// Many clients syncing with one server at once.
+//
+// Every client starts from the server's vault and runs several rounds: it
+// edits a random handful of the shared entries, deletes one, adds a few of
+// its own, then syncs with the server (newest wins), retrying when the
+// server is at its connection limit. Every edit carries a modified stamp no
+// other edit has, older than any deletion, so the outcome is known in
+// advance: once all clients are done, the server must hold each entry
+// exactly once, in the version with the highest stamp, and no deleted one.
+// Meanwhile a reader thread keeps taking copies of the server's vault and
+// checks that none ever holds an id twice.
+//
+// Reports the time, sessions per second and refusals; exits 1 if the
+// server's vault is not the expected one. Build with -fsanitize=thread to
+// check the store for data races as well.
+//
+// Usage: bench_sync_stress [--clients C] [--rounds R] [--entries N]
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <random>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstdlib>
+#include <cstring>
+#include "../../core/src/crypto/secure_memory.cpp"
+#include "../../core/src/crypto/random.cpp"
+#include "../../core/src/storage/entry_hash.cpp"
+#include "../../core/src/storage/change_feed.cpp"
+#include "../../core/src/crypto/crypto.cpp"
+#include "../../core/src/sync/compression.cpp"
+#include "../../core/src/sync/secure_channel.cpp"
+#include "../../core/src/sync/framing.cpp"
+#include "../../core/src/sync/digest_tree.cpp"
+#include "../../core/src/sync/entry_diff.cpp"
+#include "../../core/src/sync/entry_delta.cpp"
+#include "../../core/src/sync/entry_store.cpp"
+#include "../../core/src/sync/sync_server.cpp"
+#include "../../core/src/sync/sync_manager.cpp"
+
+using namespace localpdub;
+using sync::json;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+constexpr int SERVER_PORT = 52900;
+constexpr size_t EDITS_PER_ROUND = 20;
+constexpr size_t NEW_PER_ROUND = 5;
+constexpr size_t DELETES_PER_ROUND = 1;
+constexpr long BASE_STAMP = 1717243200;
+
+// SyncManager logs progress to stdout; keep it out of the report
+class QuietStdout {
+public:
+    QuietStdout() : saved_(std::cout.rdbuf(nullptr)) {}
+    ~QuietStdout() { std::cout.rdbuf(saved_); }
+
+private:
+    std::streambuf* saved_;
+};
+
+json make_entry(const std::string& id, const std::string& title, long stamp) {
+    return {
+        {"id", id},
+        {"type", "login"},
+        {"title", title},
+        {"username", "user@example.com"},
+        {"password", "v" + std::to_string(stamp)},
+        {"url", "https://example.com/login"},
+        {"notes", ""},
+        {"tags", json::array({"personal"})},
+        {"modified", stamp}
+    };
+}
+
+std::string id_string(const json& entry) {
+    return entry["id"].get_ref<const json::string_t&>().c_str();
+}
+
+// The newest version of each id written so far, and the ids deleted.
+// Every edit is older than every deletion, so a deletion always wins.
+class Expected {
+public:
+    void record(const json& entry) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::string id = id_string(entry);
+        if (deleted_.count(id)) {
+            return;
+        }
+        long& newest = newest_[id];
+        newest = std::max(newest, entry["modified"].get<long>());
+    }
+
+    void bury(const std::string& id) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        newest_.erase(id);
+        deleted_.insert(id);
+    }
+
+    size_t deleted() const { return deleted_.size(); }
+
+    // Empty if entries hold every recorded id once, at its newest stamp,
+    // and no deleted one
+    std::string mismatch(const json& entries) const {
+        std::unordered_set<std::string> seen;
+        for (const auto& entry : entries) {
+            std::string id = id_string(entry);
+            if (!seen.insert(id).second) {
+                return "duplicate id " + id;
+            }
+            if (deleted_.count(id)) {
+                return "deleted id " + id + " came back";
+            }
+            auto it = newest_.find(id);
+            if (it == newest_.end()) {
+                return "unexpected id " + id;
+            }
+            long stamp = entry["modified"].get<long>();
+            if (stamp != it->second || entry["password"] != "v" + std::to_string(stamp)) {
+                return "stale version of " + id;
+            }
+        }
+        if (seen.size() != newest_.size()) {
+            return std::to_string(newest_.size() - seen.size()) + " entries missing";
+        }
+        return "";
+    }
+
+private:
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, long> newest_;
+    std::unordered_set<std::string> deleted_;
+};
+
+struct ClientStats {
+    size_t sessions = 0;
+    size_t refusals = 0;
+    std::string error;
+};
+
+void run_client(size_t index, size_t rounds, const json& shared, std::atomic<long>& next_stamp,
+                Expected& expected, ClientStats& stats) {
+    sync::SyncManager client("stress-client-" + std::to_string(index));
+    json vault = shared;
+    std::mt19937 rng(static_cast<unsigned>(index));
+
+    sync::Device server;
+    server.id = "stress-server";
+    server.name = "server";
+    server.ip_address = "127.0.0.1";
+    server.port = SERVER_PORT;
+
+    for (size_t round = 0; round < rounds; ++round) {
+        // Edits and deletions overlap with other clients' on the shared
+        // entries; all go in the change feed, as the CLI's vault does
+        storage::ChangeFeed feed = client.get_change_feed();
+        std::uniform_int_distribution<size_t> pick(0, vault.size() - 1);
+        for (size_t i = 0; i < EDITS_PER_ROUND && !vault.empty(); ++i) {
+            json& entry = vault[pick(rng)];
+            long stamp = next_stamp++;
+            entry["modified"] = stamp;
+            entry["password"] = "v" + std::to_string(stamp);
+            expected.record(entry);
+            feed.touch(id_string(entry));
+        }
+        for (size_t i = 0; i < DELETES_PER_ROUND && !vault.empty(); ++i) {
+            size_t victim = pick(rng) % vault.size();
+            std::string id = id_string(vault[victim]);
+            feed.bury(id);
+            expected.bury(id);
+            vault.erase(victim);
+        }
+        for (size_t i = 0; i < NEW_PER_ROUND; ++i) {
+            json entry = make_entry(crypto::generate_uuid(), "Client " + std::to_string(index), next_stamp++);
+            expected.record(entry);
+            feed.touch(id_string(entry));
+            vault.push_back(std::move(entry));
+        }
+        client.set_vault_entries(vault);
+        client.set_change_feed(feed);
+
+        while (true) {
+            auto result = client.sync_with_devices({server}, sync::SyncStrategy::NEWEST_WINS,
+                                                   sync::AuthMethod::NONE);
+            ++stats.sessions;
+            if (result.success) {
+                break;
+            }
+            bool busy = !result.errors.empty() &&
+                        result.errors.front().find("Too many sync connections") != std::string::npos;
+            if (!busy) {
+                stats.error = result.errors.empty() ? "sync failed" : result.errors.front();
+                return;
+            }
+            // Back off, with jitter so refused clients don't return together
+            ++stats.refusals;
+            std::this_thread::sleep_for(std::chrono::milliseconds(50 + rng() % 100));
+        }
+        vault = client.get_vault_entries();
+    }
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    size_t clients = 16;
+    size_t rounds = 5;
+    size_t entries = 2000;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--clients") == 0 && i + 1 < argc) {
+            clients = std::max<size_t>(1, std::strtoull(argv[++i], nullptr, 10));
+        } else if (std::strcmp(argv[i], "--rounds") == 0 && i + 1 < argc) {
+            rounds = std::max<size_t>(1, std::strtoull(argv[++i], nullptr, 10));
+        } else if (std::strcmp(argv[i], "--entries") == 0 && i + 1 < argc) {
+            entries = std::max<size_t>(1, std::strtoull(argv[++i], nullptr, 10));
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--clients C] [--rounds R] [--entries N]\n";
+            return 2;
+        }
+    }
+
+    Expected expected;
+    json shared = json::array();
+    for (size_t i = 0; i < entries; ++i) {
+        shared.push_back(make_entry(crypto::generate_uuid(), "Account " + std::to_string(i),
+                                    BASE_STAMP + static_cast<long>(i)));
+        expected.record(shared.back());
+    }
+    std::atomic<long> next_stamp{BASE_STAMP + static_cast<long>(entries)};
+
+    std::cout << clients << " clients x " << rounds << " rounds against one server with "
+              << entries << " entries\n";
+
+    std::vector<ClientStats> stats(clients);
+    std::string reader_error;
+    size_t reads = 0;
+    double seconds = 0;
+    json final_entries;
+    {
+        QuietStdout quiet;
+        sync::SyncManager server("stress-server");
+        server.set_vault_entries(shared);
+        if (!server.start_sync_server(SERVER_PORT)) {
+            std::cerr << "Could not start the server on port " << SERVER_PORT << "\n";
+            return 1;
+        }
+
+        // Copies taken while sessions commit must never be half-merged
+        std::atomic<bool> done{false};
+        std::thread reader([&]() {
+            while (!done) {
+                json copy = server.get_vault_entries();
+                std::unordered_set<std::string> seen;
+                for (const auto& entry : copy) {
+                    if (!seen.insert(id_string(entry)).second && reader_error.empty()) {
+                        reader_error = "copy holds " + id_string(entry) + " twice";
+                    }
+                }
+                ++reads;
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        });
+
+        auto start = Clock::now();
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < clients; ++i) {
+            threads.emplace_back(run_client, i, rounds, std::cref(shared), std::ref(next_stamp),
+                                 std::ref(expected), std::ref(stats[i]));
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        server.wait_for_sessions(std::chrono::seconds(10));
+        seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        done = true;
+        reader.join();
+        server.stop_sync_server();
+        final_entries = server.get_vault_entries();
+    }
+
+    size_t sessions = 0;
+    size_t refusals = 0;
+    for (const auto& client : stats) {
+        sessions += client.sessions;
+        refusals += client.refusals;
+        if (!client.error.empty()) {
+            std::cerr << "Client failed: " << client.error << "\n";
+            return 1;
+        }
+    }
+    std::cout << "  " << sessions << " sessions (" << refusals << " refused at the connection limit) in "
+              << std::fixed << std::setprecision(2) << seconds << " s, "
+              << std::setprecision(1) << (sessions - refusals) / seconds << " syncs/s\n";
+    std::cout << "  " << reads << " concurrent copies of the server vault taken\n";
+
+    if (!reader_error.empty()) {
+        std::cerr << "Inconsistent copy: " << reader_error << "\n";
+        return 1;
+    }
+    std::string mismatch = expected.mismatch(final_entries);
+    if (!mismatch.empty()) {
+        std::cerr << "Server vault is wrong: " << mismatch << "\n";
+        return 1;
+    }
+    std::cout << "  Server holds " << final_entries.size() << " entries, each at its newest version, and none of "
+              << expected.deleted() << " deleted\n";
+    return 0;
+}
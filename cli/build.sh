@@ -46,6 +46,13 @@ else
     echo "✓ Argon2 found"
 fi
 
+if ! pkg-config --exists zlib; then
+    echo "❌ zlib development libraries not found"
+    missing_deps=true
+else
+    echo "✓ zlib found"
+fi
+
 # Check for nlohmann-json
 if ! pkg-config --exists nlohmann_json 2>/dev/null && \
    ! [ -f /usr/include/nlohmann/json.hpp ] && \
@@ -67,6 +74,7 @@ if $missing_deps; then
     echo "    cmake \\"
     echo "    libssl-dev \\"
     echo "    libargon2-dev \\"
+    echo "    zlib1g-dev \\"
     echo "    nlohmann-json3-dev \\"
     echo "    pkg-config"
     echo ""
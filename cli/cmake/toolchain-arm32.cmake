@@ -20,4 +20,10 @@ set(CMAKE_FIND_ROOT_PATH_MODE_PACKAGE ONLY)
 
 # Compiler flags for ARM32
 set(CMAKE_C_FLAGS "${CMAKE_C_FLAGS} -march=armv7-a -mfpu=neon-vfpv4 -mfloat-abi=hard")
-set(CMAKE_CXX_FLAGS "${CMAKE_CXX_FLAGS} -march=armv7-a -mfpu=neon-vfpv4 -mfloat-abi=hard")
\ No newline at end of file
+set(CMAKE_CXX_FLAGS "${CMAKE_CXX_FLAGS} -march=armv7-a -mfpu=neon-vfpv4 -mfloat-abi=hard")
+
+# Run target binaries (benchmarks) on the build host through qemu-user
+find_program(QEMU_ARM32 qemu-arm)
+if(QEMU_ARM32)
+    set(CMAKE_CROSSCOMPILING_EMULATOR ${QEMU_ARM32} -L /usr/arm-linux-gnueabihf)
+endif()
@@ -20,4 +20,10 @@ set(CMAKE_FIND_ROOT_PATH_MODE_PACKAGE ONLY)
 
 # Compiler flags for ARM64
 set(CMAKE_C_FLAGS "${CMAKE_C_FLAGS} -march=armv8-a+crypto")
-set(CMAKE_CXX_FLAGS "${CMAKE_CXX_FLAGS} -march=armv8-a+crypto")
\ No newline at end of file
+set(CMAKE_CXX_FLAGS "${CMAKE_CXX_FLAGS} -march=armv8-a+crypto")
+
+# Run target binaries (benchmarks) on the build host through qemu-user
+find_program(QEMU_ARM64 qemu-aarch64)
+if(QEMU_ARM64)
+    set(CMAKE_CROSSCOMPILING_EMULATOR ${QEMU_ARM64} -L /usr/aarch64-linux-gnu)
+endif()
@@ -6,6 +6,8 @@
 #include <termios.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <nlohmann/json.hpp>
 #include <iomanip>
 #include <algorithm>
@@ -16,13 +18,25 @@
 #include <mutex>
 #include <atomic>
 #include "../../core/include/ui/ansi_colors.h"
+#include "../../core/src/crypto/secure_memory.cpp"
+#include "../../core/src/crypto/random.cpp"
+#include "../../core/src/storage/entry_hash.cpp"
+#include "../../core/src/storage/change_feed.cpp"
 #include "../../core/src/storage/vault_storage.cpp"
 #include "../../core/src/crypto/crypto.cpp"
 #include "../../core/src/sync/network_discovery.cpp"
+#include "../../core/src/sync/compression.cpp"
+#include "../../core/src/sync/secure_channel.cpp"
+#include "../../core/src/sync/framing.cpp"
+#include "../../core/src/sync/digest_tree.cpp"
+#include "../../core/src/sync/entry_diff.cpp"
+#include "../../core/src/sync/entry_delta.cpp"
+#include "../../core/src/sync/entry_store.cpp"
+#include "../../core/src/sync/sync_server.cpp"
 #include "../../core/src/sync/sync_manager.cpp"
 
 using namespace localpdub;
-using json = nlohmann::json;
+using json = crypto::SecureJson;
 
 class LocalPDubCLI {
 private:
@@ -142,6 +156,12 @@ private:
                      << ui::AnsiUI::color(ui::ansi::RESET) << " Direct sync by "
                      << ui::AnsiUI::cyan("I") << "P address\n";
 
+            std::cout << ui::AnsiUI::color(ui::ansi::BRIGHT_WHITE) << "["
+                     << ui::AnsiUI::color(ui::ansi::BRIGHT_MAGENTA) << "P"
+                     << ui::AnsiUI::color(ui::ansi::BRIGHT_WHITE) << "]"
+                     << ui::AnsiUI::color(ui::ansi::RESET) << " Change master "
+                     << ui::AnsiUI::magenta("p") << "assword\n";
+
             std::cout << ui::AnsiUI::color(ui::ansi::BRIGHT_WHITE) << "["
                      << ui::AnsiUI::color(ui::ansi::BRIGHT_GREEN) << "X"
                      << ui::AnsiUI::color(ui::ansi::BRIGHT_WHITE) << "]"
@@ -173,6 +193,7 @@ private:
                 case 'G': case '7': generate_password_menu(); break;
                 case 'Y': case '8': sync_with_devices(); break;
                 case 'I': case '9': direct_sync_by_ip(); break;
+                case 'P': change_master_password(); break;
                 case 'X': save_and_exit(); break;
                 case 'Q': case '0': exit_without_saving(); break;
                 default:
@@ -184,9 +205,9 @@ private:
     void create_new_vault() {
         std::cout << "Creating new vault...\n";
         std::cout << "Enter master password: ";
-        std::string password = read_password();
+        crypto::SecureString password = read_password();
         std::cout << "\nConfirm master password: ";
-        std::string confirm = read_password();
+        crypto::SecureString confirm = read_password();
         std::cout << "\n";
 
         if (password != confirm) {
@@ -200,7 +221,9 @@ private:
         }
 
         if (vault.create_vault(password)) {
-            std::cout << ui::AnsiUI::success("Vault created successfully!") << "\n";
+            std::cout << ui::AnsiUI::success("Vault created successfully! (" +
+                                             std::string(crypto::cipher_name(vault.get_cipher())) +
+                                             ")") << "\n";
         } else {
             std::cout << ui::AnsiUI::error("Failed to create vault!") << "\n";
             exit(1);
@@ -209,7 +232,7 @@ private:
 
     void open_existing_vault() {
         std::cout << "Enter master password: ";
-        std::string password = read_password();
+        crypto::SecureString password = read_password();
         std::cout << "\n";
 
         if (vault.open_vault(password)) {
@@ -347,7 +370,7 @@ private:
         entry["username"] = username;
 
         std::cout << "Password (leave empty to generate): ";
-        std::string password;
+        crypto::SecureString password;
         std::getline(std::cin, password);
         if (password.empty()) {
             password = generate_password(20, true, true, true, true);
@@ -380,12 +403,12 @@ private:
             json custom_fields;
             while (true) {
                 std::cout << "Field name (or 'done' to finish): ";
-                std::string field_name;
+                crypto::SecureString field_name;
                 std::getline(std::cin, field_name);
                 if (field_name == "done") break;
 
                 std::cout << "Field value: ";
-                std::string field_value;
+                crypto::SecureString field_value;
                 std::getline(std::cin, field_value);
                 custom_fields[field_name] = field_value;
             }
@@ -477,7 +500,7 @@ private:
         if (!username.empty()) entry["username"] = username;
 
         std::cout << "Password [" << mask_password(entry.value("password", "")) << "]: ";
-        std::string password;
+        crypto::SecureString password;
         std::getline(std::cin, password);
         if (!password.empty()) entry["password"] = password;
 
@@ -549,7 +572,7 @@ private:
         std::string symbols;
         std::getline(std::cin, symbols);
 
-        std::string password = generate_password(
+        crypto::SecureString password = generate_password(
             length,
             upper.empty() || upper[0] == 'y' || upper[0] == 'Y',
             lower.empty() || lower[0] == 'y' || lower[0] == 'Y',
@@ -570,7 +593,7 @@ private:
         }
     }
 
-    std::string generate_password(int length, bool upper, bool lower,
+    crypto::SecureString generate_password(int length, bool upper, bool lower,
                                  bool numbers, bool symbols) {
         std::string charset;
         if (upper) charset += "ABCDEFGHIJKLMNOPQRSTUVWXYZ";
@@ -584,7 +607,7 @@ private:
         std::mt19937 gen(rd());
         std::uniform_int_distribution<> dis(0, charset.size() - 1);
 
-        std::string password;
+        crypto::SecureString password;
         for (int i = 0; i < length; i++) {
             password += charset[dis(gen)];
         }
@@ -592,6 +615,34 @@ private:
         return password;
     }
 
+    void change_master_password() {
+        std::cout << "\n═══ Change Master Password ═══\n\n";
+        std::cout << "Current master password: ";
+        crypto::SecureString current = read_password();
+        std::cout << "\nNew master password: ";
+        crypto::SecureString password = read_password();
+        std::cout << "\nConfirm new master password: ";
+        crypto::SecureString confirm = read_password();
+        std::cout << "\n";
+
+        if (password != confirm) {
+            std::cout << ui::AnsiUI::error("Passwords do not match!") << "\n";
+            return;
+        }
+
+        if (password.length() < 8) {
+            std::cout << ui::AnsiUI::error("Password must be at least 8 characters!") << "\n";
+            return;
+        }
+
+        // Only the key slot is rewritten; the vault data is not re-encrypted
+        if (vault.change_password(current, password)) {
+            std::cout << ui::AnsiUI::success("Master password changed.") << "\n";
+        } else {
+            std::cout << ui::AnsiUI::error("Current password is incorrect or the vault could not be updated!") << "\n";
+        }
+    }
+
     void sync_with_devices() {
         std::cout << "\n═══ Sync with Other Devices ═══\n\n";
 
@@ -609,6 +660,9 @@ private:
         sync::SyncManager sync_server(vault_path.string());
         // Pass the vault entries to sync manager so it can compute digests when receiving connections
         sync_server.set_vault_entries(vault.get_all_entries());
+        sync_server.set_entry_hashes(vault.get_entry_hashes());
+        sync_server.set_change_feed(vault.get_change_feed());
+        sync_server.set_stats_log((vault_path.parent_path() / "sync-stats.jsonl").string());
         // Passphrase will be set later if authentication is chosen
 
         int sync_server_port = 51820;
@@ -653,10 +707,27 @@ private:
         std::atomic<bool> input_received(false);
         std::atomic<bool> sync_started(false);
 
+        // Wakes the loop below when a device turns up or a sync starts. The
+        // callbacks keep it open, as the server may connect later still.
+        std::shared_ptr<int> notify_fd(new int(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), [](int* fd) {
+            if (*fd >= 0) {
+                close(*fd);
+            }
+            delete fd;
+        });
+        auto notify = [notify_fd]() {
+            uint64_t one = 1;
+            if (*notify_fd >= 0 && write(*notify_fd, &one, sizeof(one)) < 0) {
+                // Already signalled
+            }
+        };
+        discovery.set_device_found_callback([notify](const sync::Device&) { notify(); });
+
         // Set callback to stop discovery when sync starts
-        sync_server.set_connection_callback([&stop_requested, &sync_started]() {
+        sync_server.set_connection_callback([&stop_requested, &sync_started, notify]() {
             stop_requested = true;
             sync_started = true;
+            notify();
         });
 
         // Use a non-blocking approach for input checking
@@ -698,7 +769,15 @@ private:
                 break;
             }
 
-            std::this_thread::sleep_for(std::chrono::milliseconds(500));
+            // Sleep until a key, a device, a sync or the timeout
+            auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::seconds(60) - elapsed);
+            struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {*notify_fd, POLLIN, 0}};
+            poll(fds, *notify_fd >= 0 ? 2 : 1, static_cast<int>(remaining.count()) + 1);
+            uint64_t count;
+            if (*notify_fd >= 0 && read(*notify_fd, &count, sizeof(count)) < 0) {
+                // Nothing signalled
+            }
         }
 
         // Stop discovery first
@@ -710,6 +789,9 @@ private:
         // Clean up input state
         if (sync_started.load()) {
             std::cout << "\nStopping discovery - sync connection established.\n";
+            if (!sync_server.wait_for_sessions(std::chrono::seconds(60))) {
+                std::cout << "Incoming sync is still running; saving what has arrived so far.\n";
+            }
         } else if (!input_received.load()) {
             std::cout << "\nDiscovery timeout reached.\n";
             // Clear any pending input
@@ -752,6 +834,8 @@ private:
             if (vault_updated) {
                 // Update and save vault with entries received as server
                 vault.set_all_entries(updated_entries);
+                vault.set_entry_hashes(sync_server.get_entry_hashes());
+                vault.set_change_feed(sync_server.get_change_feed());
                 if (vault.save_vault()) {
                     std::cout << "\n✓ Vault updated from incoming sync connections\n";
                 }
@@ -858,7 +942,7 @@ private:
         }
 
         sync::AuthMethod auth_method = sync::AuthMethod::NONE;
-        std::string passphrase;
+        crypto::SecureString passphrase;
 
         if (auth_choice == 2) {
             auth_method = sync::AuthMethod::PASSPHRASE;
@@ -877,6 +961,8 @@ private:
 
         // Make sure server has latest vault entries for the sync
         sync_server.set_vault_entries(vault.get_all_entries());
+        sync_server.set_entry_hashes(vault.get_entry_hashes());
+        sync_server.set_change_feed(vault.get_change_feed());
 
         auto result = sync_server.sync_with_devices(selected_devices, strategy, auth_method, passphrase);
 
@@ -901,8 +987,8 @@ private:
                         return e.contains("id") && e["id"] == entry_id;
                     });
 
-                if (existing == current_entries.end()) {
-                    // This is a new entry that was received while acting as server
+                if (existing == current_entries.end() || *existing != entry) {
+                    // A new or changed entry, received from a peer
                     vault_updated = true;
                     break;
                 }
@@ -911,9 +997,16 @@ private:
             if (vault_updated || final_entries.size() != current_entries.size()) {
                 // Replace vault entries with synced version
                 vault.set_all_entries(final_entries);
+                vault.set_entry_hashes(sync_server.get_entry_hashes());
+                vault.set_change_feed(sync_server.get_change_feed());
                 if (vault.save_vault()) {
                     std::cout << "\n✓ Vault updated with synced entries\n";
                 }
+            } else if (std::any_of(result.devices.begin(), result.devices.end(),
+                                   [](const auto& device) { return device.success; })) {
+                // Entries unchanged, but keep how far each peer got
+                vault.set_change_feed(sync_server.get_change_feed());
+                vault.save_vault();
             }
         }
 
@@ -929,6 +1022,22 @@ private:
         std::cout << "  Entries sent: " << result.entries_sent << "\n";
         std::cout << "  Entries received: " << result.entries_received << "\n";
         std::cout << "  Conflicts resolved: " << result.conflicts_resolved << "\n";
+        if (result.deletions_sent > 0 || result.deletions_received > 0) {
+            std::cout << "  Deletions sent: " << result.deletions_sent << "\n";
+            std::cout << "  Entries deleted by peers: " << result.deletions_received << "\n";
+        }
+
+        if (result.devices.size() > 1) {
+            std::cout << "\nBy device:\n";
+            for (const auto& device : result.devices) {
+                std::cout << "  " << (device.success ? "✓ " : "✗ ") << device.device_name
+                          << ": sent " << device.entries_sent
+                          << ", received " << device.entries_received
+                          << ", " << device.conflicts_resolved << " conflicts"
+                          << " (" << device.duration.count() << " ms)\n";
+            }
+        }
+        print_sync_timings(result);
 
         if (!result.errors.empty()) {
             std::cout << "\nErrors:\n";
@@ -938,12 +1047,27 @@ private:
         }
 
         // Reload vault to show synced entries
-        if (result.entries_received > 0) {
+        if (result.entries_received > 0 || result.deletions_received > 0) {
             std::cout << "\nReloading vault to show synced entries...\n";
             vault.reload_entries();
         }
     }
 
+    // Wire bytes and where each device's session spent its time
+    void print_sync_timings(const sync::SyncResult& result) {
+        std::cout << "\nTransferred " << result.bytes_sent << " bytes, received " << result.bytes_received
+                  << " bytes in " << result.duration.count() << " ms\n";
+        for (const auto& device : result.devices) {
+            const auto& t = device.timings;
+            auto ms = [](std::chrono::microseconds span) { return std::to_string(span.count() / 1000); };
+            std::cout << "  " << device.device_name << ": connect " << ms(t.connect)
+                      << ", auth " << ms(t.auth) << ", digests " << ms(t.digest_build)
+                      << " + " << ms(t.digest_exchange) << ", diff " << ms(t.diff)
+                      << ", send " << ms(t.send) << ", receive " << ms(t.receive)
+                      << ", apply " << ms(t.apply) << " ms\n";
+        }
+    }
+
     void direct_sync_by_ip() {
         std::cout << "\n" << ui::AnsiUI::color(ui::ansi::BRIGHT_CYAN);
         std::cout << "═══ Direct Sync by IP Address ═══\n";
@@ -1018,7 +1142,7 @@ private:
         }
 
         sync::AuthMethod auth_method = sync::AuthMethod::NONE;
-        std::string passphrase;
+        crypto::SecureString passphrase;
 
         if (auth_choice == 2) {
             auth_method = sync::AuthMethod::PASSPHRASE;
@@ -1032,6 +1156,10 @@ private:
         // Create sync manager and attempt connection
         sync::SyncManager sync_manager(vault.get_vault_path());
         sync_manager.set_vault_entries(vault_entries);
+        sync_manager.set_entry_hashes(vault.get_entry_hashes());
+        sync_manager.set_change_feed(vault.get_change_feed());
+        sync_manager.set_stats_log(
+            (std::filesystem::path(vault.get_vault_path()).parent_path() / "sync-stats.jsonl").string());
 
         std::cout << "\n" << ui::AnsiUI::info("Attempting direct connection...") << "\n";
 
@@ -1040,12 +1168,19 @@ private:
         auto result = sync_manager.sync_with_devices(devices, strategy, auth_method, passphrase);
 
         // Update vault if sync was successful
-        if (result.success && (result.entries_received > 0 || result.entries_sent > 0)) {
+        if (result.success && (result.entries_received > 0 || result.entries_sent > 0 ||
+                               result.deletions_received > 0)) {
             json final_entries = sync_manager.get_vault_entries();
             vault.set_all_entries(final_entries);
+            vault.set_entry_hashes(sync_manager.get_entry_hashes());
+            vault.set_change_feed(sync_manager.get_change_feed());
             if (vault.save_vault()) {
                 std::cout << "\n✓ Vault updated with synced entries\n";
             }
+        } else if (result.success) {
+            // Nothing changed, but keep how far the peer got
+            vault.set_change_feed(sync_manager.get_change_feed());
+            vault.save_vault();
         }
 
         // Display results
@@ -1071,6 +1206,12 @@ private:
             std::cout << "  Entries received: " << result.entries_received << "\n";
             std::cout << "  Conflicts resolved: " << result.conflicts_resolved << "\n";
         }
+        if (result.deletions_received > 0) {
+            std::cout << "  Entries deleted by peer: " << result.deletions_received << "\n";
+        }
+        if (result.bytes_sent > 0 || result.bytes_received > 0) {
+            print_sync_timings(result);
+        }
 
         if (!result.errors.empty()) {
             std::cout << "\nErrors:\n";
@@ -1080,7 +1221,7 @@ private:
         }
 
         // Reload vault to show synced entries
-        if (result.entries_received > 0) {
+        if (result.entries_received > 0 || result.deletions_received > 0) {
             std::cout << "\nReloading vault to show synced entries...\n";
             vault.reload_entries();
         }
@@ -1130,33 +1271,33 @@ private:
         return c;
     }
 
-    std::string read_password() {
+    crypto::SecureString read_password() {
         termios oldt;
         tcgetattr(STDIN_FILENO, &oldt);
         termios newt = oldt;
         newt.c_lflag &= ~ECHO;
         tcsetattr(STDIN_FILENO, TCSANOW, &newt);
 
-        std::string password;
+        crypto::SecureString password;
         std::getline(std::cin, password);
 
         tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
         return password;
     }
 
-    std::string mask_password(const std::string& password) {
+    std::string mask_password(std::string_view password) {
         if (password.length() <= 4) {
             return std::string(password.length(), '*');
         }
-        return password.substr(0, 2) + std::string(password.length() - 4, '*') +
-               password.substr(password.length() - 2);
+        return std::string(password.substr(0, 2)) + std::string(password.length() - 4, '*') +
+               std::string(password.substr(password.length() - 2));
     }
 
-    std::string truncate(const std::string& str, size_t width) {
+    std::string truncate(std::string_view str, size_t width) {
         if (str.length() > width) {
-            return str.substr(0, width - 3) + "...";
+            return std::string(str.substr(0, width - 3)) + "...";
         }
-        return str;
+        return std::string(str);
     }
 };
 
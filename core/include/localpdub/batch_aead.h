@@ -0,0 +1,56 @@
+#pragma once
+
+#include "localpdub/crypto.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+namespace localpdub {
+namespace crypto {
+
+// One record of a batch. The nonce must be AEAD_NONCE_SIZE bytes and must
+// never repeat under the same key.
+struct AeadRecord {
+    std::vector<uint8_t> nonce;
+    SecureBytes data;  // Plaintext for seal, ciphertext || tag for open
+};
+
+// Multi-threaded batch AEAD engine for sealing many small records
+// (per-entry vault data, sync payloads, history records).
+//
+// Records are split across a fixed pool of worker threads; each worker keeps
+// its own AeadContext, so the key schedule is computed once per worker per
+// batch rather than once per record. Output i depends only on record i and
+// the key, so results are identical to a sequential loop regardless of how
+// the work was scheduled.
+class BatchAead {
+public:
+    // threads = 0 uses std::thread::hardware_concurrency()
+    explicit BatchAead(size_t threads = 0);
+    ~BatchAead();
+
+    BatchAead(const BatchAead&) = delete;
+    BatchAead& operator=(const BatchAead&) = delete;
+
+    // Seal every record; result[i] is ciphertext || tag of records[i]
+    std::vector<std::vector<uint8_t>> seal(const std::vector<AeadRecord>& records,
+                                           const SecureBytes& key,
+                                           Cipher cipher);
+
+    // Open every record; result[i] is the plaintext of records[i].
+    // Throws std::runtime_error naming the first record that fails authentication.
+    std::vector<SecureBytes> open(const std::vector<AeadRecord>& records,
+                                  const SecureBytes& key,
+                                  Cipher cipher);
+
+    // Number of threads working on a batch (workers plus the calling thread)
+    size_t thread_count() const;
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+} // namespace crypto
+} // namespace localpdub
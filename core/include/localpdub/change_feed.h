@@ -0,0 +1,180 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "localpdub/secure_memory.h"
+
+namespace localpdub {
+namespace storage {
+
+// Hybrid logical clock timestamp: wall-clock milliseconds since the epoch in
+// the upper 48 bits, a counter in the lower 16. Orders like a number, stays
+// close to real time, and never goes backwards when the wall clock does.
+using Hlc = uint64_t;
+
+constexpr int HLC_COUNTER_BITS = 16;
+
+// Milliseconds since the epoch of a timestamp
+inline uint64_t hlc_millis(Hlc stamp) { return stamp >> HLC_COUNTER_BITS; }
+
+// Not thread-safe; owners lock around it
+class HybridClock {
+public:
+    // Timestamps from peers further ahead of our wall clock than this are
+    // not observed, so one device with a wrong clock cannot drag ours along
+    static constexpr uint64_t MAX_DRIFT_MS = 60 * 60 * 1000;
+
+    explicit HybridClock(Hlc last = 0) : last_(last) {}
+
+    // A timestamp later than every one issued or observed before
+    Hlc tick();
+
+    // Move past a timestamp seen from a peer; false if it was too far ahead
+    bool observe(Hlc remote);
+
+    Hlc last() const { return last_; }
+
+    // The wall clock as a timestamp with a zero counter
+    static Hlc wall_clock();
+
+private:
+
+    Hlc last_;
+};
+
+// Deleted entries, so a sync does not bring them back from peers that still
+// hold them. An id is kept as the first 16 bytes of its SHA-256, the same
+// key that places entries in the digest tree, whatever the id's length.
+// Sorted by key, one fixed-size record per deletion.
+class TombstoneSet {
+public:
+    static constexpr size_t KEY_SIZE = 16;
+    using Key = std::array<uint8_t, KEY_SIZE>;
+
+    struct Tombstone {
+        Key key;
+        Hlc deleted = 0;  // When the entry was deleted, on the deleting vault's clock
+        Hlc stamp = 0;    // When the deletion was recorded here, on this vault's clock
+    };
+
+    static Key key_of(const std::string& entry_id);
+
+    // Record a deletion; a later one for the same key wins. False if the
+    // set already had this deletion or a later one.
+    bool bury(const Key& key, Hlc deleted, Hlc stamp);
+
+    // The tombstone for a key; nullptr if there is none
+    const Tombstone* find(const Key& key) const;
+
+    // Drop a key's tombstone, e.g. when its entry is added again
+    bool erase(const Key& key);
+
+    // Drop tombstones recorded here at or before horizon, or deleted at or
+    // before expiry; returns how many
+    size_t collect(Hlc horizon, Hlc expiry);
+
+    // Tombstones recorded here after since, in key order
+    std::vector<Tombstone> stamped_since(Hlc since) const;
+
+    const std::vector<Tombstone>& tombstones() const { return tombstones_; }
+    size_t size() const { return tombstones_.size(); }
+    bool empty() const { return tombstones_.empty(); }
+
+    // Persisted form: hex of the packed records, each the key then the two
+    // clocks big-endian (32 bytes)
+    std::string to_hex() const;
+    bool from_hex(const std::string& hex);
+
+private:
+    std::vector<Tombstone> tombstones_;  // Sorted by key, one per key
+};
+
+// Whether a tombstone deleted at deleted covers an entry version modified
+// at modified (seconds since the epoch): deletions win ties
+inline bool buries(Hlc deleted, int64_t modified) {
+    return static_cast<int64_t>(hlc_millis(deleted) / 1000) >= modified;
+}
+
+// When an entry version was made, in seconds since the epoch: its
+// "modified_at" (ISO 8601 UTC, as the vault writes it), else a numeric
+// "modified"; 0 if it has neither. Digests and tombstones both read this.
+int64_t entry_modified(const crypto::SecureJson& entry);
+
+// A vault's change feed: when each entry last changed, on the vault's own
+// clock, so a peer that has seen everything up to some timestamp can ask
+// for only what changed after it. Also keeps, per peer, how far this vault
+// has read the peer's feed and sent its own, and tombstones for deleted
+// entries until every peer has been offered them. Callers stamp ids they
+// add or change and bury ids they delete.
+class ChangeFeed {
+public:
+    // How far a sync with one peer got
+    struct Watermark {
+        std::string feed;   // The peer feed's id; a different id means another feed
+        Hlc pulled = 0;     // Peer's changes up to here are applied here
+        Hlc pushed = 0;     // Our changes up to here were offered to the peer
+    };
+
+    // New feed with a random id
+    ChangeFeed();
+
+    const std::string& id() const { return id_; }
+    HybridClock& clock() { return clock_; }
+    const HybridClock& clock() const { return clock_; }
+
+    // Tombstones older than this are dropped even if some peer has not
+    // synced since, so a device that never returns cannot keep them forever
+    static constexpr uint64_t TOMBSTONE_RETENTION_MS = 90ull * 24 * 60 * 60 * 1000;
+
+    // Record a change to an entry at a new timestamp, and return it. An
+    // entry added again under a deleted id drops the id's tombstone.
+    Hlc touch(const std::string& entry_id);
+
+    // Record an entry's deletion at a new timestamp, and return it
+    Hlc bury(const std::string& entry_id);
+
+    // When an entry last changed; 0 if unknown
+    Hlc stamp(const std::string& entry_id) const;
+    void set_stamp(const std::string& entry_id, Hlc stamp) { stamps_[entry_id] = stamp; }
+    void erase(const std::string& entry_id) { stamps_.erase(entry_id); }
+    void clear_stamps() { stamps_.clear(); }
+
+    // Stamp entries not recorded yet, as changed now, and drop records for
+    // ids no longer present
+    void refresh(const crypto::SecureJson& entries);
+
+    bool find_watermark(const std::string& peer, Watermark& watermark) const;
+    void set_watermark(const std::string& peer, const Watermark& watermark);
+    void erase_watermark(const std::string& peer) { watermarks_.erase(peer); }
+
+    TombstoneSet& tombstones() { return tombstones_; }
+    const TombstoneSet& tombstones() const { return tombstones_; }
+
+    // Drop the tombstones every peer with a watermark was offered, and
+    // those past TOMBSTONE_RETENTION_MS; returns how many. Without any
+    // peer only the age limit applies.
+    size_t collect_tombstones();
+
+    const std::unordered_map<std::string, Hlc>& stamps() const { return stamps_; }
+    const std::unordered_map<std::string, Watermark>& watermarks() const { return watermarks_; }
+
+    // Persisted form: {id, clock, stamps: {entry id: hlc},
+    // peers: {device id: {feed, pulled, pushed}}, tombstones: hex}
+    crypto::SecureJson to_json() const;
+
+    // A malformed or missing feed starts a new one
+    void load(const crypto::SecureJson& data);
+
+private:
+    std::string id_;
+    HybridClock clock_;
+    std::unordered_map<std::string, Hlc> stamps_;
+    std::unordered_map<std::string, Watermark> watermarks_;
+    TombstoneSet tombstones_;
+};
+
+} // namespace storage
+} // namespace localpdub
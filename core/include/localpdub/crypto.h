@@ -3,36 +3,132 @@
 #include <string>
 #include <vector>
 #include <cstdint>
+#include <cstddef>
+#include "localpdub/secure_memory.h"
+
+struct evp_cipher_ctx_st;
+struct iovec;
 
 namespace localpdub {
 namespace crypto {
 
+// AEAD sizes shared by both ciphers
+constexpr int AEAD_KEY_SIZE = 32;    // 256 bits
+constexpr int AEAD_NONCE_SIZE = 12;  // 96 bits
+constexpr int AEAD_TAG_SIZE = 16;    // 128 bits
+
+// AEAD ciphers available for vault data. The value is stored in the low
+// bits of the vault header flags, so existing values must never change.
+enum class Cipher : uint16_t {
+    AES_256_GCM = 0,
+    CHACHA20_POLY1305 = 1
+};
+
+// True if the CPU has AES instructions (AES-NI, ARMv8 crypto extensions)
+bool has_hardware_aes();
+
+// Cipher to use for new vaults: AES-256-GCM with hardware AES,
+// ChaCha20-Poly1305 otherwise
+Cipher preferred_cipher();
+
+// Human-readable cipher name
+const char* cipher_name(Cipher cipher);
+
 // Generate cryptographically secure random salt
 std::vector<uint8_t> generate_salt();
 
-// Generate random nonce for AES-GCM
+// Generate random nonce (12 bytes, used by both ciphers)
 std::vector<uint8_t> generate_nonce();
 
+// Argon2id cost parameters
+struct KdfParams {
+    uint32_t time_cost;     // Iterations
+    uint32_t memory_kib;    // Memory in KiB
+    uint32_t parallelism;   // Lanes
+};
+
+// Parameters used for vault keys (t=3, m=64 MB, p=4)
+KdfParams default_kdf_params();
+
+// Whether params are within the limits accepted from disk: each at least 1,
+// at most 64 passes or lanes and 4 GiB of memory, well over the defaults
+bool kdf_params_in_range(const KdfParams& params);
+
 // Derive encryption key from password using Argon2id
-std::vector<uint8_t> derive_key_from_password(const std::string& password,
-                                              const std::vector<uint8_t>& salt);
+SecureBytes derive_key_from_password(const SecureString& password,
+                                     const std::vector<uint8_t>& salt);
+SecureBytes derive_key_from_password(const SecureString& password,
+                                     const std::vector<uint8_t>& salt,
+                                     const KdfParams& params);
+
+// Generate a random AEAD_KEY_SIZE key in secure memory
+SecureBytes generate_key();
+
+// Wrap a data-encryption key under a key-encryption key.
+// Output is nonce || encrypted key || tag (WRAPPED_KEY_SIZE bytes).
+constexpr int WRAPPED_KEY_SIZE = AEAD_NONCE_SIZE + AEAD_KEY_SIZE + AEAD_TAG_SIZE;
+std::vector<uint8_t> wrap_key(const SecureBytes& data_key,
+                              const SecureBytes& kek,
+                              Cipher cipher);
+
+// Unwrap a key produced by wrap_key. Throws if the KEK is wrong.
+SecureBytes unwrap_key(const std::vector<uint8_t>& wrapped,
+                       const SecureBytes& kek,
+                       Cipher cipher);
+
+// Encrypt data; output is nonce || ciphertext || tag
+std::vector<uint8_t> encrypt_data(const SecureString& plaintext,
+                                 const SecureBytes& key,
+                                 Cipher cipher = Cipher::AES_256_GCM);
+
+// Decrypt data produced by encrypt_data with the same cipher
+SecureString decrypt_data(const std::vector<uint8_t>& encrypted,
+                          const SecureBytes& key,
+                          Cipher cipher = Cipher::AES_256_GCM);
+
+// Reusable AEAD cipher context. The key is set once and each seal/open only
+// resets the nonce, so the key schedule is not recomputed per record.
+// Not thread-safe: use one context per thread.
+class AeadContext {
+public:
+    AeadContext();
+    ~AeadContext();
+    AeadContext(const AeadContext&) = delete;
+    AeadContext& operator=(const AeadContext&) = delete;
+
+    // Key must be AEAD_KEY_SIZE bytes
+    void set_key(Cipher cipher, const uint8_t* key);
+
+    // Encrypt len bytes; writes ciphertext || tag (len + AEAD_TAG_SIZE bytes).
+    // The tag also covers aad_len bytes of associated data, if given.
+    void seal(const uint8_t* nonce, const uint8_t* in, size_t len, uint8_t* out,
+              const uint8_t* aad = nullptr, size_t aad_len = 0);
+
+    // As above for a plaintext in count pieces, sealed as if they were one
+    // buffer without copying them together
+    void seal(const uint8_t* nonce, const struct iovec* in, size_t count, uint8_t* out,
+              const uint8_t* aad = nullptr, size_t aad_len = 0);
+
+    // Decrypt ciphertext || tag of len bytes; writes len - AEAD_TAG_SIZE bytes.
+    // Returns false if authentication fails.
+    bool open(const uint8_t* nonce, const uint8_t* in, size_t len, uint8_t* out,
+              const uint8_t* aad = nullptr, size_t aad_len = 0);
 
-// Encrypt data using AES-256-GCM
-std::vector<uint8_t> encrypt_data(const std::string& plaintext,
-                                 const std::vector<uint8_t>& key);
+private:
+    void init_direction(int encrypt);
 
-// Decrypt data using AES-256-GCM
-std::string decrypt_data(const std::vector<uint8_t>& encrypted,
-                        const std::vector<uint8_t>& key);
+    evp_cipher_ctx_st* ctx_;
+    Cipher cipher_;
+    uint8_t key_[AEAD_KEY_SIZE];
+    bool has_key_;
+    int direction_;  // -1 = not initialized, 0 = decrypt, 1 = encrypt
+};
 
 // Secure memory cleanup
 template<typename T>
 void secure_clear(T& container) {
     if (!container.empty()) {
-        volatile auto* ptr = container.data();
-        for (size_t i = 0; i < container.size(); ++i) {
-            ptr[i] = 0;
-        }
+        secure_zero(&container[0], container.size() * sizeof(container[0]));
     }
     container.clear();
 }
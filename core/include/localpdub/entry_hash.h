@@ -0,0 +1,68 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include "localpdub/secure_memory.h"
+
+namespace localpdub {
+namespace storage {
+
+using EntryHash = std::array<uint8_t, 32>;
+
+// Canonical binary encoding of a JSON value: a type tag, then
+//   integers   8 bytes big-endian (non-negative and negative tagged apart,
+//              so 100 and 100u encode the same)
+//   floats     IEEE 754 bits, 8 bytes big-endian
+//   strings    4-byte big-endian length, bytes
+//   arrays     4-byte count, elements
+//   objects    4-byte count, (key, value) pairs sorted by key
+// Unlike dump(), the result does not depend on the parser's key order or
+// number formatting.
+void encode_canonical(const crypto::SecureJson& value, crypto::SecureBytes& out);
+
+// SHA-256 of the canonical encoding
+EntryHash hash_entry(const crypto::SecureJson& entry);
+
+std::string hash_to_hex(const EntryHash& hash);
+
+// Content hashes of vault entries, keyed by id. Each record also keeps the
+// entry's modification stamp, so a record carried over from a vault written
+// by an older version that did not maintain the cache is recomputed rather
+// than trusted. Callers invalidate ids they change.
+class EntryHashCache {
+public:
+    // Hash of an entry with an "id", recomputed on a miss or a stale stamp
+    const EntryHash& hash(const crypto::SecureJson& entry);
+
+    void invalidate(const std::string& id);
+    void clear();
+
+    // Hash every entry and drop records for ids no longer present
+    void refresh(const crypto::SecureJson& entries);
+
+    size_t size() const { return records_.size(); }
+    uint64_t hits() const { return hits_; }
+    uint64_t misses() const { return misses_; }
+
+    // Persisted form: {id: [hex hash, stamp]}
+    crypto::SecureJson to_json() const;
+    void load(const crypto::SecureJson& data);
+
+private:
+    struct Record {
+        EntryHash hash;
+        std::string stamp;
+    };
+
+    static std::string entry_stamp(const crypto::SecureJson& entry);
+
+    std::unordered_map<std::string, Record> records_;
+    crypto::SecureBytes scratch_;  // Reused encoding buffer
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+};
+
+} // namespace storage
+} // namespace localpdub
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+
+namespace localpdub {
+namespace crypto {
+
+// Cryptographically secure random bytes for nonces, salts, keys and IDs.
+//
+// Each thread serves requests from its own block buffered in the secure
+// arena, refilled from RAND_bytes a block at a time, so small requests do not
+// pay for a DRBG call each. Served bytes are wiped from the buffer
+// immediately. The thread's OpenSSL DRBG is reseeded after a fixed number of
+// bytes or seconds, and a forked child discards the parent's buffer before
+// serving anything.
+void random_bytes(void* out, size_t len);
+
+// Random RFC 4122 version 4 UUID, lowercase hex with dashes
+std::string generate_uuid();
+
+} // namespace crypto
+} // namespace localpdub
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <nlohmann/json.hpp>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+namespace localpdub {
+namespace crypto {
+
+// Zero memory in a way the compiler cannot elide. Uses the platform's
+// vectorized memset followed by a compiler barrier.
+void secure_zero(void* ptr, size_t len);
+
+// Process-wide arena for secret material (keys, decrypted vault data).
+//
+// Memory comes from mmap'd chunks that are mlock()ed so they are never
+// swapped, marked MADV_DONTDUMP so they never reach a core dump, and
+// surrounded by PROT_NONE guard pages so linear overruns fault instead of
+// reading neighbouring heap data. Small requests are served from
+// power-of-two size classes by bump pointer, with freed blocks recycled
+// through per-class free lists. Each thread keeps a few freed blocks of
+// every class to itself, so most small requests take no lock. Large
+// requests get their own guarded mapping; released ones up to
+// MAX_CACHED_LARGE are kept, by power-of-two size, for the next request of
+// that size. Every block is zeroed when it is released.
+class SecureArena {
+public:
+    struct Stats {
+        size_t bytes_mapped = 0;     // Usable bytes in all chunks and large mappings
+        size_t bytes_in_use = 0;     // Bytes currently handed out (rounded to size class)
+        size_t bytes_locked = 0;     // Bytes successfully mlock()ed
+        size_t allocations = 0;      // Total allocate() calls
+        size_t lock_failures = 0;    // Mappings that could not be locked (RLIMIT_MEMLOCK)
+    };
+
+    static SecureArena& instance();
+
+    void* allocate(size_t bytes);
+    void deallocate(void* ptr, size_t bytes) noexcept;
+
+    Stats stats() const;
+
+private:
+    SecureArena();
+    ~SecureArena() = delete;  // Lives for the whole process
+
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    static constexpr size_t MIN_BLOCK = 16;
+    static constexpr size_t MAX_SMALL_BLOCK = 4096;
+    static constexpr size_t NUM_CLASSES = 9;  // 16 .. 4096
+    static constexpr size_t CHUNK_SIZE = 256 * 1024;
+    static constexpr size_t THREAD_CACHE_BYTES = 16 * 1024;  // Per class, per thread
+    static constexpr size_t MAX_CACHED_LARGE = 1024 * 1024;
+    static constexpr size_t LARGE_CACHE_BYTES = 4 * 1024 * 1024;
+    static constexpr size_t NUM_LARGE_CLASSES = 9;  // 4 KB pages .. MAX_CACHED_LARGE
+
+    // Freed small blocks a thread keeps for itself. Past the class's limit
+    // half go back to the shared lists; all do when the thread exits.
+    struct ThreadCache {
+        FreeBlock* lists[NUM_CLASSES] = {};
+        size_t counts[NUM_CLASSES] = {};
+        ~ThreadCache();
+    };
+    static ThreadCache* thread_cache() noexcept;  // Null once the thread's is gone
+    static size_t cache_limit(size_t cls);
+
+    // Move up to count blocks of a class into cache, from the shared list
+    // or else fresh from the bump chunk; and count of them back. take()
+    // does the first for one block, with mutex_ held.
+    void refill(ThreadCache& cache, size_t cls, size_t count);
+    void flush(ThreadCache& cache, size_t cls, size_t count) noexcept;
+    FreeBlock* take(size_t cls, bool map_chunk);
+
+    void* allocate_large(size_t bytes);
+    void deallocate_large(void* ptr, size_t bytes) noexcept;
+    size_t large_size(size_t bytes) const;   // Usable bytes of the mapping
+    size_t large_class(size_t size) const;
+
+    void* map_guarded(size_t usable_bytes);
+    void unmap_guarded(void* ptr, size_t usable_bytes) noexcept;
+    static size_t size_class(size_t bytes);
+
+    mutable std::mutex mutex_;  // Guards all below but the atomics
+    size_t page_size_;
+    uint8_t* bump_ = nullptr;
+    uint8_t* bump_end_ = nullptr;
+    FreeBlock* free_lists_[NUM_CLASSES] = {};
+    FreeBlock* large_free_[NUM_LARGE_CLASSES] = {};  // Released mappings, by size
+    size_t large_cached_ = 0;  // Their bytes
+    Stats stats_;  // All but the two below
+    std::atomic<size_t> allocations_{0};
+    std::atomic<size_t> bytes_in_use_{0};
+};
+
+// std-compatible allocator backed by SecureArena
+template<typename T>
+class SecureAllocator {
+public:
+    using value_type = T;
+
+    SecureAllocator() noexcept = default;
+    template<typename U>
+    SecureAllocator(const SecureAllocator<U>&) noexcept {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(SecureArena::instance().allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T* ptr, size_t n) noexcept {
+        SecureArena::instance().deallocate(ptr, n * sizeof(T));
+    }
+
+    template<typename U>
+    bool operator==(const SecureAllocator<U>&) const noexcept { return true; }
+    template<typename U>
+    bool operator!=(const SecureAllocator<U>&) const noexcept { return false; }
+};
+
+// Containers for secret material
+using SecureBytes = std::vector<uint8_t, SecureAllocator<uint8_t>>;
+using SecureString = std::basic_string<char, std::char_traits<char>, SecureAllocator<char>>;
+
+// JSON DOM whose objects, arrays and strings all live in the secure arena
+using SecureJson = nlohmann::basic_json<std::map, std::vector, SecureString, bool,
+                                        std::int64_t, std::uint64_t, double,
+                                        SecureAllocator>;
+
+} // namespace crypto
+} // namespace localpdub
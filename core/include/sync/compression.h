@@ -0,0 +1,78 @@
+#ifndef LOCALPDUB_SYNC_COMPRESSION_H
+#define LOCALPDUB_SYNC_COMPRESSION_H
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "localpdub/secure_memory.h"
+
+struct z_stream_s;
+struct iovec;
+
+namespace localpdub {
+namespace sync {
+
+// Payload compression negotiated in SYNC_REQUEST / SYNC_ACCEPT
+enum class Compression : uint8_t {
+    NONE,
+    DEFLATE     // zlib deflate stream, one per direction
+};
+
+const char* compression_name(Compression compression);
+bool parse_compression(const std::string& name, Compression& out);
+
+// Compression methods this build supports, in order of preference
+std::vector<Compression> supported_compressions();
+
+// Messages smaller than this are sent uncompressed
+constexpr size_t COMPRESSION_THRESHOLD = 10 * 1024;
+
+// Sending half of a deflate stream that spans the connection. Each message
+// ends with a sync flush, so the receiver can decode it completely while
+// later messages still reuse the window. zlib state lives in the secure
+// arena since it holds plaintext.
+class Deflater {
+public:
+    Deflater();
+    ~Deflater();
+    Deflater(const Deflater&) = delete;
+    Deflater& operator=(const Deflater&) = delete;
+
+    // Compress one message, handing compressed output to emit in chunks of
+    // at most chunk_size bytes; last is set on the final chunk. Stops and
+    // returns false when emit does.
+    using Emit = std::function<bool(const uint8_t* data, size_t len, bool last)>;
+    bool compress(const uint8_t* data, size_t len, size_t chunk_size, const Emit& emit);
+
+    // As above for a message in count pieces, compressed as one
+    bool compress(const struct iovec* pieces, size_t count, size_t chunk_size, const Emit& emit);
+
+private:
+    std::unique_ptr<z_stream_s> stream_;
+    crypto::SecureBytes out_;
+};
+
+// Receiving half: decompresses frame payloads as they arrive
+class Inflater {
+public:
+    Inflater();
+    ~Inflater();
+    Inflater(const Inflater&) = delete;
+    Inflater& operator=(const Inflater&) = delete;
+
+    // Append the decompressed bytes to out. Throws std::runtime_error on a
+    // corrupt stream.
+    void decompress(const uint8_t* data, size_t len, crypto::SecureString& out);
+
+private:
+    std::unique_ptr<z_stream_s> stream_;
+    crypto::SecureBytes out_;
+};
+
+} // namespace sync
+} // namespace localpdub
+
+#endif // LOCALPDUB_SYNC_COMPRESSION_H
@@ -0,0 +1,95 @@
+#ifndef LOCALPDUB_SYNC_DIGEST_TREE_H
+#define LOCALPDUB_SYNC_DIGEST_TREE_H
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "localpdub/change_feed.h"
+
+namespace localpdub {
+namespace sync {
+
+struct EntryDigest {
+    std::string id;
+    std::chrono::system_clock::time_point modified;
+    std::string hash;
+};
+
+// Merkle prefix tree over a vault's entry digests, used to find differing
+// entries without exchanging every digest.
+//
+// Entries are keyed by SHA-256(id) and bucketed by the key's hex nibbles: the
+// node at path "3a" holds every entry whose key starts with 0x3a. A node with
+// at most LEAF_SIZE entries is a leaf and hashes its (key, entry hash) pairs
+// in key order; larger nodes hash their 16 children. An empty node hashes to
+// all zeros. Equal entry sets give equal node hashes on both peers, so
+// reconciliation only descends into paths whose hashes differ.
+//
+// Tombstones are folded in as leaf items keyed by their 16-byte key, the
+// first half of the entry key, and hash their deletion clock in place of an
+// entry hash. A deletion one peer has not seen changes the path to it like
+// a changed entry would, and equal tombstone sets cost nothing to compare.
+class DigestTree {
+public:
+    using Hash = std::array<uint8_t, 32>;
+
+    static constexpr size_t FANOUT = 16;
+    static constexpr size_t LEAF_SIZE = 32;
+    static constexpr size_t MAX_DEPTH = 64;  // Nibbles in a SHA-256 key
+
+    struct Node {
+        Hash hash{};
+        size_t count = 0;
+    };
+
+    using Tombstone = storage::TombstoneSet::Tombstone;
+
+    explicit DigestTree(const std::vector<EntryDigest>& entries,
+                        const storage::TombstoneSet& tombstones = storage::TombstoneSet());
+
+    // Node at a path of lowercase hex nibbles ("" is the root)
+    Node node(const std::string& path) const;
+    Hash root() const { return node("").hash; }
+
+    // Path of the nibble-th child of path
+    static std::string child_path(const std::string& path, size_t nibble);
+
+    // Digests of all entries under a path
+    std::vector<EntryDigest> entries_under(const std::string& path) const;
+
+    // Tombstones under a path, without their local stamps
+    std::vector<Tombstone> tombstones_under(const std::string& path) const;
+
+    // Entries in the tree; tombstones are not counted
+    size_t size() const { return entry_count_; }
+
+    // Paths from the network must be hex nibbles no deeper than MAX_DEPTH
+    static bool valid_path(const std::string& path);
+
+    static std::string to_hex(const Hash& hash);
+    static bool from_hex(const std::string& hex, Hash& out);
+
+private:
+    struct Item {
+        Hash key;
+        EntryDigest digest;
+        storage::Hlc deleted = 0;  // Nonzero for a tombstone, which has no digest
+    };
+
+    std::pair<size_t, size_t> range(const std::string& path) const;
+    Hash leaf_hash(size_t begin, size_t end) const;
+    Hash build(std::string& path, size_t begin, size_t end);
+
+    std::vector<Item> items_;                       // Sorted by key
+    size_t entry_count_ = 0;
+    std::unordered_map<std::string, Node> nodes_;   // Every non-empty node down to the leaves
+};
+
+} // namespace sync
+} // namespace localpdub
+
+#endif // LOCALPDUB_SYNC_DIGEST_TREE_H
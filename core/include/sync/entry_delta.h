@@ -0,0 +1,61 @@
+#ifndef LOCALPDUB_SYNC_ENTRY_DELTA_H
+#define LOCALPDUB_SYNC_ENTRY_DELTA_H
+
+#include "entry_diff.h"
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include "localpdub/history.h"
+
+namespace localpdub {
+namespace sync {
+
+// Field-level deltas between two versions of an entry. A field is one of
+// the entry's top-level keys, named on the wire by its FieldType code
+// (history.h) when it has one and by its key otherwise.
+//
+// The side about to receive updates describes each version it holds as a
+// base: {id, hash, fields: [[field, hash], ...]}, with the entry hash as in
+// digests and a short hash of each field's canonical encoding; the id never
+// changes and is not a field. The sender then ships
+// {delta: {id, base, set: [[field, value], ...], removed: [field, ...]}}
+// with only the fields that differ, naming the base by its entry hash.
+
+// Smaller entries are sent whole; describing them would cost about as much
+constexpr size_t DELTA_MIN_ENTRY_SIZE = 1024;
+
+bool worth_delta(const json& entry);
+
+// Delta item turning the version described by base into entry. False when
+// base is malformed or the delta would not be smaller than the entry.
+bool make_entry_delta(const json& entry, const json& base, json& delta);
+
+// Item of an ENTRIES batch that is a delta rather than an entry
+bool is_entry_delta(const json& item);
+
+// The versions a receiver described as bases, kept as they were then, so
+// deltas against them apply even if the vault has changed since
+class BaseVersions {
+public:
+    // Keep entry and return its base description
+    json pin(const json& entry);
+
+    // The full entry a delta item describes. False, leaving entry
+    // untouched, when no pinned version has the delta's id and base hash.
+    bool expand(const json& delta, json& entry) const;
+
+    size_t size() const { return pinned_.size(); }
+
+private:
+    struct Pinned {
+        json entry;
+        std::string hash;
+    };
+
+    std::unordered_map<std::string, Pinned> pinned_;
+};
+
+} // namespace sync
+} // namespace localpdub
+
+#endif // LOCALPDUB_SYNC_ENTRY_DELTA_H
@@ -0,0 +1,75 @@
+#ifndef LOCALPDUB_SYNC_ENTRY_DIFF_H
+#define LOCALPDUB_SYNC_ENTRY_DIFF_H
+
+#include "digest_tree.h"
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "localpdub/secure_memory.h"
+
+namespace localpdub {
+namespace sync {
+
+using json = crypto::SecureJson;
+
+// Diff and merge of vault entries by id on hash maps: O(n + m) for n local
+// and m remote entries. When an id appears more than once, the first
+// occurrence wins, as with a linear search.
+
+// Position of each entry in a JSON array of entries, by id
+class EntryIndex {
+public:
+    static constexpr size_t npos = static_cast<size_t>(-1);
+
+    EntryIndex() = default;
+    explicit EntryIndex(const json& entries);
+
+    size_t find(const std::string& id) const;
+    void add(const std::string& id, size_t position);
+    size_t size() const { return positions_.size(); }
+
+private:
+    std::unordered_map<std::string, size_t> positions_;
+};
+
+struct DigestDiff {
+    std::vector<std::string> to_send;     // Missing remotely, or newer locally
+    std::vector<std::string> to_receive;  // Missing locally, or newer remotely
+};
+
+// Entries whose hashes differ go to the side with the older modified time;
+// equal times are left alone
+DigestDiff diff_digests(const std::vector<EntryDigest>& local,
+                        const std::vector<EntryDigest>& remote);
+
+using Tombstone = storage::TombstoneSet::Tombstone;
+
+struct TombstoneDiff {
+    std::vector<Tombstone> to_send;     // Missing remotely, or deleted later locally
+    std::vector<Tombstone> to_receive;  // Missing locally, or deleted later remotely
+};
+
+// Deletions one side has that the other lacks, matched by key; each list
+// comes out in key order
+TombstoneDiff diff_tombstones(std::vector<Tombstone> local, std::vector<Tombstone> remote);
+
+using ConflictResolver = std::function<json(const json& local, const json& remote)>;
+
+// Merge incoming entries into an array of entries: new ids are appended,
+// existing ones replaced by resolve(local, incoming). Entries without a
+// string id are skipped. Returns the ids that existed on both sides.
+std::vector<std::string> merge_entries(json& entries,
+                                       const std::vector<json>& incoming,
+                                       const ConflictResolver& resolve);
+
+// As above with an index of entries kept by the caller, so a stream of
+// batches merges without re-indexing the whole array for each one
+std::vector<std::string> merge_entries(json& entries, EntryIndex& index,
+                                       const std::vector<json>& incoming,
+                                       const ConflictResolver& resolve);
+
+} // namespace sync
+} // namespace localpdub
+
+#endif // LOCALPDUB_SYNC_ENTRY_DIFF_H
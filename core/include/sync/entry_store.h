@@ -0,0 +1,135 @@
+#ifndef LOCALPDUB_SYNC_ENTRY_STORE_H
+#define LOCALPDUB_SYNC_ENTRY_STORE_H
+
+#include "entry_diff.h"
+#include "localpdub/change_feed.h"
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace localpdub {
+namespace sync {
+
+// An entry as the store keeps it, with its JSON text made the first time it
+// is sent and kept from then on. Entries are never changed in place: a new
+// version is a new EncodedEntry, so the text cannot go stale, and an entry
+// sent to many peers, or in many sessions, is serialized once. Thread-safe.
+class EncodedEntry {
+public:
+    explicit EncodedEntry(json value) : value_(std::move(value)) {}
+
+    const json& value() const { return value_; }
+
+    // value().dump()
+    const json::string_t& encoded() const;
+
+private:
+    json value_;
+    mutable std::once_flag encoded_once_;
+    mutable json::string_t encoded_;
+};
+
+using EntryRef = std::shared_ptr<const EncodedEntry>;
+
+// Vault entries at one point in time. Commits made after the snapshot was
+// taken do not change it.
+class EntrySnapshot {
+public:
+    size_t size() const { return entries_.size(); }
+    const json& operator[](size_t position) const { return entries_[position]->value(); }
+
+    // When the entry at position last changed, on the store's clock
+    storage::Hlc stamp(size_t position) const { return stamps_[position]; }
+
+    // The store's clock when the snapshot was taken: every entry changed
+    // later has a later stamp
+    storage::Hlc position() const { return position_; }
+
+    // Entries with the given ids, in that order; unknown ids are skipped
+    std::vector<const json*> find(const std::vector<std::string>& ids) const;
+
+    // As find(), sharing the entries so they outlive the snapshot
+    std::vector<EntryRef> find_shared(const std::vector<std::string>& ids) const;
+
+    // Positions of the entries stamped after since, in order
+    std::vector<size_t> changed_since(storage::Hlc since) const;
+
+    // Deleted entries; a tombstone's stamp is on the store's clock like an
+    // entry's
+    const storage::TombstoneSet& tombstones() const { return *tombstones_; }
+
+private:
+    friend class EntryStore;
+
+    // Positions of find()'s entries
+    std::vector<size_t> find_positions(const std::vector<std::string>& ids) const;
+
+    std::vector<EntryRef> entries_;
+    std::vector<storage::Hlc> stamps_;
+    std::vector<size_t> id_hashes_;  // Of each entry's id, so find() can skip entries unread
+    storage::Hlc position_ = 0;
+    std::shared_ptr<const storage::TombstoneSet> tombstones_ = std::make_shared<storage::TombstoneSet>();
+};
+
+// Vault entries shared by concurrent sync sessions. Readers take a
+// snapshot and work from it without locking. Writers commit batches: each
+// commit is atomic, resolves every incoming entry against the version
+// current at that moment, and copies entry pointers rather than entries,
+// so one session's lock lasts one batch, not the whole session.
+//
+// The store also keeps the vault's change feed clock: each commit ticks it
+// once and stamps the entries it adds or changes. Tombstones travel with the
+// entries, so a commit never brings back an entry deleted after it changed.
+class EntryStore {
+public:
+    EntryStore();
+
+    // Replace every entry, all stamped as changed now; a non-array counts
+    // as empty. Tombstones are kept.
+    void assign(const json& entries);
+
+    // Take stamps, tombstones and the clock from a persisted feed. Entries
+    // it has no stamp for count as changed now.
+    void restamp(const storage::ChangeFeed& feed);
+
+    // Copy the current stamps, tombstones and clock into a feed
+    void export_stamps(storage::ChangeFeed& feed) const;
+
+    // Move the clock past a peer's; false if the peer's was too far ahead
+    bool observe(storage::Hlc remote);
+
+    std::shared_ptr<const EntrySnapshot> snapshot() const;
+
+    // The current entries as a JSON array
+    json to_json() const;
+
+    // Merge a batch as merge_entries() does: new ids are appended, existing
+    // ones replaced by resolve(current, incoming), entries without a string
+    // id skipped. Entries that resolve to what they were keep their stamp.
+    // An entry a tombstone buries is skipped; a newer one drops the
+    // tombstone. Returns the ids that existed on both sides.
+    std::vector<std::string> commit(const std::vector<json>& incoming, const ConflictResolver& resolve);
+
+    // Apply a peer's deletions: the entries they bury are removed and each
+    // new deletion recorded with one new stamp. A deletion older than the
+    // current entry, or from a clock too far ahead of ours, is ignored.
+    // Returns the ids of the removed entries.
+    std::vector<std::string> bury(const std::vector<storage::TombstoneSet::Tombstone>& incoming);
+
+private:
+    // Callers hold commit_mutex_
+    void publish(std::shared_ptr<EntrySnapshot> next);
+
+    mutable std::mutex current_mutex_;  // Guards the pointer only
+    std::shared_ptr<const EntrySnapshot> current_;
+
+    mutable std::mutex commit_mutex_;  // One commit at a time
+    EntryIndex index_;                 // Positions in current_; rebuilt when entries are buried
+    storage::HybridClock clock_;
+};
+
+} // namespace sync
+} // namespace localpdub
+
+#endif // LOCALPDUB_SYNC_ENTRY_STORE_H
@@ -0,0 +1,186 @@
+#ifndef LOCALPDUB_SYNC_FRAMING_H
+#define LOCALPDUB_SYNC_FRAMING_H
+
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <vector>
+#include <sys/uio.h>
+#include "localpdub/secure_memory.h"
+#include "compression.h"
+#include "secure_channel.h"
+
+namespace localpdub {
+namespace sync {
+
+// Sync wire protocol version, sent in SYNC_REQUEST. Version 1 was
+// newline-delimited JSON without framing; version 2 exchanged a full digest
+// of every entry instead of reconciling digest trees; version 3 sent each
+// side's entries as one message, server first; version 4 sent updated
+// entries whole rather than as field deltas; version 5 sent everything in
+// the clear after a challenge-response over the raw passphrase; version 6
+// always descended the digest trees; version 7 could not resume an
+// interrupted entry exchange; version 8 did not carry deletions.
+constexpr int PROTOCOL_VERSION = 9;
+
+// Every message travels as one or more frames:
+//
+//   type (1) | flags (1) | payload length (4, big-endian) | payload
+//
+// A message longer than MAX_FRAME_PAYLOAD is split across frames of the same
+// type with FRAME_FLAG_MORE set on all but the last, so messages have no
+// size limit while a single frame stays bounded. Once compression has been
+// negotiated, messages of COMPRESSION_THRESHOLD bytes or more are sent as
+// deflate output with FRAME_FLAG_COMPRESSED on every frame. Every frame after
+// SYNC_ACCEPT is sealed (secure_channel.h) with FRAME_FLAG_ENCRYPTED set: its
+// payload is the (possibly compressed) chunk's ciphertext and tag, and the
+// header is authenticated along with it.
+enum class FrameType : uint8_t {
+    SYNC_REQUEST = 1,    // JSON: version, device_id, feed, vault_id, compression, ciphers, key_share, ticket
+    SYNC_ACCEPT = 2,     // JSON: version, auth, compression, cipher, key_share, resumed, salt
+    AUTH_CHALLENGE = 3,  // Unused since version 6
+    AUTH_RESPONSE = 4,   // Client finished value
+    AUTH_CONFIRM = 5,    // Server finished value
+    TREE_QUERY = 6,      // JSON: nodes [{path, hash, count}]
+    ENTRIES = 7,         // JSON: entries [entry | {delta}], more
+    ERROR = 8,           // JSON: message
+    TREE_NODES = 9,      // JSON: nodes [{path, children | entries, tombstones}]
+    ENTRY_REQUEST = 10,  // JSON: ids [...], bases [...], offer [...], checkpoint, refetch, tombstones
+    ENTRY_BASES = 11,    // JSON: bases [{id, hash, fields}], session, refetch
+    SESSION_TICKET = 12, // JSON: ticket, lifetime (seconds)
+    FEED_QUERY = 13,     // JSON: feed, since, clock, changes [id]
+    FEED = 14,           // JSON: feed, position, entries [{id, modified, hash}], tombstones | reset
+    RESUME = 15,         // JSON: session, received (server batches committed)
+    RESUMED = 16         // JSON: received (client batches committed) | reset
+};
+
+constexpr uint8_t FRAME_FLAG_MORE = 0x01;        // Message continues in the next frame
+constexpr uint8_t FRAME_FLAG_COMPRESSED = 0x02;  // Payload continues the deflate stream
+constexpr uint8_t FRAME_FLAG_ENCRYPTED = 0x04;   // Payload is sealed: ciphertext || tag
+constexpr size_t FRAME_HEADER_SIZE = 6;
+constexpr size_t MAX_FRAME_PAYLOAD = 1024 * 1024;
+
+struct Message {
+    FrameType type;
+    crypto::SecureString payload;
+};
+
+// Incremental frame parser. Bytes are fed as they arrive, in any split; each
+// byte is looked at once and payloads are appended straight to the message
+// being assembled.
+class FrameReader {
+public:
+    // Throws std::runtime_error on a malformed stream
+    void feed(const uint8_t* data, size_t len);
+
+    // Pop the next complete message, if any
+    bool next(Message& out);
+
+    // The stream started with '{': a version 1 peer sending bare JSON
+    bool legacy_peer() const { return legacy_; }
+
+    // Accept compressed frames from now on
+    void enable_decompression(Compression compression);
+
+    // Open sealed frames from now on, and only those. Bytes from the first
+    // sealed frame that arrived earlier were held back and are parsed now.
+    void enable_decryption(std::unique_ptr<RecordCipher> cipher);
+
+private:
+    void start_frame();
+    void append_payload(const uint8_t* data, size_t len);
+    void open_frame();
+    void hold(const uint8_t* data, size_t len);
+    void finish_message();
+
+    uint8_t header_[FRAME_HEADER_SIZE];
+    size_t header_len_ = 0;
+    size_t payload_remaining_ = 0;
+    uint8_t flags_ = 0;
+    bool in_payload_ = false;
+    bool in_message_ = false;
+    bool started_ = false;
+    bool legacy_ = false;
+    bool current_compressed_ = false;
+    bool frame_sealed_ = false;
+    Message current_;
+    std::deque<Message> ready_;
+    std::unique_ptr<Inflater> inflater_;
+    std::unique_ptr<RecordCipher> decryptor_;
+    crypto::SecureBytes sealed_;  // Payload of the sealed frame being read
+    crypto::SecureBytes opened_;
+    crypto::SecureBytes held_;    // Waiting for enable_decryption()
+};
+
+// Encodes messages into frames in memory, for writers on non-blocking
+// sockets. Splitting, compression and sealing are as for
+// FrameChannel::send_message.
+class FrameEncoder {
+public:
+    void set_compression(Compression compression);
+    void set_cipher(std::unique_ptr<RecordCipher> cipher);
+    void encode(FrameType type, const void* data, size_t len, crypto::SecureBytes& out);
+
+    // A message in count pieces, read in place
+    void encode(FrameType type, const struct iovec* pieces, size_t count, crypto::SecureBytes& out);
+
+private:
+    std::unique_ptr<Deflater> deflater_;
+    std::unique_ptr<RecordCipher> encryptor_;
+    std::vector<struct iovec> frame_;
+};
+
+// Framed messages over a connected stream socket. Blocking; timeouts come
+// from the socket's SO_RCVTIMEO/SO_SNDTIMEO. One thread may send while
+// another receives: the two directions share no state.
+class FrameChannel {
+public:
+    explicit FrameChannel(int socket);
+
+    bool send_message(FrameType type, const void* data, size_t len);
+    bool send_message(FrameType type, const crypto::SecureString& payload) {
+        return send_message(type, payload.data(), payload.size());
+    }
+
+    // A message in count pieces, sent without first copying them together:
+    // the pieces are the frame payload as they are, or the cipher reads
+    // them straight into the sealed frame
+    bool send_message(FrameType type, const struct iovec* pieces, size_t count);
+
+    // False on EOF, timeout or socket error; throws on a malformed stream
+    bool recv_message(Message& out);
+
+    bool legacy_peer() const { return reader_.legacy_peer(); }
+    int socket() const { return socket_; }
+
+    // Compress large outgoing messages and accept compressed incoming ones.
+    // Both sides switch right after SYNC_ACCEPT.
+    void set_compression(Compression compression);
+
+    // Seal outgoing frames and open incoming ones, also from SYNC_ACCEPT on
+    void set_ciphers(std::unique_ptr<RecordCipher> send, std::unique_ptr<RecordCipher> receive);
+
+    // Wire bytes, frame headers included
+    uint64_t bytes_sent() const { return bytes_sent_; }
+    uint64_t bytes_received() const { return bytes_received_; }
+
+private:
+    bool send_frame(FrameType type, uint8_t flags, const struct iovec* pieces, size_t count, size_t len);
+
+    int socket_;
+    std::unique_ptr<Deflater> deflater_;
+    std::unique_ptr<RecordCipher> encryptor_;
+    crypto::SecureBytes send_buffer_;  // Sealed payload of the frame being sent
+    std::vector<struct iovec> frame_;     // Payload pieces of the frame being sent
+    std::vector<struct iovec> send_iov_;  // Its header and payload, as written
+    uint64_t bytes_sent_ = 0;
+    uint64_t bytes_received_ = 0;
+    FrameReader reader_;
+    crypto::SecureBytes recv_buffer_;
+};
+
+} // namespace sync
+} // namespace localpdub
+
+#endif // LOCALPDUB_SYNC_FRAMING_H
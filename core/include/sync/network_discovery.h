@@ -8,12 +8,17 @@
 #include <functional>
 #include <chrono>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <sys/socket.h>
 #include <nlohmann/json.hpp>
+#include "localpdub/secure_memory.h"
 
 namespace localpdub {
 namespace sync {
 
-using json = nlohmann::json;
+// Sync messages carry full vault entries, so all sync JSON uses the secure arena
+using json = crypto::SecureJson;
 
 struct Device {
     std::string id;
@@ -25,6 +30,15 @@ struct Device {
     std::string public_key;
 };
 
+// Finds peers on the local network. Announces go to an IPv4 multicast group
+// and to an IPv6 link-local one, on every multicast interface: right away as
+// a query every peer answers at once, then again after 1, 2, 4... seconds up
+// to once a minute. Version 1 peers, which broadcast instead, are heard on
+// the discovery port and answered the way they expect.
+//
+// One thread runs the session: it sleeps in epoll until a datagram arrives,
+// the next announce is due (a timerfd) or stop_session() signals it (an
+// eventfd), so an idle session costs no CPU and stopping is immediate.
 class NetworkDiscoveryManager {
 public:
     using DeviceFoundCallback = std::function<void(const Device&)>;
@@ -35,10 +49,10 @@ public:
     // Start discovery session
     bool start_session(const std::string& device_name, const std::string& vault_id);
 
-    // Stop discovery session
+    // Stop discovery session; returns as soon as the session's thread exits
     void stop_session();
 
-    // Set callback for when device is found
+    // Set callback for when device is found; runs on the session's thread
     void set_device_found_callback(DeviceFoundCallback callback);
 
     // Get list of discovered devices
@@ -53,24 +67,43 @@ public:
     // Set sync server port (the TCP port we're listening on for sync connections)
     void set_sync_port(int port);
 
+    // Discovery datagrams sent this session: announces, queries, replies
+    size_t messages_sent() const { return messages_sent_; }
+
 private:
     // Network operations
+    bool open_sockets();
     bool bind_to_port(int start_port, int end_port);
-    void broadcast_presence();
-    void listen_for_broadcasts();
+    void close_sockets();
+    void announce(const char* type);
+    bool receive_from(int socket);
+    void send_to(int socket, const std::string& payload, const struct sockaddr* addr, socklen_t addr_len);
     json create_announce_message() const;
-    void handle_announce_message(const json& message, const std::string& sender_ip);
+    void handle_announce_message(const json& message, const struct sockaddr_storage& sender,
+                                 socklen_t sender_len);
+
+    // Event loop
+    bool open_loop();
+    void run_loop();
+    void arm_timer(std::chrono::steady_clock::duration delay);
 
-    // Threading
     std::atomic<bool> active_;
-    std::unique_ptr<std::thread> broadcast_thread_;
-    std::unique_ptr<std::thread> listener_thread_;
+    std::unique_ptr<std::thread> loop_thread_;
+    int epoll_fd_;
+    int timer_fd_;  // Next announce, or the end of the session
+    int wake_fd_;   // Written by stop_session()
 
     // Network state
     int bound_port_;           // UDP discovery port
     int sync_server_port_;     // TCP sync server port
-    int broadcast_socket_;
-    int listener_socket_;
+    int send_socket_;          // Announces and replies go out here, and replies to them come back
+    int listener_socket_;      // Group announces and version 1 broadcasts
+    int send_socket_v6_;
+    int listener_socket_v6_;
+    std::vector<unsigned int> interfaces_v4_;  // Interface indexes joined to the groups
+    std::vector<unsigned int> interfaces_v6_;
+    std::unordered_map<std::string, std::chrono::steady_clock::time_point> last_replies_;  // By device id
+    std::atomic<size_t> messages_sent_;
 
     // Device information
     std::string device_id_;
@@ -90,7 +123,13 @@ private:
     static constexpr int PRIMARY_PORT = 51820;
     static constexpr int FALLBACK_START_PORT = 51821;
     static constexpr int FALLBACK_END_PORT = 51829;
-    static constexpr int BROADCAST_INTERVAL_SECONDS = 2;
+    static constexpr const char* MULTICAST_GROUP_V4 = "239.255.76.80";
+    static constexpr const char* MULTICAST_GROUP_V6 = "ff02::4c50";
+    static constexpr int PROTOCOL_VERSION = 2;
+    static constexpr std::chrono::seconds FIRST_ANNOUNCE_INTERVAL{1};
+    static constexpr std::chrono::seconds MAX_ANNOUNCE_INTERVAL{60};
+    // A query reaches us once per group and interface; answer it once
+    static constexpr std::chrono::seconds REPLY_HOLDOFF{1};
 };
 
 } // namespace sync
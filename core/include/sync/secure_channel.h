@@ -0,0 +1,163 @@
+#ifndef LOCALPDUB_SYNC_SECURE_CHANNEL_H
+#define LOCALPDUB_SYNC_SECURE_CHANNEL_H
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "localpdub/crypto.h"
+#include "localpdub/secure_memory.h"
+
+typedef struct evp_pkey_st EVP_PKEY;
+
+namespace localpdub {
+namespace sync {
+
+// Encryption of sync connections. The handshake rides on SYNC_REQUEST and
+// SYNC_ACCEPT: each side sends an ephemeral X25519 key share, and both feed
+// the shared secret, a pre-shared key and a hash of the two messages into an
+// HKDF-SHA256 key schedule, much like TLS 1.3 in psk_dhe_ke mode. The
+// pre-shared key is derived from the sync passphrase with Argon2id under a
+// salt the server picks, or is all zeros without a passphrase, which still
+// hides the traffic from passive listeners. Every frame after SYNC_ACCEPT is
+// sealed, each side proves it derived the same keys with a finished value,
+// and the server hands out a session ticket so the next sync between the
+// same pair can use the ticket's secret instead of the passphrase.
+
+constexpr size_t KEY_SHARE_SIZE = 32;      // X25519 public key
+constexpr size_t SESSION_SECRET_SIZE = 32;
+constexpr size_t FINISHED_SIZE = 32;
+constexpr size_t TRANSCRIPT_HASH_SIZE = 32;
+
+// One direction of an encrypted connection. Each frame is sealed with the
+// frame header as associated data, under a nonce of the static IV XOR the
+// frame's sequence number, so frames cannot be altered, reordered, replayed
+// or dropped without the peer noticing.
+class RecordCipher {
+public:
+    RecordCipher(crypto::Cipher cipher, const uint8_t* key, const uint8_t* iv);
+
+    // Writes len + AEAD_TAG_SIZE bytes to out
+    void seal(const uint8_t* header, size_t header_len, const uint8_t* in, size_t len, uint8_t* out);
+
+    // As above for a payload gathered from count pieces
+    void seal(const uint8_t* header, size_t header_len, const struct iovec* in, size_t count,
+              uint8_t* out);
+
+    // Writes len - AEAD_TAG_SIZE bytes to out; false if the frame was tampered with
+    bool open(const uint8_t* header, size_t header_len, const uint8_t* in, size_t len, uint8_t* out);
+
+private:
+    void next_nonce(uint8_t* nonce);
+
+    crypto::AeadContext aead_;
+    uint8_t iv_[crypto::AEAD_NONCE_SIZE];
+    uint64_t sequence_ = 0;
+};
+
+// Ephemeral X25519 key pair, generated on construction
+class KeyShare {
+public:
+    KeyShare();
+    ~KeyShare();
+
+    KeyShare(const KeyShare&) = delete;
+    KeyShare& operator=(const KeyShare&) = delete;
+
+    const uint8_t* public_key() const { return public_key_; }
+
+    // Shared secret with a peer's public key; false if the key is invalid
+    bool agree(const uint8_t* peer_public_key, crypto::SecureBytes& secret) const;
+
+private:
+    EVP_PKEY* key_;
+    uint8_t public_key_[KEY_SHARE_SIZE];
+};
+
+// Everything one handshake yields
+struct SessionKeys {
+    crypto::Cipher cipher = crypto::Cipher::AES_256_GCM;
+    crypto::SecureBytes client_key, client_iv;
+    crypto::SecureBytes server_key, server_iv;
+    crypto::SecureBytes client_finished, server_finished;
+    crypto::SecureBytes resumption_secret;
+
+    std::unique_ptr<RecordCipher> client_cipher() const;
+    std::unique_ptr<RecordCipher> server_cipher() const;
+};
+
+// SHA-256 over the SYNC_REQUEST payload followed by the SYNC_ACCEPT payload
+void transcript_hash(const crypto::SecureString& request, const crypto::SecureString& accept,
+                     uint8_t* out);
+
+SessionKeys derive_session_keys(crypto::Cipher cipher, const crypto::SecureBytes& psk,
+                                const crypto::SecureBytes& shared_secret, const uint8_t* transcript);
+
+// Argon2id of the passphrase with the vault's KDF parameters
+crypto::SecureBytes derive_sync_psk(const crypto::SecureString& passphrase,
+                                    const std::vector<uint8_t>& salt);
+
+// The pre-shared key of sessions without a passphrase
+crypto::SecureBytes empty_psk();
+
+// Cipher names as sent in SYNC_REQUEST and SYNC_ACCEPT
+const char* record_cipher_name(crypto::Cipher cipher);
+bool parse_record_cipher(const std::string& name, crypto::Cipher& cipher);
+
+std::string bytes_to_hex(const uint8_t* data, size_t len);
+bool hex_to_bytes(const std::string& hex, std::vector<uint8_t>& out);
+
+// Server side of resumption. Tickets are the resumption secret, sealed under
+// a key that never leaves this process, together with an expiry and a
+// binding to the server's pre-shared key: a ticket issued under one
+// passphrase is refused once the passphrase changes. Thread-safe.
+class TicketIssuer {
+public:
+    static constexpr std::chrono::hours LIFETIME{24};
+
+    TicketIssuer();
+
+    std::string issue(const crypto::SecureBytes& resumption_secret, const crypto::SecureBytes& psk);
+
+    // False if the ticket is malformed, forged, expired or bound to another key
+    bool redeem(const std::string& ticket, const crypto::SecureBytes& psk,
+                crypto::SecureBytes& resumption_secret) const;
+
+private:
+    crypto::SecureBytes key_;
+};
+
+// Client side of resumption: the last ticket from each peer, in memory only
+class TicketCache {
+public:
+    struct Ticket {
+        std::string ticket;
+        crypto::SecureBytes secret;
+        std::chrono::steady_clock::time_point expires;
+    };
+
+    void store(const std::string& peer, Ticket ticket);
+
+    // Unexpired ticket for peer, if any
+    bool find(const std::string& peer, Ticket& ticket) const;
+
+    void erase(const std::string& peer);
+    void clear();
+
+private:
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, Ticket> tickets_;
+};
+
+// Shared by every SyncManager in the process, so tickets outlive a single
+// sync: the CLI creates a manager per sync
+TicketIssuer& ticket_issuer();
+TicketCache& ticket_cache();
+
+} // namespace sync
+} // namespace localpdub
+
+#endif // LOCALPDUB_SYNC_SECURE_CHANNEL_H
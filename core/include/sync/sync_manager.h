@@ -2,16 +2,27 @@
 #define LOCALPDUB_SYNC_MANAGER_H
 
 #include "network_discovery.h"
+#include "framing.h"
+#include "digest_tree.h"
+#include "entry_diff.h"
+#include "entry_delta.h"
+#include "entry_store.h"
+#include "secure_channel.h"
+#include "sync_server.h"
 #include <string>
 #include <vector>
 #include <memory>
+#include <chrono>
+#include <unordered_map>
+#include <condition_variable>
 #include <nlohmann/json.hpp>
+#include "localpdub/secure_memory.h"
+#include "localpdub/entry_hash.h"
+#include "localpdub/change_feed.h"
 
 namespace localpdub {
 namespace sync {
 
-using json = nlohmann::json;
-
 enum class SyncStrategy {
     LOCAL_WINS,      // Keep local version for conflicts
     REMOTE_WINS,     // Accept remote version for conflicts
@@ -27,21 +38,63 @@ enum class AuthMethod {
     DEVICE_PAIRING   // Persistent trust
 };
 
+// Where the time of a session went. Each phase sums its spans over the
+// session, reconnects included; phases that did not run stay zero. Sending
+// and receiving overlap, as both directions stream at once. On the server,
+// phases count the time spent working on them, not waiting for the client.
+struct SyncTimings {
+    std::chrono::microseconds connect{0};          // TCP connect
+    std::chrono::microseconds auth{0};             // Handshake through the finished values
+    std::chrono::microseconds digest_build{0};     // Building the digest tree, or waiting for another session to
+    std::chrono::microseconds digest_exchange{0};  // Feed or tree queries, the entry request, resuming
+    std::chrono::microseconds diff{0};             // Splitting differences, looking up entries, field deltas
+    std::chrono::microseconds send{0};             // Encoding and writing entry batches
+    std::chrono::microseconds receive{0};          // Waiting for and parsing entry batches
+    std::chrono::microseconds apply{0};            // Merging received entries and deletions
+
+    // {phase: milliseconds}
+    json to_json() const;
+};
+
+// Outcome of the session with one device
+struct DeviceSyncResult {
+    std::string device_id;
+    std::string device_name;
+    int entries_sent = 0;
+    int entries_received = 0;
+    int conflicts_resolved = 0;
+    int deletions_sent = 0;      // Tombstones offered to the device
+    int deletions_received = 0;  // Entries removed by the device's tombstones
+    std::vector<std::string> errors;
+    bool success = false;  // Session ran to completion
+    bool incremental = false;  // Reconciled from the change feed, not digest trees
+    std::chrono::milliseconds duration{0};
+    SyncTimings timings;
+    uint64_t bytes_sent = 0;      // Wire bytes, frame headers and tags included
+    uint64_t bytes_received = 0;
+
+    json to_json() const;
+};
+
 struct SyncResult {
     int entries_sent = 0;
     int entries_received = 0;
     int conflicts_resolved = 0;
+    int deletions_sent = 0;
+    int deletions_received = 0;
     std::vector<std::string> errors;
     bool success = false;
-};
+    std::chrono::milliseconds duration{0};
+    uint64_t bytes_sent = 0;
+    uint64_t bytes_received = 0;
+    std::vector<DeviceSyncResult> devices;  // In the order the devices were given
 
-struct EntryDigest {
-    std::string id;
-    std::chrono::system_clock::time_point modified;
-    std::string hash;
+    // Counts, bytes and duration, and per device the same with the
+    // timings as phases_ms; durations in milliseconds
+    json to_json() const;
 };
 
-class SyncManager {
+class SyncManager : private SessionHandler {
 public:
     SyncManager(const std::string& vault_path);
     ~SyncManager();
@@ -49,71 +102,282 @@ public:
     // Start sync server on specified port
     bool start_sync_server(int port);
 
-    // Stop sync server
+    // Stop sync server. Sessions in progress are dropped; returns as soon
+    // as the server thread and its workers have exited.
     void stop_sync_server();
 
-    // Sync with specific devices
+    // Wait until no incoming sync session is in progress and none that was
+    // cut off waits for its client to resume it (say, after the connection
+    // callback fired); false on timeout
+    bool wait_for_sessions(std::chrono::milliseconds timeout);
+
+    // Sync with specific devices, all at once. Each session reconciles
+    // against the vault as it was when the call started; what the devices
+    // send is merged afterwards in device id order, so the outcome does not
+    // depend on which device answered first.
     SyncResult sync_with_devices(
         const std::vector<Device>& devices,
         SyncStrategy strategy,
         AuthMethod auth_method,
-        const std::string& passphrase = ""
+        const crypto::SecureString& passphrase = crypto::SecureString()
     );
 
-    // Set authentication passphrase
-    void set_passphrase(const std::string& passphrase);
+    // Set the passphrase clients must know. Derives the key handshakes use
+    // with Argon2id right away, so this takes as long as unlocking a vault.
+    void set_passphrase(const crypto::SecureString& passphrase);
+
+    // Offer (as client) the session ticket from the last sync with a device,
+    // skipping the passphrase key derivation. On by default; servers always
+    // issue and accept tickets.
+    void set_session_resumption_enabled(bool enabled) { session_resumption_enabled_ = enabled; }
+
+    // Offer (as client) and accept (as server) payload compression. On by
+    // default; a connection compresses only if both sides have it on.
+    void set_compression_enabled(bool enabled) { compression_enabled_ = enabled; }
+
+    // Describe our versions of large entries the peer is about to update, so
+    // it can send only the fields that changed, and send field deltas where
+    // the peer does the same. On by default.
+    void set_field_deltas_enabled(bool enabled) { field_deltas_enabled_ = enabled; }
+
+    // Ask (as client) a device we have synced with before only for what
+    // changed since, and offer only what changed here since; the digest
+    // trees are descended on first contact or when the device's feed no
+    // longer matches our watermark. On by default; servers always answer.
+    void set_change_feed_enabled(bool enabled) { change_feed_enabled_ = enabled; }
+
+    // Resume (as client) an entry exchange cut off by a dropped connection:
+    // reconnect up to RESUME_ATTEMPTS times and carry on after the batches
+    // each side has already committed, rather than reconciling again. On by
+    // default; servers keep interrupted exchanges for PARKED_EXCHANGE_SECONDS.
+    void set_checkpoints_enabled(bool enabled) { checkpoints_enabled_ = enabled; }
 
     // Set vault entries (for computing digest without needing to decrypt)
     void set_vault_entries(const json& entries);
 
     // Get updated vault entries after sync
-    json get_vault_entries() const { return vault_entries_; }
+    json get_vault_entries() const { return entries_.to_json(); }
+
+    // Cached entry hashes for digests. set_vault_entries() clears them, so
+    // set the vault's cache after the entries; read it back after sync.
+    void set_entry_hashes(const storage::EntryHashCache& hashes);
+    storage::EntryHashCache get_entry_hashes() const;
+
+    // The vault's change feed: entry stamps, clock and watermarks. Without
+    // one every entry counts as changed. Set it after the entries; read it
+    // back after sync, with the watermarks of the devices synced: by
+    // device id for those we called, by their feed id for clients.
+    void set_change_feed(const storage::ChangeFeed& feed);
+    storage::ChangeFeed get_change_feed() const;
 
     // Get sync history
     std::vector<SyncResult> get_sync_history() const;
 
+    // Append a line of JSON to path for every sync: SyncResult::to_json()
+    // with role ("client" for sync_with_devices(), "server" for each
+    // incoming session, its one device carrying the client's feed id, or
+    // the device_id an older client sent) and time (milliseconds since the epoch). Empty turns it off,
+    // as it starts.
+    void set_stats_log(const std::string& path);
+
     // Set callback for when sync connection is received
     using ConnectionCallback = std::function<void()>;
     void set_connection_callback(ConnectionCallback callback);
 
 private:
-    // Connection management
-    bool establish_connection(const Device& device);
-    bool authenticate_connection(int socket, AuthMethod method, const std::string& passphrase);
+    // Receives each batch of entries a device sends
+    using BatchSink = std::function<void(std::vector<json>& batch)>;
+
+    // The digest tree of the entries being synced, built on first use
+    using TreeSource = std::function<const DigestTree&()>;
+
+    // Client side of an entry exchange, kept across reconnects. Batches are
+    // counted from the start of each stream; they hold ENTRY_BATCH_SIZE
+    // entries, so a count of committed batches is a position in it.
+    struct ExchangeCheckpoint {
+        std::string session;         // The server's id for it; empty if not resumable
+        std::vector<EntryRef> outgoing;  // What we send, field deltas included
+        BaseVersions bases;          // Ours, for the server's deltas
+        size_t acknowledged = 0;     // Our batches the server committed
+        size_t received = 0;         // Server batches committed here
+        bool received_all = false;
+        std::vector<Tombstone> buried;  // The server's deletions, applied once the exchange completes
+        bool refetch = false;        // The server agreed to fetch whole entries afterwards
+        std::vector<std::string> failed;  // Server deltas that did not expand
+    };
+
+    // A server-side exchange the client can resume, and the connection it
+    // runs on. Parked once that connection closes before completion.
+    struct ResumableExchange {
+        std::shared_ptr<ServerConnection> connection;
+        std::string device_id;
+        std::chrono::steady_clock::time_point expires;  // Set when parked
+    };
+
+    // Client side of one session: connect, authenticate, reconcile against
+    // entries from the change feed or the digest tree, then exchange entries
+    bool sync_with_device(const Device& device, const EntrySnapshot& entries,
+                          const TreeSource& tree, AuthMethod auth_method,
+                          const crypto::SecureString& passphrase, const BatchSink& on_batch,
+                          DeviceSyncResult& result);
+
+    // Connection management: a connected socket with our timeouts, or -1
+    int connect_to_device(const Device& device);
+
+    // Client side of the handshake: SYNC_REQUEST through the server's
+    // finished value and ticket, then our finished value. Leaves the
+    // channel compressing and encrypting as agreed.
+    bool open_session(FrameChannel& channel, const Device& device, AuthMethod auth_method,
+                      const crypto::SecureString& passphrase, std::string& error);
+
+    // Reconcile with the device and request entries, leaving in checkpoint
+    // what to exchange. The watermark starts from the one kept for the
+    // device and moves as reconcile_feed() describes.
+    bool prepare_exchange(FrameChannel& channel, const Device& device, const EntrySnapshot& entries,
+                          const TreeSource& tree, storage::ChangeFeed::Watermark& watermark,
+                          ExchangeCheckpoint& checkpoint, DeviceSyncResult& result, std::string& error);
+
+    // Ask the server to carry on with the checkpoint's exchange; resumed is
+    // false when it no longer can, and the checkpoint is then cleared
+    bool resume_exchange(FrameChannel& channel, ExchangeCheckpoint& checkpoint, bool& resumed);
 
     // Data exchange
-    std::vector<EntryDigest> compute_vault_digest();
-    std::vector<EntryDigest> exchange_digests(int socket, const std::vector<EntryDigest>& local_digest);
-    std::vector<json> find_entries_to_send(const std::vector<EntryDigest>& local, const std::vector<EntryDigest>& remote);
-    std::vector<json> find_entries_to_receive(const std::vector<EntryDigest>& local, const std::vector<EntryDigest>& remote);
+    std::vector<EntryDigest> compute_vault_digest(const EntrySnapshot& entries);
+    std::vector<EntryDigest> digest_entries(const std::vector<const json*>& entries);
+    bool reconcile_digests(FrameChannel& channel, const EntrySnapshot& entries, const DigestTree& tree,
+                           std::vector<EntryRef>& entries_to_send, std::vector<std::string>& wanted_ids,
+                           std::vector<std::string>& update_ids, TombstoneDiff& tombstones,
+                           SyncTimings& timings);
+    bool answer_tree_query(const DigestTree& tree, const Message& query, json& reply);
+
+    // Change feed reconciliation. The client offers the ids it changed since
+    // the watermark and gets digests of the server's changes since then,
+    // plus the server's versions of its own. The watermark moves to the
+    // server's feed and position; reset means the server could not answer
+    // from it and the digest trees must be descended instead. Deletions
+    // recorded since the watermark go the same way as changed entries.
+    bool reconcile_feed(FrameChannel& channel, const EntrySnapshot& entries,
+                        storage::ChangeFeed::Watermark& watermark, bool& reset,
+                        std::vector<EntryRef>& entries_to_send, std::vector<std::string>& wanted_ids,
+                        std::vector<std::string>& update_ids, TombstoneDiff& tombstones,
+                        SyncTimings& timings);
+    bool answer_feed_query(const EntrySnapshot& entries, const Message& query, json& reply);
+
+    // Split digests of differing entries into what to send and fetch, and
+    // the entries we send that the peer holds an older version of. The
+    // tombstones of the same paths are split the same way; entries a
+    // deletion on the other side buries are neither sent nor fetched.
+    static void split_diff(const EntrySnapshot& entries, const std::vector<EntryDigest>& local_diff,
+                           const std::vector<EntryDigest>& remote_diff,
+                           const std::vector<Tombstone>& local_tombstones,
+                           const std::vector<Tombstone>& remote_tombstones,
+                           std::vector<EntryRef>& entries_to_send, std::vector<std::string>& wanted_ids,
+                           std::vector<std::string>& update_ids, TombstoneDiff& tombstones);
+    static std::vector<EntryRef> find_entries_by_id(const EntrySnapshot& entries,
+                                                    const std::vector<std::string>& ids);
+
+    // Field deltas: pin and describe our large entries among ids; replace
+    // entries the peer described with deltas where smaller (returns how
+    // many); expand received deltas against what we pinned, dropping those
+    // that don't match and adding their ids to failed
+    static json pin_bases(const EntrySnapshot& entries, const std::vector<std::string>& ids,
+                          BaseVersions& bases);
+    static size_t replace_with_deltas(std::vector<EntryRef>& entries, const json& bases);
+    static void expand_deltas(std::vector<json>& batch, const BaseVersions& bases,
+                              std::vector<std::string>& failed);
 
-    // Data transfer
-    bool send_entries(int socket, const std::vector<json>& entries);
-    std::vector<json> receive_entries(int socket);
+    // After an exchange the server agreed to refetch for: ask for the
+    // entries whose deltas failed here, learn which of ours failed there,
+    // and exchange those whole
+    bool refetch_entries(FrameChannel& channel, const EntrySnapshot& entries,
+                         ExchangeCheckpoint& checkpoint, const BatchSink& on_batch,
+                         DeviceSyncResult& result);
 
-    // Conflict resolution
+    // Data transfer. Both sides send their entries in batches while
+    // receiving and applying the peer's, so the two directions overlap.
+    // A resumable exchange keeps what it sends until it completes; others
+    // let go of entries as they go.
+    bool exchange_entries(FrameChannel& channel, ExchangeCheckpoint& checkpoint,
+                          const BatchSink& on_batch, DeviceSyncResult& result);
+    bool send_entries(FrameChannel& channel, std::vector<EntryRef>& entries, size_t position, bool keep);
+    bool receive_entries(FrameChannel& channel, ExchangeCheckpoint& checkpoint,
+                         const BatchSink& on_batch, DeviceSyncResult& result);
+
+    // ENTRIES payloads: the next batch from position, as pieces to send
+    // without copying them together (each entry's cached text between the
+    // brackets and commas of the message), and the entries of a received
+    // one; parse returns the "more" flag. The pieces point into entries
+    // until they are released.
+    static void next_entry_batch(const std::vector<EntryRef>& entries, size_t& position,
+                                 std::vector<struct iovec>& pieces);
+    static bool parse_entry_batch(const Message& msg, std::vector<json>& batch);
+
+    // Conflict resolution. Each call commits its entries to the store as
+    // one batch; sessions applying at once interleave batch by batch.
     std::vector<std::string> apply_changes(const std::vector<json>& entries, SyncStrategy strategy);
+
+    // Remove the entries a peer's tombstones bury and keep the tombstones;
+    // returns how many entries went
+    size_t apply_deletions(const std::vector<Tombstone>& tombstones);
     json resolve_conflict(const json& local_entry, const json& remote_entry, SyncStrategy strategy);
 
-    // Server operations
-    void handle_sync_client(int client_socket);
-    void accept_clients();
+    // Server sessions, on the sync server's event loop. Each step that
+    // touches the vault runs on the server's workers.
+    void on_open(ServerConnection& connection) override;
+    void on_message(ServerConnection& connection, Message& msg) override;
+    void on_writable(ServerConnection& connection) override;
+    void on_legacy_peer(ServerConnection& connection) override;
+    void on_close(ServerConnection& connection) override;
+    void handle_sync_request(ServerConnection& connection, const Message& msg);
+    void handle_auth_response(ServerConnection& connection, const Message& response);
+    void begin_reconcile(ServerConnection& connection);
+    void handle_reconcile_message(ServerConnection& connection, Message& msg);
+    void handle_resume(ServerConnection& connection, const Message& msg);
+    void prune_resumable();  // Drops expired and surplus parked ones; recounts them
+    void handle_entries_message(ServerConnection& connection, Message& msg);
+    void begin_refetch(ServerConnection& connection);
+    void finish_session(ServerConnection& connection);
+
+    // Stats log: one session's result as a line of it
+    void record_server_session(ServerConnection& connection);
+    void log_stats(const char* role, const SyncResult& result);
 
     // State
     std::string vault_path_;
-    std::string passphrase_;
-    json vault_entries_;  // Decrypted vault entries
-    std::atomic<bool> server_running_;
-    int server_socket_;
-    std::unique_ptr<std::thread> server_thread_;
+    crypto::SecureBytes psk_;        // Derived from the passphrase; empty without one
+    std::vector<uint8_t> psk_salt_;
+    mutable std::mutex psk_mutex_;
+    std::atomic<bool> compression_enabled_{true};
+    std::atomic<bool> field_deltas_enabled_{true};
+    std::atomic<bool> session_resumption_enabled_{true};
+    std::atomic<bool> change_feed_enabled_{true};
+    std::atomic<bool> checkpoints_enabled_{true};
+    EntryStore entries_;  // Decrypted vault entries
+    storage::EntryHashCache entry_hashes_;
+    mutable std::mutex hashes_mutex_;
+    storage::ChangeFeed feed_;  // Id and watermarks; entries_ keeps the stamps
+    mutable std::mutex feed_mutex_;
+    std::unique_ptr<SyncServer> server_;
+    int active_sessions_ = 0;
+    int parked_exchanges_ = 0;
+    std::mutex sessions_mutex_;
+    std::condition_variable sessions_cv_;
+    std::unordered_map<std::string, ResumableExchange> resumable_;  // By session id; loop thread only
     std::vector<SyncResult> sync_history_;
     mutable std::mutex history_mutex_;
     ConnectionCallback connection_callback_;
+    std::string stats_log_;  // Empty when off
+    std::mutex stats_mutex_;
 
     // Constants
     static constexpr int SOCKET_TIMEOUT_SECONDS = 30;
-    static constexpr size_t MAX_CHUNK_SIZE = 10 * 1024 * 1024; // 10MB
     static constexpr int MAX_SIMULTANEOUS_CONNECTIONS = 10;
+    static constexpr size_t ENTRY_BATCH_SIZE = 1000;
+    static constexpr size_t MAX_SERVER_WORKERS = 4;
+    static constexpr int RESUME_ATTEMPTS = 3;
+    static constexpr int RESUME_BACKOFF_MS = 250;  // Doubles with each attempt
+    static constexpr int PARKED_EXCHANGE_SECONDS = 300;
+    static constexpr size_t MAX_PARKED_EXCHANGES = 16;
 };
 
 } // namespace sync
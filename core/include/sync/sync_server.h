@@ -0,0 +1,223 @@
+#ifndef LOCALPDUB_SYNC_SERVER_H
+#define LOCALPDUB_SYNC_SERVER_H
+
+#include "framing.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace localpdub {
+namespace sync {
+
+// Fixed set of threads running queued tasks. stop() drops tasks that have
+// not started and joins once the running ones finish.
+class WorkerPool {
+public:
+    explicit WorkerPool(size_t threads);
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    void submit(std::function<void()> task);
+    void stop();
+
+private:
+    void worker_loop();
+
+    std::vector<std::thread> workers_;
+    std::deque<std::function<void()>> queue_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stopping_ = false;
+};
+
+class SyncServer;
+
+// Protocol state a SessionHandler keeps per connection
+struct SessionState {
+    virtual ~SessionState() = default;
+};
+
+// One client of a SyncServer. Unless noted, members are for the event loop
+// thread, which is where SessionHandler callbacks run.
+class ServerConnection : public std::enable_shared_from_this<ServerConnection> {
+public:
+    // Work for the worker pool, in one of two lanes. Tasks in a lane run one
+    // at a time, in order. While an INPUT task is queued or running no more
+    // messages are delivered; OUTPUT tasks produce data to send and run
+    // alongside INPUT ones. done() runs on the loop thread afterwards,
+    // unless the connection closed or the task threw (which closes it).
+    enum class Lane { INPUT, OUTPUT };
+    void run(Lane lane, std::function<void()> task, std::function<void()> done = nullptr);
+    bool busy(Lane lane) const;
+
+    // Queue a message. Any thread, tasks included; messages go out in the
+    // order they were queued.
+    void send(FrameType type, const crypto::SecureString& payload);
+
+    // A message in count pieces, encoded straight from them
+    void send(FrameType type, const struct iovec* pieces, size_t count);
+
+    // Unframed bytes, for answering version 1 peers
+    void send_raw(const std::string& data);
+
+    // Compress messages queued from now on and accept compressed input
+    void set_compression(Compression compression);
+
+    // Seal messages queued from now on and require sealed input
+    void set_ciphers(std::unique_ptr<RecordCipher> send, std::unique_ptr<RecordCipher> receive);
+
+    // Bytes queued but not yet written. Any thread.
+    size_t pending_output() const { return pending_bytes_; }
+
+    // Wire bytes queued for the peer and read from it so far. Any thread.
+    uint64_t bytes_sent() const { return bytes_sent_; }
+    uint64_t bytes_received() const { return bytes_received_; }
+
+    // Deliver no more messages and close once queued output is written
+    void close_after_flush();
+
+    // Close right away, dropping queued output; for a connection the peer
+    // has abandoned. Runs SessionHandler::on_close() before returning.
+    void abort();
+
+    std::unique_ptr<SessionState> session;
+
+private:
+    friend class SyncServer;
+
+    struct LaneState {
+        bool busy = false;
+        std::deque<std::pair<std::function<void()>, std::function<void()>>> queued;
+    };
+
+    ServerConnection(SyncServer& server, int socket, uint64_t id);
+    void append_output(crypto::SecureBytes&& data);
+    crypto::SecureBytes take_spare();
+    void start_next(Lane lane);
+
+    SyncServer& server_;
+    int socket_;
+    uint64_t id_;
+    bool closed_ = false;
+    bool closing_ = false;
+    bool input_closed_ = false;
+    uint32_t events_ = 0;  // Current epoll interest
+    std::chrono::steady_clock::time_point last_activity_;
+
+    FrameReader reader_;
+    std::deque<Message> inbox_;
+    LaneState lanes_[2];
+
+    // Output: the encoder lock orders encoding (the deflate stream) with
+    // queueing; the queue lock alone guards the queue against the writer
+    std::mutex encoder_mutex_;
+    FrameEncoder encoder_;
+    mutable std::mutex output_mutex_;
+    std::deque<crypto::SecureBytes> output_;
+    std::vector<crypto::SecureBytes> spare_;  // Written, emptied, kept for reuse
+    size_t output_offset_ = 0;  // Bytes of output_.front() already written
+    std::atomic<size_t> pending_bytes_{0};
+    std::atomic<uint64_t> bytes_sent_{0};
+    std::atomic<uint64_t> bytes_received_{0};
+};
+
+// Called by SyncServer on its event loop thread
+class SessionHandler {
+public:
+    virtual ~SessionHandler() = default;
+
+    virtual void on_open(ServerConnection& connection) = 0;
+    virtual void on_message(ServerConnection& connection, Message& message) = 0;
+
+    // The connection could take more output: the OUTPUT lane is idle and
+    // less than SyncServer::OUTPUT_LOW_WATER bytes are queued
+    virtual void on_writable(ServerConnection& connection) = 0;
+
+    // The peer speaks the unframed version 1 protocol
+    virtual void on_legacy_peer(ServerConnection& connection) = 0;
+
+    virtual void on_close(ServerConnection& connection) = 0;
+};
+
+// Event-driven sync server. One thread runs an epoll loop over non-blocking
+// sockets: it accepts clients, parses frames as bytes arrive, hands complete
+// messages to the handler and writes queued output as the socket allows.
+// CPU-heavy steps go to a bounded worker pool through
+// ServerConnection::run(). Connections beyond max_connections are refused,
+// and connections idle for idle_timeout are closed.
+class SyncServer {
+public:
+    // Output a connection may queue before on_writable() stops being called
+    static constexpr size_t OUTPUT_LOW_WATER = 256 * 1024;
+
+    SyncServer(SessionHandler& handler, size_t max_connections, size_t worker_threads,
+               std::chrono::seconds idle_timeout);
+    ~SyncServer();
+
+    SyncServer(const SyncServer&) = delete;
+    SyncServer& operator=(const SyncServer&) = delete;
+
+    bool start(int port);
+
+    // Wake the loop and wait for it to exit, let running tasks finish, drop
+    // queued ones and close every connection. Returns without waiting on
+    // any peer.
+    void stop();
+
+    bool running() const { return running_; }
+
+private:
+    friend class ServerConnection;
+
+    using Completion = std::function<void()>;
+
+    void loop();
+    void accept_clients();
+    void read_from(ServerConnection& connection);
+    void write_to(ServerConnection& connection);
+    void pump(ServerConnection& connection);
+    void update_interest(ServerConnection& connection);
+    void close_connection(ServerConnection& connection);
+    void close_idle();
+
+    // Task plumbing: workers post completions back to the loop
+    void submit(std::shared_ptr<ServerConnection> connection, ServerConnection::Lane lane,
+                std::function<void()> task, std::function<void()> done);
+    void post(Completion completion);
+    void run_completions();
+    void wake();
+
+    SessionHandler& handler_;
+    size_t max_connections_;
+    std::chrono::seconds idle_timeout_;
+    WorkerPool pool_;
+
+    int listen_fd_ = -1;
+    int epoll_fd_ = -1;
+    int wake_fd_ = -1;
+    std::atomic<bool> running_{false};
+    std::thread thread_;
+
+    uint64_t next_id_;
+    std::unordered_map<uint64_t, std::shared_ptr<ServerConnection>> connections_;
+    crypto::SecureBytes read_buffer_;
+
+    std::mutex completions_mutex_;
+    std::vector<Completion> completions_;
+};
+
+} // namespace sync
+} // namespace localpdub
+
+#endif // LOCALPDUB_SYNC_SERVER_H
@@ -0,0 +1,226 @@
+#include "localpdub/batch_aead.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <stdexcept>
+#include <limits>
+#include <algorithm>
+
+namespace localpdub {
+namespace crypto {
+
+// Records handed to a worker at a time; keeps the shared counter cold
+constexpr size_t BATCH_CHUNK_RECORDS = 8;
+
+class BatchAead::Impl {
+public:
+    struct Job {
+        const std::vector<AeadRecord>* records = nullptr;
+        std::vector<std::vector<uint8_t>>* sealed = nullptr;  // Seal output
+        std::vector<SecureBytes>* opened = nullptr;           // Open output
+        const uint8_t* key = nullptr;
+        Cipher cipher = Cipher::AES_256_GCM;
+        bool encrypt = true;
+        std::atomic<size_t> next{0};
+        std::atomic<size_t> failed_index{std::numeric_limits<size_t>::max()};
+        std::exception_ptr error;
+    };
+
+    explicit Impl(size_t threads) {
+        if (threads == 0) {
+            threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+        }
+        // The calling thread works too, so spawn one fewer
+        for (size_t i = 1; i < threads; ++i) {
+            workers_.emplace_back([this]() { worker_loop(); });
+        }
+    }
+
+    ~Impl() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        work_cv_.notify_all();
+        for (auto& t : workers_) {
+            if (t.joinable()) t.join();
+        }
+    }
+
+    size_t thread_count() const {
+        return workers_.size() + 1;
+    }
+
+    void run(const std::vector<AeadRecord>& records,
+             const SecureBytes& key,
+             Cipher cipher,
+             std::vector<std::vector<uint8_t>>* sealed,
+             std::vector<SecureBytes>* opened) {
+        if (key.size() != AEAD_KEY_SIZE) {
+            throw std::runtime_error("Invalid key length");
+        }
+        for (const auto& record : records) {
+            if (record.nonce.size() != AEAD_NONCE_SIZE) {
+                throw std::runtime_error("Invalid nonce length");
+            }
+        }
+
+        if (sealed) sealed->resize(records.size());
+        if (opened) opened->resize(records.size());
+
+        // One batch at a time per engine
+        std::lock_guard<std::mutex> call_lock(call_mutex_);
+
+        Job job;
+        job.records = &records;
+        job.sealed = sealed;
+        job.opened = opened;
+        job.key = key.data();
+        job.cipher = cipher;
+        job.encrypt = sealed != nullptr;
+
+        bool parallel = !workers_.empty() && records.size() > BATCH_CHUNK_RECORDS;
+        if (parallel) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                job_ = &job;
+                active_ = workers_.size();
+                ++generation_;
+            }
+            work_cv_.notify_all();
+        }
+
+        process(job, caller_ctx_);
+
+        if (parallel) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            done_cv_.wait(lock, [this]() { return active_ == 0; });
+            job_ = nullptr;
+        }
+
+        if (job.error) {
+            std::rethrow_exception(job.error);
+        }
+        size_t failed = job.failed_index.load();
+        if (failed != std::numeric_limits<size_t>::max()) {
+            throw std::runtime_error("Authentication failed for record " + std::to_string(failed));
+        }
+    }
+
+private:
+    void worker_loop() {
+        AeadContext ctx;
+        uint64_t seen_generation = 0;
+
+        while (true) {
+            Job* job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                work_cv_.wait(lock, [&]() { return stopping_ || generation_ != seen_generation; });
+                if (stopping_) return;
+                seen_generation = generation_;
+                job = job_;
+            }
+
+            process(*job, ctx);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (--active_ == 0) {
+                    done_cv_.notify_one();
+                }
+            }
+        }
+    }
+
+    void process(Job& job, AeadContext& ctx) {
+        const auto& records = *job.records;
+
+        try {
+            ctx.set_key(job.cipher, job.key);
+
+            while (true) {
+                size_t begin = job.next.fetch_add(BATCH_CHUNK_RECORDS);
+                if (begin >= records.size()) break;
+                size_t end = std::min(records.size(), begin + BATCH_CHUNK_RECORDS);
+
+                for (size_t i = begin; i < end; ++i) {
+                    const auto& record = records[i];
+
+                    if (job.encrypt) {
+                        auto& out = (*job.sealed)[i];
+                        out.resize(record.data.size() + AEAD_TAG_SIZE);
+                        ctx.seal(record.nonce.data(), record.data.data(), record.data.size(), out.data());
+                    } else {
+                        if (record.data.size() < static_cast<size_t>(AEAD_TAG_SIZE)) {
+                            record_failure(job, i);
+                            continue;
+                        }
+                        auto& out = (*job.opened)[i];
+                        out.resize(record.data.size() - AEAD_TAG_SIZE);
+                        if (!ctx.open(record.nonce.data(), record.data.data(), record.data.size(), out.data())) {
+                            secure_clear(out);
+                            record_failure(job, i);
+                        }
+                    }
+                }
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(error_mutex_);
+            if (!job.error) {
+                job.error = std::current_exception();
+            }
+            // Stop handing out further records
+            job.next.store(records.size());
+        }
+    }
+
+    static void record_failure(Job& job, size_t index) {
+        size_t current = job.failed_index.load();
+        while (index < current && !job.failed_index.compare_exchange_weak(current, index)) {
+        }
+    }
+
+    std::vector<std::thread> workers_;
+    AeadContext caller_ctx_;
+    std::mutex call_mutex_;
+    std::mutex mutex_;
+    std::mutex error_mutex_;
+    std::condition_variable work_cv_;
+    std::condition_variable done_cv_;
+    Job* job_ = nullptr;
+    uint64_t generation_ = 0;
+    size_t active_ = 0;
+    bool stopping_ = false;
+};
+
+BatchAead::BatchAead(size_t threads)
+    : impl(std::make_unique<Impl>(threads)) {
+}
+
+BatchAead::~BatchAead() = default;
+
+std::vector<std::vector<uint8_t>> BatchAead::seal(const std::vector<AeadRecord>& records,
+                                                  const SecureBytes& key,
+                                                  Cipher cipher) {
+    std::vector<std::vector<uint8_t>> sealed;
+    impl->run(records, key, cipher, &sealed, nullptr);
+    return sealed;
+}
+
+std::vector<SecureBytes> BatchAead::open(const std::vector<AeadRecord>& records,
+                                         const SecureBytes& key,
+                                         Cipher cipher) {
+    std::vector<SecureBytes> opened;
+    impl->run(records, key, cipher, nullptr, &opened);
+    return opened;
+}
+
+size_t BatchAead::thread_count() const {
+    return impl->thread_count();
+}
+
+} // namespace crypto
+} // namespace localpdub
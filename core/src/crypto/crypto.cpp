@@ -1,14 +1,23 @@
 #include <openssl/evp.h>
-#include <openssl/aes.h>
 #include <openssl/rand.h>
 #include <openssl/sha.h>
 #include <openssl/hmac.h>
 #include <argon2.h>
+#include <sys/uio.h>
+#include "localpdub/crypto.h"
+#include "localpdub/random.h"
 #include <vector>
 #include <string>
 #include <cstring>
 #include <stdexcept>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#elif defined(__linux__) && (defined(__aarch64__) || defined(__arm__))
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
 namespace localpdub {
 namespace crypto {
 
@@ -16,6 +25,10 @@ namespace crypto {
 constexpr int AES_KEY_SIZE = 32;  // 256 bits
 constexpr int AES_GCM_IV_SIZE = 12;
 constexpr int AES_GCM_TAG_SIZE = 16;
+// ChaCha20-Poly1305 uses the same key, nonce and tag sizes as AES-256-GCM,
+// so both ciphers share one on-disk layout: nonce || ciphertext || tag
+static_assert(AEAD_NONCE_SIZE == AES_GCM_IV_SIZE, "nonce size mismatch");
+static_assert(AEAD_TAG_SIZE == AES_GCM_TAG_SIZE, "tag size mismatch");
 constexpr int SALT_SIZE = 32;
 
 // Argon2 parameters
@@ -23,26 +36,30 @@ constexpr uint32_t ARGON2_TIME_COST = 3;
 constexpr uint32_t ARGON2_MEMORY_COST = 65536;  // 64 MB
 constexpr uint32_t ARGON2_PARALLELISM = 4;
 
+// Ceilings for parameters read back from a vault
+constexpr uint32_t ARGON2_MAX_TIME_COST = 64;
+constexpr uint32_t ARGON2_MAX_MEMORY_COST = 4u * 1024 * 1024;  // 4 GB
+constexpr uint32_t ARGON2_MAX_PARALLELISM = 64;
+
 class CryptoImpl {
 public:
-    // Generate random bytes
+    // Generate random bytes from the thread's buffered CSPRNG
     static std::vector<uint8_t> generate_random(size_t length) {
         std::vector<uint8_t> buffer(length);
-        if (RAND_bytes(buffer.data(), length) != 1) {
-            throw std::runtime_error("Failed to generate random bytes");
-        }
+        random_bytes(buffer.data(), length);
         return buffer;
     }
 
     // Derive key from password using Argon2id
-    static std::vector<uint8_t> derive_key(const std::string& password,
-                                          const std::vector<uint8_t>& salt) {
-        std::vector<uint8_t> key(AES_KEY_SIZE);
+    static SecureBytes derive_key(const SecureString& password,
+                                  const std::vector<uint8_t>& salt,
+                                  const KdfParams& params) {
+        SecureBytes key(AES_KEY_SIZE);
 
         int result = argon2id_hash_raw(
-            ARGON2_TIME_COST,
-            ARGON2_MEMORY_COST,
-            ARGON2_PARALLELISM,
+            params.time_cost,
+            params.memory_kib,
+            params.parallelism,
             password.c_str(),
             password.length(),
             salt.data(),
@@ -58,126 +75,47 @@ public:
         return key;
     }
 
-    // AES-256-GCM encryption
-    static std::vector<uint8_t> encrypt_aes_gcm(const std::vector<uint8_t>& plaintext,
-                                                const std::vector<uint8_t>& key,
-                                                const std::vector<uint8_t>& iv) {
-        EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
-        if (!ctx) throw std::runtime_error("Failed to create cipher context");
-
-        // Initialize encryption
-        if (EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), nullptr, nullptr, nullptr) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            throw std::runtime_error("Failed to initialize encryption");
-        }
-
-        // Set IV length
-        if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, AES_GCM_IV_SIZE, nullptr) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            throw std::runtime_error("Failed to set IV length");
+    // AEAD encryption (AES-256-GCM or ChaCha20-Poly1305).
+    // Writes nonce || ciphertext || tag without copying the plaintext.
+    static std::vector<uint8_t> encrypt_aead(Cipher cipher,
+                                             const uint8_t* plaintext,
+                                             size_t plaintext_len,
+                                             const SecureBytes& key,
+                                             const std::vector<uint8_t>& iv) {
+        if (key.size() != AEAD_KEY_SIZE || iv.size() != AEAD_NONCE_SIZE) {
+            throw std::runtime_error("Invalid key or IV length");
         }
 
-        // Initialize with key and IV
-        if (EVP_EncryptInit_ex(ctx, nullptr, nullptr, key.data(), iv.data()) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            throw std::runtime_error("Failed to set key and IV");
-        }
-
-        // Encrypt
-        std::vector<uint8_t> ciphertext(plaintext.size() + AES_BLOCK_SIZE);
-        int len;
-        int ciphertext_len;
-
-        if (EVP_EncryptUpdate(ctx, ciphertext.data(), &len, plaintext.data(), plaintext.size()) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            throw std::runtime_error("Failed to encrypt data");
-        }
-        ciphertext_len = len;
+        AeadContext ctx;
+        ctx.set_key(cipher, key.data());
 
-        // Finalize
-        if (EVP_EncryptFinal_ex(ctx, ciphertext.data() + len, &len) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            throw std::runtime_error("Failed to finalize encryption");
-        }
-        ciphertext_len += len;
-
-        // Get tag
-        std::vector<uint8_t> tag(AES_GCM_TAG_SIZE);
-        if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, AES_GCM_TAG_SIZE, tag.data()) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            throw std::runtime_error("Failed to get authentication tag");
-        }
-
-        EVP_CIPHER_CTX_free(ctx);
-
-        // Combine ciphertext and tag
-        ciphertext.resize(ciphertext_len);
-        ciphertext.insert(ciphertext.end(), tag.begin(), tag.end());
-
-        return ciphertext;
+        std::vector<uint8_t> encrypted(AEAD_NONCE_SIZE + plaintext_len + AEAD_TAG_SIZE);
+        std::memcpy(encrypted.data(), iv.data(), AEAD_NONCE_SIZE);
+        ctx.seal(iv.data(), plaintext, plaintext_len, encrypted.data() + AEAD_NONCE_SIZE);
+        return encrypted;
     }
 
-    // AES-256-GCM decryption
-    static std::vector<uint8_t> decrypt_aes_gcm(const std::vector<uint8_t>& ciphertext,
-                                                const std::vector<uint8_t>& key,
-                                                const std::vector<uint8_t>& iv) {
-        if (ciphertext.size() < AES_GCM_TAG_SIZE) {
+    // AEAD decryption (AES-256-GCM or ChaCha20-Poly1305) straight into
+    // secure memory
+    static SecureString decrypt_aead(Cipher cipher,
+                                     const uint8_t* ciphertext,
+                                     size_t ciphertext_len,
+                                     const SecureBytes& key,
+                                     const uint8_t* iv) {
+        if (ciphertext_len < static_cast<size_t>(AEAD_TAG_SIZE)) {
             throw std::runtime_error("Ciphertext too short");
         }
-
-        // Split ciphertext and tag
-        size_t actual_ciphertext_len = ciphertext.size() - AES_GCM_TAG_SIZE;
-        std::vector<uint8_t> tag(ciphertext.end() - AES_GCM_TAG_SIZE, ciphertext.end());
-
-        EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
-        if (!ctx) throw std::runtime_error("Failed to create cipher context");
-
-        // Initialize decryption
-        if (EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), nullptr, nullptr, nullptr) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            throw std::runtime_error("Failed to initialize decryption");
-        }
-
-        // Set IV length
-        if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, AES_GCM_IV_SIZE, nullptr) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            throw std::runtime_error("Failed to set IV length");
-        }
-
-        // Initialize with key and IV
-        if (EVP_DecryptInit_ex(ctx, nullptr, nullptr, key.data(), iv.data()) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            throw std::runtime_error("Failed to set key and IV");
-        }
-
-        // Decrypt
-        std::vector<uint8_t> plaintext(actual_ciphertext_len);
-        int len;
-        int plaintext_len;
-
-        if (EVP_DecryptUpdate(ctx, plaintext.data(), &len, ciphertext.data(), actual_ciphertext_len) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            throw std::runtime_error("Failed to decrypt data");
+        if (key.size() != AEAD_KEY_SIZE) {
+            throw std::runtime_error("Invalid key length");
         }
-        plaintext_len = len;
 
-        // Set tag
-        if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, AES_GCM_TAG_SIZE,
-                                const_cast<uint8_t*>(tag.data())) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            throw std::runtime_error("Failed to set authentication tag");
-        }
+        AeadContext ctx;
+        ctx.set_key(cipher, key.data());
 
-        // Finalize
-        if (EVP_DecryptFinal_ex(ctx, plaintext.data() + len, &len) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
+        SecureString plaintext(ciphertext_len - AEAD_TAG_SIZE, '\0');
+        if (!ctx.open(iv, ciphertext, ciphertext_len, reinterpret_cast<uint8_t*>(&plaintext[0]))) {
             throw std::runtime_error("Authentication failed - data may be corrupted");
         }
-        plaintext_len += len;
-
-        EVP_CIPHER_CTX_free(ctx);
-
-        plaintext.resize(plaintext_len);
         return plaintext;
     }
 
@@ -201,49 +139,248 @@ public:
     }
 };
 
+static const EVP_CIPHER* evp_cipher(Cipher cipher) {
+    switch (cipher) {
+        case Cipher::AES_256_GCM:
+            return EVP_aes_256_gcm();
+        case Cipher::CHACHA20_POLY1305:
+            return EVP_chacha20_poly1305();
+    }
+    throw std::runtime_error("Unsupported cipher");
+}
+
+// AeadContext
+AeadContext::AeadContext()
+    : ctx_(EVP_CIPHER_CTX_new())
+    , cipher_(Cipher::AES_256_GCM)
+    , has_key_(false)
+    , direction_(-1) {
+    if (!ctx_) throw std::runtime_error("Failed to create cipher context");
+}
+
+AeadContext::~AeadContext() {
+    OPENSSL_cleanse(key_, sizeof(key_));
+    EVP_CIPHER_CTX_free(ctx_);
+}
+
+void AeadContext::set_key(Cipher cipher, const uint8_t* key) {
+    cipher_ = cipher;
+    std::memcpy(key_, key, AEAD_KEY_SIZE);
+    has_key_ = true;
+    direction_ = -1;  // Re-key lazily on the next seal/open
+}
+
+void AeadContext::init_direction(int encrypt) {
+    if (!has_key_) throw std::runtime_error("Cipher key not set");
+
+    // Full init (cipher + key schedule) only when the key or direction changes
+    if (EVP_CipherInit_ex(ctx_, evp_cipher(cipher_), nullptr, nullptr, nullptr, encrypt) != 1) {
+        throw std::runtime_error("Failed to initialize cipher");
+    }
+    if (EVP_CIPHER_CTX_ctrl(ctx_, EVP_CTRL_AEAD_SET_IVLEN, AEAD_NONCE_SIZE, nullptr) != 1) {
+        throw std::runtime_error("Failed to set IV length");
+    }
+    if (EVP_CipherInit_ex(ctx_, nullptr, nullptr, key_, nullptr, encrypt) != 1) {
+        throw std::runtime_error("Failed to set key");
+    }
+    direction_ = encrypt;
+}
+
+void AeadContext::seal(const uint8_t* nonce, const uint8_t* in, size_t len, uint8_t* out,
+                       const uint8_t* aad, size_t aad_len) {
+    struct iovec piece = {const_cast<uint8_t*>(in), len};
+    seal(nonce, &piece, 1, out, aad, aad_len);
+}
+
+void AeadContext::seal(const uint8_t* nonce, const struct iovec* in, size_t count, uint8_t* out,
+                       const uint8_t* aad, size_t aad_len) {
+    if (direction_ != 1) init_direction(1);
+
+    // Only the nonce changes between records
+    if (EVP_CipherInit_ex(ctx_, nullptr, nullptr, nullptr, nonce, 1) != 1) {
+        throw std::runtime_error("Failed to set IV");
+    }
+
+    int outl = 0;
+    if (aad_len > 0 && EVP_EncryptUpdate(ctx_, nullptr, &outl, aad, static_cast<int>(aad_len)) != 1) {
+        throw std::runtime_error("Failed to add associated data");
+    }
+    // Both ciphers are stream modes: each update writes as many bytes as it
+    // reads, so the pieces land back to back
+    size_t len = 0;
+    for (size_t i = 0; i < count; ++i) {
+        outl = 0;
+        if (in[i].iov_len > 0 &&
+            EVP_EncryptUpdate(ctx_, out + len, &outl, static_cast<const uint8_t*>(in[i].iov_base),
+                              static_cast<int>(in[i].iov_len)) != 1) {
+            throw std::runtime_error("Failed to encrypt data");
+        }
+        len += outl;
+    }
+    int finl = 0;
+    if (EVP_EncryptFinal_ex(ctx_, out + len, &finl) != 1) {
+        throw std::runtime_error("Failed to finalize encryption");
+    }
+    len += finl;
+    if (EVP_CIPHER_CTX_ctrl(ctx_, EVP_CTRL_AEAD_GET_TAG, AEAD_TAG_SIZE, out + len) != 1) {
+        throw std::runtime_error("Failed to get authentication tag");
+    }
+}
+
+bool AeadContext::open(const uint8_t* nonce, const uint8_t* in, size_t len, uint8_t* out,
+                       const uint8_t* aad, size_t aad_len) {
+    if (len < static_cast<size_t>(AEAD_TAG_SIZE)) return false;
+    if (direction_ != 0) init_direction(0);
+
+    if (EVP_CipherInit_ex(ctx_, nullptr, nullptr, nullptr, nonce, 0) != 1) {
+        throw std::runtime_error("Failed to set IV");
+    }
+
+    size_t body_len = len - AEAD_TAG_SIZE;
+    int outl = 0;
+    if (aad_len > 0 && EVP_DecryptUpdate(ctx_, nullptr, &outl, aad, static_cast<int>(aad_len)) != 1) {
+        return false;
+    }
+    outl = 0;
+    if (body_len > 0 && EVP_DecryptUpdate(ctx_, out, &outl, in, static_cast<int>(body_len)) != 1) {
+        return false;
+    }
+    if (EVP_CIPHER_CTX_ctrl(ctx_, EVP_CTRL_AEAD_SET_TAG, AEAD_TAG_SIZE,
+                            const_cast<uint8_t*>(in + body_len)) != 1) {
+        return false;
+    }
+    int finl = 0;
+    return EVP_DecryptFinal_ex(ctx_, out + outl, &finl) == 1;
+}
+
 // Public API functions
+bool has_hardware_aes() {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+    return (ecx & bit_AES) != 0;
+#elif defined(__linux__) && defined(__aarch64__)
+    return (getauxval(AT_HWCAP) & HWCAP_AES) != 0;
+#elif defined(__linux__) && defined(__arm__)
+    return (getauxval(AT_HWCAP2) & HWCAP2_AES) != 0;
+#elif defined(__APPLE__) && defined(__aarch64__)
+    return true;  // Every Apple Silicon core has the crypto extensions
+#else
+    return false;
+#endif
+}
+
+Cipher preferred_cipher() {
+    static const Cipher cipher = has_hardware_aes() ? Cipher::AES_256_GCM
+                                                    : Cipher::CHACHA20_POLY1305;
+    return cipher;
+}
+
+const char* cipher_name(Cipher cipher) {
+    switch (cipher) {
+        case Cipher::AES_256_GCM:
+            return "AES-256-GCM";
+        case Cipher::CHACHA20_POLY1305:
+            return "ChaCha20-Poly1305";
+    }
+    return "unknown";
+}
+
 std::vector<uint8_t> generate_salt() {
     return CryptoImpl::generate_random(SALT_SIZE);
 }
 
 std::vector<uint8_t> generate_nonce() {
-    return CryptoImpl::generate_random(AES_GCM_IV_SIZE);
+    return CryptoImpl::generate_random(AEAD_NONCE_SIZE);
 }
 
-std::vector<uint8_t> derive_key_from_password(const std::string& password,
-                                              const std::vector<uint8_t>& salt) {
-    return CryptoImpl::derive_key(password, salt);
+KdfParams default_kdf_params() {
+    return KdfParams{ARGON2_TIME_COST, ARGON2_MEMORY_COST, ARGON2_PARALLELISM};
 }
 
-std::vector<uint8_t> encrypt_data(const std::string& plaintext,
-                                 const std::vector<uint8_t>& key) {
-    std::vector<uint8_t> data(plaintext.begin(), plaintext.end());
-    std::vector<uint8_t> nonce = generate_nonce();
+bool kdf_params_in_range(const KdfParams& params) {
+    if (params.time_cost < 1 || params.time_cost > ARGON2_MAX_TIME_COST) {
+        return false;
+    }
+    if (params.parallelism < 1 || params.parallelism > ARGON2_MAX_PARALLELISM) {
+        return false;
+    }
+    // Argon2 needs at least 8 KiB per lane
+    return params.memory_kib >= 8 * params.parallelism &&
+           params.memory_kib <= ARGON2_MAX_MEMORY_COST;
+}
 
-    auto encrypted = CryptoImpl::encrypt_aes_gcm(data, key, nonce);
+SecureBytes derive_key_from_password(const SecureString& password,
+                                     const std::vector<uint8_t>& salt) {
+    return CryptoImpl::derive_key(password, salt, default_kdf_params());
+}
 
-    // Prepend nonce to encrypted data
-    encrypted.insert(encrypted.begin(), nonce.begin(), nonce.end());
+SecureBytes derive_key_from_password(const SecureString& password,
+                                     const std::vector<uint8_t>& salt,
+                                     const KdfParams& params) {
+    return CryptoImpl::derive_key(password, salt, params);
+}
 
-    return encrypted;
+SecureBytes generate_key() {
+    SecureBytes key(AEAD_KEY_SIZE);
+    random_bytes(key.data(), AEAD_KEY_SIZE);
+    return key;
 }
 
-std::string decrypt_data(const std::vector<uint8_t>& encrypted,
-                        const std::vector<uint8_t>& key) {
-    if (encrypted.size() < AES_GCM_IV_SIZE + AES_GCM_TAG_SIZE) {
-        throw std::runtime_error("Invalid encrypted data");
+std::vector<uint8_t> wrap_key(const SecureBytes& data_key,
+                              const SecureBytes& kek,
+                              Cipher cipher) {
+    if (data_key.size() != AEAD_KEY_SIZE) {
+        throw std::runtime_error("Invalid key length");
+    }
+    return CryptoImpl::encrypt_aead(cipher, data_key.data(), data_key.size(),
+                                    kek, generate_nonce());
+}
+
+SecureBytes unwrap_key(const std::vector<uint8_t>& wrapped,
+                       const SecureBytes& kek,
+                       Cipher cipher) {
+    if (wrapped.size() != WRAPPED_KEY_SIZE || kek.size() != AEAD_KEY_SIZE) {
+        throw std::runtime_error("Invalid wrapped key or KEK length");
     }
 
-    // Extract nonce
-    std::vector<uint8_t> nonce(encrypted.begin(), encrypted.begin() + AES_GCM_IV_SIZE);
+    AeadContext ctx;
+    ctx.set_key(cipher, kek.data());
 
-    // Extract ciphertext with tag
-    std::vector<uint8_t> ciphertext(encrypted.begin() + AES_GCM_IV_SIZE, encrypted.end());
+    SecureBytes key(AEAD_KEY_SIZE);
+    if (!ctx.open(wrapped.data(), wrapped.data() + AEAD_NONCE_SIZE,
+                  AEAD_KEY_SIZE + AEAD_TAG_SIZE, key.data())) {
+        throw std::runtime_error("Authentication failed - wrong key");
+    }
+    return key;
+}
 
-    auto decrypted = CryptoImpl::decrypt_aes_gcm(ciphertext, key, nonce);
+std::vector<uint8_t> encrypt_data(const SecureString& plaintext,
+                                 const SecureBytes& key,
+                                 Cipher cipher) {
+    std::vector<uint8_t> nonce = generate_nonce();
+
+    // Nonce is prepended to the encrypted data
+    return CryptoImpl::encrypt_aead(cipher,
+                                    reinterpret_cast<const uint8_t*>(plaintext.data()),
+                                    plaintext.size(), key, nonce);
+}
+
+SecureString decrypt_data(const std::vector<uint8_t>& encrypted,
+                          const SecureBytes& key,
+                          Cipher cipher) {
+    if (encrypted.size() < AEAD_NONCE_SIZE + AEAD_TAG_SIZE) {
+        throw std::runtime_error("Invalid encrypted data");
+    }
 
-    return std::string(decrypted.begin(), decrypted.end());
+    // Nonce first, then ciphertext with tag
+    return CryptoImpl::decrypt_aead(cipher,
+                                    encrypted.data() + AEAD_NONCE_SIZE,
+                                    encrypted.size() - AEAD_NONCE_SIZE,
+                                    key, encrypted.data());
 }
 
 } // namespace crypto
-} // namespace localpdub
\ No newline at end of file
+} // namespace localpdub
@@ -0,0 +1,143 @@
+#include "localpdub/random.h"
+#include "localpdub/secure_memory.h"
+#include <openssl/rand.h>
+#include <openssl/evp.h>
+#include <openssl/opensslv.h>
+#include <pthread.h>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <algorithm>
+#include <stdexcept>
+
+namespace localpdub {
+namespace crypto {
+
+namespace {
+
+constexpr size_t RANDOM_BLOCK_SIZE = 4096;
+constexpr size_t RESEED_BYTES = 1 << 20;                   // Reseed after 1 MB served
+constexpr std::chrono::seconds RESEED_INTERVAL(60);        // ...or a minute
+
+// Bumped in the child after fork() so every thread buffer is discarded
+std::atomic<uint64_t> g_fork_generation{0};
+std::once_flag g_atfork_once;
+
+void on_fork_child() {
+    g_fork_generation.fetch_add(1, std::memory_order_relaxed);
+}
+
+class BufferedRandom {
+public:
+    BufferedRandom() : buffer_(RANDOM_BLOCK_SIZE) {
+        std::call_once(g_atfork_once, []() {
+            pthread_atfork(nullptr, nullptr, on_fork_child);
+        });
+        reseed();
+    }
+
+    void fill(uint8_t* out, size_t len) {
+        if (g_fork_generation.load(std::memory_order_relaxed) != fork_generation_ ||
+            served_since_reseed_ >= RESEED_BYTES ||
+            std::chrono::steady_clock::now() - last_reseed_ >= RESEED_INTERVAL) {
+            reseed();
+        }
+
+        // Large requests bypass the buffer
+        if (len >= RANDOM_BLOCK_SIZE) {
+            generate(out, len);
+            served_since_reseed_ += len;
+            return;
+        }
+
+        while (len > 0) {
+            if (pos_ == RANDOM_BLOCK_SIZE) {
+                refill();
+            }
+            size_t n = std::min(len, RANDOM_BLOCK_SIZE - pos_);
+            std::memcpy(out, buffer_.data() + pos_, n);
+            secure_zero(buffer_.data() + pos_, n);
+            pos_ += n;
+            out += n;
+            len -= n;
+            served_since_reseed_ += n;
+        }
+    }
+
+private:
+    static void generate(uint8_t* out, size_t len) {
+        if (RAND_bytes(out, static_cast<int>(len)) != 1) {
+            throw std::runtime_error("Failed to generate random bytes");
+        }
+    }
+
+    void refill() {
+        generate(buffer_.data(), RANDOM_BLOCK_SIZE);
+        pos_ = 0;
+    }
+
+    // Drop buffered bytes and pull fresh entropy into this thread's DRBG
+    void reseed() {
+        if (pos_ < RANDOM_BLOCK_SIZE) {
+            secure_zero(buffer_.data() + pos_, RANDOM_BLOCK_SIZE - pos_);
+        }
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        EVP_RAND_CTX* drbg = RAND_get0_public(nullptr);
+        bool reseeded = drbg != nullptr && EVP_RAND_reseed(drbg, 0, nullptr, 0, nullptr, 0) == 1;
+#else
+        // 1.1.1 has no handle on the thread's DRBG; reseeding the master
+        // makes it reseed on its next request
+        bool reseeded = RAND_poll() == 1;
+#endif
+        if (!reseeded) {
+            throw std::runtime_error("Failed to reseed random generator");
+        }
+        fork_generation_ = g_fork_generation.load(std::memory_order_relaxed);
+        served_since_reseed_ = 0;
+        last_reseed_ = std::chrono::steady_clock::now();
+        refill();
+    }
+
+    SecureBytes buffer_;
+    size_t pos_ = RANDOM_BLOCK_SIZE;
+    size_t served_since_reseed_ = 0;
+    uint64_t fork_generation_ = 0;
+    std::chrono::steady_clock::time_point last_reseed_;
+};
+
+BufferedRandom& thread_random() {
+    thread_local BufferedRandom rng;
+    return rng;
+}
+
+} // namespace
+
+void random_bytes(void* out, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    thread_random().fill(static_cast<uint8_t*>(out), len);
+}
+
+std::string generate_uuid() {
+    uint8_t bytes[16];
+    random_bytes(bytes, sizeof(bytes));
+    bytes[6] = (bytes[6] & 0x0F) | 0x40;  // Version 4
+    bytes[8] = (bytes[8] & 0x3F) | 0x80;  // RFC 4122 variant
+
+    static const char hex[] = "0123456789abcdef";
+    std::string uuid(36, '-');
+    size_t out = 0;
+    for (int i = 0; i < 16; ++i) {
+        if (i == 4 || i == 6 || i == 8 || i == 10) {
+            ++out;  // Dash already in place
+        }
+        uuid[out++] = hex[bytes[i] >> 4];
+        uuid[out++] = hex[bytes[i] & 0x0F];
+    }
+    return uuid;
+}
+
+} // namespace crypto
+} // namespace localpdub
@@ -0,0 +1,285 @@
+#include "localpdub/secure_memory.h"
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cstring>
+#include <new>
+
+namespace localpdub {
+namespace crypto {
+
+void secure_zero(void* ptr, size_t len) {
+    if (!ptr || len == 0) {
+        return;
+    }
+    std::memset(ptr, 0, len);
+    // Tell the compiler the zeroed memory is observed so the memset stays
+    __asm__ __volatile__("" : : "r"(ptr) : "memory");
+}
+
+SecureArena& SecureArena::instance() {
+    // Never destroyed: static destructors elsewhere may still release blocks
+    static SecureArena* arena = new SecureArena();
+    return *arena;
+}
+
+SecureArena::SecureArena()
+    : page_size_(static_cast<size_t>(sysconf(_SC_PAGESIZE))) {
+}
+
+namespace {
+
+// Set as the thread's cache goes. Blocks released after that, by other
+// thread_local destructors, go straight to the shared lists.
+thread_local bool secure_cache_gone = false;
+
+} // namespace
+
+SecureArena::ThreadCache::~ThreadCache() {
+    secure_cache_gone = true;
+    for (size_t cls = 0; cls < NUM_CLASSES; ++cls) {
+        instance().flush(*this, cls, counts[cls]);
+    }
+}
+
+SecureArena::ThreadCache* SecureArena::thread_cache() noexcept {
+    if (secure_cache_gone) {
+        return nullptr;
+    }
+    thread_local ThreadCache cache;
+    return &cache;
+}
+
+size_t SecureArena::cache_limit(size_t cls) {
+    size_t blocks = THREAD_CACHE_BYTES / (MIN_BLOCK << cls);
+    return blocks < 2 ? 2 : blocks;
+}
+
+size_t SecureArena::size_class(size_t bytes) {
+    size_t cls = 0;
+    size_t block = MIN_BLOCK;
+    while (block < bytes) {
+        block <<= 1;
+        ++cls;
+    }
+    return cls;
+}
+
+size_t SecureArena::large_size(size_t bytes) const {
+    size_t pages = (bytes + page_size_ - 1) / page_size_ * page_size_;
+    if (pages > MAX_CACHED_LARGE) {
+        return pages;
+    }
+    // Cached sizes double, so a region suits more requests
+    size_t size = page_size_;
+    while (size < bytes) {
+        size <<= 1;
+    }
+    return size;
+}
+
+size_t SecureArena::large_class(size_t size) const {
+    size_t cls = 0;
+    for (size_t pages = size / page_size_; pages > 1; pages >>= 1) {
+        ++cls;
+    }
+    return cls;
+}
+
+void* SecureArena::map_guarded(size_t usable_bytes) {
+    size_t total = usable_bytes + 2 * page_size_;
+    void* base = mmap(nullptr, total, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        throw std::bad_alloc();
+    }
+
+    uint8_t* region = static_cast<uint8_t*>(base) + page_size_;
+
+    // Guard pages on both sides
+    mprotect(base, page_size_, PROT_NONE);
+    mprotect(region + usable_bytes, page_size_, PROT_NONE);
+
+#ifdef MADV_DONTDUMP
+    madvise(region, usable_bytes, MADV_DONTDUMP);
+#endif
+
+    // Locking can fail under RLIMIT_MEMLOCK; the memory is still usable,
+    // guarded and excluded from core dumps
+    if (mlock(region, usable_bytes) == 0) {
+        stats_.bytes_locked += usable_bytes;
+    } else {
+        ++stats_.lock_failures;
+    }
+
+    stats_.bytes_mapped += usable_bytes;
+    return region;
+}
+
+void SecureArena::unmap_guarded(void* ptr, size_t usable_bytes) noexcept {
+    uint8_t* region = static_cast<uint8_t*>(ptr);
+    if (munlock(region, usable_bytes) == 0) {
+        stats_.bytes_locked -= usable_bytes;
+    }
+    munmap(region - page_size_, usable_bytes + 2 * page_size_);
+    stats_.bytes_mapped -= usable_bytes;
+}
+
+SecureArena::FreeBlock* SecureArena::take(size_t cls, bool map_chunk) {
+    FreeBlock* block = free_lists_[cls];
+    if (block) {
+        free_lists_[cls] = block->next;
+        return block;
+    }
+
+    // Bump-allocate from the current chunk; fresh memory is zero
+    size_t size = MIN_BLOCK << cls;
+    if (bump_ == nullptr || static_cast<size_t>(bump_end_ - bump_) < size) {
+        if (!map_chunk) {
+            return nullptr;
+        }
+        bump_ = static_cast<uint8_t*>(map_guarded(CHUNK_SIZE));
+        bump_end_ = bump_ + CHUNK_SIZE;
+    }
+    block = reinterpret_cast<FreeBlock*>(bump_);
+    bump_ += size;
+    return block;
+}
+
+void SecureArena::refill(ThreadCache& cache, size_t cls, size_t count) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < count; ++i) {
+        // A new chunk only when there is nothing to hand out at all
+        FreeBlock* block = take(cls, i == 0);
+        if (!block) {
+            break;
+        }
+        block->next = cache.lists[cls];
+        cache.lists[cls] = block;
+        ++cache.counts[cls];
+    }
+}
+
+void SecureArena::flush(ThreadCache& cache, size_t cls, size_t count) noexcept {
+    if (count == 0) {
+        return;
+    }
+    FreeBlock* first = cache.lists[cls];
+    FreeBlock* last = first;
+    for (size_t i = 1; i < count; ++i) {
+        last = last->next;
+    }
+    cache.lists[cls] = last->next;
+    cache.counts[cls] -= count;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    last->next = free_lists_[cls];
+    free_lists_[cls] = first;
+}
+
+void* SecureArena::allocate(size_t bytes) {
+    if (bytes == 0) {
+        bytes = 1;
+    }
+    allocations_.fetch_add(1, std::memory_order_relaxed);
+
+    if (bytes > MAX_SMALL_BLOCK) {
+        return allocate_large(bytes);
+    }
+
+    size_t cls = size_class(bytes);
+    bytes_in_use_.fetch_add(MIN_BLOCK << cls, std::memory_order_relaxed);
+
+    FreeBlock* block = nullptr;
+    ThreadCache* cache = thread_cache();
+    if (cache) {
+        if (!cache->lists[cls]) {
+            refill(*cache, cls, cache_limit(cls) / 2);
+        }
+        block = cache->lists[cls];
+        cache->lists[cls] = block->next;
+        --cache->counts[cls];
+    } else {
+        std::lock_guard<std::mutex> lock(mutex_);
+        block = take(cls, true);
+    }
+    block->next = nullptr;  // Blocks are handed out fully zeroed
+    return block;
+}
+
+void SecureArena::deallocate(void* ptr, size_t bytes) noexcept {
+    if (!ptr) {
+        return;
+    }
+    if (bytes == 0) {
+        bytes = 1;
+    }
+
+    if (bytes > MAX_SMALL_BLOCK) {
+        deallocate_large(ptr, bytes);
+        return;
+    }
+
+    size_t cls = size_class(bytes);
+    size_t block = MIN_BLOCK << cls;
+    secure_zero(ptr, block);
+    bytes_in_use_.fetch_sub(block, std::memory_order_relaxed);
+
+    FreeBlock* freed = static_cast<FreeBlock*>(ptr);
+    ThreadCache* cache = thread_cache();
+    if (!cache) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        freed->next = free_lists_[cls];
+        free_lists_[cls] = freed;
+        return;
+    }
+    freed->next = cache->lists[cls];
+    cache->lists[cls] = freed;
+    if (++cache->counts[cls] > cache_limit(cls)) {
+        flush(*cache, cls, cache->counts[cls] / 2);
+    }
+}
+
+void* SecureArena::allocate_large(size_t bytes) {
+    size_t size = large_size(bytes);
+    bytes_in_use_.fetch_add(size, std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t cls = large_class(size);
+    if (size <= MAX_CACHED_LARGE && cls < NUM_LARGE_CLASSES && large_free_[cls]) {
+        FreeBlock* region = large_free_[cls];
+        large_free_[cls] = region->next;
+        large_cached_ -= size;
+        region->next = nullptr;
+        return region;
+    }
+    return map_guarded(size);
+}
+
+void SecureArena::deallocate_large(void* ptr, size_t bytes) noexcept {
+    size_t size = large_size(bytes);
+    secure_zero(ptr, size);
+    bytes_in_use_.fetch_sub(size, std::memory_order_relaxed);
+
+    // Keep the mapping, guarded and locked, for the next request its size
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t cls = large_class(size);
+    if (size <= MAX_CACHED_LARGE && cls < NUM_LARGE_CLASSES && large_cached_ + size <= LARGE_CACHE_BYTES) {
+        FreeBlock* region = static_cast<FreeBlock*>(ptr);
+        region->next = large_free_[cls];
+        large_free_[cls] = region;
+        large_cached_ += size;
+        return;
+    }
+    unmap_guarded(ptr, size);
+}
+
+SecureArena::Stats SecureArena::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Stats stats = stats_;
+    stats.allocations = allocations_.load(std::memory_order_relaxed);
+    stats.bytes_in_use = bytes_in_use_.load(std::memory_order_relaxed);
+    return stats;
+}
+
+} // namespace crypto
+} // namespace localpdub
@@ -0,0 +1,336 @@
+#include "localpdub/change_feed.h"
+#include "localpdub/random.h"
+#include <openssl/sha.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <unordered_set>
+
+namespace localpdub {
+namespace storage {
+
+namespace {
+
+using json = crypto::SecureJson;
+
+bool uint_member(const json& object, const char* name, Hlc& out) {
+    auto it = object.find(name);
+    if (it == object.end() || !it->is_number_unsigned()) {
+        return false;
+    }
+    out = it->get<Hlc>();
+    return true;
+}
+
+constexpr size_t TOMBSTONE_RECORD_SIZE = TombstoneSet::KEY_SIZE + 2 * sizeof(Hlc);
+
+bool key_less(const TombstoneSet::Tombstone& tombstone, const TombstoneSet::Key& key) {
+    return tombstone.key < key;
+}
+
+void put_hlc(Hlc value, uint8_t* out) {
+    for (int i = 7; i >= 0; --i) {
+        out[i] = static_cast<uint8_t>(value);
+        value >>= 8;
+    }
+}
+
+Hlc get_hlc(const uint8_t* in) {
+    Hlc value = 0;
+    for (int i = 0; i < 8; ++i) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+int nibble_of(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+} // namespace
+
+TombstoneSet::Key TombstoneSet::key_of(const std::string& entry_id) {
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const unsigned char*>(entry_id.data()), entry_id.size(), digest);
+    Key key;
+    std::copy(digest, digest + KEY_SIZE, key.begin());
+    return key;
+}
+
+bool TombstoneSet::bury(const Key& key, Hlc deleted, Hlc stamp) {
+    auto it = std::lower_bound(tombstones_.begin(), tombstones_.end(), key, key_less);
+    if (it != tombstones_.end() && it->key == key) {
+        if (it->deleted >= deleted) {
+            return false;
+        }
+        it->deleted = deleted;
+        it->stamp = stamp;
+        return true;
+    }
+    tombstones_.insert(it, Tombstone{key, deleted, stamp});
+    return true;
+}
+
+const TombstoneSet::Tombstone* TombstoneSet::find(const Key& key) const {
+    auto it = std::lower_bound(tombstones_.begin(), tombstones_.end(), key, key_less);
+    return it != tombstones_.end() && it->key == key ? &*it : nullptr;
+}
+
+bool TombstoneSet::erase(const Key& key) {
+    auto it = std::lower_bound(tombstones_.begin(), tombstones_.end(), key, key_less);
+    if (it == tombstones_.end() || it->key != key) {
+        return false;
+    }
+    tombstones_.erase(it);
+    return true;
+}
+
+size_t TombstoneSet::collect(Hlc horizon, Hlc expiry) {
+    size_t before = tombstones_.size();
+    tombstones_.erase(std::remove_if(tombstones_.begin(), tombstones_.end(),
+                                     [horizon, expiry](const Tombstone& tombstone) {
+                                         return tombstone.stamp <= horizon || tombstone.deleted <= expiry;
+                                     }),
+                      tombstones_.end());
+    return before - tombstones_.size();
+}
+
+std::vector<TombstoneSet::Tombstone> TombstoneSet::stamped_since(Hlc since) const {
+    std::vector<Tombstone> result;
+    for (const auto& tombstone : tombstones_) {
+        if (tombstone.stamp > since) {
+            result.push_back(tombstone);
+        }
+    }
+    return result;
+}
+
+std::string TombstoneSet::to_hex() const {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    hex.reserve(tombstones_.size() * TOMBSTONE_RECORD_SIZE * 2);
+    uint8_t record[TOMBSTONE_RECORD_SIZE];
+    for (const auto& tombstone : tombstones_) {
+        std::copy(tombstone.key.begin(), tombstone.key.end(), record);
+        put_hlc(tombstone.deleted, record + KEY_SIZE);
+        put_hlc(tombstone.stamp, record + KEY_SIZE + sizeof(Hlc));
+        for (uint8_t byte : record) {
+            hex.push_back(digits[byte >> 4]);
+            hex.push_back(digits[byte & 0x0F]);
+        }
+    }
+    return hex;
+}
+
+bool TombstoneSet::from_hex(const std::string& hex) {
+    tombstones_.clear();
+    if (hex.size() % (TOMBSTONE_RECORD_SIZE * 2) != 0) {
+        return false;
+    }
+    uint8_t record[TOMBSTONE_RECORD_SIZE];
+    for (size_t offset = 0; offset < hex.size(); offset += TOMBSTONE_RECORD_SIZE * 2) {
+        for (size_t i = 0; i < TOMBSTONE_RECORD_SIZE; ++i) {
+            int hi = nibble_of(hex[offset + 2 * i]);
+            int lo = nibble_of(hex[offset + 2 * i + 1]);
+            if (hi < 0 || lo < 0) {
+                tombstones_.clear();
+                return false;
+            }
+            record[i] = static_cast<uint8_t>((hi << 4) | lo);
+        }
+        Key key;
+        std::copy(record, record + KEY_SIZE, key.begin());
+        // Written in order, but a hand-edited file should not break lookups
+        bury(key, get_hlc(record + KEY_SIZE), get_hlc(record + KEY_SIZE + sizeof(Hlc)));
+    }
+    return true;
+}
+
+int64_t entry_modified(const json& entry) {
+    auto it = entry.find("modified_at");
+    if (it != entry.end() && it->is_string()) {
+        std::tm tm = {};
+        if (std::sscanf(it->get_ref<const json::string_t&>().c_str(), "%4d-%2d-%2dT%2d:%2d:%2d",
+                        &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) == 6) {
+            tm.tm_year -= 1900;
+            tm.tm_mon -= 1;
+            return static_cast<int64_t>(timegm(&tm));
+        }
+    }
+    it = entry.find("modified");
+    return it != entry.end() && it->is_number() ? it->get<int64_t>() : 0;
+}
+
+Hlc HybridClock::wall_clock() {
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+    auto millis = std::chrono::duration_cast<std::chrono::milliseconds>(now).count();
+    return static_cast<Hlc>(std::max<int64_t>(millis, 0)) << HLC_COUNTER_BITS;
+}
+
+Hlc HybridClock::tick() {
+    // Past the wall clock only while it lags what we issued or observed;
+    // the counter then carries into the milliseconds if it must
+    last_ = std::max(last_ + 1, wall_clock());
+    return last_;
+}
+
+bool HybridClock::observe(Hlc remote) {
+    if (hlc_millis(remote) > hlc_millis(wall_clock()) + MAX_DRIFT_MS) {
+        return false;
+    }
+    last_ = std::max(last_, remote);
+    return true;
+}
+
+ChangeFeed::ChangeFeed()
+    : id_(crypto::generate_uuid()) {
+}
+
+Hlc ChangeFeed::touch(const std::string& entry_id) {
+    Hlc stamp = clock_.tick();
+    stamps_[entry_id] = stamp;
+    if (!tombstones_.empty()) {
+        tombstones_.erase(TombstoneSet::key_of(entry_id));
+    }
+    return stamp;
+}
+
+Hlc ChangeFeed::bury(const std::string& entry_id) {
+    Hlc stamp = clock_.tick();
+    stamps_.erase(entry_id);
+    tombstones_.bury(TombstoneSet::key_of(entry_id), stamp, stamp);
+    return stamp;
+}
+
+size_t ChangeFeed::collect_tombstones() {
+    // Every peer's watermark says how far our feed was offered to it; a
+    // tombstone stamped at or before the lowest has reached them all
+    Hlc horizon = 0;
+    if (!watermarks_.empty()) {
+        horizon = watermarks_.begin()->second.pushed;
+        for (const auto& [peer, watermark] : watermarks_) {
+            horizon = std::min(horizon, watermark.pushed);
+        }
+    }
+    uint64_t now = hlc_millis(HybridClock::wall_clock());
+    Hlc expiry = now > TOMBSTONE_RETENTION_MS ? (now - TOMBSTONE_RETENTION_MS) << HLC_COUNTER_BITS : 0;
+    return tombstones_.collect(horizon, expiry);
+}
+
+Hlc ChangeFeed::stamp(const std::string& entry_id) const {
+    auto it = stamps_.find(entry_id);
+    return it == stamps_.end() ? 0 : it->second;
+}
+
+void ChangeFeed::refresh(const json& entries) {
+    std::unordered_set<std::string> live;
+    Hlc now = 0;
+    if (entries.is_array()) {
+        for (const auto& entry : entries) {
+            if (!entry.is_object() || !entry.contains("id") || !entry["id"].is_string()) {
+                continue;
+            }
+            std::string id = entry["id"].get_ref<const json::string_t&>().c_str();
+            if (stamps_.find(id) == stamps_.end()) {
+                // One timestamp for everything found unstamped at once
+                if (now == 0) {
+                    now = clock_.tick();
+                }
+                stamps_[id] = now;
+            }
+            live.insert(std::move(id));
+        }
+    }
+    for (auto it = stamps_.begin(); it != stamps_.end();) {
+        it = live.count(it->first) ? std::next(it) : stamps_.erase(it);
+    }
+}
+
+bool ChangeFeed::find_watermark(const std::string& peer, Watermark& watermark) const {
+    auto it = watermarks_.find(peer);
+    if (it == watermarks_.end()) {
+        return false;
+    }
+    watermark = it->second;
+    return true;
+}
+
+void ChangeFeed::set_watermark(const std::string& peer, const Watermark& watermark) {
+    watermarks_[peer] = watermark;
+}
+
+json ChangeFeed::to_json() const {
+    json stamps = json::object();
+    for (const auto& [id, stamp] : stamps_) {
+        stamps[json::string_t(id.data(), id.size())] = stamp;
+    }
+    json peers = json::object();
+    for (const auto& [peer, watermark] : watermarks_) {
+        peers[json::string_t(peer.data(), peer.size())] = {
+            {"feed", watermark.feed},
+            {"pulled", watermark.pulled},
+            {"pushed", watermark.pushed}
+        };
+    }
+    return {
+        {"id", id_},
+        {"clock", clock_.last()},
+        {"stamps", std::move(stamps)},
+        {"peers", std::move(peers)},
+        {"tombstones", tombstones_.to_hex()}
+    };
+}
+
+void ChangeFeed::load(const json& data) {
+    *this = ChangeFeed();
+    Hlc clock = 0;
+    if (!data.is_object() || !data.contains("id") || !data["id"].is_string() ||
+        !uint_member(data, "clock", clock)) {
+        return;
+    }
+    id_ = data["id"].get_ref<const json::string_t&>().c_str();
+
+    auto stamps = data.find("stamps");
+    if (stamps != data.end() && stamps->is_object()) {
+        for (auto it = stamps->begin(); it != stamps->end(); ++it) {
+            if (it.value().is_number_unsigned()) {
+                Hlc stamp = it.value().get<Hlc>();
+                stamps_[it.key().c_str()] = stamp;
+                clock = std::max(clock, stamp);
+            }
+        }
+    }
+    clock_ = HybridClock(clock);
+
+    auto peers = data.find("peers");
+    if (peers != data.end() && peers->is_object()) {
+        for (auto it = peers->begin(); it != peers->end(); ++it) {
+            const json& value = it.value();
+            Watermark watermark;
+            if (!value.is_object() || !value.contains("feed") || !value["feed"].is_string() ||
+                !uint_member(value, "pulled", watermark.pulled) ||
+                !uint_member(value, "pushed", watermark.pushed)) {
+                continue;
+            }
+            watermark.feed = value["feed"].get_ref<const json::string_t&>().c_str();
+            watermarks_[it.key().c_str()] = std::move(watermark);
+        }
+    }
+
+    // Older vaults have none; a malformed set is dropped rather than
+    // failing the load
+    auto tombstones = data.find("tombstones");
+    if (tombstones != data.end() && tombstones->is_string()) {
+        tombstones_.from_hex(tombstones->get_ref<const json::string_t&>().c_str());
+        for (const auto& tombstone : tombstones_.tombstones()) {
+            clock = std::max(clock, tombstone.stamp);
+        }
+        clock_ = HybridClock(clock);
+    }
+}
+
+} // namespace storage
+} // namespace localpdub
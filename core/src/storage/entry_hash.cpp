@@ -0,0 +1,244 @@
+#include "localpdub/entry_hash.h"
+#include <openssl/sha.h>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+namespace localpdub {
+namespace storage {
+
+namespace {
+
+using json = crypto::SecureJson;
+
+enum Tag : uint8_t {
+    TAG_NULL = 0,
+    TAG_FALSE = 1,
+    TAG_TRUE = 2,
+    TAG_UINT = 3,
+    TAG_INT = 4,
+    TAG_FLOAT = 5,
+    TAG_STRING = 6,
+    TAG_ARRAY = 7,
+    TAG_OBJECT = 8,
+    TAG_BINARY = 9
+};
+
+void put_u32(crypto::SecureBytes& out, uint32_t v) {
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        out.push_back(static_cast<uint8_t>(v >> shift));
+    }
+}
+
+void put_u64(crypto::SecureBytes& out, uint64_t v) {
+    for (int shift = 56; shift >= 0; shift -= 8) {
+        out.push_back(static_cast<uint8_t>(v >> shift));
+    }
+}
+
+void put_bytes(crypto::SecureBytes& out, const void* data, size_t len) {
+    put_u32(out, static_cast<uint32_t>(len));
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    out.insert(out.end(), bytes, bytes + len);
+}
+
+int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+} // namespace
+
+void encode_canonical(const json& value, crypto::SecureBytes& out) {
+    switch (value.type()) {
+        case json::value_t::null:
+        case json::value_t::discarded:
+            out.push_back(TAG_NULL);
+            break;
+
+        case json::value_t::boolean:
+            out.push_back(value.get<bool>() ? TAG_TRUE : TAG_FALSE);
+            break;
+
+        case json::value_t::number_unsigned:
+            out.push_back(TAG_UINT);
+            put_u64(out, value.get<uint64_t>());
+            break;
+
+        case json::value_t::number_integer: {
+            int64_t v = value.get<int64_t>();
+            out.push_back(v >= 0 ? TAG_UINT : TAG_INT);
+            put_u64(out, static_cast<uint64_t>(v));
+            break;
+        }
+
+        case json::value_t::number_float: {
+            double d = value.get<double>();
+            uint64_t bits;
+            std::memcpy(&bits, &d, sizeof(bits));
+            out.push_back(TAG_FLOAT);
+            put_u64(out, bits);
+            break;
+        }
+
+        case json::value_t::string: {
+            const auto& s = value.get_ref<const json::string_t&>();
+            out.push_back(TAG_STRING);
+            put_bytes(out, s.data(), s.size());
+            break;
+        }
+
+        case json::value_t::array:
+            out.push_back(TAG_ARRAY);
+            put_u32(out, static_cast<uint32_t>(value.size()));
+            for (const auto& element : value) {
+                encode_canonical(element, out);
+            }
+            break;
+
+        case json::value_t::object: {
+            // Sort explicitly rather than relying on the object container
+            std::vector<json::const_iterator> members;
+            members.reserve(value.size());
+            for (auto it = value.begin(); it != value.end(); ++it) {
+                members.push_back(it);
+            }
+            std::sort(members.begin(), members.end(), [](const auto& a, const auto& b) {
+                return a.key() < b.key();
+            });
+
+            out.push_back(TAG_OBJECT);
+            put_u32(out, static_cast<uint32_t>(members.size()));
+            for (const auto& it : members) {
+                put_bytes(out, it.key().data(), it.key().size());
+                encode_canonical(it.value(), out);
+            }
+            break;
+        }
+
+        case json::value_t::binary: {
+            const auto& bin = value.get_binary();
+            out.push_back(TAG_BINARY);
+            put_bytes(out, bin.data(), bin.size());
+            break;
+        }
+    }
+}
+
+EntryHash hash_entry(const json& entry) {
+    crypto::SecureBytes encoded;
+    encode_canonical(entry, encoded);
+    EntryHash hash;
+    SHA256(encoded.data(), encoded.size(), hash.data());
+    return hash;
+}
+
+std::string hash_to_hex(const EntryHash& hash) {
+    static const char hex[] = "0123456789abcdef";
+    std::string out(hash.size() * 2, '0');
+    for (size_t i = 0; i < hash.size(); ++i) {
+        out[2 * i] = hex[hash[i] >> 4];
+        out[2 * i + 1] = hex[hash[i] & 0x0F];
+    }
+    return out;
+}
+
+std::string EntryHashCache::entry_stamp(const json& entry) {
+    std::string stamp;
+    auto it = entry.find("modified_at");
+    if (it != entry.end() && it->is_string()) {
+        stamp = it->get_ref<const json::string_t&>().c_str();
+    }
+    it = entry.find("modified");
+    if (it != entry.end() && it->is_number()) {
+        stamp += '|';
+        stamp += it->dump().c_str();
+    }
+    return stamp;
+}
+
+const EntryHash& EntryHashCache::hash(const json& entry) {
+    std::string id = entry.at("id").get_ref<const json::string_t&>().c_str();
+    std::string stamp = entry_stamp(entry);
+
+    auto it = records_.find(id);
+    if (it != records_.end() && it->second.stamp == stamp) {
+        ++hits_;
+        return it->second.hash;
+    }
+
+    ++misses_;
+    scratch_.clear();
+    encode_canonical(entry, scratch_);
+    Record& record = records_[id];
+    SHA256(scratch_.data(), scratch_.size(), record.hash.data());
+    record.stamp = std::move(stamp);
+    crypto::secure_zero(scratch_.data(), scratch_.size());
+    return record.hash;
+}
+
+void EntryHashCache::invalidate(const std::string& id) {
+    records_.erase(id);
+}
+
+void EntryHashCache::clear() {
+    records_.clear();
+}
+
+void EntryHashCache::refresh(const json& entries) {
+    std::unordered_map<std::string, Record> live;
+    if (entries.is_array()) {
+        for (const auto& entry : entries) {
+            if (!entry.is_object() || !entry.contains("id") || !entry["id"].is_string()) {
+                continue;
+            }
+            hash(entry);
+            live.insert(records_.extract(entry["id"].get_ref<const json::string_t&>().c_str()));
+        }
+    }
+    records_ = std::move(live);
+}
+
+json EntryHashCache::to_json() const {
+    json data = json::object();
+    for (const auto& [id, record] : records_) {
+        data[json::string_t(id.data(), id.size())] = json::array({hash_to_hex(record.hash), record.stamp});
+    }
+    return data;
+}
+
+void EntryHashCache::load(const json& data) {
+    records_.clear();
+    if (!data.is_object()) {
+        return;
+    }
+
+    for (auto it = data.begin(); it != data.end(); ++it) {
+        const auto& value = it.value();
+        if (!value.is_array() || value.size() != 2 || !value[0].is_string() || !value[1].is_string()) {
+            continue;
+        }
+        const auto& hex = value[0].get_ref<const json::string_t&>();
+        if (hex.size() != 64) {
+            continue;
+        }
+
+        Record record;
+        bool valid = true;
+        for (size_t i = 0; i < record.hash.size() && valid; ++i) {
+            int hi = hex_value(hex[2 * i]);
+            int lo = hex_value(hex[2 * i + 1]);
+            valid = hi >= 0 && lo >= 0;
+            record.hash[i] = static_cast<uint8_t>((hi << 4) | lo);
+        }
+        if (!valid) {
+            continue;
+        }
+        record.stamp = value[1].get_ref<const json::string_t&>().c_str();
+        records_[it.key().c_str()] = std::move(record);
+    }
+}
+
+} // namespace storage
+} // namespace localpdub
@@ -1,4 +1,7 @@
 #include "localpdub/crypto.h"
+#include "localpdub/random.h"
+#include "localpdub/entry_hash.h"
+#include "localpdub/change_feed.h"
 #include <nlohmann/json.hpp>
 #include <fstream>
 #include <filesystem>
@@ -6,31 +9,73 @@
 #include <cstring>
 #include <chrono>
 #include <iomanip>
+#include <array>
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace localpdub {
 namespace storage {
 
-using json = nlohmann::json;
+// Decrypted vault data lives entirely in the secure arena
+using json = crypto::SecureJson;
 namespace fs = std::filesystem;
 
 // File format constants
 constexpr char MAGIC_BYTES[4] = {'L', 'P', 'D', 'V'};
-constexpr uint16_t FILE_VERSION = 1;
+constexpr uint16_t FILE_VERSION = 2;
+constexpr uint16_t FILE_VERSION_LEGACY = 1;  // Salt + password-derived data key
 constexpr size_t SALT_SIZE = 32;
 
+// Vault JSON key for the persisted EntryHashCache; held outside vault_data
+// while the vault is open
+constexpr char ENTRY_HASHES_KEY[] = "entry_hashes";
+
+// Vault JSON key for the persisted ChangeFeed, held outside vault_data the
+// same way
+constexpr char CHANGE_FEED_KEY[] = "change_feed";
+
+// Header flags: bits 0-3 hold the crypto::Cipher of the vault data and key slots
+constexpr uint16_t FLAG_CIPHER_MASK = 0x000F;
+
 struct FileHeader {
     char magic[4];
     uint16_t version;
     uint16_t flags;
-    uint32_t header_size;
+    uint32_t header_size;  // Offset of the encrypted data
     uint32_t data_size;
 };
 
+// Key slots (version 2). The vault data is encrypted with a random data key;
+// each slot holds that key wrapped by an Argon2id key derived from one
+// password. Changing a password rewrites a single slot in place.
+constexpr size_t KEY_SLOT_COUNT = 4;
+constexpr uint8_t KEY_SLOT_EMPTY = 0;
+constexpr uint8_t KEY_SLOT_PASSWORD = 1;
+
+struct KeySlot {
+    uint8_t type;
+    uint8_t reserved[3];
+    uint32_t time_cost;
+    uint32_t memory_kib;
+    uint32_t parallelism;
+    uint8_t salt[SALT_SIZE];
+    uint8_t wrapped_key[crypto::WRAPPED_KEY_SIZE];  // Nonce || key || tag
+    uint8_t padding[20];
+};
+
+static_assert(sizeof(KeySlot) == 128, "key slot layout changed");
+
+using KeySlotTable = std::array<KeySlot, KEY_SLOT_COUNT>;
+
 class VaultStorage {
 private:
     fs::path vault_path;
-    std::vector<uint8_t> master_key;
+    crypto::SecureBytes data_key;  // Random key the vault data is encrypted with
+    KeySlotTable key_slots{};
     json vault_data;
+    EntryHashCache entry_hashes;  // Content hashes for sync digests
+    ChangeFeed change_feed;       // When entries changed, for incremental sync
+    crypto::Cipher cipher = crypto::Cipher::AES_256_GCM;
     bool is_open = false;
 
 public:
@@ -44,7 +89,7 @@ public:
         }
     }
 
-    bool create_vault(const std::string& password) {
+    bool create_vault(const crypto::SecureString& password) {
         // Initialize empty vault
         vault_data = {
             {"metadata", {
@@ -56,56 +101,64 @@ public:
             {"entries", json::array()},
             {"categories", json::array()}
         };
+        entry_hashes.clear();
+        change_feed = ChangeFeed();
 
-        // Generate salt and derive key
-        auto salt = crypto::generate_salt();
-        master_key = crypto::derive_key_from_password(password, salt);
-
-        // Save vault
-        return save_vault(salt);
-    }
+        // Pick the fastest cipher for this CPU; readers take it from the header
+        cipher = crypto::preferred_cipher();
 
-    bool open_vault(const std::string& password) {
-        if (!fs::exists(vault_path)) {
-            return false;
-        }
+        // Random data key, wrapped by the password in slot 0
+        data_key = crypto::generate_key();
+        key_slots = KeySlotTable{};
+        seal_slot(key_slots[0], password);
 
-        std::ifstream file(vault_path, std::ios::binary);
-        if (!file.is_open()) {
+        // Save vault
+        is_open = true;
+        if (!write_vault()) {
+            close_vault();
             return false;
         }
+        return true;
+    }
 
-        // Read header
+    bool open_vault(const crypto::SecureString& password) {
         FileHeader header;
-        file.read(reinterpret_cast<char*>(&header), sizeof(FileHeader));
-
-        // Validate magic bytes
-        if (std::memcmp(header.magic, MAGIC_BYTES, 4) != 0) {
+        KeySlotTable slots{};
+        std::vector<uint8_t> legacy_salt;
+        std::vector<uint8_t> encrypted;
+        crypto::Cipher file_cipher;
+        if (!read_vault_file(header, slots, legacy_salt, encrypted, file_cipher)) {
             return false;
         }
 
-        // Read salt
-        std::vector<uint8_t> salt(SALT_SIZE);
-        file.read(reinterpret_cast<char*>(salt.data()), SALT_SIZE);
-
-        // Derive key from password
-        master_key = crypto::derive_key_from_password(password, salt);
-
-        // Read encrypted data
-        std::vector<uint8_t> encrypted(header.data_size);
-        file.read(reinterpret_cast<char*>(encrypted.data()), header.data_size);
-
         try {
+            crypto::SecureBytes kek;
+            if (header.version == FILE_VERSION_LEGACY) {
+                // Version 1 encrypted the data with the password key itself
+                kek = crypto::derive_key_from_password(password, legacy_salt);
+                data_key = kek;
+            } else if (!unlock_slot(slots, password, file_cipher, data_key)) {
+                return false;
+            }
+
             // Decrypt
-            std::string decrypted = crypto::decrypt_data(encrypted, master_key);
+            crypto::SecureString decrypted = crypto::decrypt_data(encrypted, data_key, file_cipher);
 
             // Parse JSON
             vault_data = json::parse(decrypted);
+            take_entry_hashes();
+            take_change_feed();
+            cipher = file_cipher;
+            key_slots = slots;
             is_open = true;
+
+            if (header.version == FILE_VERSION_LEGACY) {
+                upgrade_legacy_vault(kek, legacy_salt);
+            }
             return true;
         } catch (const std::exception& e) {
             // Wrong password or corrupted data
-            crypto::secure_clear(master_key);
+            crypto::secure_clear(data_key);
             return false;
         }
     }
@@ -114,23 +167,86 @@ public:
         if (!is_open) {
             return false;
         }
+        return write_vault();
+    }
 
-        // Read existing salt from file
-        std::vector<uint8_t> salt(SALT_SIZE);
-        if (fs::exists(vault_path)) {
-            std::ifstream file(vault_path, std::ios::binary);
-            file.seekg(sizeof(FileHeader));
-            file.read(reinterpret_cast<char*>(salt.data()), SALT_SIZE);
-        } else {
-            salt = crypto::generate_salt();
+    // Replace the password that unlocks current_password's slot. Only the
+    // key slot table is rewritten: the new slot is written and synced before
+    // the old one is cleared, so a crash leaves at least one working slot.
+    bool change_password(const crypto::SecureString& current_password,
+                         const crypto::SecureString& new_password) {
+        if (!is_open) {
+            return false;
+        }
+
+        size_t old_index = find_slot(current_password);
+        if (old_index == KEY_SLOT_COUNT) {
+            return false;
+        }
+
+        // Prefer a free slot so the old one stays valid until the new one is on disk
+        size_t new_index = free_slot();
+        if (new_index == KEY_SLOT_COUNT) {
+            new_index = old_index;
+        }
+
+        KeySlot slot{};
+        seal_slot(slot, new_password);
+        if (!write_slot(new_index, slot)) {
+            return false;
+        }
+        key_slots[new_index] = slot;
+
+        if (new_index != old_index) {
+            key_slots[old_index] = KeySlot{};
+            if (!write_slot(old_index, key_slots[old_index])) {
+                return false;
+            }
+        }
+
+        // The backup still carries the old slot table and would open with
+        // the old password
+        std::error_code ec;
+        fs::remove(vault_path.string() + ".bak", ec);
+        return true;
+    }
+
+    // Add another password that unlocks the vault. Fails when all slots are taken.
+    bool add_password(const crypto::SecureString& password) {
+        if (!is_open) {
+            return false;
+        }
+
+        size_t index = free_slot();
+        if (index == KEY_SLOT_COUNT) {
+            return false;
         }
 
-        return save_vault(salt);
+        KeySlot slot{};
+        seal_slot(slot, password);
+        if (!write_slot(index, slot)) {
+            return false;
+        }
+        key_slots[index] = slot;
+        return true;
+    }
+
+    size_t key_slot_count() const {
+        size_t used = 0;
+        for (const auto& slot : key_slots) {
+            if (slot.type != KEY_SLOT_EMPTY) {
+                ++used;
+            }
+        }
+        return used;
     }
 
     void close_vault() {
-        crypto::secure_clear(master_key);
+        crypto::secure_clear(data_key);
+        key_slots = KeySlotTable{};
         vault_data.clear();
+        entry_hashes.clear();
+        change_feed = ChangeFeed();
         is_open = false;
     }
 
@@ -141,13 +257,14 @@ public:
         }
 
         // Generate UUID
-        std::string id = generate_uuid();
+        std::string id = crypto::generate_uuid();
         json new_entry = entry;
         new_entry["id"] = id;
         new_entry["created_at"] = get_timestamp();
         new_entry["modified_at"] = get_timestamp();
 
         vault_data["entries"].push_back(new_entry);
+        change_feed.touch(id);
         vault_data["metadata"]["entry_count"] = vault_data["entries"].size();
         vault_data["metadata"]["modified_at"] = get_timestamp();
 
@@ -167,6 +284,8 @@ public:
                 updated["created_at"] = e["created_at"];
                 updated["modified_at"] = get_timestamp();
                 e = updated;
+                entry_hashes.invalidate(id);
+                change_feed.touch(id);
                 vault_data["metadata"]["modified_at"] = get_timestamp();
                 return true;
             }
@@ -183,6 +302,8 @@ public:
         for (auto it = entries.begin(); it != entries.end(); ++it) {
             if ((*it)["id"] == id) {
                 entries.erase(it);
+                entry_hashes.invalidate(id);
+                change_feed.bury(id);
                 vault_data["metadata"]["entry_count"] = entries.size();
                 vault_data["metadata"]["modified_at"] = get_timestamp();
                 return true;
@@ -217,12 +338,12 @@ public:
         }
 
         json results = json::array();
-        std::string lower_query = to_lower(query);
+        crypto::SecureString lower_query = to_lower(crypto::SecureString(query));
 
         for (const auto& entry : vault_data["entries"]) {
-            std::string title = entry.value("title", "");
-            std::string username = entry.value("username", "");
-            std::string url = entry.value("url", "");
+            crypto::SecureString title = entry.value("title", "");
+            crypto::SecureString username = entry.value("username", "");
+            crypto::SecureString url = entry.value("url", "");
 
             if (to_lower(title).find(lower_query) != std::string::npos ||
                 to_lower(username).find(lower_query) != std::string::npos ||
@@ -246,16 +367,62 @@ public:
         return vault_path.string();
     }
 
+    crypto::Cipher get_cipher() const {
+        return cipher;
+    }
+
     bool set_all_entries(const json& new_entries) {
         if (!is_open) {
             return false;
         }
 
+        // Stamp the entries that differ, so the change feed stays right
+        // for callers that do not pass one along with the entries
+        if (new_entries.is_array()) {
+            std::unordered_map<std::string, const json*> old_entries;
+            for (const auto& entry : vault_data["entries"]) {
+                if (entry.is_object() && entry.contains("id") && entry["id"].is_string()) {
+                    old_entries.emplace(entry["id"].get_ref<const json::string_t&>().c_str(), &entry);
+                }
+            }
+            for (const auto& entry : new_entries) {
+                if (!entry.is_object() || !entry.contains("id") || !entry["id"].is_string()) {
+                    continue;
+                }
+                std::string id = entry["id"].get_ref<const json::string_t&>().c_str();
+                auto it = old_entries.find(id);
+                if (it == old_entries.end() || *it->second != entry) {
+                    change_feed.touch(id);
+                }
+            }
+        }
+
         // Replace all entries with the new set
         vault_data["entries"] = new_entries;
+        entry_hashes.clear();
         return true;
     }
 
+    // Hashes matching the current entries, e.g. kept up to date by a
+    // SyncManager that produced the entries passed to set_all_entries()
+    const EntryHashCache& get_entry_hashes() const {
+        return entry_hashes;
+    }
+
+    void set_entry_hashes(const EntryHashCache& hashes) {
+        entry_hashes = hashes;
+    }
+
+    // Change stamps and sync watermarks, e.g. from the SyncManager that
+    // produced the entries passed to set_all_entries()
+    const ChangeFeed& get_change_feed() const {
+        return change_feed;
+    }
+
+    void set_change_feed(const ChangeFeed& feed) {
+        change_feed = feed;
+    }
+
     bool reload_entries() {
         if (!is_open) {
             return false;
@@ -263,32 +430,27 @@ public:
 
         // Re-read vault file to get synced changes
         try {
-            std::ifstream file(vault_path, std::ios::binary);
-            if (!file) {
-                return false;
-            }
-
-            // Read header
             FileHeader header;
-            file.read(reinterpret_cast<char*>(&header), sizeof(FileHeader));
-
-            // Validate magic bytes
-            if (std::memcmp(header.magic, MAGIC_BYTES, 4) != 0) {
+            KeySlotTable slots{};
+            std::vector<uint8_t> legacy_salt;
+            std::vector<uint8_t> encrypted;
+            crypto::Cipher file_cipher;
+            if (!read_vault_file(header, slots, legacy_salt, encrypted, file_cipher)) {
                 std::cerr << "Invalid vault file format" << std::endl;
                 return false;
             }
+            if (header.version != FILE_VERSION) {
+                std::cerr << "Unsupported vault version" << std::endl;
+                return false;
+            }
 
-            // Skip salt (we already have the master key)
-            file.seekg(SALT_SIZE, std::ios::cur);
-
-            // Read encrypted data
-            std::vector<uint8_t> encrypted(header.data_size);
-            file.read(reinterpret_cast<char*>(encrypted.data()), header.data_size);
-            file.close();
-
-            // Decrypt with current key
-            std::string decrypted = crypto::decrypt_data(encrypted, master_key);
+            // Decrypt with current data key
+            crypto::SecureString decrypted = crypto::decrypt_data(encrypted, data_key, file_cipher);
             vault_data = json::parse(decrypted);
+            take_entry_hashes();
+            take_change_feed();
+            cipher = file_cipher;
+            key_slots = slots;
 
             return true;
         } catch (const std::exception& e) {
@@ -298,15 +460,25 @@ public:
     }
 
 private:
-    bool save_vault(const std::vector<uint8_t>& salt) {
+    bool write_vault() {
         // Update modified time
         vault_data["metadata"]["modified_at"] = get_timestamp();
 
+        // Persist hashes for every entry; only entries changed since the
+        // last write are hashed again
+        entry_hashes.refresh(vault_data["entries"]);
+        vault_data[ENTRY_HASHES_KEY] = entry_hashes.to_json();
+        change_feed.refresh(vault_data["entries"]);
+        change_feed.collect_tombstones();
+        vault_data[CHANGE_FEED_KEY] = change_feed.to_json();
+
         // Serialize to JSON
-        std::string json_str = vault_data.dump(2);
+        crypto::SecureString json_str = vault_data.dump(2);
+        vault_data.erase(ENTRY_HASHES_KEY);
+        vault_data.erase(CHANGE_FEED_KEY);
 
         // Encrypt
-        auto encrypted = crypto::encrypt_data(json_str, master_key);
+        auto encrypted = crypto::encrypt_data(json_str, data_key, cipher);
 
         // Create directory if needed
         fs::create_directories(vault_path.parent_path());
@@ -328,14 +500,14 @@ private:
         FileHeader header;
         std::memcpy(header.magic, MAGIC_BYTES, 4);
         header.version = FILE_VERSION;
-        header.flags = 0;
-        header.header_size = sizeof(FileHeader);
+        header.flags = static_cast<uint16_t>(cipher) & FLAG_CIPHER_MASK;
+        header.header_size = sizeof(FileHeader) + sizeof(KeySlotTable);
         header.data_size = encrypted.size();
 
         file.write(reinterpret_cast<const char*>(&header), sizeof(FileHeader));
 
-        // Write salt
-        file.write(reinterpret_cast<const char*>(salt.data()), salt.size());
+        // Write key slots
+        file.write(reinterpret_cast<const char*>(key_slots.data()), sizeof(KeySlotTable));
 
         // Write encrypted data
         file.write(reinterpret_cast<const char*>(encrypted.data()), encrypted.size());
@@ -348,23 +520,191 @@ private:
         return true;
     }
 
-    std::string generate_uuid() const {
-        // Simple UUID v4 generation
-        std::random_device rd;
-        std::mt19937 gen(rd());
-        std::uniform_int_distribution<> dis(0, 15);
+    // Read header, key slots (or the version 1 salt) and encrypted data
+    bool read_vault_file(FileHeader& header, KeySlotTable& slots,
+                         std::vector<uint8_t>& legacy_salt,
+                         std::vector<uint8_t>& encrypted,
+                         crypto::Cipher& file_cipher) const {
+        if (!fs::exists(vault_path)) {
+            return false;
+        }
 
-        std::stringstream ss;
-        for (int i = 0; i < 36; i++) {
-            if (i == 8 || i == 13 || i == 18 || i == 23) {
-                ss << "-";
-            } else if (i == 14) {
-                ss << "4";  // Version 4
-            } else {
-                ss << std::hex << dis(gen);
+        std::ifstream file(vault_path, std::ios::binary);
+        if (!file.is_open()) {
+            return false;
+        }
+
+        // Read header
+        file.read(reinterpret_cast<char*>(&header), sizeof(FileHeader));
+
+        // Validate magic bytes
+        if (!file || std::memcmp(header.magic, MAGIC_BYTES, 4) != 0) {
+            return false;
+        }
+
+        if (!cipher_from_flags(header.flags, file_cipher)) {
+            return false;
+        }
+
+        if (header.version == FILE_VERSION_LEGACY) {
+            legacy_salt.resize(SALT_SIZE);
+            file.read(reinterpret_cast<char*>(legacy_salt.data()), SALT_SIZE);
+        } else if (header.version == FILE_VERSION) {
+            if (header.header_size < sizeof(FileHeader) + sizeof(KeySlotTable)) {
+                return false;
             }
+            file.read(reinterpret_cast<char*>(slots.data()), sizeof(KeySlotTable));
+            file.seekg(header.header_size);
+        } else {
+            return false;
+        }
+
+        // Read encrypted data
+        encrypted.resize(header.data_size);
+        file.read(reinterpret_cast<char*>(encrypted.data()), header.data_size);
+        return static_cast<bool>(file);
+    }
+
+    // Wrap data_key under a fresh key derived from password
+    void seal_slot(KeySlot& slot, const crypto::SecureString& password) const {
+        auto salt = crypto::generate_salt();
+        auto params = crypto::default_kdf_params();
+        auto kek = crypto::derive_key_from_password(password, salt, params);
+        fill_slot(slot, kek, salt, params);
+    }
+
+    void fill_slot(KeySlot& slot, const crypto::SecureBytes& kek,
+                   const std::vector<uint8_t>& salt,
+                   const crypto::KdfParams& params) const {
+        auto wrapped = crypto::wrap_key(data_key, kek, cipher);
+
+        slot = KeySlot{};
+        slot.type = KEY_SLOT_PASSWORD;
+        slot.time_cost = params.time_cost;
+        slot.memory_kib = params.memory_kib;
+        slot.parallelism = params.parallelism;
+        std::memcpy(slot.salt, salt.data(), SALT_SIZE);
+        std::memcpy(slot.wrapped_key, wrapped.data(), crypto::WRAPPED_KEY_SIZE);
+    }
+
+    // Unwrap the data key from a single slot. Throws on a wrong password.
+    static crypto::SecureBytes open_slot(const KeySlot& slot,
+                                         const crypto::SecureString& password,
+                                         crypto::Cipher slot_cipher) {
+        std::vector<uint8_t> salt(slot.salt, slot.salt + SALT_SIZE);
+        crypto::KdfParams params{slot.time_cost, slot.memory_kib, slot.parallelism};
+        // A damaged or hostile slot must not make us spend hours or gigabytes
+        if (!crypto::kdf_params_in_range(params)) {
+            throw std::runtime_error("Key slot KDF parameters out of range");
+        }
+        auto kek = crypto::derive_key_from_password(password, salt, params);
+        std::vector<uint8_t> wrapped(slot.wrapped_key,
+                                     slot.wrapped_key + crypto::WRAPPED_KEY_SIZE);
+        return crypto::unwrap_key(wrapped, kek, slot_cipher);
+    }
+
+    // Try password against every used slot; on success sets key
+    static bool unlock_slot(const KeySlotTable& slots, const crypto::SecureString& password,
+                            crypto::Cipher slot_cipher, crypto::SecureBytes& key) {
+        for (const auto& slot : slots) {
+            if (slot.type != KEY_SLOT_PASSWORD) {
+                continue;
+            }
+            try {
+                key = open_slot(slot, password, slot_cipher);
+                return true;
+            } catch (const std::exception&) {
+                // Not this slot
+            }
+        }
+        return false;
+    }
+
+    // Index of the slot password unlocks, or KEY_SLOT_COUNT
+    size_t find_slot(const crypto::SecureString& password) const {
+        for (size_t i = 0; i < KEY_SLOT_COUNT; ++i) {
+            if (key_slots[i].type != KEY_SLOT_PASSWORD) {
+                continue;
+            }
+            try {
+                if (open_slot(key_slots[i], password, cipher) == data_key) {
+                    return i;
+                }
+            } catch (const std::exception&) {
+                // Not this slot
+            }
+        }
+        return KEY_SLOT_COUNT;
+    }
+
+    size_t free_slot() const {
+        for (size_t i = 0; i < KEY_SLOT_COUNT; ++i) {
+            if (key_slots[i].type == KEY_SLOT_EMPTY) {
+                return i;
+            }
+        }
+        return KEY_SLOT_COUNT;
+    }
+
+    // Overwrite one slot of the on-disk table and fsync
+    bool write_slot(size_t index, const KeySlot& slot) const {
+        int fd = ::open(vault_path.c_str(), O_WRONLY);
+        if (fd < 0) {
+            return false;
+        }
+        off_t offset = sizeof(FileHeader) + index * sizeof(KeySlot);
+        bool ok = ::pwrite(fd, &slot, sizeof(KeySlot), offset) == static_cast<ssize_t>(sizeof(KeySlot)) &&
+                  ::fsync(fd) == 0;
+        ::close(fd);
+        return ok;
+    }
+
+    // Version 1 vaults used the password key as the data key. Move the data
+    // to a random data key wrapped in slot 0, reusing the derived key so the
+    // password is not hashed twice. The version 1 file is kept as the backup.
+    void upgrade_legacy_vault(const crypto::SecureBytes& kek,
+                              const std::vector<uint8_t>& salt) {
+        data_key = crypto::generate_key();
+        key_slots = KeySlotTable{};
+        fill_slot(key_slots[0], kek, salt, crypto::default_kdf_params());
+        if (!write_vault()) {
+            std::cerr << "Failed to upgrade vault to key slot format" << std::endl;
+        }
+    }
+
+    void take_entry_hashes() {
+        auto it = vault_data.find(ENTRY_HASHES_KEY);
+        if (it == vault_data.end()) {
+            entry_hashes.clear();
+            return;
+        }
+        entry_hashes.load(*it);
+        vault_data.erase(it);
+    }
+
+    // Vaults written before the change feed get a new one; write_vault()
+    // stamps their entries
+    void take_change_feed() {
+        auto it = vault_data.find(CHANGE_FEED_KEY);
+        if (it == vault_data.end()) {
+            change_feed = ChangeFeed();
+            return;
+        }
+        change_feed.load(*it);
+        vault_data.erase(it);
+    }
+
+    static bool cipher_from_flags(uint16_t flags, crypto::Cipher& out) {
+        switch (flags & FLAG_CIPHER_MASK) {
+            case static_cast<uint16_t>(crypto::Cipher::AES_256_GCM):
+                out = crypto::Cipher::AES_256_GCM;
+                return true;
+            case static_cast<uint16_t>(crypto::Cipher::CHACHA20_POLY1305):
+                out = crypto::Cipher::CHACHA20_POLY1305;
+                return true;
+            default:
+                return false;
         }
-        return ss.str();
     }
 
     std::string get_timestamp() const {
@@ -375,8 +715,8 @@ private:
         return ss.str();
     }
 
-    std::string to_lower(const std::string& str) const {
-        std::string result = str;
+    crypto::SecureString to_lower(const crypto::SecureString& str) const {
+        crypto::SecureString result = str;
         std::transform(result.begin(), result.end(), result.begin(), ::tolower);
         return result;
     }
@@ -0,0 +1,177 @@
+#include "sync/compression.h"
+#include <zlib.h>
+#include <sys/uio.h>
+#include <stdexcept>
+
+namespace localpdub {
+namespace sync {
+
+namespace {
+
+constexpr size_t OUTPUT_BUFFER_SIZE = 64 * 1024;
+constexpr int DEFLATE_LEVEL = 1;  // Entries are small JSON; speed over ratio
+
+// zlib allocations go to the secure arena. zfree gets no size, so keep it
+// in a 16-byte header in front of the block.
+constexpr size_t ALLOC_HEADER = 16;
+
+voidpf secure_zalloc(voidpf, uInt items, uInt size) {
+    size_t bytes = static_cast<size_t>(items) * size + ALLOC_HEADER;
+    auto* block = static_cast<uint8_t*>(crypto::SecureArena::instance().allocate(bytes));
+    *reinterpret_cast<size_t*>(block) = bytes;
+    return block + ALLOC_HEADER;
+}
+
+void secure_zfree(voidpf, voidpf address) {
+    if (address == nullptr) {
+        return;
+    }
+    uint8_t* block = static_cast<uint8_t*>(address) - ALLOC_HEADER;
+    crypto::SecureArena::instance().deallocate(block, *reinterpret_cast<size_t*>(block));
+}
+
+std::unique_ptr<z_stream_s> make_stream() {
+    auto stream = std::make_unique<z_stream_s>();
+    stream->zalloc = secure_zalloc;
+    stream->zfree = secure_zfree;
+    stream->opaque = nullptr;
+    return stream;
+}
+
+} // namespace
+
+const char* compression_name(Compression compression) {
+    switch (compression) {
+        case Compression::DEFLATE:
+            return "deflate";
+        case Compression::NONE:
+        default:
+            return "none";
+    }
+}
+
+bool parse_compression(const std::string& name, Compression& out) {
+    if (name == "deflate") {
+        out = Compression::DEFLATE;
+        return true;
+    }
+    if (name == "none") {
+        out = Compression::NONE;
+        return true;
+    }
+    return false;
+}
+
+std::vector<Compression> supported_compressions() {
+    return {Compression::DEFLATE};
+}
+
+Deflater::Deflater()
+    : stream_(make_stream())
+    , out_(OUTPUT_BUFFER_SIZE) {
+    if (deflateInit(stream_.get(), DEFLATE_LEVEL) != Z_OK) {
+        throw std::runtime_error("Failed to initialize deflate");
+    }
+}
+
+Deflater::~Deflater() {
+    deflateEnd(stream_.get());
+}
+
+bool Deflater::compress(const uint8_t* data, size_t len, size_t chunk_size, const Emit& emit) {
+    struct iovec piece = {const_cast<uint8_t*>(data), len};
+    return compress(&piece, 1, chunk_size, emit);
+}
+
+bool Deflater::compress(const struct iovec* pieces, size_t count, size_t chunk_size, const Emit& emit) {
+    z_stream_s& z = *stream_;
+    size_t capacity = std::min(chunk_size, out_.size());
+    z.avail_in = 0;
+    z.next_out = out_.data();
+    z.avail_out = static_cast<uInt>(capacity);
+
+    // Pieces go in one after another; avail_in is 32-bit, so very large
+    // ones in slices
+    size_t remaining = 0;
+    for (size_t i = 0; i < count; ++i) {
+        remaining += pieces[i].iov_len;
+    }
+    size_t piece = 0;
+    size_t offset = 0;
+    bool done = false;
+    while (!done) {
+        while (z.avail_in == 0 && remaining > 0) {
+            size_t slice = std::min<size_t>(pieces[piece].iov_len - offset, 1u << 30);
+            z.next_in = static_cast<Bytef*>(pieces[piece].iov_base) + offset;
+            z.avail_in = static_cast<uInt>(slice);
+            remaining -= slice;
+            offset += slice;
+            if (offset == pieces[piece].iov_len) {
+                ++piece;
+                offset = 0;
+            }
+        }
+
+        int flush = remaining > 0 ? Z_NO_FLUSH : Z_SYNC_FLUSH;
+        int rc = deflate(&z, flush);
+        if (rc != Z_OK && rc != Z_BUF_ERROR) {
+            throw std::runtime_error("Deflate failed");
+        }
+
+        // The flush is complete once all input is consumed and deflate
+        // stopped with output space to spare. Until then a chunk goes out
+        // only when full, however the input was split.
+        done = remaining == 0 && z.avail_in == 0 && z.avail_out > 0;
+        if (z.avail_out == 0 || done) {
+            if (!emit(out_.data(), capacity - z.avail_out, done)) {
+                return false;
+            }
+            z.next_out = out_.data();
+            z.avail_out = static_cast<uInt>(capacity);
+        }
+    }
+
+    crypto::secure_zero(out_.data(), out_.size());
+    return true;
+}
+
+Inflater::Inflater()
+    : stream_(make_stream())
+    , out_(OUTPUT_BUFFER_SIZE) {
+    if (inflateInit(stream_.get()) != Z_OK) {
+        throw std::runtime_error("Failed to initialize inflate");
+    }
+}
+
+Inflater::~Inflater() {
+    inflateEnd(stream_.get());
+}
+
+void Inflater::decompress(const uint8_t* data, size_t len, crypto::SecureString& out) {
+    z_stream_s& z = *stream_;
+    z.next_in = const_cast<Bytef*>(data);
+    z.avail_in = static_cast<uInt>(len);  // Frame payloads are at most 1 MB
+
+    while (true) {
+        z.next_out = out_.data();
+        z.avail_out = static_cast<uInt>(out_.size());
+        int rc = inflate(&z, Z_SYNC_FLUSH);
+        if (rc != Z_OK && rc != Z_BUF_ERROR) {
+            throw std::runtime_error("Corrupt compressed frame");
+        }
+
+        size_t produced = out_.size() - z.avail_out;
+        out.append(reinterpret_cast<const char*>(out_.data()), produced);
+        if (z.avail_in == 0 && z.avail_out > 0) {
+            break;
+        }
+        if (rc == Z_BUF_ERROR && produced == 0) {
+            throw std::runtime_error("Corrupt compressed frame");
+        }
+    }
+
+    crypto::secure_zero(out_.data(), out_.size());
+}
+
+} // namespace sync
+} // namespace localpdub
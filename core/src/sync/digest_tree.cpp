@@ -0,0 +1,230 @@
+#include "sync/digest_tree.h"
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#include <algorithm>
+#include <stdexcept>
+
+namespace localpdub {
+namespace sync {
+
+namespace {
+
+const char HEX_DIGITS[] = "0123456789abcdef";
+
+int nibble_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+uint8_t key_nibble(const DigestTree::Hash& key, size_t depth) {
+    uint8_t byte = key[depth / 2];
+    return (depth % 2 == 0) ? (byte >> 4) : (byte & 0x0F);
+}
+
+// Compare the first path.size() nibbles of key with path
+int compare_prefix(const DigestTree::Hash& key, const std::string& path) {
+    for (size_t i = 0; i < path.size(); ++i) {
+        int a = key_nibble(key, i);
+        int b = nibble_value(path[i]);
+        if (a != b) {
+            return a < b ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+// Incremental SHA-256 over the EVP interface
+class Sha256 {
+public:
+    Sha256() : ctx_(EVP_MD_CTX_new()) {
+        if (ctx_ == nullptr || EVP_DigestInit_ex(ctx_, EVP_sha256(), nullptr) != 1) {
+            EVP_MD_CTX_free(ctx_);
+            throw std::runtime_error("Failed to initialize SHA-256");
+        }
+    }
+    ~Sha256() { EVP_MD_CTX_free(ctx_); }
+    Sha256(const Sha256&) = delete;
+    Sha256& operator=(const Sha256&) = delete;
+
+    void update(const void* data, size_t len) {
+        EVP_DigestUpdate(ctx_, data, len);
+    }
+
+    DigestTree::Hash finish() {
+        DigestTree::Hash hash;
+        EVP_DigestFinal_ex(ctx_, hash.data(), nullptr);
+        return hash;
+    }
+
+private:
+    EVP_MD_CTX* ctx_;
+};
+
+} // namespace
+
+DigestTree::DigestTree(const std::vector<EntryDigest>& entries, const storage::TombstoneSet& tombstones)
+    : entry_count_(entries.size()) {
+    items_.reserve(entries.size() + tombstones.size());
+    for (const auto& entry : entries) {
+        Item item;
+        SHA256(reinterpret_cast<const unsigned char*>(entry.id.data()), entry.id.size(), item.key.data());
+        item.digest = entry;
+        items_.push_back(std::move(item));
+    }
+    for (const auto& tombstone : tombstones.tombstones()) {
+        Item item;
+        item.key.fill(0);
+        std::copy(tombstone.key.begin(), tombstone.key.end(), item.key.begin());
+        item.deleted = tombstone.deleted;
+        items_.push_back(std::move(item));
+    }
+    std::sort(items_.begin(), items_.end(), [](const Item& a, const Item& b) {
+        return a.key != b.key ? a.key < b.key : a.deleted < b.deleted;
+    });
+
+    std::string path;
+    build(path, 0, items_.size());
+}
+
+DigestTree::Hash DigestTree::build(std::string& path, size_t begin, size_t end) {
+    Node node;
+    node.count = end - begin;
+    if (node.count == 0) {
+        return node.hash;
+    }
+
+    if (node.count <= LEAF_SIZE || path.size() == MAX_DEPTH) {
+        node.hash = leaf_hash(begin, end);
+    } else {
+        // Children partition [begin, end) by the next nibble
+        Sha256 sha;
+        size_t child_begin = begin;
+        for (size_t nibble = 0; nibble < FANOUT; ++nibble) {
+            size_t child_end = child_begin;
+            while (child_end < end && key_nibble(items_[child_end].key, path.size()) == nibble) {
+                ++child_end;
+            }
+            path.push_back(HEX_DIGITS[nibble]);
+            Hash child = build(path, child_begin, child_end);
+            path.pop_back();
+            sha.update(child.data(), child.size());
+            child_begin = child_end;
+        }
+        node.hash = sha.finish();
+    }
+
+    nodes_[path] = node;
+    return node.hash;
+}
+
+DigestTree::Hash DigestTree::leaf_hash(size_t begin, size_t end) const {
+    Sha256 sha;
+    for (size_t i = begin; i < end; ++i) {
+        const auto& item = items_[i];
+        sha.update(item.key.data(), item.key.size());
+        if (item.deleted != 0) {
+            uint8_t deleted[8];
+            for (int b = 0; b < 8; ++b) {
+                deleted[b] = static_cast<uint8_t>(item.deleted >> (56 - 8 * b));
+            }
+            sha.update(deleted, sizeof(deleted));
+            sha.update("\x01", 1);  // Tells a tombstone from an entry hash
+        } else {
+            sha.update(item.digest.hash.data(), item.digest.hash.size());
+            sha.update("", 1);  // Separator: hashes are variable-length strings
+        }
+    }
+    return sha.finish();
+}
+
+DigestTree::Node DigestTree::node(const std::string& path) const {
+    auto it = nodes_.find(path);
+    if (it != nodes_.end()) {
+        return it->second;
+    }
+
+    // Below a leaf (or outside the tree): at most LEAF_SIZE entries
+    auto bounds = range(path);
+    Node node;
+    node.count = bounds.second - bounds.first;
+    if (node.count > 0) {
+        node.hash = leaf_hash(bounds.first, bounds.second);
+    }
+    return node;
+}
+
+std::string DigestTree::child_path(const std::string& path, size_t nibble) {
+    return path + HEX_DIGITS[nibble & 0x0F];
+}
+
+std::vector<EntryDigest> DigestTree::entries_under(const std::string& path) const {
+    auto bounds = range(path);
+    std::vector<EntryDigest> result;
+    result.reserve(bounds.second - bounds.first);
+    for (size_t i = bounds.first; i < bounds.second; ++i) {
+        if (items_[i].deleted == 0) {
+            result.push_back(items_[i].digest);
+        }
+    }
+    return result;
+}
+
+std::vector<DigestTree::Tombstone> DigestTree::tombstones_under(const std::string& path) const {
+    auto bounds = range(path);
+    std::vector<Tombstone> result;
+    for (size_t i = bounds.first; i < bounds.second; ++i) {
+        const auto& item = items_[i];
+        if (item.deleted != 0) {
+            Tombstone tombstone;
+            std::copy(item.key.begin(), item.key.begin() + tombstone.key.size(), tombstone.key.begin());
+            tombstone.deleted = item.deleted;
+            result.push_back(tombstone);
+        }
+    }
+    return result;
+}
+
+std::pair<size_t, size_t> DigestTree::range(const std::string& path) const {
+    auto lower = std::partition_point(items_.begin(), items_.end(), [&path](const Item& item) {
+        return compare_prefix(item.key, path) < 0;
+    });
+    auto upper = std::partition_point(lower, items_.end(), [&path](const Item& item) {
+        return compare_prefix(item.key, path) == 0;
+    });
+    return {static_cast<size_t>(lower - items_.begin()), static_cast<size_t>(upper - items_.begin())};
+}
+
+bool DigestTree::valid_path(const std::string& path) {
+    if (path.size() > MAX_DEPTH) {
+        return false;
+    }
+    return std::all_of(path.begin(), path.end(), [](char c) { return nibble_value(c) >= 0; });
+}
+
+std::string DigestTree::to_hex(const Hash& hash) {
+    std::string hex(hash.size() * 2, '0');
+    for (size_t i = 0; i < hash.size(); ++i) {
+        hex[2 * i] = HEX_DIGITS[hash[i] >> 4];
+        hex[2 * i + 1] = HEX_DIGITS[hash[i] & 0x0F];
+    }
+    return hex;
+}
+
+bool DigestTree::from_hex(const std::string& hex, Hash& out) {
+    if (hex.size() != out.size() * 2) {
+        return false;
+    }
+    for (size_t i = 0; i < out.size(); ++i) {
+        int hi = nibble_value(hex[2 * i]);
+        int lo = nibble_value(hex[2 * i + 1]);
+        if (hi < 0 || lo < 0) {
+            return false;
+        }
+        out[i] = static_cast<uint8_t>((hi << 4) | lo);
+    }
+    return true;
+}
+
+} // namespace sync
+} // namespace localpdub
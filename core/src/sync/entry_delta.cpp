@@ -0,0 +1,199 @@
+#include "sync/entry_delta.h"
+#include "localpdub/entry_hash.h"
+#include <openssl/sha.h>
+
+namespace localpdub {
+namespace sync {
+
+namespace {
+
+// Entry keys of the fields FieldType names
+struct FieldKey {
+    FieldType field;
+    const char* key;
+};
+
+constexpr FieldKey FIELD_KEYS[] = {
+    {FieldType::TITLE, "title"},
+    {FieldType::USERNAME, "username"},
+    {FieldType::PASSWORD, "password"},
+    {FieldType::URL, "url"},
+    {FieldType::NOTES, "notes"},
+    {FieldType::TAGS, "tags"},
+    {FieldType::CUSTOM_FIELD, "custom_fields"},
+    {FieldType::CATEGORY, "category"},
+    {FieldType::FAVORITE, "favorite"}
+};
+
+constexpr size_t FIELD_HASH_SIZE = 8;
+
+// A field's name on the wire: its FieldType code, or its key
+json field_name(const std::string& key) {
+    for (const auto& field : FIELD_KEYS) {
+        if (key == field.key) {
+            return static_cast<int>(field.field);
+        }
+    }
+    return key;
+}
+
+bool field_key(const json& name, std::string& key) {
+    if (name.is_number_integer()) {
+        for (const auto& field : FIELD_KEYS) {
+            if (name.get<int>() == static_cast<int>(field.field)) {
+                key = field.key;
+                return true;
+            }
+        }
+        return false;
+    }
+    if (name.is_string()) {
+        key = name.get_ref<const json::string_t&>().c_str();
+        return !key.empty();
+    }
+    return false;
+}
+
+std::string field_hash(const json& value, crypto::SecureBytes& scratch) {
+    scratch.clear();
+    storage::encode_canonical(value, scratch);
+    storage::EntryHash hash;
+    SHA256(scratch.data(), scratch.size(), hash.data());
+    return storage::hash_to_hex(hash).substr(0, 2 * FIELD_HASH_SIZE);
+}
+
+bool string_member(const json& object, const char* name, std::string& out) {
+    auto it = object.find(name);
+    if (it == object.end() || !it->is_string()) {
+        return false;
+    }
+    out = it->get_ref<const json::string_t&>().c_str();
+    return true;
+}
+
+bool array_member(const json& object, const char* name) {
+    auto it = object.find(name);
+    return it != object.end() && it->is_array();
+}
+
+} // namespace
+
+bool worth_delta(const json& entry) {
+    return entry.is_object() && entry.dump().size() >= DELTA_MIN_ENTRY_SIZE;
+}
+
+bool make_entry_delta(const json& entry, const json& base, json& delta) {
+    std::string id, base_hash;
+    if (!entry.is_object() || !base.is_object() || !string_member(base, "id", id) ||
+        !string_member(base, "hash", base_hash) || !array_member(base, "fields")) {
+        return false;
+    }
+
+    std::unordered_map<std::string, std::string> base_fields;
+    for (const auto& field : base["fields"]) {
+        std::string key;
+        if (!field.is_array() || field.size() != 2 || !field_key(field[0], key) || !field[1].is_string()) {
+            return false;
+        }
+        base_fields[key] = field[1].get_ref<const json::string_t&>().c_str();
+    }
+
+    // Fields the base lacks or holds differently go out; base fields the
+    // entry no longer has are removed
+    json set = json::array();
+    crypto::SecureBytes scratch;
+    for (auto it = entry.begin(); it != entry.end(); ++it) {
+        std::string key = it.key().c_str();
+        if (key == "id") {
+            continue;
+        }
+        auto match = base_fields.find(key);
+        if (match == base_fields.end() || match->second != field_hash(it.value(), scratch)) {
+            set.push_back(json::array({field_name(key), it.value()}));
+        }
+        if (match != base_fields.end()) {
+            base_fields.erase(match);
+        }
+    }
+    json removed = json::array();
+    for (const auto& field : base_fields) {
+        removed.push_back(field_name(field.first));
+    }
+
+    delta = {{"delta", {
+        {"id", id},
+        {"base", base_hash},
+        {"set", std::move(set)},
+        {"removed", std::move(removed)}
+    }}};
+    return delta.dump().size() < entry.dump().size();
+}
+
+bool is_entry_delta(const json& item) {
+    if (!item.is_object()) {
+        return false;
+    }
+    auto it = item.find("delta");
+    return it != item.end() && it->is_object();
+}
+
+json BaseVersions::pin(const json& entry) {
+    Pinned pinned;
+    pinned.entry = entry;
+    pinned.hash = storage::hash_to_hex(storage::hash_entry(entry));
+
+    json fields = json::array();
+    crypto::SecureBytes scratch;
+    for (auto it = entry.begin(); it != entry.end(); ++it) {
+        if (it.key() != "id") {
+            fields.push_back(json::array({field_name(it.key().c_str()), field_hash(it.value(), scratch)}));
+        }
+    }
+
+    std::string id = entry["id"].get_ref<const json::string_t&>().c_str();
+    json base = {
+        {"id", id},
+        {"hash", pinned.hash},
+        {"fields", std::move(fields)}
+    };
+    pinned_[id] = std::move(pinned);
+    return base;
+}
+
+bool BaseVersions::expand(const json& item, json& entry) const {
+    if (!is_entry_delta(item)) {
+        return false;
+    }
+    const json& delta = item["delta"];
+
+    std::string id, base_hash;
+    if (!string_member(delta, "id", id) || !string_member(delta, "base", base_hash) ||
+        !array_member(delta, "set") || !array_member(delta, "removed")) {
+        return false;
+    }
+    auto pinned = pinned_.find(id);
+    if (pinned == pinned_.end() || pinned->second.hash != base_hash) {
+        return false;
+    }
+
+    json result = pinned->second.entry;
+    std::string key;
+    for (const auto& name : delta["removed"]) {
+        if (!field_key(name, key) || key == "id") {
+            return false;
+        }
+        result.erase(key.c_str());
+    }
+    for (const auto& field : delta["set"]) {
+        if (!field.is_array() || field.size() != 2 || !field_key(field[0], key) || key == "id") {
+            return false;
+        }
+        result[key.c_str()] = field[1];
+    }
+
+    entry = std::move(result);
+    return true;
+}
+
+} // namespace sync
+} // namespace localpdub
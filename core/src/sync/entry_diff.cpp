@@ -0,0 +1,147 @@
+#include "sync/entry_diff.h"
+#include <algorithm>
+#include <string_view>
+
+namespace localpdub {
+namespace sync {
+
+namespace {
+
+bool entry_id(const json& entry, std::string& id) {
+    if (!entry.is_object()) {
+        return false;
+    }
+    auto it = entry.find("id");
+    if (it == entry.end() || !it->is_string()) {
+        return false;
+    }
+    id = it->get_ref<const json::string_t&>().c_str();
+    return true;
+}
+
+// Digests by id, first occurrence kept. Views point into the digest vector.
+std::unordered_map<std::string_view, const EntryDigest*> digests_by_id(const std::vector<EntryDigest>& digests) {
+    std::unordered_map<std::string_view, const EntryDigest*> by_id;
+    by_id.reserve(digests.size());
+    for (const auto& digest : digests) {
+        by_id.emplace(digest.id, &digest);
+    }
+    return by_id;
+}
+
+} // namespace
+
+EntryIndex::EntryIndex(const json& entries) {
+    if (!entries.is_array()) {
+        return;
+    }
+    positions_.reserve(entries.size());
+    std::string id;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        if (entry_id(entries[i], id)) {
+            positions_.emplace(id, i);
+        }
+    }
+}
+
+size_t EntryIndex::find(const std::string& id) const {
+    auto it = positions_.find(id);
+    return it == positions_.end() ? npos : it->second;
+}
+
+void EntryIndex::add(const std::string& id, size_t position) {
+    positions_.emplace(id, position);
+}
+
+DigestDiff diff_digests(const std::vector<EntryDigest>& local,
+                        const std::vector<EntryDigest>& remote) {
+    DigestDiff diff;
+    auto local_by_id = digests_by_id(local);
+    auto remote_by_id = digests_by_id(remote);
+
+    for (const auto& entry : local) {
+        auto it = remote_by_id.find(entry.id);
+        if (it == remote_by_id.end()) {
+            diff.to_send.push_back(entry.id);
+        } else if (entry.hash != it->second->hash && entry.modified > it->second->modified) {
+            diff.to_send.push_back(entry.id);
+        }
+    }
+
+    for (const auto& entry : remote) {
+        auto it = local_by_id.find(entry.id);
+        if (it == local_by_id.end()) {
+            diff.to_receive.push_back(entry.id);
+        } else if (entry.hash != it->second->hash && entry.modified > it->second->modified) {
+            diff.to_receive.push_back(entry.id);
+        }
+    }
+
+    return diff;
+}
+
+TombstoneDiff diff_tombstones(std::vector<Tombstone> local, std::vector<Tombstone> remote) {
+    auto by_key = [](const Tombstone& a, const Tombstone& b) { return a.key < b.key; };
+    std::sort(local.begin(), local.end(), by_key);
+    std::sort(remote.begin(), remote.end(), by_key);
+
+    TombstoneDiff diff;
+    size_t i = 0, j = 0;
+    while (i < local.size() || j < remote.size()) {
+        if (j == remote.size() || (i < local.size() && local[i].key < remote[j].key)) {
+            diff.to_send.push_back(local[i++]);
+        } else if (i == local.size() || remote[j].key < local[i].key) {
+            diff.to_receive.push_back(remote[j++]);
+        } else {
+            if (local[i].deleted > remote[j].deleted) {
+                diff.to_send.push_back(local[i]);
+            } else if (remote[j].deleted > local[i].deleted) {
+                diff.to_receive.push_back(remote[j]);
+            }
+            ++i;
+            ++j;
+        }
+    }
+    return diff;
+}
+
+std::vector<std::string> merge_entries(json& entries,
+                                       const std::vector<json>& incoming,
+                                       const ConflictResolver& resolve) {
+    if (!entries.is_array()) {
+        entries = json::array();
+    }
+    EntryIndex index(entries);
+    return merge_entries(entries, index, incoming, resolve);
+}
+
+std::vector<std::string> merge_entries(json& entries, EntryIndex& index,
+                                       const std::vector<json>& incoming,
+                                       const ConflictResolver& resolve) {
+    std::vector<std::string> conflicts;
+    if (!entries.is_array()) {
+        entries = json::array();
+    }
+
+    std::string id;
+    for (const auto& remote_entry : incoming) {
+        if (!entry_id(remote_entry, id)) {
+            continue;  // Skip invalid entries
+        }
+
+        size_t position = index.find(id);
+        if (position == EntryIndex::npos) {
+            index.add(id, entries.size());
+            entries.push_back(remote_entry);
+        } else {
+            json& local_entry = entries[position];
+            local_entry = resolve(local_entry, remote_entry);
+            conflicts.push_back(id);
+        }
+    }
+
+    return conflicts;
+}
+
+} // namespace sync
+} // namespace localpdub
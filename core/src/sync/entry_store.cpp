@@ -0,0 +1,346 @@
+#include "sync/entry_store.h"
+#include <algorithm>
+#include <functional>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace localpdub {
+namespace sync {
+
+namespace {
+
+bool id_of(const json& entry, std::string& id) {
+    if (!entry.is_object()) {
+        return false;
+    }
+    auto it = entry.find("id");
+    if (it == entry.end() || !it->is_string()) {
+        return false;
+    }
+    id = it->get_ref<const json::string_t&>().c_str();
+    return true;
+}
+
+// As id_of(), without copying the id
+bool id_view(const json& entry, std::string_view& id) {
+    if (!entry.is_object()) {
+        return false;
+    }
+    auto it = entry.find("id");
+    if (it == entry.end() || !it->is_string()) {
+        return false;
+    }
+    const auto& value = it->get_ref<const json::string_t&>();
+    id = std::string_view(value.data(), value.size());
+    return true;
+}
+
+size_t hash_id(std::string_view id) {
+    return std::hash<std::string_view>()(id);
+}
+
+} // namespace
+
+std::vector<size_t> EntrySnapshot::changed_since(storage::Hlc since) const {
+    std::vector<size_t> changed;
+    for (size_t i = 0; i < stamps_.size(); ++i) {
+        if (stamps_[i] > since) {
+            changed.push_back(i);
+        }
+    }
+    return changed;
+}
+
+const json::string_t& EncodedEntry::encoded() const {
+    std::call_once(encoded_once_, [this]() { encoded_ = value_.dump(); });
+    return encoded_;
+}
+
+std::vector<const json*> EntrySnapshot::find(const std::vector<std::string>& ids) const {
+    std::vector<const json*> found;
+    for (size_t position : find_positions(ids)) {
+        found.push_back(&entries_[position]->value());
+    }
+    return found;
+}
+
+std::vector<EntryRef> EntrySnapshot::find_shared(const std::vector<std::string>& ids) const {
+    std::vector<EntryRef> found;
+    for (size_t position : find_positions(ids)) {
+        found.push_back(entries_[position]);
+    }
+    return found;
+}
+
+std::vector<size_t> EntrySnapshot::find_positions(const std::vector<std::string>& ids) const {
+    std::vector<size_t> found;
+    if (ids.empty()) {
+        return found;
+    }
+
+    // Callers want a handful of ids out of the whole vault. One pass over
+    // the id hashes, opening only the entries whose hash matches, costs far
+    // less than indexing every id. The first entry with an id wins, as in
+    // EntryIndex.
+    constexpr size_t NONE = static_cast<size_t>(-1);
+    std::unordered_map<std::string_view, size_t> matches;
+    std::unordered_set<size_t> hashes;
+    matches.reserve(ids.size());
+    hashes.reserve(ids.size());
+    for (const auto& wanted : ids) {
+        matches.emplace(wanted, NONE);
+        hashes.insert(hash_id(wanted));
+    }
+    std::string_view id;
+    for (size_t i = 0; i < entries_.size(); ++i) {
+        if (!hashes.count(id_hashes_[i]) || !id_view(entries_[i]->value(), id)) {
+            continue;
+        }
+        auto match = matches.find(id);
+        if (match != matches.end() && match->second == NONE) {
+            match->second = i;
+        }
+    }
+
+    found.reserve(ids.size());
+    for (const auto& wanted : ids) {
+        size_t position = matches.find(wanted)->second;
+        if (position != NONE) {
+            found.push_back(position);
+        }
+    }
+    return found;
+}
+
+EntryStore::EntryStore()
+    : current_(std::make_shared<EntrySnapshot>()) {
+}
+
+void EntryStore::assign(const json& entries) {
+    auto next = std::make_shared<EntrySnapshot>();
+    if (entries.is_array()) {
+        next->entries_.reserve(entries.size());
+        next->id_hashes_.reserve(entries.size());
+        std::string_view id;
+        for (const auto& entry : entries) {
+            next->entries_.push_back(std::make_shared<const EncodedEntry>(entry));
+            next->id_hashes_.push_back(id_view(entry, id) ? hash_id(id) : 0);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(commit_mutex_);
+    next->tombstones_ = snapshot()->tombstones_;
+    next->stamps_.assign(next->entries_.size(), clock_.tick());
+    index_ = entries.is_array() ? EntryIndex(entries) : EntryIndex();
+    publish(std::move(next));
+}
+
+void EntryStore::restamp(const storage::ChangeFeed& feed) {
+    std::lock_guard<std::mutex> lock(commit_mutex_);
+    clock_.observe(feed.clock().last());
+
+    auto next = std::make_shared<EntrySnapshot>(*snapshot());
+    storage::Hlc now = 0;
+    std::string id;
+    for (size_t i = 0; i < next->entries_.size(); ++i) {
+        storage::Hlc stamp = id_of(next->entries_[i]->value(), id) ? feed.stamp(id) : 0;
+        if (stamp == 0) {
+            if (now == 0) {
+                now = clock_.tick();
+            }
+            stamp = now;
+        }
+        next->stamps_[i] = stamp;
+    }
+    next->tombstones_ = std::make_shared<storage::TombstoneSet>(feed.tombstones());
+    publish(std::move(next));
+}
+
+void EntryStore::export_stamps(storage::ChangeFeed& feed) const {
+    std::lock_guard<std::mutex> lock(commit_mutex_);
+    auto entries = snapshot();
+    std::string id;
+    for (size_t i = 0; i < entries->size(); ++i) {
+        if (id_of(entries->entries_[i]->value(), id)) {
+            feed.set_stamp(id, entries->stamps_[i]);
+        }
+    }
+    feed.tombstones() = entries->tombstones();
+    feed.clock() = clock_;
+}
+
+bool EntryStore::observe(storage::Hlc remote) {
+    std::lock_guard<std::mutex> lock(commit_mutex_);
+    return clock_.observe(remote);
+}
+
+std::shared_ptr<const EntrySnapshot> EntryStore::snapshot() const {
+    std::lock_guard<std::mutex> lock(current_mutex_);
+    return current_;
+}
+
+json EntryStore::to_json() const {
+    auto entries = snapshot();
+    json array = json::array();
+    for (size_t i = 0; i < entries->size(); ++i) {
+        array.push_back((*entries)[i]);
+    }
+    return array;
+}
+
+std::vector<std::string> EntryStore::commit(const std::vector<json>& incoming,
+                                            const ConflictResolver& resolve) {
+    std::vector<std::string> conflicts;
+    if (incoming.empty()) {
+        return conflicts;
+    }
+
+    std::lock_guard<std::mutex> lock(commit_mutex_);
+
+    // Snapshots already handed out keep the old pointer array
+    auto next = std::make_shared<EntrySnapshot>(*snapshot());
+    auto& entries = next->entries_;
+    entries.reserve(entries.size() + incoming.size());
+
+    // New ids join the index only once the whole batch has merged, so a
+    // throwing resolver leaves the store as it was
+    std::unordered_map<std::string, size_t> added;
+    storage::Hlc stamp = clock_.tick();
+    auto& stamps = next->stamps_;
+    std::shared_ptr<storage::TombstoneSet> tombstones;  // Copied once an entry comes back
+    std::string id;
+    for (const auto& remote_entry : incoming) {
+        if (!id_of(remote_entry, id)) {
+            continue;  // Skip invalid entries
+        }
+
+        const storage::TombstoneSet& current = tombstones ? *tombstones : *next->tombstones_;
+        if (!current.empty()) {
+            auto key = storage::TombstoneSet::key_of(id);
+            const auto* tombstone = current.find(key);
+            if (tombstone && storage::buries(tombstone->deleted, storage::entry_modified(remote_entry))) {
+                continue;  // Deleted since this version
+            }
+            if (tombstone) {
+                if (!tombstones) {
+                    tombstones = std::make_shared<storage::TombstoneSet>(*next->tombstones_);
+                }
+                tombstones->erase(key);
+            }
+        }
+
+        size_t position = index_.find(id);
+        if (position == EntryIndex::npos) {
+            auto it = added.find(id);
+            position = it == added.end() ? EntryIndex::npos : it->second;
+        }
+        if (position == EntryIndex::npos) {
+            added.emplace(id, entries.size());
+            entries.push_back(std::make_shared<const EncodedEntry>(remote_entry));
+            stamps.push_back(stamp);
+            next->id_hashes_.push_back(hash_id(id));
+        } else {
+            json resolved = resolve(entries[position]->value(), remote_entry);
+            if (resolved != entries[position]->value()) {
+                entries[position] = std::make_shared<const EncodedEntry>(std::move(resolved));
+                stamps[position] = stamp;
+            }
+            conflicts.push_back(id);
+        }
+    }
+
+    for (const auto& entry : added) {
+        index_.add(entry.first, entry.second);
+    }
+    if (tombstones) {
+        next->tombstones_ = std::move(tombstones);
+    }
+    publish(std::move(next));
+    return conflicts;
+}
+
+std::vector<std::string> EntryStore::bury(const std::vector<storage::TombstoneSet::Tombstone>& incoming) {
+    std::vector<std::string> removed;
+    if (incoming.empty()) {
+        return removed;
+    }
+
+    std::lock_guard<std::mutex> lock(commit_mutex_);
+    auto current = snapshot();
+
+    // Keys of the live entries, sorted; deletions are rare enough that
+    // hashing every id here beats keeping the keys up to date
+    using Key = storage::TombstoneSet::Key;
+    std::vector<std::pair<Key, size_t>> live;
+    live.reserve(current->size());
+    std::string id;
+    for (size_t i = 0; i < current->size(); ++i) {
+        if (id_of(current->entries_[i]->value(), id)) {
+            live.emplace_back(storage::TombstoneSet::key_of(id), i);
+        }
+    }
+    std::sort(live.begin(), live.end());
+
+    auto tombstones = std::make_shared<storage::TombstoneSet>(current->tombstones());
+    std::vector<bool> buried(current->size(), false);
+    storage::Hlc stamp = 0;
+    bool changed = false;
+    for (const auto& tombstone : incoming) {
+        if (tombstone.deleted == 0 || !clock_.observe(tombstone.deleted)) {
+            continue;
+        }
+        auto it = std::lower_bound(live.begin(), live.end(), std::make_pair(tombstone.key, size_t(0)));
+        if (it != live.end() && it->first == tombstone.key) {
+            const json& entry = current->entries_[it->second]->value();
+            if (!storage::buries(tombstone.deleted, storage::entry_modified(entry))) {
+                continue;  // Changed here since it was deleted there
+            }
+            buried[it->second] = true;
+        }
+        if (stamp == 0) {
+            stamp = clock_.tick();
+        }
+        changed = tombstones->bury(tombstone.key, tombstone.deleted, stamp) || changed;
+    }
+    if (!changed) {
+        return removed;
+    }
+
+    auto next = std::make_shared<EntrySnapshot>();
+    next->entries_.reserve(current->size());
+    next->stamps_.reserve(current->size());
+    next->id_hashes_.reserve(current->size());
+    for (size_t i = 0; i < current->size(); ++i) {
+        if (buried[i]) {
+            if (id_of(current->entries_[i]->value(), id)) {
+                removed.push_back(id);
+            }
+            continue;
+        }
+        next->entries_.push_back(current->entries_[i]);
+        next->stamps_.push_back(current->stamps_[i]);
+        next->id_hashes_.push_back(current->id_hashes_[i]);
+    }
+    next->tombstones_ = std::move(tombstones);
+
+    if (!removed.empty()) {
+        index_ = EntryIndex();
+        for (size_t i = 0; i < next->entries_.size(); ++i) {
+            if (id_of(next->entries_[i]->value(), id)) {
+                index_.add(id, i);
+            }
+        }
+    }
+    publish(std::move(next));
+    return removed;
+}
+
+void EntryStore::publish(std::shared_ptr<EntrySnapshot> next) {
+    next->position_ = clock_.last();
+    std::lock_guard<std::mutex> lock(current_mutex_);
+    current_ = std::move(next);
+}
+
+} // namespace sync
+} // namespace localpdub
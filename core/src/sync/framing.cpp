@@ -0,0 +1,388 @@
+#include "sync/framing.h"
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <climits>
+#include <cerrno>
+#include <stdexcept>
+#include <algorithm>
+
+namespace localpdub {
+namespace sync {
+
+namespace {
+
+constexpr size_t RECV_BUFFER_SIZE = 64 * 1024;
+constexpr size_t SEALED_FRAME_MAX = MAX_FRAME_PAYLOAD + crypto::AEAD_TAG_SIZE;
+
+// Held bytes beyond this before keys are set mean the peer is not waiting
+// for the handshake as it should
+constexpr size_t MAX_HELD = 2 * (FRAME_HEADER_SIZE + SEALED_FRAME_MAX);
+
+bool valid_frame_type(uint8_t type) {
+    return type >= static_cast<uint8_t>(FrameType::SYNC_REQUEST) &&
+           type <= static_cast<uint8_t>(FrameType::RESUMED);
+}
+
+void put_header(uint8_t* header, FrameType type, uint8_t flags, size_t len) {
+    header[0] = static_cast<uint8_t>(type);
+    header[1] = flags;
+    header[2] = static_cast<uint8_t>(len >> 24);
+    header[3] = static_cast<uint8_t>(len >> 16);
+    header[4] = static_cast<uint8_t>(len >> 8);
+    header[5] = static_cast<uint8_t>(len);
+}
+
+// Split a message in count pieces into frames, deflating it first when a
+// deflater is given and the message is large enough. emit(flags, pieces,
+// piece_count, len) writes a frame; frame holds the current frame's pieces
+// and is reused from call to call.
+template<typename Emit>
+bool for_each_frame(Deflater* deflater, const struct iovec* pieces, size_t count,
+                    std::vector<struct iovec>& frame, Emit&& emit) {
+    size_t len = 0;
+    for (size_t i = 0; i < count; ++i) {
+        len += pieces[i].iov_len;
+    }
+
+    if (deflater && len >= COMPRESSION_THRESHOLD) {
+        return deflater->compress(pieces, count, MAX_FRAME_PAYLOAD,
+            [&emit](const uint8_t* chunk, size_t chunk_len, bool last) {
+                struct iovec piece = {const_cast<uint8_t*>(chunk), chunk_len};
+                return emit(FRAME_FLAG_COMPRESSED | (last ? 0 : FRAME_FLAG_MORE), &piece, 1, chunk_len);
+            });
+    }
+
+    // A piece that straddles a frame boundary is split between the two
+    size_t piece = 0;
+    size_t offset = 0;
+    do {
+        size_t chunk = std::min(len, MAX_FRAME_PAYLOAD);
+        frame.clear();
+        for (size_t need = chunk; need > 0;) {
+            size_t take = std::min(need, pieces[piece].iov_len - offset);
+            if (take > 0) {
+                frame.push_back({static_cast<uint8_t*>(pieces[piece].iov_base) + offset, take});
+            }
+            need -= take;
+            offset += take;
+            if (offset == pieces[piece].iov_len) {
+                ++piece;
+                offset = 0;
+            }
+        }
+        if (!emit(chunk < len ? FRAME_FLAG_MORE : 0, frame.data(), frame.size(), chunk)) {
+            return false;
+        }
+        len -= chunk;
+    } while (len > 0);
+
+    return true;
+}
+
+// Write count buffers in full, at most IOV_MAX per call; resumes after
+// partial writes. Advances the iovecs as it goes.
+bool write_all(int socket, struct iovec* iov, size_t count, uint64_t& bytes_sent) {
+    while (count > 0 && iov->iov_len == 0) {
+        ++iov;
+        --count;
+    }
+    while (count > 0) {
+        struct msghdr msg {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = std::min<size_t>(count, IOV_MAX);
+        ssize_t sent = sendmsg(socket, &msg, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        bytes_sent += sent;
+        while (count > 0 && static_cast<size_t>(sent) >= iov->iov_len) {
+            sent -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (sent > 0) {
+            iov->iov_base = static_cast<uint8_t*>(iov->iov_base) + sent;
+            iov->iov_len -= sent;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+void FrameReader::feed(const uint8_t* data, size_t len) {
+    if (legacy_) {
+        return;
+    }
+    if (!held_.empty()) {
+        hold(data, len);
+        return;
+    }
+
+    if (!started_ && len > 0) {
+        started_ = true;
+        if (data[0] == '{') {
+            legacy_ = true;
+            return;
+        }
+    }
+
+    while (len > 0) {
+        if (!in_payload_) {
+            size_t n = std::min(len, FRAME_HEADER_SIZE - header_len_);
+            std::copy(data, data + n, header_ + header_len_);
+            header_len_ += n;
+            data += n;
+            len -= n;
+            if (header_len_ == FRAME_HEADER_SIZE) {
+                if ((header_[1] & FRAME_FLAG_ENCRYPTED) && !decryptor_) {
+                    // Sealed before we have keys: keep it and what follows
+                    held_.assign(header_, header_ + FRAME_HEADER_SIZE);
+                    header_len_ = 0;
+                    hold(data, len);
+                    return;
+                }
+                start_frame();
+            }
+            continue;
+        }
+
+        // A sealed payload is opened once complete; nothing from it is
+        // used before its tag checks out
+        size_t n = std::min(len, payload_remaining_);
+        if (frame_sealed_) {
+            sealed_.insert(sealed_.end(), data, data + n);
+        } else {
+            append_payload(data, n);
+        }
+        payload_remaining_ -= n;
+        data += n;
+        len -= n;
+
+        if (payload_remaining_ == 0) {
+            in_payload_ = false;
+            if (frame_sealed_) {
+                open_frame();
+            }
+            if (!(flags_ & FRAME_FLAG_MORE)) {
+                finish_message();
+            }
+        }
+    }
+}
+
+void FrameReader::append_payload(const uint8_t* data, size_t len) {
+    if (current_compressed_) {
+        inflater_->decompress(data, len, current_.payload);
+    } else {
+        current_.payload.append(reinterpret_cast<const char*>(data), len);
+    }
+}
+
+void FrameReader::open_frame() {
+    // The header is still in header_: the next one has not started
+    opened_.resize(sealed_.size() - crypto::AEAD_TAG_SIZE);
+    if (!decryptor_->open(header_, FRAME_HEADER_SIZE, sealed_.data(), sealed_.size(), opened_.data())) {
+        throw std::runtime_error("Frame failed authentication");
+    }
+    sealed_.clear();
+    append_payload(opened_.data(), opened_.size());
+}
+
+void FrameReader::hold(const uint8_t* data, size_t len) {
+    if (held_.size() + len > MAX_HELD) {
+        throw std::runtime_error("Sealed frames before the handshake finished");
+    }
+    held_.insert(held_.end(), data, data + len);
+}
+
+void FrameReader::start_frame() {
+    uint8_t type = header_[0];
+    flags_ = header_[1];
+    size_t length = (static_cast<size_t>(header_[2]) << 24) |
+                    (static_cast<size_t>(header_[3]) << 16) |
+                    (static_cast<size_t>(header_[4]) << 8) |
+                    static_cast<size_t>(header_[5]);
+    header_len_ = 0;
+
+    if (!valid_frame_type(type)) {
+        throw std::runtime_error("Invalid frame type " + std::to_string(type));
+    }
+
+    // Once keys are set, every frame must be sealed
+    frame_sealed_ = (flags_ & FRAME_FLAG_ENCRYPTED) != 0;
+    if (!frame_sealed_ && decryptor_) {
+        throw std::runtime_error("Unencrypted frame after keys were set");
+    }
+    if (length > (frame_sealed_ ? SEALED_FRAME_MAX : MAX_FRAME_PAYLOAD)) {
+        throw std::runtime_error("Frame too large");
+    }
+    if (frame_sealed_ && length < static_cast<size_t>(crypto::AEAD_TAG_SIZE)) {
+        throw std::runtime_error("Sealed frame too short");
+    }
+
+    bool compressed = (flags_ & FRAME_FLAG_COMPRESSED) != 0;
+    if (compressed && !inflater_) {
+        throw std::runtime_error("Compressed frame before compression was negotiated");
+    }
+
+    if (in_message_) {
+        if (static_cast<FrameType>(type) != current_.type) {
+            throw std::runtime_error("Continuation frame type mismatch");
+        }
+        if (compressed != current_compressed_) {
+            throw std::runtime_error("Continuation frame compression mismatch");
+        }
+    } else {
+        current_.type = static_cast<FrameType>(type);
+        current_compressed_ = compressed;
+        in_message_ = true;
+    }
+
+    payload_remaining_ = length;
+    in_payload_ = length > 0;
+    if (!in_payload_ && !(flags_ & FRAME_FLAG_MORE)) {
+        finish_message();
+    }
+}
+
+void FrameReader::finish_message() {
+    ready_.push_back(std::move(current_));
+    current_ = Message{};
+    current_compressed_ = false;
+    in_message_ = false;
+}
+
+void FrameReader::enable_decompression(Compression compression) {
+    if (compression == Compression::DEFLATE && !inflater_) {
+        inflater_ = std::make_unique<Inflater>();
+    }
+}
+
+void FrameReader::enable_decryption(std::unique_ptr<RecordCipher> cipher) {
+    decryptor_ = std::move(cipher);
+    if (!held_.empty()) {
+        crypto::SecureBytes held;
+        held.swap(held_);
+        feed(held.data(), held.size());
+    }
+}
+
+bool FrameReader::next(Message& out) {
+    if (ready_.empty()) {
+        return false;
+    }
+    out = std::move(ready_.front());
+    ready_.pop_front();
+    return true;
+}
+
+void FrameEncoder::set_compression(Compression compression) {
+    if (compression == Compression::DEFLATE && !deflater_) {
+        deflater_ = std::make_unique<Deflater>();
+    }
+}
+
+void FrameEncoder::set_cipher(std::unique_ptr<RecordCipher> cipher) {
+    encryptor_ = std::move(cipher);
+}
+
+void FrameEncoder::encode(FrameType type, const void* data, size_t len, crypto::SecureBytes& out) {
+    struct iovec piece = {const_cast<void*>(data), len};
+    encode(type, &piece, 1, out);
+}
+
+void FrameEncoder::encode(FrameType type, const struct iovec* pieces, size_t count, crypto::SecureBytes& out) {
+    for_each_frame(deflater_.get(), pieces, count, frame_,
+        [this, type, &out](uint8_t flags, const struct iovec* payload, size_t payload_count, size_t payload_len) {
+            size_t body_len = payload_len + (encryptor_ ? crypto::AEAD_TAG_SIZE : 0);
+            size_t offset = out.size();
+            out.resize(offset + FRAME_HEADER_SIZE + body_len);
+            uint8_t* header = out.data() + offset;
+            if (encryptor_) {
+                // Sealed straight into the output buffer
+                put_header(header, type, flags | FRAME_FLAG_ENCRYPTED, body_len);
+                encryptor_->seal(header, FRAME_HEADER_SIZE, payload, payload_count, header + FRAME_HEADER_SIZE);
+            } else {
+                put_header(header, type, flags, body_len);
+                uint8_t* body = header + FRAME_HEADER_SIZE;
+                for (size_t i = 0; i < payload_count; ++i) {
+                    const uint8_t* base = static_cast<const uint8_t*>(payload[i].iov_base);
+                    body = std::copy(base, base + payload[i].iov_len, body);
+                }
+            }
+            return true;
+        });
+}
+
+FrameChannel::FrameChannel(int socket)
+    : socket_(socket)
+    , recv_buffer_(RECV_BUFFER_SIZE) {
+}
+
+void FrameChannel::set_compression(Compression compression) {
+    if (compression == Compression::DEFLATE && !deflater_) {
+        deflater_ = std::make_unique<Deflater>();
+    }
+    reader_.enable_decompression(compression);
+}
+
+void FrameChannel::set_ciphers(std::unique_ptr<RecordCipher> send, std::unique_ptr<RecordCipher> receive) {
+    encryptor_ = std::move(send);
+    reader_.enable_decryption(std::move(receive));
+}
+
+bool FrameChannel::send_message(FrameType type, const void* data, size_t len) {
+    struct iovec piece = {const_cast<void*>(data), len};
+    return send_message(type, &piece, 1);
+}
+
+bool FrameChannel::send_message(FrameType type, const struct iovec* pieces, size_t count) {
+    return for_each_frame(deflater_.get(), pieces, count, frame_,
+        [this, type](uint8_t flags, const struct iovec* payload, size_t payload_count, size_t payload_len) {
+            return send_frame(type, flags, payload, payload_count, payload_len);
+        });
+}
+
+bool FrameChannel::send_frame(FrameType type, uint8_t flags, const struct iovec* pieces, size_t count,
+                              size_t len) {
+    uint8_t header[FRAME_HEADER_SIZE];
+    send_iov_.clear();
+    send_iov_.push_back({header, FRAME_HEADER_SIZE});
+    if (encryptor_) {
+        // The pieces are read once, by the cipher, into the reused buffer
+        put_header(header, type, flags | FRAME_FLAG_ENCRYPTED, len + crypto::AEAD_TAG_SIZE);
+        send_buffer_.resize(len + crypto::AEAD_TAG_SIZE);
+        encryptor_->seal(header, FRAME_HEADER_SIZE, pieces, count, send_buffer_.data());
+        send_iov_.push_back({send_buffer_.data(), send_buffer_.size()});
+    } else {
+        // Header and pieces straight from where they are
+        put_header(header, type, flags, len);
+        send_iov_.insert(send_iov_.end(), pieces, pieces + count);
+    }
+    return write_all(socket_, send_iov_.data(), send_iov_.size(), bytes_sent_);
+}
+
+bool FrameChannel::recv_message(Message& out) {
+    while (!reader_.next(out)) {
+        if (reader_.legacy_peer()) {
+            return false;
+        }
+        ssize_t received = recv(socket_, recv_buffer_.data(), recv_buffer_.size(), 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return false;
+        }
+        bytes_received_ += received;
+        reader_.feed(recv_buffer_.data(), received);
+    }
+    return true;
+}
+
+} // namespace sync
+} // namespace localpdub
@@ -1,38 +1,87 @@
 #include "sync/network_discovery.h"
+#include "localpdub/random.h"
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <net/if.h>
+#include <ifaddrs.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
+#include <algorithm>
+#include <cerrno>
 #include <cstring>
 #include <iostream>
 #include <iomanip>
 #include <sstream>
-#include <random>
 
 namespace localpdub {
 namespace sync {
 
+namespace {
+
+// Indexes of the interfaces that are up, can multicast and have an address
+// of the family
+std::vector<unsigned int> multicast_interfaces(int family) {
+    std::vector<unsigned int> indexes;
+    struct ifaddrs* addresses = nullptr;
+    if (getifaddrs(&addresses) != 0) {
+        return indexes;
+    }
+    for (auto* it = addresses; it; it = it->ifa_next) {
+        if (!it->ifa_addr || it->ifa_addr->sa_family != family ||
+            (it->ifa_flags & (IFF_UP | IFF_MULTICAST)) != (IFF_UP | IFF_MULTICAST)) {
+            continue;
+        }
+        unsigned int index = if_nametoindex(it->ifa_name);
+        if (index != 0 && std::find(indexes.begin(), indexes.end(), index) == indexes.end()) {
+            indexes.push_back(index);
+        }
+    }
+    freeifaddrs(addresses);
+    return indexes;
+}
+
+// Numeric address of a datagram's sender; IPv6 link-local ones carry their
+// interface ("fe80::1%eth0") so they can be connected to
+std::string address_string(const struct sockaddr_storage& addr) {
+    char text[INET6_ADDRSTRLEN] = {};
+    if (addr.ss_family == AF_INET) {
+        const auto& v4 = reinterpret_cast<const struct sockaddr_in&>(addr);
+        inet_ntop(AF_INET, &v4.sin_addr, text, sizeof(text));
+        return text;
+    }
+    const auto& v6 = reinterpret_cast<const struct sockaddr_in6&>(addr);
+    inet_ntop(AF_INET6, &v6.sin6_addr, text, sizeof(text));
+    std::string result = text;
+    char name[IF_NAMESIZE];
+    if (IN6_IS_ADDR_LINKLOCAL(&v6.sin6_addr) && v6.sin6_scope_id != 0 &&
+        if_indextoname(v6.sin6_scope_id, name)) {
+        result += '%';
+        result += name;
+    }
+    return result;
+}
+
+} // namespace
+
 NetworkDiscoveryManager::NetworkDiscoveryManager()
     : active_(false)
+    , epoll_fd_(-1)
+    , timer_fd_(-1)
+    , wake_fd_(-1)
     , bound_port_(-1)
     , sync_server_port_(51820)  // Default sync port
-    , broadcast_socket_(-1)
+    , send_socket_(-1)
     , listener_socket_(-1)
+    , send_socket_v6_(-1)
+    , listener_socket_v6_(-1)
+    , messages_sent_(0)
     , timeout_(std::chrono::seconds(300)) {
 
     // Generate unique device ID
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_int_distribution<> dis(0, 255);
-
-    std::stringstream ss;
-    for (int i = 0; i < 16; ++i) {
-        if (i == 4 || i == 6 || i == 8 || i == 10) {
-            ss << "-";
-        }
-        ss << std::hex << std::setw(2) << std::setfill('0') << dis(gen);
-    }
-    device_id_ = ss.str();
+    device_id_ = crypto::generate_uuid();
 }
 
 NetworkDiscoveryManager::~NetworkDiscoveryManager() {
@@ -43,101 +92,218 @@ bool NetworkDiscoveryManager::start_session(const std::string& device_name, cons
     if (active_) {
         return false; // Session already active
     }
+    // A session that timed out on its own still has its thread to join
+    stop_session();
 
     // Clear any previously discovered devices from last session
     {
         std::lock_guard<std::mutex> lock(devices_mutex_);
         discovered_devices_.clear();
     }
+    last_replies_.clear();
+    messages_sent_ = 0;
 
     device_name_ = device_name;
     vault_id_ = vault_id;
     session_start_time_ = std::chrono::system_clock::now();
 
-    // Try to bind to available port
-    if (!bind_to_port(PRIMARY_PORT, FALLBACK_END_PORT)) {
+    if (!open_sockets() || !open_loop()) {
+        close_sockets();
         return false;
     }
 
     active_ = true;
-
-    // Start broadcast thread
-    broadcast_thread_ = std::make_unique<std::thread>([this]() {
-        while (active_) {
-            broadcast_presence();
-            std::this_thread::sleep_for(std::chrono::seconds(BROADCAST_INTERVAL_SECONDS));
-
-            // Check timeout
-            auto now = std::chrono::system_clock::now();
-            if (now - session_start_time_ > timeout_) {
-                // Don't call stop_session from within the thread - just set active to false
-                active_ = false;
-                break;
-            }
-        }
-    });
-
-    // Start listener thread
-    listener_thread_ = std::make_unique<std::thread>([this]() {
-        listen_for_broadcasts();
+    loop_thread_ = std::make_unique<std::thread>([this]() {
+        run_loop();
     });
 
     return true;
 }
 
 void NetworkDiscoveryManager::stop_session() {
-    // Set active to false to signal threads to stop
+    // Set active to false and wake the loop, wherever it waits
     active_ = false;
-
-    // Close sockets
-    if (broadcast_socket_ >= 0) {
-        close(broadcast_socket_);
-        broadcast_socket_ = -1;
-    }
-
-    if (listener_socket_ >= 0) {
-        close(listener_socket_);
-        listener_socket_ = -1;
+    if (wake_fd_ >= 0) {
+        uint64_t one = 1;
+        ssize_t written = write(wake_fd_, &one, sizeof(one));
+        (void)written;  // Already signalled if the counter is full
     }
 
-    // Always wait for threads to finish, even if active was already false
-    if (broadcast_thread_ && broadcast_thread_->joinable()) {
-        broadcast_thread_->join();
+    // Always wait for the thread to finish, even if active was already false
+    if (loop_thread_ && loop_thread_->joinable()) {
+        loop_thread_->join();
     }
 
-    if (listener_thread_ && listener_thread_->joinable()) {
-        listener_thread_->join();
-    }
+    // Closed only once no thread uses them
+    close_sockets();
 
     // Don't clear discovered devices - we need them for sync!
     // Devices will be cleared when starting a new session or when object is destroyed
 }
 
-bool NetworkDiscoveryManager::bind_to_port(int start_port, int end_port) {
-    // Create UDP socket for broadcasting
-    broadcast_socket_ = socket(AF_INET, SOCK_DGRAM, 0);
-    if (broadcast_socket_ < 0) {
+bool NetworkDiscoveryManager::open_loop() {
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd_ < 0 || timer_fd_ < 0 || wake_fd_ < 0) {
+        return false;
+    }
+    for (int fd : {timer_fd_, wake_fd_, listener_socket_, send_socket_, listener_socket_v6_, send_socket_v6_}) {
+        if (fd < 0) {
+            continue;
+        }
+        struct epoll_event ev {};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void NetworkDiscoveryManager::arm_timer(std::chrono::steady_clock::duration delay) {
+    auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(delay).count();
+    struct itimerspec spec {};
+    // Zero would disarm it; a deadline already passed fires at once
+    spec.it_value.tv_sec = nanoseconds / 1000000000;
+    spec.it_value.tv_nsec = std::max<long long>(nanoseconds % 1000000000, nanoseconds > 0 ? 0 : 1);
+    timerfd_settime(timer_fd_, 0, &spec, nullptr);
+}
+
+void NetworkDiscoveryManager::run_loop() {
+    // A query first, then announces further and further apart until the
+    // session times out
+    auto now = std::chrono::steady_clock::now();
+    auto deadline = now + timeout_;
+    std::chrono::steady_clock::duration interval = FIRST_ANNOUNCE_INTERVAL;
+    auto next = now + interval;
+    announce("LOCALPDUB_QUERY");
+    arm_timer(std::min(next, deadline) - now);
+
+    struct epoll_event events[8];
+    while (active_) {
+        int count = epoll_wait(epoll_fd_, events, 8, -1);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (int i = 0; i < count && active_; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == wake_fd_) {
+                return;
+            }
+            if (fd != timer_fd_) {
+                // Drain it; the listener also hears every announce we send
+                while (receive_from(fd)) {
+                }
+                continue;
+            }
+
+            uint64_t expirations;
+            if (read(timer_fd_, &expirations, sizeof(expirations)) < 0) {
+                continue;
+            }
+            now = std::chrono::steady_clock::now();
+            if (now >= deadline) {
+                // Don't call stop_session from within the thread - just set active to false
+                active_ = false;
+                return;
+            }
+            if (now >= next) {
+                announce("LOCALPDUB_ANNOUNCE");
+                interval = std::min<std::chrono::steady_clock::duration>(2 * interval, MAX_ANNOUNCE_INTERVAL);
+                next = now + interval;
+            }
+            arm_timer(std::min(next, deadline) - now);
+        }
+    }
+}
+
+bool NetworkDiscoveryManager::open_sockets() {
+    // IPv4: listen on the discovery port, where both the group's announces
+    // and version 1 broadcasts arrive; several instances may share it
+    if (!bind_to_port(PRIMARY_PORT, FALLBACK_END_PORT)) {
         return false;
     }
 
-    // Enable broadcast option
-    int broadcast_enable = 1;
-    if (setsockopt(broadcast_socket_, SOL_SOCKET, SO_BROADCAST,
-                   &broadcast_enable, sizeof(broadcast_enable)) < 0) {
-        close(broadcast_socket_);
-        broadcast_socket_ = -1;
+    // Create UDP socket for sending; it also receives the replies
+    send_socket_ = socket(AF_INET, SOCK_DGRAM, 0);
+    if (send_socket_ < 0) {
+        close_sockets();
         return false;
     }
+    int enable = 1;
+    unsigned char hops = 1;
+    setsockopt(send_socket_, IPPROTO_IP, IP_MULTICAST_TTL, &hops, sizeof(hops));
+    setsockopt(send_socket_, IPPROTO_IP, IP_MULTICAST_LOOP, &enable, sizeof(enable));  // Other instances here
+
+    struct ip_mreqn membership;
+    std::memset(&membership, 0, sizeof(membership));
+    inet_pton(AF_INET, MULTICAST_GROUP_V4, &membership.imr_multiaddr);
+    for (unsigned int index : multicast_interfaces(AF_INET)) {
+        membership.imr_ifindex = static_cast<int>(index);
+        if (setsockopt(listener_socket_, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) == 0) {
+            interfaces_v4_.push_back(index);
+        }
+    }
+
+    // IPv6: the same on the link-local group, if the host has IPv6
+    std::vector<unsigned int> interfaces = multicast_interfaces(AF_INET6);
+    if (interfaces.empty()) {
+        return true;
+    }
+    listener_socket_v6_ = socket(AF_INET6, SOCK_DGRAM, 0);
+    send_socket_v6_ = socket(AF_INET6, SOCK_DGRAM, 0);
+    struct sockaddr_in6 addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(bound_port_);
+    if (listener_socket_v6_ < 0 || send_socket_v6_ < 0 ||
+        setsockopt(listener_socket_v6_, IPPROTO_IPV6, IPV6_V6ONLY, &enable, sizeof(enable)) != 0 ||
+        setsockopt(listener_socket_v6_, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) != 0 ||
+        bind(listener_socket_v6_, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        // IPv4 still works
+        for (int* fd : {&listener_socket_v6_, &send_socket_v6_}) {
+            if (*fd >= 0) {
+                close(*fd);
+                *fd = -1;
+            }
+        }
+        return true;
+    }
+    int hop_limit = 1;
+    setsockopt(send_socket_v6_, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &hop_limit, sizeof(hop_limit));
+    setsockopt(send_socket_v6_, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &enable, sizeof(enable));
+
+    struct ipv6_mreq membership_v6;
+    std::memset(&membership_v6, 0, sizeof(membership_v6));
+    inet_pton(AF_INET6, MULTICAST_GROUP_V6, &membership_v6.ipv6mr_multiaddr);
+    for (unsigned int index : interfaces) {
+        membership_v6.ipv6mr_interface = index;
+        if (setsockopt(listener_socket_v6_, IPPROTO_IPV6, IPV6_JOIN_GROUP,
+                       &membership_v6, sizeof(membership_v6)) == 0) {
+            interfaces_v6_.push_back(index);
+        }
+    }
+    return true;
+}
 
+bool NetworkDiscoveryManager::bind_to_port(int start_port, int end_port) {
     // Create UDP socket for listening
     listener_socket_ = socket(AF_INET, SOCK_DGRAM, 0);
     if (listener_socket_ < 0) {
-        close(broadcast_socket_);
-        broadcast_socket_ = -1;
         return false;
     }
 
-    // Try to bind listener socket to available port
+    int reuse = 1;
+    setsockopt(listener_socket_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    // Try to bind listener socket to available port; only a version 1
+    // instance holding the port without sharing it moves us along
     for (int port = start_port; port <= end_port; ++port) {
         struct sockaddr_in addr;
         std::memset(&addr, 0, sizeof(addr));
@@ -152,65 +318,83 @@ bool NetworkDiscoveryManager::bind_to_port(int start_port, int end_port) {
     }
 
     // Failed to bind to any port
-    close(broadcast_socket_);
     close(listener_socket_);
-    broadcast_socket_ = -1;
     listener_socket_ = -1;
     return false;
 }
 
-void NetworkDiscoveryManager::broadcast_presence() {
-    if (broadcast_socket_ < 0 || !active_) {
-        return;
+void NetworkDiscoveryManager::close_sockets() {
+    for (int* fd : {&send_socket_, &listener_socket_, &send_socket_v6_, &listener_socket_v6_,
+                    &epoll_fd_, &timer_fd_, &wake_fd_}) {
+        if (*fd >= 0) {
+            close(*fd);
+            *fd = -1;
+        }
     }
+    interfaces_v4_.clear();
+    interfaces_v6_.clear();
+}
 
-    json message = create_announce_message();
-    std::string msg_str = message.dump();
-
-    struct sockaddr_in broadcast_addr;
-    std::memset(&broadcast_addr, 0, sizeof(broadcast_addr));
-    broadcast_addr.sin_family = AF_INET;
-    broadcast_addr.sin_addr.s_addr = inet_addr("255.255.255.255");
-    broadcast_addr.sin_port = htons(PRIMARY_PORT);
-
-    sendto(broadcast_socket_, msg_str.c_str(), msg_str.length(), 0,
-           (struct sockaddr*)&broadcast_addr, sizeof(broadcast_addr));
+void NetworkDiscoveryManager::send_to(int socket, const std::string& payload,
+                                      const struct sockaddr* addr, socklen_t addr_len) {
+    if (sendto(socket, payload.data(), payload.size(), 0, addr, addr_len) >= 0) {
+        ++messages_sent_;
+    }
 }
 
-void NetworkDiscoveryManager::listen_for_broadcasts() {
-    if (listener_socket_ < 0) {
-        return;
+void NetworkDiscoveryManager::announce(const char* type) {
+    json message = create_announce_message();
+    message["type"] = type;
+    std::string payload = message.dump().c_str();
+
+    // Once per interface, as a group address alone reaches only the default one
+    struct sockaddr_in group;
+    std::memset(&group, 0, sizeof(group));
+    group.sin_family = AF_INET;
+    inet_pton(AF_INET, MULTICAST_GROUP_V4, &group.sin_addr);
+    group.sin_port = htons(PRIMARY_PORT);
+    for (unsigned int index : interfaces_v4_) {
+        struct ip_mreqn via;
+        std::memset(&via, 0, sizeof(via));
+        via.imr_ifindex = static_cast<int>(index);
+        setsockopt(send_socket_, IPPROTO_IP, IP_MULTICAST_IF, &via, sizeof(via));
+        send_to(send_socket_, payload, (struct sockaddr*)&group, sizeof(group));
     }
 
-    // Set socket timeout
-    struct timeval tv;
-    tv.tv_sec = 1;
-    tv.tv_usec = 0;
-    setsockopt(listener_socket_, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    struct sockaddr_in6 group_v6;
+    std::memset(&group_v6, 0, sizeof(group_v6));
+    group_v6.sin6_family = AF_INET6;
+    inet_pton(AF_INET6, MULTICAST_GROUP_V6, &group_v6.sin6_addr);
+    group_v6.sin6_port = htons(PRIMARY_PORT);
+    for (unsigned int index : interfaces_v6_) {
+        group_v6.sin6_scope_id = index;
+        send_to(send_socket_v6_, payload, (struct sockaddr*)&group_v6, sizeof(group_v6));
+    }
+}
 
+bool NetworkDiscoveryManager::receive_from(int socket) {
     char buffer[4096];
-    struct sockaddr_in sender_addr;
+    struct sockaddr_storage sender_addr;
     socklen_t sender_len = sizeof(sender_addr);
 
-    while (active_) {
-        int received = recvfrom(listener_socket_, buffer, sizeof(buffer) - 1, 0,
-                               (struct sockaddr*)&sender_addr, &sender_len);
-
-        if (received > 0) {
-            buffer[received] = '\0';
-            std::string sender_ip = inet_ntoa(sender_addr.sin_addr);
-
-            try {
-                json message = json::parse(buffer);
-                if (message["type"] == "LOCALPDUB_ANNOUNCE" ||
-                    message["type"] == "LOCALPDUB_RESPONSE") {
-                    handle_announce_message(message, sender_ip);
-                }
-            } catch (const std::exception& e) {
-                // Invalid JSON, ignore
-            }
+    int received = recvfrom(socket, buffer, sizeof(buffer) - 1, MSG_DONTWAIT,
+                            (struct sockaddr*)&sender_addr, &sender_len);
+    if (received < 0) {
+        return false;
+    }
+    buffer[received] = '\0';
+
+    try {
+        json message = json::parse(buffer);
+        if (message["type"] == "LOCALPDUB_ANNOUNCE" ||
+            message["type"] == "LOCALPDUB_QUERY" ||
+            message["type"] == "LOCALPDUB_RESPONSE") {
+            handle_announce_message(message, sender_addr, sender_len);
         }
+    } catch (const std::exception& e) {
+        // Invalid JSON, ignore
     }
+    return true;
 }
 
 json NetworkDiscoveryManager::create_announce_message() const {
@@ -222,7 +406,7 @@ json NetworkDiscoveryManager::create_announce_message() const {
 
     json message = {
         {"type", "LOCALPDUB_ANNOUNCE"},
-        {"version", 1},
+        {"version", PROTOCOL_VERSION},
         {"device", {
             {"id", device_id_},
             {"name", device_name_},
@@ -239,11 +423,13 @@ json NetworkDiscoveryManager::create_announce_message() const {
     return message;
 }
 
-void NetworkDiscoveryManager::handle_announce_message(const json& message, const std::string& sender_ip) {
+void NetworkDiscoveryManager::handle_announce_message(const json& message,
+                                                      const struct sockaddr_storage& sender,
+                                                      socklen_t sender_len) {
     try {
         const auto& device_info = message["device"];
 
-        // Ignore our own broadcasts
+        // Ignore our own announces, looped back by the group
         if (device_info["id"] == device_id_) {
             return;
         }
@@ -251,7 +437,7 @@ void NetworkDiscoveryManager::handle_announce_message(const json& message, const
         Device device;
         device.id = device_info["id"];
         device.name = device_info["name"];
-        device.ip_address = sender_ip;
+        device.ip_address = address_string(sender);
         device.port = device_info["port"];
         device.vault_id = device_info["vault_id"];
 
@@ -265,6 +451,7 @@ void NetworkDiscoveryManager::handle_announce_message(const json& message, const
         device.public_key = message["auth"]["public_key"];
 
         // Add to discovered devices
+        bool found = false;
         {
             std::lock_guard<std::mutex> lock(devices_mutex_);
 
@@ -274,6 +461,7 @@ void NetworkDiscoveryManager::handle_announce_message(const json& message, const
 
             if (it == discovered_devices_.end()) {
                 discovered_devices_.push_back(device);
+                found = true;
 
                 // Notify callback if set
                 if (device_found_callback_) {
@@ -285,20 +473,33 @@ void NetworkDiscoveryManager::handle_announce_message(const json& message, const
             }
         }
 
-        // Send response if this was an announcement
-        if (message["type"] == "LOCALPDUB_ANNOUNCE") {
-            json response = create_announce_message();
-            response["type"] = "LOCALPDUB_RESPONSE";
-            std::string response_str = response.dump();
-
-            struct sockaddr_in response_addr;
-            std::memset(&response_addr, 0, sizeof(response_addr));
-            response_addr.sin_family = AF_INET;
-            response_addr.sin_addr.s_addr = inet_addr(sender_ip.c_str());
+        // Answer queries, and announces from devices new to us; a peer we
+        // already know hears from us on our own schedule
+        std::string type = message["type"];
+        if (type == "LOCALPDUB_RESPONSE" || (type == "LOCALPDUB_ANNOUNCE" && !found)) {
+            return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        auto last = last_replies_.find(device.id);
+        if (last != last_replies_.end() && now - last->second < REPLY_HOLDOFF) {
+            return;
+        }
+        last_replies_[device.id] = now;
+
+        json response = create_announce_message();
+        response["type"] = "LOCALPDUB_RESPONSE";
+        std::string response_str = response.dump().c_str();
+
+        if (message.value("version", 1) >= 2) {
+            // Back to the socket it came from, which listens for replies
+            int socket = sender.ss_family == AF_INET6 ? send_socket_v6_ : send_socket_;
+            send_to(socket, response_str, (const struct sockaddr*)&sender, sender_len);
+        } else if (sender.ss_family == AF_INET) {
+            // Version 1 peers listen on the discovery port they announce as
+            // their sync port
+            struct sockaddr_in response_addr = reinterpret_cast<const struct sockaddr_in&>(sender);
             response_addr.sin_port = htons(device.port);
-
-            sendto(broadcast_socket_, response_str.c_str(), response_str.length(), 0,
-                   (struct sockaddr*)&response_addr, sizeof(response_addr));
+            send_to(send_socket_, response_str, (struct sockaddr*)&response_addr, sizeof(response_addr));
         }
     } catch (const std::exception& e) {
         // Error handling message, ignore
@@ -0,0 +1,315 @@
+#include "sync/secure_channel.h"
+#include "localpdub/random.h"
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+#include <openssl/crypto.h>
+#include <cstring>
+#include <stdexcept>
+
+namespace localpdub {
+namespace sync {
+
+namespace {
+
+constexpr size_t HKDF_HASH_SIZE = SHA256_DIGEST_LENGTH;
+constexpr size_t TICKET_BODY_SIZE = 8 + HKDF_HASH_SIZE + SESSION_SECRET_SIZE;  // expiry, binding, secret
+
+crypto::SecureBytes hkdf_extract(const crypto::SecureBytes& salt, const crypto::SecureBytes& ikm) {
+    crypto::SecureBytes prk(HKDF_HASH_SIZE);
+    unsigned int len = HKDF_HASH_SIZE;
+    HMAC(EVP_sha256(), salt.data(), static_cast<int>(salt.size()), ikm.data(), ikm.size(), prk.data(), &len);
+    return prk;
+}
+
+// HKDF-Expand for outputs of at most one hash block, with info of
+// "localpdub sync " || label || transcript
+crypto::SecureBytes hkdf_expand(const crypto::SecureBytes& prk, const char* label,
+                                const uint8_t* transcript, size_t len) {
+    static const char prefix[] = "localpdub sync ";
+    crypto::SecureBytes info(prefix, prefix + sizeof(prefix) - 1);
+    info.insert(info.end(), label, label + std::strlen(label));
+    info.insert(info.end(), transcript, transcript + TRANSCRIPT_HASH_SIZE);
+    info.push_back(1);
+
+    crypto::SecureBytes block(HKDF_HASH_SIZE);
+    unsigned int block_len = HKDF_HASH_SIZE;
+    HMAC(EVP_sha256(), prk.data(), static_cast<int>(prk.size()), info.data(), info.size(),
+         block.data(), &block_len);
+    block.resize(len);
+    return block;
+}
+
+// SHA-256 of a followed by b
+void sha256_pair(const void* a, size_t a_len, const void* b, size_t b_len, uint8_t* out) {
+    EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+    bool ok = ctx && EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr) == 1 &&
+              EVP_DigestUpdate(ctx, a, a_len) == 1 && EVP_DigestUpdate(ctx, b, b_len) == 1 &&
+              EVP_DigestFinal_ex(ctx, out, nullptr) == 1;
+    EVP_MD_CTX_free(ctx);
+    if (!ok) {
+        throw std::runtime_error("Failed to hash sync handshake");
+    }
+}
+
+// What a ticket is bound to: a hash of the server's pre-shared key
+void psk_binding(const crypto::SecureBytes& psk, uint8_t* out) {
+    static const char label[] = "localpdub sync ticket binding";
+    sha256_pair(label, sizeof(label) - 1, psk.data(), psk.size(), out);
+}
+
+int hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+} // namespace
+
+RecordCipher::RecordCipher(crypto::Cipher cipher, const uint8_t* key, const uint8_t* iv) {
+    aead_.set_key(cipher, key);
+    std::memcpy(iv_, iv, sizeof(iv_));
+}
+
+void RecordCipher::next_nonce(uint8_t* nonce) {
+    if (sequence_ == UINT64_MAX) {
+        throw std::runtime_error("Sync connection exhausted its nonces");
+    }
+    std::memcpy(nonce, iv_, sizeof(iv_));
+    for (int i = 0; i < 8; ++i) {
+        nonce[crypto::AEAD_NONCE_SIZE - 1 - i] ^= static_cast<uint8_t>(sequence_ >> (8 * i));
+    }
+    ++sequence_;
+}
+
+void RecordCipher::seal(const uint8_t* header, size_t header_len, const uint8_t* in, size_t len,
+                        uint8_t* out) {
+    uint8_t nonce[crypto::AEAD_NONCE_SIZE];
+    next_nonce(nonce);
+    aead_.seal(nonce, in, len, out, header, header_len);
+}
+
+void RecordCipher::seal(const uint8_t* header, size_t header_len, const struct iovec* in, size_t count,
+                        uint8_t* out) {
+    uint8_t nonce[crypto::AEAD_NONCE_SIZE];
+    next_nonce(nonce);
+    aead_.seal(nonce, in, count, out, header, header_len);
+}
+
+bool RecordCipher::open(const uint8_t* header, size_t header_len, const uint8_t* in, size_t len,
+                        uint8_t* out) {
+    uint8_t nonce[crypto::AEAD_NONCE_SIZE];
+    next_nonce(nonce);
+    return aead_.open(nonce, in, len, out, header, header_len);
+}
+
+KeyShare::KeyShare()
+    : key_(nullptr) {
+    EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_X25519, nullptr);
+    bool ok = ctx && EVP_PKEY_keygen_init(ctx) == 1 && EVP_PKEY_keygen(ctx, &key_) == 1;
+    EVP_PKEY_CTX_free(ctx);
+
+    size_t len = sizeof(public_key_);
+    if (!ok || EVP_PKEY_get_raw_public_key(key_, public_key_, &len) != 1 || len != sizeof(public_key_)) {
+        EVP_PKEY_free(key_);
+        throw std::runtime_error("Failed to generate sync key share");
+    }
+}
+
+KeyShare::~KeyShare() {
+    EVP_PKEY_free(key_);
+}
+
+bool KeyShare::agree(const uint8_t* peer_public_key, crypto::SecureBytes& secret) const {
+    EVP_PKEY* peer = EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, nullptr, peer_public_key, KEY_SHARE_SIZE);
+    EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new(key_, nullptr);
+
+    size_t len = SESSION_SECRET_SIZE;
+    secret.resize(len);
+    // Fails for low-order peer keys, whose shared secret would be all zeros
+    bool ok = peer && ctx && EVP_PKEY_derive_init(ctx) == 1 && EVP_PKEY_derive_set_peer(ctx, peer) == 1 &&
+              EVP_PKEY_derive(ctx, secret.data(), &len) == 1 && len == SESSION_SECRET_SIZE;
+
+    EVP_PKEY_CTX_free(ctx);
+    EVP_PKEY_free(peer);
+    return ok;
+}
+
+std::unique_ptr<RecordCipher> SessionKeys::client_cipher() const {
+    return std::make_unique<RecordCipher>(cipher, client_key.data(), client_iv.data());
+}
+
+std::unique_ptr<RecordCipher> SessionKeys::server_cipher() const {
+    return std::make_unique<RecordCipher>(cipher, server_key.data(), server_iv.data());
+}
+
+void transcript_hash(const crypto::SecureString& request, const crypto::SecureString& accept, uint8_t* out) {
+    sha256_pair(request.data(), request.size(), accept.data(), accept.size(), out);
+}
+
+SessionKeys derive_session_keys(crypto::Cipher cipher, const crypto::SecureBytes& psk,
+                                const crypto::SecureBytes& shared_secret, const uint8_t* transcript) {
+    crypto::SecureBytes zeros(HKDF_HASH_SIZE, 0);
+    crypto::SecureBytes early_secret = hkdf_extract(zeros, psk);
+    crypto::SecureBytes secret = hkdf_extract(early_secret, shared_secret);
+
+    SessionKeys keys;
+    keys.cipher = cipher;
+    keys.client_key = hkdf_expand(secret, "c key", transcript, crypto::AEAD_KEY_SIZE);
+    keys.client_iv = hkdf_expand(secret, "c iv", transcript, crypto::AEAD_NONCE_SIZE);
+    keys.server_key = hkdf_expand(secret, "s key", transcript, crypto::AEAD_KEY_SIZE);
+    keys.server_iv = hkdf_expand(secret, "s iv", transcript, crypto::AEAD_NONCE_SIZE);
+    keys.client_finished = hkdf_expand(secret, "c finished", transcript, FINISHED_SIZE);
+    keys.server_finished = hkdf_expand(secret, "s finished", transcript, FINISHED_SIZE);
+    keys.resumption_secret = hkdf_expand(secret, "resumption", transcript, SESSION_SECRET_SIZE);
+    return keys;
+}
+
+crypto::SecureBytes derive_sync_psk(const crypto::SecureString& passphrase, const std::vector<uint8_t>& salt) {
+    return crypto::derive_key_from_password(passphrase, salt, crypto::default_kdf_params());
+}
+
+crypto::SecureBytes empty_psk() {
+    return crypto::SecureBytes(SESSION_SECRET_SIZE, 0);
+}
+
+const char* record_cipher_name(crypto::Cipher cipher) {
+    switch (cipher) {
+        case crypto::Cipher::AES_256_GCM: return "aes-256-gcm";
+        case crypto::Cipher::CHACHA20_POLY1305: return "chacha20-poly1305";
+    }
+    return "";
+}
+
+bool parse_record_cipher(const std::string& name, crypto::Cipher& cipher) {
+    for (auto candidate : {crypto::Cipher::AES_256_GCM, crypto::Cipher::CHACHA20_POLY1305}) {
+        if (name == record_cipher_name(candidate)) {
+            cipher = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+std::string bytes_to_hex(const uint8_t* data, size_t len) {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex(2 * len, '0');
+    for (size_t i = 0; i < len; ++i) {
+        hex[2 * i] = digits[data[i] >> 4];
+        hex[2 * i + 1] = digits[data[i] & 0x0f];
+    }
+    return hex;
+}
+
+bool hex_to_bytes(const std::string& hex, std::vector<uint8_t>& out) {
+    if (hex.size() % 2 != 0) {
+        return false;
+    }
+    out.resize(hex.size() / 2);
+    for (size_t i = 0; i < out.size(); ++i) {
+        int hi = hex_digit(hex[2 * i]);
+        int lo = hex_digit(hex[2 * i + 1]);
+        if (hi < 0 || lo < 0) {
+            return false;
+        }
+        out[i] = static_cast<uint8_t>((hi << 4) | lo);
+    }
+    return true;
+}
+
+constexpr std::chrono::hours TicketIssuer::LIFETIME;
+
+TicketIssuer::TicketIssuer()
+    : key_(crypto::generate_key()) {
+}
+
+std::string TicketIssuer::issue(const crypto::SecureBytes& resumption_secret, const crypto::SecureBytes& psk) {
+    // expiry (8, big-endian seconds) || binding || secret, sealed
+    crypto::SecureBytes body(TICKET_BODY_SIZE);
+    auto expiry = std::chrono::system_clock::now() + LIFETIME;
+    uint64_t seconds = std::chrono::duration_cast<std::chrono::seconds>(expiry.time_since_epoch()).count();
+    for (int i = 0; i < 8; ++i) {
+        body[i] = static_cast<uint8_t>(seconds >> (56 - 8 * i));
+    }
+    psk_binding(psk, body.data() + 8);
+    std::memcpy(body.data() + 8 + HKDF_HASH_SIZE, resumption_secret.data(), SESSION_SECRET_SIZE);
+
+    std::vector<uint8_t> ticket(crypto::AEAD_NONCE_SIZE + TICKET_BODY_SIZE + crypto::AEAD_TAG_SIZE);
+    crypto::random_bytes(ticket.data(), crypto::AEAD_NONCE_SIZE);
+    crypto::AeadContext aead;
+    aead.set_key(crypto::Cipher::AES_256_GCM, key_.data());
+    aead.seal(ticket.data(), body.data(), body.size(), ticket.data() + crypto::AEAD_NONCE_SIZE);
+    return bytes_to_hex(ticket.data(), ticket.size());
+}
+
+bool TicketIssuer::redeem(const std::string& ticket, const crypto::SecureBytes& psk,
+                          crypto::SecureBytes& resumption_secret) const {
+    std::vector<uint8_t> sealed;
+    if (!hex_to_bytes(ticket, sealed) ||
+        sealed.size() != crypto::AEAD_NONCE_SIZE + TICKET_BODY_SIZE + crypto::AEAD_TAG_SIZE) {
+        return false;
+    }
+
+    crypto::SecureBytes body(TICKET_BODY_SIZE);
+    crypto::AeadContext aead;
+    aead.set_key(crypto::Cipher::AES_256_GCM, key_.data());
+    if (!aead.open(sealed.data(), sealed.data() + crypto::AEAD_NONCE_SIZE,
+                   sealed.size() - crypto::AEAD_NONCE_SIZE, body.data())) {
+        return false;
+    }
+
+    uint64_t seconds = 0;
+    for (int i = 0; i < 8; ++i) {
+        seconds = (seconds << 8) | body[i];
+    }
+    auto now = std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    uint8_t binding[HKDF_HASH_SIZE];
+    psk_binding(psk, binding);
+    if (static_cast<uint64_t>(now) >= seconds ||
+        CRYPTO_memcmp(binding, body.data() + 8, HKDF_HASH_SIZE) != 0) {
+        return false;
+    }
+
+    resumption_secret.assign(body.begin() + 8 + HKDF_HASH_SIZE, body.end());
+    return true;
+}
+
+void TicketCache::store(const std::string& peer, Ticket ticket) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tickets_[peer] = std::move(ticket);
+}
+
+bool TicketCache::find(const std::string& peer, Ticket& ticket) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = tickets_.find(peer);
+    if (it == tickets_.end() || std::chrono::steady_clock::now() >= it->second.expires) {
+        return false;
+    }
+    ticket = it->second;
+    return true;
+}
+
+void TicketCache::erase(const std::string& peer) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tickets_.erase(peer);
+}
+
+void TicketCache::clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tickets_.clear();
+}
+
+TicketIssuer& ticket_issuer() {
+    static TicketIssuer issuer;
+    return issuer;
+}
+
+TicketCache& ticket_cache() {
+    static TicketCache cache;
+    return cache;
+}
+
+} // namespace sync
+} // namespace localpdub
@@ -1,522 +1,1775 @@
 #include "sync/sync_manager.h"
+#include "localpdub/random.h"
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <netdb.h>
 #include <unistd.h>
 #include <cstring>
 #include <iostream>
+#include <unordered_set>
+#include <iterator>
+#include <thread>
+#include <algorithm>
 #include <fstream>
-#include <openssl/evp.h>
-#include <openssl/sha.h>
-#include <openssl/hmac.h>
-#include <openssl/rand.h>
+#include <openssl/crypto.h>
 
 namespace localpdub {
 namespace sync {
 
-SyncManager::SyncManager(const std::string& vault_path)
-    : vault_path_(vault_path)
-    , server_running_(false)
-    , server_socket_(-1) {
+namespace {
+
+// Record ciphers in our order of preference
+std::vector<crypto::Cipher> record_ciphers() {
+    crypto::Cipher preferred = crypto::preferred_cipher();
+    crypto::Cipher other = preferred == crypto::Cipher::AES_256_GCM ?
+        crypto::Cipher::CHACHA20_POLY1305 : crypto::Cipher::AES_256_GCM;
+    return {preferred, other};
 }
 
-SyncManager::~SyncManager() {
-    stop_sync_server();
+// A hex member of exactly size bytes (any size if 0)
+bool hex_member(const json& object, const char* name, size_t size, std::vector<uint8_t>& out) {
+    auto it = object.find(name);
+    return it != object.end() && it->is_string() &&
+           hex_to_bytes(it->get_ref<const json::string_t&>().c_str(), out) &&
+           !out.empty() && (size == 0 || out.size() == size);
 }
 
-bool SyncManager::start_sync_server(int port) {
-    if (server_running_) {
-        return false;
-    }
+crypto::SecureString finished_payload(const crypto::SecureBytes& finished) {
+    return crypto::SecureString(reinterpret_cast<const char*>(finished.data()), finished.size());
+}
 
-    // Create TCP socket
-    server_socket_ = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket_ < 0) {
-        return false;
+using SteadyClock = std::chrono::steady_clock;
+
+std::chrono::microseconds elapsed_since(SteadyClock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(SteadyClock::now() - start);
+}
+
+// Adds the time it lives to a phase
+class PhaseTimer {
+public:
+    explicit PhaseTimer(std::chrono::microseconds& phase) : phase_(phase), start_(SteadyClock::now()) {}
+    ~PhaseTimer() { phase_ += elapsed_since(start_); }
+
+    PhaseTimer(const PhaseTimer&) = delete;
+    PhaseTimer& operator=(const PhaseTimer&) = delete;
+
+private:
+    std::chrono::microseconds& phase_;
+    SteadyClock::time_point start_;
+};
+
+double to_milliseconds(std::chrono::microseconds span) {
+    return span.count() / 1000.0;
+}
+
+// Adds a channel's wire bytes to a result when the channel goes
+class WireCount {
+public:
+    WireCount(const FrameChannel& channel, DeviceSyncResult& result) : channel_(channel), result_(result) {}
+    ~WireCount() {
+        result_.bytes_sent += channel_.bytes_sent();
+        result_.bytes_received += channel_.bytes_received();
     }
 
-    // Allow socket reuse
-    int reuse = 1;
-    if (setsockopt(server_socket_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
-        close(server_socket_);
-        server_socket_ = -1;
-        return false;
+    WireCount(const WireCount&) = delete;
+    WireCount& operator=(const WireCount&) = delete;
+
+private:
+    const FrameChannel& channel_;
+    DeviceSyncResult& result_;
+};
+
+std::string error_message(const Message& msg) {
+    try {
+        return json::parse(msg.payload).value("message", "unknown error").c_str();
+    } catch (const std::exception&) {
+        return "unknown error";
     }
+}
 
-    // Bind to port
-    struct sockaddr_in addr;
-    std::memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(port);
+// Server side of one sync session. Stages follow the protocol: request,
+// authentication, reconciliation from the change feed or digest trees, then
+// the entry exchange.
+struct ServerSession : SessionState {
+    enum class Stage { REQUEST, AUTH, RECONCILE, EXCHANGE };
+
+    Stage stage = Stage::REQUEST;
+    std::string device_id;
+    std::string peer_feed;  // The client vault's feed id; empty from older clients
+    crypto::SecureBytes client_finished;  // Expected in AUTH_RESPONSE
+    std::unique_ptr<DigestTree> tree;             // Built on the first TREE_QUERY
+    std::shared_ptr<const EntrySnapshot> entries;  // What the client reconciles against
+    storage::Hlc position = 0;                     // Of that snapshot
+    BaseVersions bases;               // Ours, for the client's deltas
+    std::vector<EntryRef> outgoing;
+    size_t next_outgoing = 0;
+    std::vector<struct iovec> batch;  // Pieces of the ENTRIES message being sent
+    std::string checkpoint;        // Id the client resumes the exchange under; empty if it can't
+    bool refetch = false;          // A round fetching whole entries follows the exchange
+    std::shared_ptr<Message> refetch_request;  // The client's, once it came
+    std::vector<std::string> failed;  // Client deltas that did not expand, by INPUT tasks
+    size_t received_batches = 0;   // Client batches committed, by INPUT tasks
+    bool input_ended = false;      // The last of them was, likewise
+    bool sent_all = false;
+    bool received_all = false;
+    bool completed = false;
+    SyncResult result;
+    SyncTimings timings;  // Tasks in the two lanes touch different phases
+    SteadyClock::time_point opened = SteadyClock::now();
+    uint64_t bytes_sent = 0;      // On earlier connections of a resumed exchange
+    uint64_t bytes_received = 0;
+};
+
+// The strings in an array member of a request
+std::vector<std::string> string_ids(const json& request, const char* name) {
+    std::vector<std::string> ids;
+    auto it = request.find(name);
+    if (it != request.end() && it->is_array()) {
+        for (const auto& id : *it) {
+            if (id.is_string()) {
+                ids.push_back(id.get_ref<const json::string_t&>().c_str());
+            }
+        }
+    }
+    return ids;
+}
 
-    if (bind(server_socket_, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        close(server_socket_);
-        server_socket_ = -1;
-        return false;
+// Deltas that did not expand, where their entries could not be fetched whole
+void report_failed_deltas(const std::vector<std::string>& ids, std::vector<std::string>& errors) {
+    for (const auto& id : ids) {
+        errors.push_back("Field delta for entry " + id + " does not match the version it was made from");
     }
+}
 
-    // Start listening
-    if (listen(server_socket_, MAX_SIMULTANEOUS_CONNECTIONS) < 0) {
-        close(server_socket_);
-        server_socket_ = -1;
-        return false;
+// Tombstones as TREE_NODES, FEED and ENTRY_REQUEST carry them: [key, deleted]
+// pairs, the key in hex. Local stamps are not sent.
+json tombstones_json(const std::vector<Tombstone>& tombstones) {
+    json array = json::array();
+    for (const auto& tombstone : tombstones) {
+        array.push_back(json::array({bytes_to_hex(tombstone.key.data(), tombstone.key.size()),
+                                     tombstone.deleted}));
     }
+    return array;
+}
 
-    server_running_ = true;
+// Malformed tombstones are skipped
+std::vector<Tombstone> parse_tombstones(const json& object, const char* name) {
+    std::vector<Tombstone> tombstones;
+    auto it = object.find(name);
+    if (it == object.end() || !it->is_array()) {
+        return tombstones;
+    }
+    std::vector<uint8_t> key;
+    for (const auto& node : *it) {
+        if (!node.is_array() || node.size() != 2 || !node[0].is_string() ||
+            !node[1].is_number_unsigned() ||
+            !hex_to_bytes(node[0].get_ref<const json::string_t&>().c_str(), key) ||
+            key.size() != storage::TombstoneSet::KEY_SIZE) {
+            continue;
+        }
+        Tombstone tombstone;
+        std::copy(key.begin(), key.end(), tombstone.key.begin());
+        tombstone.deleted = node[1].get<storage::Hlc>();
+        tombstones.push_back(tombstone);
+    }
+    return tombstones;
+}
 
-    // Start server thread
-    server_thread_ = std::make_unique<std::thread>([this]() {
-        accept_clients();
-    });
+// An entry digest as TREE_NODES and FEED carry it
+json digest_json(const EntryDigest& digest) {
+    return {
+        {"id", digest.id},
+        {"modified", std::chrono::system_clock::to_time_t(digest.modified)},
+        {"hash", digest.hash}
+    };
+}
 
+bool parse_digest(const json& node, EntryDigest& digest) {
+    if (!node.is_object() || !node.contains("id") || !node["id"].is_string() ||
+        !node.contains("modified") || !node["modified"].is_number() ||
+        !node.contains("hash") || !node["hash"].is_string()) {
+        return false;
+    }
+    digest.id = node["id"].get<crypto::SecureString>().c_str();
+    digest.modified = std::chrono::system_clock::from_time_t(node["modified"]);
+    digest.hash = node["hash"].get<crypto::SecureString>().c_str();
     return true;
 }
 
-void SyncManager::stop_sync_server() {
-    if (!server_running_) {
-        return;
-    }
+ServerSession& server_session(ServerConnection& connection) {
+    return static_cast<ServerSession&>(*connection.session);
+}
+
+void reject(ServerConnection& connection, const std::string& message) {
+    json error = {{"message", message}};
+    connection.send(FrameType::ERROR, error.dump());
+    connection.close_after_flush();
+}
 
-    server_running_ = false;
+} // namespace
+
+json SyncTimings::to_json() const {
+    return {
+        {"connect", to_milliseconds(connect)},
+        {"auth", to_milliseconds(auth)},
+        {"digest_build", to_milliseconds(digest_build)},
+        {"digest_exchange", to_milliseconds(digest_exchange)},
+        {"diff", to_milliseconds(diff)},
+        {"send", to_milliseconds(send)},
+        {"receive", to_milliseconds(receive)},
+        {"apply", to_milliseconds(apply)}
+    };
+}
 
-    if (server_socket_ >= 0) {
-        shutdown(server_socket_, SHUT_RDWR);
-        close(server_socket_);
-        server_socket_ = -1;
+json DeviceSyncResult::to_json() const {
+    json error_list = json::array();
+    for (const auto& error : errors) {
+        error_list.push_back(error);
     }
+    return {
+        {"device_id", device_id},
+        {"device_name", device_name},
+        {"success", success},
+        {"incremental", incremental},
+        {"duration_ms", duration.count()},
+        {"entries_sent", entries_sent},
+        {"entries_received", entries_received},
+        {"conflicts_resolved", conflicts_resolved},
+        {"deletions_sent", deletions_sent},
+        {"deletions_received", deletions_received},
+        {"bytes_sent", bytes_sent},
+        {"bytes_received", bytes_received},
+        {"phases_ms", timings.to_json()},
+        {"errors", std::move(error_list)}
+    };
+}
 
-    if (server_thread_ && server_thread_->joinable()) {
-        server_thread_->join();
+json SyncResult::to_json() const {
+    json error_list = json::array();
+    for (const auto& error : errors) {
+        error_list.push_back(error);
+    }
+    json device_list = json::array();
+    for (const auto& device : devices) {
+        device_list.push_back(device.to_json());
     }
+    return {
+        {"success", success},
+        {"duration_ms", duration.count()},
+        {"entries_sent", entries_sent},
+        {"entries_received", entries_received},
+        {"conflicts_resolved", conflicts_resolved},
+        {"deletions_sent", deletions_sent},
+        {"deletions_received", deletions_received},
+        {"bytes_sent", bytes_sent},
+        {"bytes_received", bytes_received},
+        {"errors", std::move(error_list)},
+        {"devices", std::move(device_list)}
+    };
 }
 
-void SyncManager::accept_clients() {
-    while (server_running_) {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
+SyncManager::SyncManager(const std::string& vault_path)
+    : vault_path_(vault_path) {
+}
 
-        // Set accept timeout
-        struct timeval tv;
-        tv.tv_sec = 1;
-        tv.tv_usec = 0;
-        setsockopt(server_socket_, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+SyncManager::~SyncManager() {
+    stop_sync_server();
+}
 
-        int client_socket = accept(server_socket_, (struct sockaddr*)&client_addr, &client_len);
+bool SyncManager::start_sync_server(int port) {
+    if (server_) {
+        return false;
+    }
 
-        if (client_socket >= 0) {
-            // Handle client in separate thread
-            std::thread client_thread([this, client_socket]() {
-                handle_sync_client(client_socket);
-                close(client_socket);
-            });
-            client_thread.detach();
-        }
+    size_t workers = std::min<size_t>(MAX_SERVER_WORKERS,
+                                      std::max(1u, std::thread::hardware_concurrency()));
+    SessionHandler& handler = *this;
+    server_ = std::make_unique<SyncServer>(handler, MAX_SIMULTANEOUS_CONNECTIONS, workers,
+                                           std::chrono::seconds(SOCKET_TIMEOUT_SECONDS));
+    if (!server_->start(port)) {
+        server_.reset();
+        return false;
     }
+    return true;
 }
 
-void SyncManager::handle_sync_client(int client_socket) {
-    // Set socket timeout
-    struct timeval tv;
-    tv.tv_sec = SOCKET_TIMEOUT_SECONDS;
-    tv.tv_usec = 0;
-    setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-    setsockopt(client_socket, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+void SyncManager::stop_sync_server() {
+    if (server_) {
+        server_->stop();
+        resumable_.clear();
+        server_.reset();
+        std::lock_guard<std::mutex> lock(sessions_mutex_);
+        parked_exchanges_ = 0;
+    }
+}
+
+bool SyncManager::wait_for_sessions(std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(sessions_mutex_);
+    return sessions_cv_.wait_for(lock, timeout, [this]() {
+        return active_sessions_ == 0 && parked_exchanges_ == 0;
+    });
+}
 
+void SyncManager::on_open(ServerConnection& connection) {
+    {
+        std::lock_guard<std::mutex> lock(sessions_mutex_);
+        ++active_sessions_;
+    }
+    connection.session = std::make_unique<ServerSession>();
     std::cout << "\n✓ Incoming sync connection received" << std::endl;
 
     // Notify callback that sync connection was received
     if (connection_callback_) {
         connection_callback_();
     }
+}
+
+void SyncManager::on_close(ServerConnection& connection) {
+    auto& session = server_session(connection);
+    if (!session.completed) {
+        std::cout << "  ✗ Sync connection closed before completion" << std::endl;
+    }
+
+    // An exchange the client checkpoints waits a while for it to reconnect
+    auto resumable = resumable_.find(session.checkpoint);
+    if (resumable != resumable_.end() && resumable->second.connection.get() == &connection) {
+        resumable->second.expires = std::chrono::steady_clock::now() +
+                                    std::chrono::seconds(PARKED_EXCHANGE_SECONDS);
+        std::cout << "  Keeping the exchange for the client to resume" << std::endl;
+        prune_resumable();
+    } else if (!session.completed && session.checkpoint.empty()) {
+        // A resumable exchange is recorded once it completes
+        record_server_session(connection);
+    }
+    {
+        std::lock_guard<std::mutex> lock(sessions_mutex_);
+        --active_sessions_;
+    }
+    sessions_cv_.notify_all();
+}
 
+void SyncManager::on_legacy_peer(ServerConnection& connection) {
+    // Version 1 peers read one JSON line; tell them why we stop
+    std::cout << "  ✗ Peer uses the unframed version 1 protocol" << std::endl;
+    connection.send_raw("{\"type\":\"ERROR\",\"message\":\"Sync protocol version " +
+                        std::to_string(PROTOCOL_VERSION) + " required\"}\n");
+    connection.close_after_flush();
+}
+
+void SyncManager::on_message(ServerConnection& connection, Message& msg) {
+    auto& session = server_session(connection);
     try {
-        // Receive sync request
-        char buffer[65536];  // Increased buffer size
-        int received = recv(client_socket, buffer, sizeof(buffer) - 1, 0);
-        if (received <= 0) {
-            std::cout << "  ✗ Failed to receive sync request" << std::endl;
-            return;
+        switch (session.stage) {
+            case ServerSession::Stage::REQUEST:
+                handle_sync_request(connection, msg);
+                break;
+            case ServerSession::Stage::AUTH:
+                handle_auth_response(connection, msg);
+                break;
+            case ServerSession::Stage::RECONCILE:
+                handle_reconcile_message(connection, msg);
+                break;
+            case ServerSession::Stage::EXCHANGE:
+                handle_entries_message(connection, msg);
+                break;
         }
-        buffer[received] = '\0';
-        std::cout << "  Received sync request (" << received << " bytes)" << std::endl;
+    } catch (const std::exception& e) {
+        std::cerr << "Error handling sync client: " << e.what() << std::endl;
+        connection.close_after_flush();
+    }
+}
 
-        // Find the end of the JSON object (newline delimiter)
-        std::string request_data(buffer, received);
-        size_t newline_pos = request_data.find('\n');
-        if (newline_pos == std::string::npos) {
-            // No newline found, use entire buffer
-            newline_pos = request_data.length();
-        }
+void SyncManager::handle_sync_request(ServerConnection& connection, const Message& msg) {
+    auto& session = server_session(connection);
+    if (msg.type != FrameType::SYNC_REQUEST) {
+        reject(connection, "Expected SYNC_REQUEST");
+        return;
+    }
+
+    PhaseTimer timer(session.timings.auth);
+    json request = json::parse(msg.payload);
+    // Clients name their vault by its change feed id; older ones only sent
+    // the id they know us by
+    session.peer_feed = request.value("feed", "").c_str();
+    session.device_id = session.peer_feed.empty() ? request.value("device_id", "").c_str() : session.peer_feed;
 
-        std::string json_str = request_data.substr(0, newline_pos);
-        json request = json::parse(json_str);
-        std::cout << "  Parsed sync request from device: " << request.value("device_id", "unknown") << std::endl;
+    int version = request.value("version", 1);
+    if (version < PROTOCOL_VERSION) {
+        reject(connection, "Sync protocol version " + std::to_string(PROTOCOL_VERSION) + " required");
+        return;
+    }
 
-        // Check if there's remaining data (the digest might be in the same buffer)
-        std::string remaining_data;
-        if (newline_pos + 1 < request_data.length()) {
-            remaining_data = request_data.substr(newline_pos + 1);
-            std::cout << "  Found additional data in buffer (" << remaining_data.length() << " bytes)" << std::endl;
+    // Use the first compression the client offers that we support
+    Compression compression = Compression::NONE;
+    if (compression_enabled_ && request.contains("compression") && request["compression"].is_array()) {
+        auto supported = supported_compressions();
+        for (const auto& name : request["compression"]) {
+            Compression offered;
+            if (name.is_string() &&
+                parse_compression(name.get<crypto::SecureString>().c_str(), offered) &&
+                std::find(supported.begin(), supported.end(), offered) != supported.end()) {
+                compression = offered;
+                break;
+            }
         }
+    }
 
-        // Authenticate if required
-        if (!passphrase_.empty()) {
-            if (!authenticate_connection(client_socket, AuthMethod::PASSPHRASE, passphrase_)) {
-                return;
+    // Our preferred cipher if the client offers it, else the first it offers
+    crypto::Cipher cipher = crypto::preferred_cipher();
+    bool have_cipher = false;
+    if (request.contains("ciphers") && request["ciphers"].is_array()) {
+        for (const auto& name : request["ciphers"]) {
+            crypto::Cipher offered;
+            if (name.is_string() && parse_record_cipher(name.get<crypto::SecureString>().c_str(), offered) &&
+                (!have_cipher || offered == crypto::preferred_cipher())) {
+                cipher = offered;
+                have_cipher = true;
             }
         }
+    }
+    std::vector<uint8_t> client_share;
+    if (!have_cipher || !hex_member(request, "key_share", KEY_SHARE_SIZE, client_share)) {
+        reject(connection, "Encrypted sync required");
+        return;
+    }
+
+    crypto::SecureBytes server_psk;
+    std::vector<uint8_t> salt;
+    {
+        std::lock_guard<std::mutex> lock(psk_mutex_);
+        server_psk = psk_;
+        salt = psk_salt_;
+    }
+    bool auth_required = !server_psk.empty();
+    if (!auth_required) {
+        server_psk = empty_psk();
+    }
 
-        // Receive client digest first (client sends first)
-        std::string digest_json_str;
+    // A ticket we issued under the current passphrase stands in for it
+    crypto::SecureBytes psk = server_psk;
+    bool resumed = request.contains("ticket") && request["ticket"].is_string() &&
+        ticket_issuer().redeem(request["ticket"].get<crypto::SecureString>().c_str(), server_psk, psk);
 
-        if (!remaining_data.empty()) {
-            // Digest might be in the remaining data
-            size_t digest_newline = remaining_data.find('\n');
-            if (digest_newline != std::string::npos) {
-                // Complete digest found in remaining data
-                digest_json_str = remaining_data.substr(0, digest_newline);
-                std::cout << "  Found client digest in initial buffer" << std::endl;
-            } else {
-                // Partial digest, need to receive more
-                std::cout << "  Partial digest in buffer, receiving more..." << std::endl;
-                received = recv(client_socket, buffer, sizeof(buffer) - 1, 0);
-                if (received <= 0) {
-                    std::cout << "  ✗ Failed to receive rest of client digest" << std::endl;
-                    return;
+    KeyShare share;
+    crypto::SecureBytes shared_secret;
+    if (!share.agree(client_share.data(), shared_secret)) {
+        reject(connection, "Invalid key share");
+        return;
+    }
+
+    json accept = {
+        {"version", PROTOCOL_VERSION},
+        {"auth", auth_required ? "passphrase" : "none"},
+        {"compression", compression_name(compression)},
+        {"cipher", record_cipher_name(cipher)},
+        {"key_share", bytes_to_hex(share.public_key(), KEY_SHARE_SIZE)},
+        {"resumed", resumed}
+    };
+    if (auth_required && !resumed) {
+        accept["salt"] = bytes_to_hex(salt.data(), salt.size());
+    }
+    crypto::SecureString accept_payload = accept.dump();
+    uint8_t transcript[TRANSCRIPT_HASH_SIZE];
+    transcript_hash(msg.payload, accept_payload, transcript);
+    SessionKeys keys = derive_session_keys(cipher, psk, shared_secret, transcript);
+
+    // Everything after SYNC_ACCEPT is sealed. Prove we hold the keys and
+    // hand out a ticket; the client's finished value must come next.
+    connection.send(FrameType::SYNC_ACCEPT, accept_payload);
+    connection.set_compression(compression);
+    connection.set_ciphers(keys.server_cipher(), keys.client_cipher());
+    connection.send(FrameType::AUTH_CONFIRM, finished_payload(keys.server_finished));
+    json ticket = {
+        {"ticket", ticket_issuer().issue(keys.resumption_secret, server_psk)},
+        {"lifetime", std::chrono::duration_cast<std::chrono::seconds>(TicketIssuer::LIFETIME).count()}
+    };
+    connection.send(FrameType::SESSION_TICKET, ticket.dump());
+
+    session.client_finished = std::move(keys.client_finished);
+    session.stage = ServerSession::Stage::AUTH;
+}
+
+void SyncManager::handle_auth_response(ServerConnection& connection, const Message& response) {
+    auto& session = server_session(connection);
+    PhaseTimer timer(session.timings.auth);
+    if (response.type != FrameType::AUTH_RESPONSE || response.payload.size() != FINISHED_SIZE ||
+        CRYPTO_memcmp(response.payload.data(), session.client_finished.data(), FINISHED_SIZE) != 0) {
+        std::cout << "  ✗ Authentication failed" << std::endl;
+        reject(connection, "Authentication failed");
+        return;
+    }
+    session.client_finished.clear();
+    begin_reconcile(connection);
+}
+
+void SyncManager::begin_reconcile(ServerConnection& connection) {
+    auto& session = server_session(connection);
+    session.stage = ServerSession::Stage::RECONCILE;
+    session.entries = entries_.snapshot();
+    session.position = session.entries->position();
+}
+
+// Answer change feed and digest tree queries until the client asks for
+// entries
+void SyncManager::handle_reconcile_message(ServerConnection& connection, Message& msg) {
+    if (msg.type == FrameType::RESUME) {
+        handle_resume(connection, msg);
+        return;
+    }
+
+    auto& session = server_session(connection);
+    auto message = std::make_shared<Message>(std::move(msg));
+
+    if (message->type == FrameType::FEED_QUERY) {
+        auto valid = std::make_shared<bool>(false);
+        connection.run(ServerConnection::Lane::INPUT,
+            [this, &connection, &session, message, valid]() {
+                PhaseTimer timer(session.timings.digest_exchange);
+                json reply;
+                *valid = answer_feed_query(*session.entries, *message, reply);
+                if (*valid) {
+                    connection.send(FrameType::FEED, reply.dump());
                 }
-                buffer[received] = '\0';
-                remaining_data += std::string(buffer, received);
-                digest_newline = remaining_data.find('\n');
-                if (digest_newline == std::string::npos) {
-                    digest_newline = remaining_data.length();
+            },
+            [&connection, valid]() {
+                if (!*valid) {
+                    std::cout << "  ✗ Invalid change feed query" << std::endl;
+                    reject(connection, "Invalid change feed query");
+                }
+            });
+        return;
+    }
+
+    if (message->type == FrameType::TREE_QUERY) {
+        auto valid = std::make_shared<bool>(false);
+        connection.run(ServerConnection::Lane::INPUT,
+            [this, &connection, &session, message, valid]() {
+                if (!session.tree) {
+                    PhaseTimer timer(session.timings.digest_build);
+                    session.tree = std::make_unique<DigestTree>(compute_vault_digest(*session.entries),
+                                                                session.entries->tombstones());
                 }
-                digest_json_str = remaining_data.substr(0, digest_newline);
+                PhaseTimer timer(session.timings.digest_exchange);
+                json reply;
+                *valid = answer_tree_query(*session.tree, *message, reply);
+                if (*valid) {
+                    connection.send(FrameType::TREE_NODES, reply.dump());
+                }
+            },
+            [&connection, valid]() {
+                if (!*valid) {
+                    std::cout << "  ✗ Invalid digest query" << std::endl;
+                    reject(connection, "Invalid digest query");
+                }
+            });
+        return;
+    }
+
+    if (message->type != FrameType::ENTRY_REQUEST) {
+        reject(connection, "Expected FEED_QUERY, TREE_QUERY, ENTRY_REQUEST or RESUME");
+        return;
+    }
+
+    connection.run(ServerConnection::Lane::INPUT,
+        [this, &connection, &session, message]() {
+            // What is not diffing or applying is answering the request
+            auto start = SteadyClock::now();
+            auto local = session.timings.diff + session.timings.apply;
+            json request = json::parse(message->payload);
+            json bases = json::array();
+            {
+                PhaseTimer timer(session.timings.diff);
+                session.outgoing = find_entries_by_id(*session.entries, string_ids(request, "ids"));
             }
-        } else {
-            // Need to receive digest separately
-            std::cout << "  Waiting for client digest..." << std::endl;
-            received = recv(client_socket, buffer, sizeof(buffer) - 1, 0);
-            if (received <= 0) {
-                std::cout << "  ✗ Failed to receive client digest" << std::endl;
-                return;
+            session.tree.reset();
+            {
+                PhaseTimer timer(session.timings.apply);
+                session.result.deletions_received +=
+                    static_cast<int>(apply_deletions(parse_tombstones(request, "tombstones")));
             }
-            buffer[received] = '\0';
-            std::cout << "  Received client digest (" << received << " bytes)" << std::endl;
 
-            std::string digest_data(buffer, received);
-            size_t digest_newline = digest_data.find('\n');
-            if (digest_newline == std::string::npos) {
-                digest_newline = digest_data.length();
+            // Deltas against the client's versions; then describe ours of
+            // the entries it offers to update, before any entries go out
+            if (field_deltas_enabled_) {
+                PhaseTimer timer(session.timings.diff);
+                if (request.contains("bases") && request["bases"].is_array()) {
+                    replace_with_deltas(session.outgoing, request["bases"]);
+                }
+                bases = pin_bases(*session.entries, string_ids(request, "offer"), session.bases);
             }
-            digest_json_str = digest_data.substr(0, digest_newline);
-        }
+            session.entries.reset();
+
+            // Where deltas may go either way, entries whose delta does not
+            // expand are fetched whole once the exchange is over
+            bool described = !bases.empty() ||
+                (request.contains("bases") && request["bases"].is_array() && !request["bases"].empty());
+            session.refetch = field_deltas_enabled_ && request.value("refetch", false) && described;
+            json reply = {{"bases", std::move(bases)}};
+            if (session.refetch) {
+                reply["refetch"] = true;
+            }
+            if (request.value("checkpoint", false)) {
+                session.checkpoint = crypto::generate_uuid();
+                reply["session"] = session.checkpoint;
+            }
+            connection.send(FrameType::ENTRY_BASES, reply.dump());
+            session.timings.digest_exchange +=
+                elapsed_since(start) - (session.timings.diff + session.timings.apply - local);
+        },
+        [this, &connection, &session]() {
+            // Batches go out from on_writable() while the client's come in
+            session.stage = ServerSession::Stage::EXCHANGE;
+            if (!session.checkpoint.empty()) {
+                resumable_[session.checkpoint] = {connection.shared_from_this(), session.device_id,
+                                                  std::chrono::steady_clock::time_point::max()};
+            }
+        });
+}
 
-        json client_digest_msg = json::parse(digest_json_str);
+// A client whose connection dropped during the exchange carries on from the
+// batches each side committed. The session id came in ENTRY_BASES over an
+// authenticated connection, and must come back from the same device.
+void SyncManager::handle_resume(ServerConnection& connection, const Message& msg) {
+    json request = json::parse(msg.payload);
+    std::string id = request.value("session", "").c_str();
+    size_t received = 0;
+    if (request.contains("received") && request["received"].is_number_unsigned()) {
+        received = request["received"].get<size_t>();
+    }
 
-        // Now compute and send our digest
-        auto local_digest = compute_vault_digest();
-        std::cout << "  Computing digest for " << local_digest.size() << " local entries" << std::endl;
+    prune_resumable();
+    std::shared_ptr<ServerConnection> previous;
+    auto it = resumable_.find(id);
+    if (it != resumable_.end() && it->second.connection.get() != &connection &&
+        it->second.device_id == server_session(connection).device_id) {
+        previous = std::move(it->second.connection);
+        resumable_.erase(it);
+        prune_resumable();
+        // Still open if the link died without a reset; the client has
+        // given up on it, and its output may never drain
+        previous->abort();
+    }
 
-        // Send local digest
-        json digest_msg = {
-            {"type", "DIGEST"},
-            {"entries", json::array()}
-        };
+    // A task of the old connection still running would race us for the
+    // session; rare, since the client backs off before reconnecting
+    if (!previous || !previous->session || previous->busy(ServerConnection::Lane::INPUT) ||
+        previous->busy(ServerConnection::Lane::OUTPUT)) {
+        std::cout << "  Cannot resume the exchange; client reconciles again" << std::endl;
+        json reply = {{"reset", true}};
+        connection.send(FrameType::RESUMED, reply.dump());
+        return;
+    }
 
-        for (const auto& entry : local_digest) {
-            auto time_t = std::chrono::system_clock::to_time_t(entry.modified);
-            digest_msg["entries"].push_back({
-                {"id", entry.id},
-                {"modified", time_t},
-                {"hash", entry.hash}
-            });
-        }
+    connection.session = std::move(previous->session);
+    auto& session = server_session(connection);
+    session.bytes_sent += previous->bytes_sent();
+    session.bytes_received += previous->bytes_received();
+    received = std::min(received, session.outgoing.size() / ENTRY_BATCH_SIZE + 1);
+    session.next_outgoing = std::min(received * ENTRY_BATCH_SIZE, session.next_outgoing);
+    session.sent_all = received > 0 && session.next_outgoing >= session.outgoing.size();
+    session.received_all = session.input_ended;
+    session.result.entries_sent = static_cast<int>(session.next_outgoing);
+    resumable_[session.checkpoint] = {connection.shared_from_this(), session.device_id,
+                                      std::chrono::steady_clock::time_point::max()};
+
+    json reply = {{"received", session.received_batches}};
+    connection.send(FrameType::RESUMED, reply.dump());
+    std::cout << "  Resumed the exchange after " << session.next_outgoing << " entries sent and "
+              << session.result.entries_received << " received" << std::endl;
+    finish_session(connection);
+}
 
-        std::string digest_str = digest_msg.dump() + "\n";
-        ssize_t sent = send(client_socket, digest_str.c_str(), digest_str.length(), 0);
-        if (sent <= 0) {
-            std::cout << "  ✗ Failed to send digest" << std::endl;
-            return;
+void SyncManager::prune_resumable() {
+    auto now = std::chrono::steady_clock::now();
+    auto live = std::chrono::steady_clock::time_point::max();
+    size_t parked = 0;
+    for (auto it = resumable_.begin(); it != resumable_.end();) {
+        if (it->second.expires <= now) {
+            it = resumable_.erase(it);
+        } else {
+            parked += it->second.expires != live;
+            ++it;
         }
-        std::cout << "  Sent digest to client" << std::endl;
+    }
 
-        // Parse the client digest that we already received
-        std::vector<EntryDigest> remote_digest;
+    // Past the limit the exchange parked longest goes first
+    for (; parked > MAX_PARKED_EXCHANGES; --parked) {
+        resumable_.erase(std::min_element(resumable_.begin(), resumable_.end(),
+            [](const auto& a, const auto& b) { return a.second.expires < b.second.expires; }));
+    }
 
-        if (!client_digest_msg.contains("entries") || !client_digest_msg["entries"].is_array()) {
-            return;  // Invalid message format
-        }
+    {
+        std::lock_guard<std::mutex> lock(sessions_mutex_);
+        parked_exchanges_ = static_cast<int>(parked);
+    }
+    sessions_cv_.notify_all();
+}
 
-        for (const auto& entry : client_digest_msg["entries"]) {
-            if (!entry.is_object() || !entry.contains("id") ||
-                !entry.contains("modified") || !entry.contains("hash")) {
-                continue;  // Skip invalid entries
+void SyncManager::handle_entries_message(ServerConnection& connection, Message& msg) {
+    auto& session = server_session(connection);
+    if (msg.type == FrameType::ENTRY_REQUEST && session.refetch && session.received_all &&
+        !session.refetch_request) {
+        // Our last batch may still be on its way out
+        session.refetch_request = std::make_shared<Message>(std::move(msg));
+        finish_session(connection);
+        return;
+    }
+    if (msg.type != FrameType::ENTRIES) {
+        reject(connection, "Expected ENTRIES");
+        return;
+    }
+
+    // Apply on a worker; the next batch is read meanwhile. The completion
+    // flags change only on the loop thread, where finish_session() reads
+    // them while the other lane may be running.
+    auto message = std::make_shared<Message>(std::move(msg));
+    auto more = std::make_shared<bool>(true);
+    connection.run(ServerConnection::Lane::INPUT,
+        [this, &session, message, more]() {
+            std::vector<json> batch;
+            {
+                PhaseTimer timer(session.timings.receive);
+                *more = parse_entry_batch(*message, batch);
+                expand_deltas(batch, session.bases, session.failed);
+            }
+            if (!batch.empty()) {
+                PhaseTimer timer(session.timings.apply);
+                auto conflicts = apply_changes(batch, SyncStrategy::NEWEST_WINS);
+                session.result.entries_received += batch.size();
+                session.result.conflicts_resolved += conflicts.size();
             }
+            ++session.received_batches;
+            session.input_ended = !*more;
+        },
+        [this, &connection, &session, more]() {
+            session.received_all = !*more;
+            finish_session(connection);
+        });
+}
 
-            EntryDigest digest;
-            digest.id = entry["id"];
-            digest.modified = std::chrono::system_clock::from_time_t(entry["modified"]);
-            digest.hash = entry["hash"];
-            remote_digest.push_back(digest);
-        }
+void SyncManager::on_writable(ServerConnection& connection) {
+    auto& session = server_session(connection);
+    if (session.stage != ServerSession::Stage::EXCHANGE || session.sent_all) {
+        return;
+    }
 
-        // Determine what to send
-        auto entries_to_send = find_entries_to_send(local_digest, remote_digest);
-        std::cout << "  Found " << entries_to_send.size() << " entries to send to client" << std::endl;
+    connection.run(ServerConnection::Lane::OUTPUT,
+        [&connection, &session]() {
+            PhaseTimer timer(session.timings.send);
+            size_t begin = session.next_outgoing;
+            next_entry_batch(session.outgoing, session.next_outgoing, session.batch);
+            connection.send(FrameType::ENTRIES, session.batch.data(), session.batch.size());
+            session.result.entries_sent += session.next_outgoing - begin;
+
+            // A checkpointed exchange may have to send them again
+            if (session.checkpoint.empty()) {
+                std::fill(session.outgoing.begin() + begin, session.outgoing.begin() + session.next_outgoing,
+                          nullptr);
+            }
+        },
+        [this, &connection, &session]() {
+            session.sent_all = session.next_outgoing >= session.outgoing.size();
+            finish_session(connection);
+        });
+}
 
-        // Send entries
-        if (!send_entries(client_socket, entries_to_send)) {
-            std::cout << "  ✗ Failed to send entries" << std::endl;
-            return;
+void SyncManager::finish_session(ServerConnection& connection) {
+    auto& session = server_session(connection);
+    if (!session.sent_all || !session.received_all || session.completed) {
+        return;
+    }
+    if (session.refetch) {
+        if (session.refetch_request) {
+            begin_refetch(connection);
         }
-        std::cout << "  Sent " << entries_to_send.size() << " entries to client" << std::endl;
+        return;
+    }
 
-        // Receive entries from client using proper multi-packet handling
-        std::cout << "  Waiting for client entries..." << std::endl;
-        auto client_entries = receive_entries(client_socket);
-        std::cout << "  Received " << client_entries.size() << " entries from client" << std::endl;
+    session.completed = true;
+    report_failed_deltas(session.failed, session.result.errors);
+
+    // The client has our changes and deletions up to the snapshot it
+    // reconciled against, so tombstones up to there may go as far as it
+    // is concerned. Without this, peers that only ever connect to us
+    // would not hold collection back.
+    if (!session.peer_feed.empty()) {
+        std::lock_guard<std::mutex> lock(feed_mutex_);
+        storage::ChangeFeed::Watermark watermark;
+        feed_.find_watermark(session.device_id, watermark);
+        watermark.feed = session.peer_feed;
+        watermark.pushed = session.position;
+        feed_.set_watermark(session.device_id, watermark);
+    }
+    resumable_.erase(session.checkpoint);
+    std::cout << "  Sent " << session.result.entries_sent << " entries, received "
+              << session.result.entries_received << " (" << session.result.conflicts_resolved
+              << " conflicts resolved)" << std::endl;
+    std::cout << "✓ Sync server processing completed" << std::endl;
+    record_server_session(connection);
+    connection.close_after_flush();
+}
 
-        if (!client_entries.empty()) {
-            auto conflicts = apply_changes(client_entries, SyncStrategy::NEWEST_WINS);
-            std::cout << "  Applied changes (" << conflicts.size() << " conflicts resolved)" << std::endl;
-        }
-        std::cout << "✓ Sync server processing completed" << std::endl;
+// Another exchange, of whole entries: those the client asks for, for ours
+// whose deltas it could not expand, and ours that it could not expand
+void SyncManager::begin_refetch(ServerConnection& connection) {
+    auto& session = server_session(connection);
+    session.refetch = false;
+    auto message = session.refetch_request;
+    connection.run(ServerConnection::Lane::INPUT,
+        [this, &connection, &session, message]() {
+            PhaseTimer timer(session.timings.diff);
+            json request = json::parse(message->payload);
+            session.outgoing = find_entries_by_id(*entries_.snapshot(), string_ids(request, "ids"));
+            json reply = {{"ids", session.failed}};
+            session.failed.clear();
+            connection.send(FrameType::ENTRY_REQUEST, reply.dump());
+        },
+        [this, &connection, &session]() {
+            session.next_outgoing = 0;
+            session.sent_all = false;
+            session.received_all = false;
+            session.input_ended = false;
+            session.bases = BaseVersions();
+            finish_session(connection);
+        });
+}
 
-    } catch (const std::exception& e) {
-        std::cerr << "Error handling sync client: " << e.what() << std::endl;
+void SyncManager::record_server_session(ServerConnection& connection) {
+    auto& session = server_session(connection);
+    DeviceSyncResult client;
+    client.device_id = session.device_id;
+    client.entries_sent = session.result.entries_sent;
+    client.entries_received = session.result.entries_received;
+    client.conflicts_resolved = session.result.conflicts_resolved;
+    client.deletions_received = session.result.deletions_received;
+    client.errors = session.result.errors;
+    client.success = session.completed;
+    client.duration = std::chrono::duration_cast<std::chrono::milliseconds>(SteadyClock::now() - session.opened);
+    client.timings = session.timings;
+    client.bytes_sent = session.bytes_sent + connection.bytes_sent();
+    client.bytes_received = session.bytes_received + connection.bytes_received();
+
+    SyncResult result = session.result;
+    result.success = client.success;
+    result.duration = client.duration;
+    result.bytes_sent = client.bytes_sent;
+    result.bytes_received = client.bytes_received;
+    result.devices = {std::move(client)};
+    log_stats("server", result);
+}
+
+void SyncManager::log_stats(const char* role, const SyncResult& result) {
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    if (stats_log_.empty()) {
+        return;
+    }
+    json line = result.to_json();
+    line["role"] = role;
+    line["time"] = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    std::ofstream out(stats_log_, std::ios::app);
+    if (!out || !(out << line.dump() << '\n')) {
+        std::cerr << "Could not write sync stats to " << stats_log_ << std::endl;
     }
 }
 
+void SyncManager::set_stats_log(const std::string& path) {
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    stats_log_ = path;
+}
+
 SyncResult SyncManager::sync_with_devices(
     const std::vector<Device>& devices,
     SyncStrategy strategy,
     AuthMethod auth_method,
-    const std::string& passphrase) {
+    const crypto::SecureString& passphrase) {
 
+    auto start = SteadyClock::now();
     SyncResult total_result;
     total_result.success = true;
+    total_result.devices.resize(devices.size());
+
+    // Every session reconciles against this snapshot of the vault. Only
+    // sessions that cannot use the change feed need the digest tree.
+    auto entries = entries_.snapshot();
+    std::once_flag tree_built;
+    std::unique_ptr<DigestTree> digest_tree;
+    TreeSource tree = [&]() -> const DigestTree& {
+        std::call_once(tree_built, [&]() {
+            digest_tree = std::make_unique<DigestTree>(compute_vault_digest(*entries), entries->tombstones());
+        });
+        return *digest_tree;
+    };
+
+    if (devices.size() == 1) {
+        // Apply batches as they arrive
+        DeviceSyncResult& result = total_result.devices[0];
+        sync_with_device(devices[0], *entries, tree, auth_method, passphrase,
+            [this, strategy, &result](std::vector<json>& batch) {
+                result.conflicts_resolved += apply_changes(batch, strategy).size();
+            },
+            result);
+    } else if (!devices.empty()) {
+        // Sessions only read the vault; each stages what it receives
+        std::vector<std::vector<json>> received(devices.size());
+        std::vector<std::thread> sessions;
+        sessions.reserve(devices.size());
+        for (size_t i = 0; i < devices.size(); ++i) {
+            sessions.emplace_back([&, i]() {
+                sync_with_device(devices[i], *entries, tree, auth_method, passphrase,
+                    [&received, i](std::vector<json>& batch) {
+                        std::move(batch.begin(), batch.end(), std::back_inserter(received[i]));
+                    },
+                    total_result.devices[i]);
+            });
+        }
+        for (auto& session : sessions) {
+            session.join();
+        }
 
-    for (const auto& device : devices) {
-        try {
-            // Connect to device
-            int sock = socket(AF_INET, SOCK_STREAM, 0);
-            if (sock < 0) {
-                total_result.errors.push_back("Failed to create socket for " + device.name);
-                continue;
-            }
+        // Merge in device id order. Conflicts between devices resolve as
+        // they would had the devices been synced one after another.
+        std::vector<size_t> order(devices.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+        }
+        std::stable_sort(order.begin(), order.end(), [&devices](size_t a, size_t b) {
+            return devices[a].id < devices[b].id;
+        });
+
+        for (size_t i : order) {
+            PhaseTimer timer(total_result.devices[i].timings.apply);
+            total_result.devices[i].conflicts_resolved += apply_changes(received[i], strategy).size();
+        }
+    }
+
+    for (const auto& result : total_result.devices) {
+        total_result.entries_sent += result.entries_sent;
+        total_result.entries_received += result.entries_received;
+        total_result.conflicts_resolved += result.conflicts_resolved;
+        total_result.deletions_sent += result.deletions_sent;
+        total_result.deletions_received += result.deletions_received;
+        total_result.bytes_sent += result.bytes_sent;
+        total_result.bytes_received += result.bytes_received;
+        total_result.errors.insert(total_result.errors.end(), result.errors.begin(), result.errors.end());
+        total_result.success = total_result.success && result.success;
+    }
+    total_result.duration = std::chrono::duration_cast<std::chrono::milliseconds>(SteadyClock::now() - start);
+
+    // Save sync result to history
+    {
+        std::lock_guard<std::mutex> lock(history_mutex_);
+        sync_history_.push_back(total_result);
+    }
+    log_stats("client", total_result);
 
-            // Set socket timeout
-            struct timeval tv;
-            tv.tv_sec = SOCKET_TIMEOUT_SECONDS;
-            tv.tv_usec = 0;
-            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-            setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    return total_result;
+}
 
-            // Connect
-            struct sockaddr_in addr;
-            std::memset(&addr, 0, sizeof(addr));
-            addr.sin_family = AF_INET;
-            addr.sin_addr.s_addr = inet_addr(device.ip_address.c_str());
-            addr.sin_port = htons(device.port);
+bool SyncManager::sync_with_device(const Device& device, const EntrySnapshot& entries,
+                                   const TreeSource& tree, AuthMethod auth_method,
+                                   const crypto::SecureString& passphrase, const BatchSink& on_batch,
+                                   DeviceSyncResult& result) {
+    auto start = std::chrono::steady_clock::now();
+    result.device_id = device.id;
+    result.device_name = device.name;
+
+    int sock = -1;
+    auto fail = [&](const std::string& error) {
+        if (sock >= 0) {
+            close(sock);
+        }
+        result.errors.push_back(error);
+        result.duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start);
+        return false;
+    };
 
-            if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    try {
+        storage::ChangeFeed::Watermark watermark;
+        ExchangeCheckpoint checkpoint;
+        for (int attempt = 0;; ++attempt) {
+            if (attempt > 0) {
                 close(sock);
-                total_result.errors.push_back("Failed to connect to " + device.name);
-                continue;
+                sock = -1;
+                std::this_thread::sleep_for(std::chrono::milliseconds(RESUME_BACKOFF_MS << (attempt - 1)));
+                std::cout << "  " << device.name << ": reconnecting to resume the exchange (attempt "
+                          << attempt << " of " << RESUME_ATTEMPTS << ")" << std::endl;
             }
 
-            // Send sync request
-            json request = {
-                {"type", "SYNC_REQUEST"},
-                {"device_id", device.id},
-                {"vault_id", vault_path_}
-            };
-            std::string request_str = request.dump() + "\n";  // Add newline delimiter
-            send(sock, request_str.c_str(), request_str.length(), 0);
-
-            // Authenticate
-            if (auth_method != AuthMethod::NONE) {
-                if (!authenticate_connection(sock, auth_method, passphrase)) {
-                    close(sock);
-                    total_result.errors.push_back("Authentication failed for " + device.name);
+            // Once the server holds our exchange a dropped connection is
+            // worth another try; before that nothing would be saved
+            bool retry = !checkpoint.session.empty() && attempt < RESUME_ATTEMPTS;
+
+            {
+                PhaseTimer timer(result.timings.connect);
+                sock = connect_to_device(device);
+            }
+            if (sock < 0) {
+                if (retry) {
                     continue;
                 }
+                return fail("Failed to connect to " + device.name);
             }
 
-            // Exchange digests
-            auto local_digest = compute_vault_digest();
+            FrameChannel channel(sock);
+            WireCount wire(channel, result);
 
-            // Send our digest
-            json digest_msg = {
-                {"type", "DIGEST"},
-                {"entries", json::array()}
-            };
-
-            for (const auto& entry : local_digest) {
-                auto time_t = std::chrono::system_clock::to_time_t(entry.modified);
-                digest_msg["entries"].push_back({
-                    {"id", entry.id},
-                    {"modified", time_t},
-                    {"hash", entry.hash}
-                });
+            std::string error;
+            bool opened = false;
+            {
+                PhaseTimer timer(result.timings.auth);
+                opened = open_session(channel, device, auth_method, passphrase, error);
             }
-
-            std::string digest_str = digest_msg.dump() + "\n";
-            std::cout << "  Sending digest to server (" << local_digest.size() << " entries)..." << std::endl;
-            ssize_t sent = send(sock, digest_str.c_str(), digest_str.length(), 0);
-            if (sent <= 0) {
-                close(sock);
-                total_result.errors.push_back("Failed to send digest to " + device.name);
-                continue;
+            if (!opened) {
+                if (retry) {
+                    continue;
+                }
+                return fail(error);
             }
-            std::cout << "  Sent digest successfully" << std::endl;
 
-            // Receive remote digest
-            std::cout << "  Waiting for server digest..." << std::endl;
-            char buffer[65536];  // Increased buffer size
-            int received = recv(sock, buffer, sizeof(buffer) - 1, 0);
-            if (received <= 0) {
-                close(sock);
-                total_result.errors.push_back("Failed to receive digest from " + device.name);
-                continue;
+            bool resumed = false;
+            if (!checkpoint.session.empty()) {
+                bool answered = false;
+                {
+                    PhaseTimer timer(result.timings.digest_exchange);
+                    answered = resume_exchange(channel, checkpoint, resumed);
+                }
+                if (!answered) {
+                    if (retry) {
+                        continue;
+                    }
+                    return fail("Failed to resume the exchange with " + device.name);
+                }
+                std::cout << "  " << device.name << ": "
+                          << (resumed ? "resumed the exchange" : "exchange not resumable; reconciling again")
+                          << std::endl;
+            }
+            if (!resumed) {
+                // What is not building the tree or diffing is the exchange
+                // with the device
+                auto start = SteadyClock::now();
+                auto local = result.timings.digest_build + result.timings.diff;
+                bool prepared = prepare_exchange(channel, device, entries, tree, watermark, checkpoint,
+                                                 result, error);
+                result.timings.digest_exchange +=
+                    elapsed_since(start) - (result.timings.digest_build + result.timings.diff - local);
+                if (!prepared) {
+                    return fail(error);
+                }
             }
-            buffer[received] = '\0';
-            std::cout << "  Received digest (" << received << " bytes)" << std::endl;
 
-            // Find the end of the JSON object (newline delimiter)
-            std::string digest_data(buffer, received);
-            size_t digest_newline = digest_data.find('\n');
-            if (digest_newline == std::string::npos) {
-                digest_newline = digest_data.length();
+            // Both directions stream at once; the server started sending
+            // right after the bases
+            if (exchange_entries(channel, checkpoint, on_batch, result)) {
+                if (!checkpoint.refetch) {
+                    report_failed_deltas(checkpoint.failed, result.errors);
+                } else if (!refetch_entries(channel, entries, checkpoint, on_batch, result)) {
+                    return fail("Fetching whole entries from " + device.name + " failed");
+                }
+                break;
+            }
+            if (checkpoint.session.empty() || attempt >= RESUME_ATTEMPTS) {
+                return fail("Entry exchange with " + device.name + " failed");
             }
+        }
 
-            std::string digest_json_str = digest_data.substr(0, digest_newline);
-            json remote_digest_msg = json::parse(digest_json_str);
-            std::vector<EntryDigest> remote_digest;
+        // Its deletions go once its entries are in, so none comes back
+        {
+            PhaseTimer timer(result.timings.apply);
+            result.deletions_received += apply_deletions(checkpoint.buried);
+        }
 
-            if (!remote_digest_msg.contains("entries") || !remote_digest_msg["entries"].is_array()) {
-                close(sock);
-                total_result.errors.push_back("Invalid digest format from " + device.name);
-                continue;
-            }
+        // The device has what we had, and we its changes up to its position
+        if (change_feed_enabled_) {
+            watermark.pushed = entries.position();
+            std::lock_guard<std::mutex> lock(feed_mutex_);
+            feed_.set_watermark(device.id, watermark);
+        }
 
-            for (const auto& entry : remote_digest_msg["entries"]) {
-                if (!entry.is_object() || !entry.contains("id") ||
-                    !entry.contains("modified") || !entry.contains("hash")) {
-                    continue;  // Skip invalid entries
-                }
+        close(sock);
+        result.success = true;
+        result.duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start);
+        return true;
+
+    } catch (const std::exception& e) {
+        return fail("Error syncing with " + device.name + ": " + e.what());
+    }
+}
+
+int SyncManager::connect_to_device(const Device& device) {
+    // IPv4, or IPv6 as discovery reports it ("fe80::1%eth0" for link-local)
+    struct addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+    struct addrinfo* address = nullptr;
+    if (getaddrinfo(device.ip_address.c_str(), std::to_string(device.port).c_str(), &hints, &address) != 0) {
+        return -1;
+    }
+
+    int sock = socket(address->ai_family, SOCK_STREAM, 0);
+    if (sock < 0) {
+        freeaddrinfo(address);
+        return -1;
+    }
+
+    // Set socket timeout
+    struct timeval tv;
+    tv.tv_sec = SOCKET_TIMEOUT_SECONDS;
+    tv.tv_usec = 0;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    // Frames go out a message at a time already. With Nagle the first
+    // query after AUTH_RESPONSE would wait out the server's delayed ACK.
+    int nodelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    int connected = connect(sock, address->ai_addr, address->ai_addrlen);
+    freeaddrinfo(address);
+    if (connected < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+bool SyncManager::prepare_exchange(FrameChannel& channel, const Device& device, const EntrySnapshot& entries,
+                                   const TreeSource& tree, storage::ChangeFeed::Watermark& watermark,
+                                   ExchangeCheckpoint& checkpoint, DeviceSyncResult& result,
+                                   std::string& error) {
+    auto failed = [&error](const std::string& message) {
+        error = message;
+        return false;
+    };
+
+    // Ask for the changes since our watermark; descend the digest
+    // trees on first contact or when the watermark no longer holds
+    checkpoint = ExchangeCheckpoint();
+    std::vector<std::string> wanted_ids;
+    std::vector<std::string> update_ids;
+    TombstoneDiff tombstones;
+
+    watermark = storage::ChangeFeed::Watermark();
+    bool reset = true;
+    if (change_feed_enabled_) {
+        {
+            std::lock_guard<std::mutex> lock(feed_mutex_);
+            feed_.find_watermark(device.id, watermark);
+        }
+        if (!reconcile_feed(channel, entries, watermark, reset,
+                            checkpoint.outgoing, wanted_ids, update_ids, tombstones, result.timings)) {
+            return failed("Failed to query the change feed of " + device.name);
+        }
+    }
+    if (reset) {
+        const DigestTree* digests = nullptr;
+        {
+            PhaseTimer timer(result.timings.digest_build);
+            digests = &tree();
+        }
+        if (!reconcile_digests(channel, entries, *digests, checkpoint.outgoing, wanted_ids, update_ids,
+                               tombstones, result.timings)) {
+            return failed("Failed to reconcile digests with " + device.name);
+        }
+    }
+    result.incremental = !reset;
+
+    // Describe our versions of the entries we fetch, and offer the
+    // server the same for the entries we update, so both sides can
+    // send field deltas
+    json request_ids = {
+        {"ids", wanted_ids},
+        {"bases", json::array()},
+        {"offer", json::array()},
+        {"checkpoint", checkpoints_enabled_.load()},
+        {"refetch", true},
+        {"tombstones", tombstones_json(tombstones.to_send)}
+    };
+    result.deletions_sent = static_cast<int>(tombstones.to_send.size());
+    checkpoint.buried = std::move(tombstones.to_receive);
+    if (field_deltas_enabled_) {
+        PhaseTimer timer(result.timings.diff);
+        request_ids["bases"] = pin_bases(entries, wanted_ids, checkpoint.bases);
+        request_ids["offer"] = update_ids;
+    }
+    if (!channel.send_message(FrameType::ENTRY_REQUEST, request_ids.dump())) {
+        return failed("Failed to request entries from " + device.name);
+    }
+
+    Message bases_msg;
+    if (!channel.recv_message(bases_msg) || bases_msg.type != FrameType::ENTRY_BASES) {
+        return failed("No entry bases from " + device.name);
+    }
+    json server_bases = json::parse(bases_msg.payload);
+    if (field_deltas_enabled_ && server_bases.contains("bases") && server_bases["bases"].is_array()) {
+        PhaseTimer timer(result.timings.diff);
+        replace_with_deltas(checkpoint.outgoing, server_bases["bases"]);
+    }
+    if (checkpoints_enabled_ && server_bases.contains("session") && server_bases["session"].is_string()) {
+        checkpoint.session = server_bases["session"].get<crypto::SecureString>().c_str();
+    }
+    checkpoint.refetch = server_bases.value("refetch", false);
+    return true;
+}
+
+bool SyncManager::refetch_entries(FrameChannel& channel, const EntrySnapshot& entries,
+                                  ExchangeCheckpoint& checkpoint, const BatchSink& on_batch,
+                                  DeviceSyncResult& result) {
+    json request = {{"ids", checkpoint.failed}};
+    checkpoint.failed.clear();
+    Message reply;
+    {
+        PhaseTimer timer(result.timings.digest_exchange);
+        if (!channel.send_message(FrameType::ENTRY_REQUEST, request.dump()) ||
+            !channel.recv_message(reply) || reply.type != FrameType::ENTRY_REQUEST) {
+            return false;
+        }
+    }
+
+    // Whole entries both ways, so nothing is left to fail; resuming would
+    // have to start over, so a dropped connection ends the session
+    ExchangeCheckpoint round;
+    {
+        PhaseTimer timer(result.timings.diff);
+        round.outgoing = find_entries_by_id(entries, string_ids(json::parse(reply.payload), "ids"));
+    }
+    int sent = result.entries_sent;
+    if (!exchange_entries(channel, round, on_batch, result)) {
+        return false;
+    }
+    result.entries_sent = sent + static_cast<int>(round.outgoing.size());
+    report_failed_deltas(round.failed, result.errors);
+    return true;
+}
+
+bool SyncManager::resume_exchange(FrameChannel& channel, ExchangeCheckpoint& checkpoint, bool& resumed) {
+    json request = {
+        {"session", checkpoint.session},
+        {"received", checkpoint.received}
+    };
+    if (!channel.send_message(FrameType::RESUME, request.dump())) {
+        return false;
+    }
+
+    Message msg;
+    if (!channel.recv_message(msg) || msg.type != FrameType::RESUMED) {
+        return false;
+    }
+    json reply = json::parse(msg.payload);
+    resumed = !reply.value("reset", false) && reply.contains("received") && reply["received"].is_number_unsigned();
+    if (resumed) {
+        checkpoint.acknowledged = reply["received"].get<size_t>();
+    } else {
+        checkpoint = ExchangeCheckpoint();
+    }
+    return true;
+}
+
+bool SyncManager::open_session(FrameChannel& channel, const Device& device, AuthMethod auth_method,
+                               const crypto::SecureString& passphrase, std::string& error) {
+    auto failed = [&error](const std::string& message) {
+        error = message;
+        return false;
+    };
+
+    // Offer the ticket from our last session with this device, if any
+    TicketCache::Ticket ticket;
+    bool offered = session_resumption_enabled_ && ticket_cache().find(device.id, ticket);
+
+    std::string feed_id;
+    {
+        std::lock_guard<std::mutex> lock(feed_mutex_);
+        feed_id = feed_.id();
+    }
+
+    KeyShare share;
+    json request = {
+        {"version", PROTOCOL_VERSION},
+        {"device_id", device.id},
+        {"feed", feed_id},
+        {"vault_id", vault_path_},
+        {"compression", json::array()},
+        {"ciphers", json::array()},
+        {"key_share", bytes_to_hex(share.public_key(), KEY_SHARE_SIZE)}
+    };
+    if (compression_enabled_) {
+        for (auto compression : supported_compressions()) {
+            request["compression"].push_back(compression_name(compression));
+        }
+    }
+    for (auto cipher : record_ciphers()) {
+        request["ciphers"].push_back(record_cipher_name(cipher));
+    }
+    if (offered) {
+        request["ticket"] = ticket.ticket;
+    }
+    crypto::SecureString request_payload = request.dump();
+    if (!channel.send_message(FrameType::SYNC_REQUEST, request_payload)) {
+        return failed("Failed to send sync request to " + device.name);
+    }
+
+    Message reply;
+    if (!channel.recv_message(reply)) {
+        return failed("No response from " + device.name);
+    }
+    if (reply.type == FrameType::ERROR) {
+        return failed(device.name + " refused sync: " + error_message(reply));
+    }
+    if (reply.type != FrameType::SYNC_ACCEPT) {
+        return failed("Unexpected reply from " + device.name);
+    }
+
+    json accept = json::parse(reply.payload);
+    Compression compression = Compression::NONE;
+    if (!parse_compression(accept.value("compression", "none").c_str(), compression) ||
+        (compression != Compression::NONE && !compression_enabled_)) {
+        return failed(device.name + " chose an unsupported compression");
+    }
+
+    // Both sides must agree on using a passphrase
+    bool server_auth = accept.value("auth", "none") == "passphrase";
+    bool client_auth = auth_method == AuthMethod::PASSPHRASE && !passphrase.empty();
+    if (server_auth != client_auth) {
+        return failed(server_auth ?
+            device.name + " requires a sync passphrase" :
+            device.name + " does not use a sync passphrase");
+    }
+
+    crypto::Cipher cipher;
+    std::vector<uint8_t> server_share;
+    crypto::SecureBytes shared_secret;
+    if (!parse_record_cipher(accept.value("cipher", "").c_str(), cipher) ||
+        !hex_member(accept, "key_share", KEY_SHARE_SIZE, server_share) ||
+        !share.agree(server_share.data(), shared_secret)) {
+        return failed(device.name + " sent an invalid handshake");
+    }
 
-                EntryDigest digest;
-                digest.id = entry["id"];
-                digest.modified = std::chrono::system_clock::from_time_t(entry["modified"]);
-                digest.hash = entry["hash"];
-                remote_digest.push_back(digest);
+    // The pre-shared key: the ticket's secret when the server took it,
+    // else the passphrase under the server's salt
+    crypto::SecureBytes psk;
+    std::vector<uint8_t> salt;
+    if (accept.value("resumed", false)) {
+        if (!offered) {
+            return failed(device.name + " resumed a session we did not offer");
+        }
+        psk = ticket.secret;
+    } else if (server_auth) {
+        if (!hex_member(accept, "salt", 0, salt)) {
+            return failed(device.name + " sent an invalid handshake");
+        }
+        psk = derive_sync_psk(passphrase, salt);
+    } else {
+        psk = empty_psk();
+    }
+
+    uint8_t transcript[TRANSCRIPT_HASH_SIZE];
+    transcript_hash(request_payload, reply.payload, transcript);
+    SessionKeys keys = derive_session_keys(cipher, psk, shared_secret, transcript);
+    channel.set_compression(compression);
+
+    // With the wrong passphrase the server's first sealed frame fails to
+    // open, possibly already when the keys are set if it has arrived
+    Message confirm;
+    bool confirmed = false;
+    try {
+        channel.set_ciphers(keys.client_cipher(), keys.server_cipher());
+        confirmed = channel.recv_message(confirm) && confirm.type == FrameType::AUTH_CONFIRM &&
+                    confirm.payload.size() == FINISHED_SIZE &&
+                    CRYPTO_memcmp(confirm.payload.data(), keys.server_finished.data(), FINISHED_SIZE) == 0;
+    } catch (const std::exception&) {
+        confirmed = false;
+    }
+    if (!confirmed) {
+        ticket_cache().erase(device.id);
+        return failed(server_auth ? "Authentication failed for " + device.name :
+                                    "Failed to set up encryption with " + device.name);
+    }
+
+    Message ticket_msg;
+    if (!channel.recv_message(ticket_msg) || ticket_msg.type != FrameType::SESSION_TICKET) {
+        return failed("No session ticket from " + device.name);
+    }
+    json issued = json::parse(ticket_msg.payload);
+    if (session_resumption_enabled_ && issued.contains("ticket") && issued["ticket"].is_string()) {
+        auto lifetime = std::min<std::chrono::seconds>(std::chrono::seconds(issued.value("lifetime", 0)),
+                                                       TicketIssuer::LIFETIME);
+        ticket_cache().store(device.id, {issued["ticket"].get<crypto::SecureString>().c_str(),
+                                         keys.resumption_secret,
+                                         std::chrono::steady_clock::now() + lifetime});
+    }
+
+    if (!channel.send_message(FrameType::AUTH_RESPONSE, finished_payload(keys.client_finished))) {
+        return failed("Failed to send finished message to " + device.name);
+    }
+    std::cout << "  " << device.name << ": secure channel " << record_cipher_name(cipher)
+              << (accept.value("resumed", false) ? ", resumed from ticket" : "") << std::endl;
+    return true;
+}
+
+// Client side of reconciliation. Each round queries the hash and size of
+// every path still in question; the server answers only for paths that differ,
+// with child hashes for large nodes and entry digests for small ones. Rounds
+// stop when every differing path has resolved to entry digests.
+bool SyncManager::reconcile_digests(FrameChannel& channel, const EntrySnapshot& entries,
+                                    const DigestTree& tree,
+                                    std::vector<EntryRef>& entries_to_send,
+                                    std::vector<std::string>& wanted_ids,
+                                    std::vector<std::string>& update_ids,
+                                    TombstoneDiff& tombstones,
+                                    SyncTimings& timings) {
+    std::vector<std::string> pending = {""};
+    std::vector<EntryDigest> local_diff;
+    std::vector<EntryDigest> remote_diff;
+    std::vector<Tombstone> local_tombstones;
+    std::vector<Tombstone> remote_tombstones;
+
+    while (!pending.empty()) {
+        json query = {{"nodes", json::array()}};
+        for (const auto& path : pending) {
+            auto node = tree.node(path);
+            query["nodes"].push_back({
+                {"path", path},
+                {"hash", DigestTree::to_hex(node.hash)},
+                {"count", node.count}
+            });
+        }
+        if (!channel.send_message(FrameType::TREE_QUERY, query.dump())) {
+            return false;
+        }
+
+        Message msg;
+        if (!channel.recv_message(msg) || msg.type != FrameType::TREE_NODES) {
+            return false;
+        }
+        json reply = json::parse(msg.payload);
+        if (!reply.contains("nodes") || !reply["nodes"].is_array()) {
+            return false;
+        }
+
+        // Accept one answer per queried path, nothing else
+        std::unordered_set<std::string> asked(pending.begin(), pending.end());
+        pending.clear();
+
+        for (const auto& node : reply["nodes"]) {
+            if (!node.is_object() || !node.contains("path") || !node["path"].is_string()) {
+                return false;
+            }
+            std::string path = node["path"].get<crypto::SecureString>().c_str();
+            if (asked.erase(path) == 0) {
+                return false;
             }
 
-            // Send our entries (always send, even if empty)
-            auto entries_to_send = find_entries_to_send(local_digest, remote_digest);
-            std::cout << "  Sending " << entries_to_send.size() << " entries to server..." << std::endl;
-            if (send_entries(sock, entries_to_send)) {
-                total_result.entries_sent += entries_to_send.size();
-                std::cout << "  Sent successfully" << std::endl;
+            if (node.contains("children")) {
+                const auto& children = node["children"];
+                if (!children.is_array() || children.size() != DigestTree::FANOUT ||
+                    path.size() == DigestTree::MAX_DEPTH) {
+                    return false;
+                }
+                for (size_t i = 0; i < DigestTree::FANOUT; ++i) {
+                    std::string hex = children[i].get<crypto::SecureString>().c_str();
+                    DigestTree::Hash remote_hash{};  // "" is an empty subtree
+                    if (!hex.empty() && !DigestTree::from_hex(hex, remote_hash)) {
+                        return false;
+                    }
+                    std::string child = DigestTree::child_path(path, i);
+                    if (tree.node(child).hash != remote_hash) {
+                        pending.push_back(child);
+                    }
+                }
+            } else if (node.contains("entries") && node["entries"].is_array()) {
+                auto local = tree.entries_under(path);
+                local_diff.insert(local_diff.end(), local.begin(), local.end());
+
+                for (const auto& entry : node["entries"]) {
+                    EntryDigest ed;
+                    if (parse_digest(entry, ed)) {
+                        remote_diff.push_back(ed);
+                    }
+                }
+
+                auto buried_here = tree.tombstones_under(path);
+                local_tombstones.insert(local_tombstones.end(), buried_here.begin(), buried_here.end());
+                auto buried_there = parse_tombstones(node, "tombstones");
+                remote_tombstones.insert(remote_tombstones.end(), buried_there.begin(), buried_there.end());
             } else {
-                std::cout << "  Failed to send entries" << std::endl;
+                return false;
             }
+        }
+    }
 
-            // Receive their entries
-            std::cout << "  Waiting for server entries..." << std::endl;
-            auto received_entries = receive_entries(sock);
-            std::cout << "  Received " << received_entries.size() << " entries from server" << std::endl;
-            if (!received_entries.empty()) {
-                auto conflicts = apply_changes(received_entries, strategy);
-                total_result.entries_received += received_entries.size();
-                total_result.conflicts_resolved += conflicts.size();
-            }
+    PhaseTimer timer(timings.diff);
+    split_diff(entries, local_diff, remote_diff, local_tombstones, remote_tombstones,
+               entries_to_send, wanted_ids, update_ids, tombstones);
+    return true;
+}
 
-            close(sock);
+void SyncManager::split_diff(const EntrySnapshot& entries, const std::vector<EntryDigest>& local_diff,
+                             const std::vector<EntryDigest>& remote_diff,
+                             const std::vector<Tombstone>& local_tombstones,
+                             const std::vector<Tombstone>& remote_tombstones,
+                             std::vector<EntryRef>& entries_to_send, std::vector<std::string>& wanted_ids,
+                             std::vector<std::string>& update_ids, TombstoneDiff& tombstones) {
+    auto diff = diff_digests(local_diff, remote_diff);
+    tombstones = diff_tombstones(local_tombstones, remote_tombstones);
+
+    // Our versions the peer's new deletions bury go nowhere, and neither do
+    // its versions that ours bury; the deletions go instead
+    if (!tombstones.to_receive.empty()) {
+        std::unordered_map<std::string, const EntryDigest*> local_by_id;
+        for (const auto& digest : local_diff) {
+            local_by_id.emplace(digest.id, &digest);
+        }
+        auto buried_remotely = [&](const std::string& id) {
+            auto key = storage::TombstoneSet::key_of(id);
+            auto it = std::lower_bound(tombstones.to_receive.begin(), tombstones.to_receive.end(), key,
+                                       [](const Tombstone& tombstone, const storage::TombstoneSet::Key& k) {
+                                           return tombstone.key < k;
+                                       });
+            auto local = local_by_id.find(id);
+            return it != tombstones.to_receive.end() && it->key == key && local != local_by_id.end() &&
+                   storage::buries(it->deleted, std::chrono::system_clock::to_time_t(local->second->modified));
+        };
+        diff.to_send.erase(std::remove_if(diff.to_send.begin(), diff.to_send.end(), buried_remotely),
+                           diff.to_send.end());
+    }
+    const auto& buried_here = entries.tombstones();
+    if (!buried_here.empty()) {
+        std::unordered_map<std::string, const EntryDigest*> remote_by_id;
+        for (const auto& digest : remote_diff) {
+            remote_by_id.emplace(digest.id, &digest);
+        }
+        auto buried_locally = [&](const std::string& id) {
+            const auto* tombstone = buried_here.find(storage::TombstoneSet::key_of(id));
+            auto remote = remote_by_id.find(id);
+            return tombstone && remote != remote_by_id.end() &&
+                   storage::buries(tombstone->deleted, std::chrono::system_clock::to_time_t(remote->second->modified));
+        };
+        diff.to_receive.erase(std::remove_if(diff.to_receive.begin(), diff.to_receive.end(), buried_locally),
+                              diff.to_receive.end());
+    }
+
+    entries_to_send = find_entries_by_id(entries, diff.to_send);
+    wanted_ids = std::move(diff.to_receive);
 
-        } catch (const std::exception& e) {
-            total_result.errors.push_back("Error syncing with " + device.name + ": " + e.what());
-            total_result.success = false;
+    // Entries we send that the server holds an older version of
+    std::unordered_set<std::string> remote_ids;
+    for (const auto& digest : remote_diff) {
+        remote_ids.insert(digest.id);
+    }
+    update_ids.clear();
+    for (const auto& id : diff.to_send) {
+        if (remote_ids.count(id)) {
+            update_ids.push_back(id);
         }
     }
+}
 
-    // Save sync result to history
-    {
-        std::lock_guard<std::mutex> lock(history_mutex_);
-        sync_history_.push_back(total_result);
+bool SyncManager::answer_tree_query(const DigestTree& tree, const Message& query, json& reply) {
+    json request = json::parse(query.payload);
+    if (!request.contains("nodes") || !request["nodes"].is_array()) {
+        return false;
     }
 
-    return total_result;
+    reply = {{"nodes", json::array()}};
+    for (const auto& node : request["nodes"]) {
+        if (!node.is_object() || !node.contains("path") || !node["path"].is_string() ||
+            !node.contains("hash") || !node["hash"].is_string()) {
+            return false;
+        }
+        std::string path = node["path"].get<crypto::SecureString>().c_str();
+        DigestTree::Hash remote_hash;
+        if (!DigestTree::valid_path(path) ||
+            !DigestTree::from_hex(node["hash"].get<crypto::SecureString>().c_str(), remote_hash)) {
+            return false;
+        }
+        size_t remote_count = node.value("count", size_t(0));
+
+        auto local = tree.node(path);
+        if (local.hash == remote_hash) {
+            continue;  // Subtree in sync
+        }
+
+        json answer = {{"path", path}};
+        if (local.count <= DigestTree::LEAF_SIZE || remote_count == 0 ||
+            path.size() == DigestTree::MAX_DEPTH) {
+            // Small subtree, or the client has nothing here: list its entries
+            json entries = json::array();
+            for (const auto& entry : tree.entries_under(path)) {
+                entries.push_back(digest_json(entry));
+            }
+            answer["entries"] = std::move(entries);
+            auto tombstones = tree.tombstones_under(path);
+            if (!tombstones.empty()) {
+                answer["tombstones"] = tombstones_json(tombstones);
+            }
+        } else {
+            json children = json::array();
+            for (size_t i = 0; i < DigestTree::FANOUT; ++i) {
+                auto child = tree.node(DigestTree::child_path(path, i));
+                children.push_back(child.count > 0 ? DigestTree::to_hex(child.hash) : std::string());
+            }
+            answer["children"] = std::move(children);
+        }
+        reply["nodes"].push_back(std::move(answer));
+    }
+
+    return true;
 }
 
-bool SyncManager::authenticate_connection(int socket, AuthMethod method, const std::string& passphrase) {
-    if (method == AuthMethod::NONE) {
-        return true;
+bool SyncManager::reconcile_feed(FrameChannel& channel, const EntrySnapshot& entries,
+                                 storage::ChangeFeed::Watermark& watermark, bool& reset,
+                                 std::vector<EntryRef>& entries_to_send, std::vector<std::string>& wanted_ids,
+                                 std::vector<std::string>& update_ids, TombstoneDiff& tombstones,
+                                 SyncTimings& timings) {
+    // A watermark past our own position means the vault was replaced, say
+    // by a backup, since we last synced: we cannot tell what changed
+    bool valid = !watermark.feed.empty() && watermark.pushed <= entries.position();
+    std::vector<const json*> changed;
+    json query = {
+        {"feed", valid ? watermark.feed : std::string()},
+        {"since", valid ? watermark.pulled : 0},
+        {"clock", entries.position()},
+        {"changes", json::array()}
+    };
+    if (valid) {
+        for (size_t position : entries.changed_since(watermark.pushed)) {
+            const json& entry = entries[position];
+            if (entry.is_object() && entry.contains("id") && entry["id"].is_string()) {
+                query["changes"].push_back(entry["id"]);
+                changed.push_back(&entry);
+            }
+        }
+    }
+    if (!channel.send_message(FrameType::FEED_QUERY, query.dump())) {
+        return false;
+    }
+
+    Message msg;
+    if (!channel.recv_message(msg) || msg.type != FrameType::FEED) {
+        return false;
     }
+    json reply = json::parse(msg.payload);
+    if (!reply.contains("feed") || !reply["feed"].is_string() ||
+        !reply.contains("position") || !reply["position"].is_number_unsigned()) {
+        return false;
+    }
+    watermark.feed = reply["feed"].get<crypto::SecureString>().c_str();
+    watermark.pulled = reply["position"].get<storage::Hlc>();
+    entries_.observe(watermark.pulled);
 
-    if (method == AuthMethod::PASSPHRASE) {
-        // Send challenge
-        unsigned char challenge[32];
-        RAND_bytes(challenge, sizeof(challenge));
-        send(socket, challenge, sizeof(challenge), 0);
+    reset = !valid || reply.value("reset", false);
+    if (reset) {
+        return true;
+    }
+    if (!reply.contains("entries") || !reply["entries"].is_array()) {
+        return false;
+    }
 
-        // Receive response
-        unsigned char response[32];
-        int received = recv(socket, response, sizeof(response), 0);
-        if (received != sizeof(response)) {
-            return false;
+    // Compare the server's changes and its versions of ours with our
+    // versions of both, as if the digest trees had led to exactly these
+    std::vector<EntryDigest> remote_diff;
+    std::vector<std::string> remote_ids;
+    for (const auto& node : reply["entries"]) {
+        EntryDigest ed;
+        if (parse_digest(node, ed)) {
+            remote_ids.push_back(ed.id);
+            remote_diff.push_back(std::move(ed));
+        }
+    }
+    std::unordered_set<const json*> seen(changed.begin(), changed.end());
+    for (const json* entry : entries.find(remote_ids)) {
+        if (seen.insert(entry).second) {
+            changed.push_back(entry);
         }
+    }
 
-        // Compute expected HMAC
-        unsigned char expected[32];
-        unsigned int expected_len;
-        HMAC(EVP_sha256(), passphrase.c_str(), passphrase.length(),
-             challenge, sizeof(challenge), expected, &expected_len);
+    PhaseTimer timer(timings.diff);
+    split_diff(entries, digest_entries(changed), remote_diff,
+               entries.tombstones().stamped_since(watermark.pushed), parse_tombstones(reply, "tombstones"),
+               entries_to_send, wanted_ids, update_ids, tombstones);
+    return true;
+}
 
-        // Compare
-        return CRYPTO_memcmp(response, expected, sizeof(expected)) == 0;
+bool SyncManager::answer_feed_query(const EntrySnapshot& entries, const Message& query, json& reply) {
+    json request = json::parse(query.payload);
+    if (!request.is_object() || !request.contains("feed") || !request["feed"].is_string() ||
+        !request.contains("since") || !request["since"].is_number_unsigned()) {
+        return false;
+    }
+    if (request.contains("clock") && request["clock"].is_number_unsigned()) {
+        entries_.observe(request["clock"].get<storage::Hlc>());
     }
 
-    // Other auth methods not implemented yet
-    return false;
+    std::string feed_id;
+    {
+        std::lock_guard<std::mutex> lock(feed_mutex_);
+        feed_id = feed_.id();
+    }
+    reply = {{"feed", feed_id}, {"position", entries.position()}};
+
+    // Another feed, or a position we have not reached: the vault was
+    // replaced since the client's last sync
+    storage::Hlc since = request["since"].get<storage::Hlc>();
+    if (request["feed"].get<crypto::SecureString>().c_str() != feed_id || since > entries.position()) {
+        reply["reset"] = true;
+        return true;
+    }
+
+    std::vector<const json*> selected;
+    std::unordered_set<const json*> seen;
+    for (size_t position : entries.changed_since(since)) {
+        selected.push_back(&entries[position]);
+        seen.insert(&entries[position]);
+    }
+    for (const json* entry : entries.find(string_ids(request, "changes"))) {
+        if (seen.insert(entry).second) {
+            selected.push_back(entry);
+        }
+    }
+
+    json digests = json::array();
+    for (const auto& digest : digest_entries(selected)) {
+        digests.push_back(digest_json(digest));
+    }
+    reply["entries"] = std::move(digests);
+    reply["tombstones"] = tombstones_json(entries.tombstones().stamped_since(since));
+    return true;
+}
+
+std::vector<EntryDigest> SyncManager::compute_vault_digest(const EntrySnapshot& entries) {
+    std::vector<const json*> all;
+    all.reserve(entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+        all.push_back(&entries[i]);
+    }
+    return digest_entries(all);
 }
 
-std::vector<EntryDigest> SyncManager::compute_vault_digest() {
+std::vector<EntryDigest> SyncManager::digest_entries(const std::vector<const json*>& entries) {
     std::vector<EntryDigest> digest;
+    std::lock_guard<std::mutex> lock(hashes_mutex_);
 
     try {
-        // Use the vault entries that were set via set_vault_entries()
-        if (vault_entries_.is_null() || !vault_entries_.is_array()) {
-            return digest;  // No entries or invalid format
-        }
-
-        for (const auto& entry : vault_entries_) {
-            if (!entry.is_object() || !entry.contains("id")) {
+        digest.reserve(entries.size());
+        for (const json* pointer : entries) {
+            const json& entry = *pointer;
+            if (!entry.is_object() || !entry.contains("id") || !entry["id"].is_string()) {
                 continue;  // Skip invalid entries
             }
 
             EntryDigest ed;
             ed.id = entry["id"];
 
-            // Parse timestamp
-            if (entry.contains("modified")) {
-                ed.modified = std::chrono::system_clock::from_time_t(entry["modified"]);
-            } else {
-                ed.modified = std::chrono::system_clock::now();
-            }
-
-            // Compute hash
-            std::string entry_str = entry.dump();
-            unsigned char hash[SHA256_DIGEST_LENGTH];
-            SHA256((unsigned char*)entry_str.c_str(), entry_str.length(), hash);
+            // The same time the store checks tombstones against
+            ed.modified = std::chrono::system_clock::from_time_t(storage::entry_modified(entry));
 
-            std::stringstream ss;
-            for (int i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
-                ss << std::hex << std::setw(2) << std::setfill('0') << (int)hash[i];
-            }
-            ed.hash = ss.str();
+            // Cached unless the entry changed since it was last hashed
+            ed.hash = storage::hash_to_hex(entry_hashes_.hash(entry));
 
             digest.push_back(ed);
         }
@@ -527,71 +1780,157 @@ std::vector<EntryDigest> SyncManager::compute_vault_digest() {
     return digest;
 }
 
-std::vector<json> SyncManager::find_entries_to_send(
-    const std::vector<EntryDigest>& local,
-    const std::vector<EntryDigest>& remote) {
-
-    std::vector<json> entries_to_send;
+std::vector<EntryRef> SyncManager::find_entries_by_id(const EntrySnapshot& entries,
+                                                      const std::vector<std::string>& ids) {
+    return entries.find_shared(ids);
+}
 
-    try {
-        // Use the vault entries that were set via set_vault_entries()
-        if (vault_entries_.is_null() || !vault_entries_.is_array()) {
-            return entries_to_send;
+json SyncManager::pin_bases(const EntrySnapshot& entries, const std::vector<std::string>& ids,
+                            BaseVersions& bases) {
+    json described = json::array();
+    for (const json* entry : entries.find(ids)) {
+        if (worth_delta(*entry)) {
+            described.push_back(bases.pin(*entry));
         }
+    }
+    return described;
+}
 
-        for (const auto& local_entry : local) {
-            // Check if entry exists in remote
-            auto remote_it = std::find_if(remote.begin(), remote.end(),
-                [&local_entry](const EntryDigest& rd) { return rd.id == local_entry.id; });
-
-            bool should_send = false;
+size_t SyncManager::replace_with_deltas(std::vector<EntryRef>& entries, const json& bases) {
+    std::unordered_map<std::string, const json*> by_id;
+    for (const auto& base : bases) {
+        if (base.is_object() && base.contains("id") && base["id"].is_string()) {
+            by_id.emplace(base["id"].get_ref<const json::string_t&>().c_str(), &base);
+        }
+    }
+    if (by_id.empty()) {
+        return 0;
+    }
 
-            if (remote_it == remote.end()) {
-                // Entry doesn't exist remotely
-                should_send = true;
-            } else if (local_entry.hash != remote_it->hash) {
-                // Entry exists but is different
-                if (local_entry.modified > remote_it->modified) {
-                    should_send = true;
-                }
-            }
+    // Entries stay whole unless a delta is smaller
+    size_t replaced = 0;
+    for (auto& entry : entries) {
+        auto it = by_id.find(entry->value().value("id", "").c_str());
+        json delta;
+        if (it != by_id.end() && make_entry_delta(entry->value(), *it->second, delta)) {
+            entry = std::make_shared<const EncodedEntry>(std::move(delta));
+            ++replaced;
+        }
+    }
+    return replaced;
+}
 
-            if (should_send) {
-                // Find the full entry in vault data
-                for (const auto& entry : vault_entries_) {
-                    if (entry.is_object() && entry.contains("id") && entry["id"] == local_entry.id) {
-                        entries_to_send.push_back(entry);
-                        break;
-                    }
-                }
+void SyncManager::expand_deltas(std::vector<json>& batch, const BaseVersions& bases,
+                                std::vector<std::string>& failed) {
+    size_t kept = 0;
+    for (auto& item : batch) {
+        if (is_entry_delta(item)) {
+            json entry;
+            if (!bases.expand(item, entry)) {
+                failed.push_back(item["delta"].value("id", "").c_str());
+                continue;
             }
+            item = std::move(entry);
         }
-    } catch (const std::exception& e) {
-        std::cerr << "Error finding entries to send: " << e.what() << std::endl;
+        if (&batch[kept] != &item) {
+            batch[kept] = std::move(item);
+        }
+        ++kept;
+    }
+    batch.resize(kept);
+}
+
+bool SyncManager::exchange_entries(FrameChannel& channel, ExchangeCheckpoint& checkpoint,
+                                   const BatchSink& on_batch, DeviceSyncResult& result) {
+    // Carry on after the batches the server committed; if that was the
+    // last one, only its stream is left
+    std::vector<EntryRef>& outgoing = checkpoint.outgoing;
+    size_t acknowledged = std::min(checkpoint.acknowledged, outgoing.size() / ENTRY_BATCH_SIZE + 1);
+    size_t position = acknowledged * ENTRY_BATCH_SIZE;
+    bool sent = acknowledged > 0 && position >= outgoing.size();
+
+    // The sender only touches the channel's send side and the entries;
+    // this thread reads, applies and counts the batches it committed
+    std::thread sender;
+    std::chrono::microseconds sending{0};
+    if (!sent) {
+        bool keep = !checkpoint.session.empty();
+        sender = std::thread([this, &channel, &outgoing, position, keep, &sent, &sending]() {
+            PhaseTimer timer(sending);
+            sent = send_entries(channel, outgoing, position, keep);
+        });
+    }
+
+    bool received = checkpoint.received_all || receive_entries(channel, checkpoint, on_batch, result);
+    if (!received) {
+        shutdown(channel.socket(), SHUT_RDWR);  // Unblock a sender stuck on a dead peer
     }
+    if (sender.joinable()) {
+        sender.join();
+    }
+    result.timings.send += sending;
 
-    return entries_to_send;
+    if (sent) {
+        result.entries_sent = static_cast<int>(outgoing.size());
+    }
+    return sent && received;
 }
 
-bool SyncManager::send_entries(int socket, const std::vector<json>& entries) {
-    try {
-        json msg = {
-            {"type", "ENTRIES"},
-            {"entries", entries}
-        };
+void SyncManager::next_entry_batch(const std::vector<EntryRef>& entries, size_t& position,
+                                   std::vector<struct iovec>& pieces) {
+    // The message dump() would write: {"entries":[...],"more":...}
+    static const char OPEN[] = "{\"entries\":[";
+    static const char COMMA[] = ",";
+    static const char CLOSE_MORE[] = "],\"more\":true}";
+    static const char CLOSE_LAST[] = "],\"more\":false}";
+    auto piece = [](const char* text, size_t len) {
+        return iovec{const_cast<char*>(text), len};
+    };
+
+    size_t end = std::min(entries.size(), position + ENTRY_BATCH_SIZE);
+    pieces.clear();
+    pieces.push_back(piece(OPEN, sizeof(OPEN) - 1));
+    for (size_t i = position; i < end; ++i) {
+        if (i > position) {
+            pieces.push_back(piece(COMMA, sizeof(COMMA) - 1));
+        }
+        const auto& encoded = entries[i]->encoded();
+        pieces.push_back(piece(encoded.data(), encoded.size()));
+    }
+    if (end < entries.size()) {
+        pieces.push_back(piece(CLOSE_MORE, sizeof(CLOSE_MORE) - 1));
+    } else {
+        pieces.push_back(piece(CLOSE_LAST, sizeof(CLOSE_LAST) - 1));
+    }
+    position = end;
+}
 
-        std::string msg_str = msg.dump() + "\n";  // Add newline delimiter
-        size_t total_sent = 0;
+bool SyncManager::parse_entry_batch(const Message& msg, std::vector<json>& batch) {
+    json parsed = json::parse(msg.payload);
+    if (parsed.contains("entries") && parsed["entries"].is_array()) {
+        batch.reserve(parsed["entries"].size());
+        for (auto& entry : parsed["entries"]) {
+            batch.push_back(std::move(entry));
+        }
+    }
+    return parsed.value("more", false);
+}
 
-        while (total_sent < msg_str.length()) {
-            int sent = send(socket, msg_str.c_str() + total_sent,
-                           msg_str.length() - total_sent, 0);
-            if (sent <= 0) {
+bool SyncManager::send_entries(FrameChannel& channel, std::vector<EntryRef>& entries, size_t position, bool keep) {
+    try {
+        // Always at least one batch, so an empty side still ends its stream
+        std::vector<struct iovec> pieces;
+        pieces.reserve(2 * ENTRY_BATCH_SIZE + 1);
+        do {
+            size_t begin = position;
+            next_entry_batch(entries, position, pieces);
+            if (!channel.send_message(FrameType::ENTRIES, pieces.data(), pieces.size())) {
                 return false;
             }
-            total_sent += sent;
-        }
-
+            if (!keep) {
+                std::fill(entries.begin() + begin, entries.begin() + position, nullptr);
+            }
+        } while (position < entries.size());
         return true;
     } catch (const std::exception& e) {
         std::cerr << "Error sending entries: " << e.what() << std::endl;
@@ -599,73 +1938,44 @@ bool SyncManager::send_entries(int socket, const std::vector<json>& entries) {
     }
 }
 
-std::vector<json> SyncManager::receive_entries(int socket) {
-    std::vector<json> entries;
-
+bool SyncManager::receive_entries(FrameChannel& channel, ExchangeCheckpoint& checkpoint,
+                                  const BatchSink& on_batch, DeviceSyncResult& result) {
     try {
-        // Read until we get a complete message (newline-delimited)
-        std::string entries_data;
-        char buffer[4096];
-        bool complete = false;
-        int total_received = 0;
-
-        while (!complete) {
-            int received = recv(socket, buffer, sizeof(buffer) - 1, 0);
-
-            if (received > 0) {
-                buffer[received] = '\0';
-                entries_data.append(buffer, received);
-                total_received += received;
-
-                // Check if we have a complete message (ends with newline)
-                if (entries_data.find('\n') != std::string::npos) {
-                    complete = true;
+        while (true) {
+            std::vector<json> batch;
+            bool more = false;
+            {
+                PhaseTimer timer(result.timings.receive);
+                Message msg;
+                if (!channel.recv_message(msg)) {
+                    std::cerr << "Connection closed before entries were received" << std::endl;
+                    return false;
                 }
-
-                // Safety limit to prevent infinite loops
-                if (total_received > 10 * 1024 * 1024) {  // 10MB limit
-                    std::cerr << "Message too large, aborting" << std::endl;
-                    break;
-                }
-            } else if (received == 0) {
-                std::cout << "    DEBUG: Connection closed by peer after " << total_received << " bytes" << std::endl;
-                // If we have partial data, still try to parse it
-                if (!entries_data.empty()) {
-                    complete = true;
-                } else {
-                    break;
+                if (msg.type != FrameType::ENTRIES) {
+                    std::cerr << "Expected ENTRIES, got frame type " << static_cast<int>(msg.type) << std::endl;
+                    return false;
                 }
-            } else {
-                std::cout << "    DEBUG: recv failed with error" << std::endl;
-                break;
+                more = parse_entry_batch(msg, batch);
+                expand_deltas(batch, checkpoint.bases, checkpoint.failed);
             }
-        }
-
-        std::cout << "    DEBUG: receive_entries got total " << total_received << " bytes" << std::endl;
 
-        if (!entries_data.empty()) {
-            // Find the end of the JSON object (newline delimiter)
-            size_t entries_newline = entries_data.find('\n');
-            if (entries_newline == std::string::npos) {
-                entries_newline = entries_data.length();
+            // Handled while the peer's next batch is already on its way
+            if (!batch.empty()) {
+                PhaseTimer timer(result.timings.apply);
+                result.entries_received += batch.size();
+                on_batch(batch);
             }
+            ++checkpoint.received;
 
-            std::string entries_json_str = entries_data.substr(0, entries_newline);
-
-            json msg = json::parse(entries_json_str);
-
-            if (msg.contains("type") && msg["type"] == "ENTRIES") {
-                entries = msg["entries"].get<std::vector<json>>();
-                std::cout << "    DEBUG: Parsed " << entries.size() << " entries from message" << std::endl;
-            } else {
-                std::cout << "    DEBUG: Message type is not ENTRIES" << std::endl;
+            if (!more) {
+                checkpoint.received_all = true;
+                return true;
             }
         }
     } catch (const std::exception& e) {
         std::cerr << "Error receiving entries: " << e.what() << std::endl;
+        return false;
     }
-
-    return entries;
 }
 
 std::vector<std::string> SyncManager::apply_changes(
@@ -673,32 +1983,21 @@ std::vector<std::string> SyncManager::apply_changes(
     SyncStrategy strategy) {
 
     std::vector<std::string> conflicts;
+    if (entries.empty()) {
+        return conflicts;
+    }
 
     try {
-        // Work with the vault entries in memory
-        if (vault_entries_.is_null() || !vault_entries_.is_array()) {
-            vault_entries_ = json::array();
-        }
-
-        for (const auto& remote_entry : entries) {
-            if (!remote_entry.is_object() || !remote_entry.contains("id")) {
-                continue;  // Skip invalid entries
-            }
-            std::string entry_id = remote_entry["id"];
-
-            // Find local entry if exists
-            auto local_it = std::find_if(vault_entries_.begin(),
-                                        vault_entries_.end(),
-                [&entry_id](const json& e) { return e["id"] == entry_id; });
+        // Each conflict is resolved against the version current at commit
+        conflicts = entries_.commit(entries,
+            [this, strategy](const json& local_entry, const json& remote_entry) {
+                return resolve_conflict(local_entry, remote_entry, strategy);
+            });
 
-            if (local_it == vault_entries_.end()) {
-                // New entry, add it
-                vault_entries_.push_back(remote_entry);
-            } else {
-                // Existing entry, check for conflict
-                json resolved = resolve_conflict(*local_it, remote_entry, strategy);
-                *local_it = resolved;
-                conflicts.push_back(entry_id);
+        std::lock_guard<std::mutex> lock(hashes_mutex_);
+        for (const auto& entry : entries) {
+            if (entry.is_object() && entry.contains("id") && entry["id"].is_string()) {
+                entry_hashes_.invalidate(entry["id"].get<crypto::SecureString>().c_str());
             }
         }
 
@@ -712,6 +2011,15 @@ std::vector<std::string> SyncManager::apply_changes(
     return conflicts;
 }
 
+size_t SyncManager::apply_deletions(const std::vector<Tombstone>& tombstones) {
+    auto removed = entries_.bury(tombstones);
+    std::lock_guard<std::mutex> lock(hashes_mutex_);
+    for (const auto& id : removed) {
+        entry_hashes_.invalidate(id);
+    }
+    return removed.size();
+}
+
 json SyncManager::resolve_conflict(
     const json& local_entry,
     const json& remote_entry,
@@ -736,13 +2044,53 @@ json SyncManager::resolve_conflict(
     }
 }
 
-void SyncManager::set_passphrase(const std::string& passphrase) {
-    passphrase_ = passphrase;
+void SyncManager::set_passphrase(const crypto::SecureString& passphrase) {
+    // Derive once: Argon2id is too slow to run per session
+    crypto::SecureBytes psk;
+    std::vector<uint8_t> salt;
+    if (!passphrase.empty()) {
+        salt = crypto::generate_salt();
+        psk = derive_sync_psk(passphrase, salt);
+    }
+    std::lock_guard<std::mutex> lock(psk_mutex_);
+    psk_ = std::move(psk);
+    psk_salt_ = std::move(salt);
 }
 
 void SyncManager::set_vault_entries(const json& entries) {
-    vault_entries_ = entries;
-    std::cout << "  SyncManager: Set " << vault_entries_.size() << " vault entries" << std::endl;
+    entries_.assign(entries);
+    {
+        std::lock_guard<std::mutex> lock(hashes_mutex_);
+        entry_hashes_.clear();
+    }
+}
+
+void SyncManager::set_entry_hashes(const storage::EntryHashCache& hashes) {
+    std::lock_guard<std::mutex> lock(hashes_mutex_);
+    entry_hashes_ = hashes;
+}
+
+storage::EntryHashCache SyncManager::get_entry_hashes() const {
+    std::lock_guard<std::mutex> lock(hashes_mutex_);
+    return entry_hashes_;
+}
+
+void SyncManager::set_change_feed(const storage::ChangeFeed& feed) {
+    entries_.restamp(feed);
+    std::lock_guard<std::mutex> lock(feed_mutex_);
+    feed_ = feed;
+    feed_.clear_stamps();
+    feed_.tombstones() = storage::TombstoneSet();
+}
+
+storage::ChangeFeed SyncManager::get_change_feed() const {
+    storage::ChangeFeed feed;
+    {
+        std::lock_guard<std::mutex> lock(feed_mutex_);
+        feed = feed_;
+    }
+    entries_.export_stamps(feed);
+    return feed;
 }
 
 void SyncManager::set_connection_callback(ConnectionCallback callback) {
@@ -0,0 +1,628 @@
+#include "sync/sync_server.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+namespace localpdub {
+namespace sync {
+
+namespace {
+
+constexpr uint64_t LISTEN_ID = 0;
+constexpr uint64_t WAKE_ID = 1;
+constexpr size_t READ_CHUNK = 64 * 1024;
+constexpr size_t READ_BUDGET = 1024 * 1024;  // Per connection per wakeup
+constexpr int MAX_EVENTS = 64;
+constexpr int MAX_WRITE_IOV = 64;
+constexpr int IDLE_CHECK_MS = 1000;
+
+// Written output buffers a connection keeps for reuse, and the largest kept
+constexpr size_t MAX_SPARE_OUTPUT = 4;
+constexpr size_t MAX_SPARE_CAPACITY = 4 * 1024 * 1024;
+
+// Sent in place of SYNC_ACCEPT to clients over the connection limit
+const char SERVER_BUSY[] = "{\"message\":\"Too many sync connections, try again later\"}";
+
+size_t lane_index(ServerConnection::Lane lane) {
+    return lane == ServerConnection::Lane::INPUT ? 0 : 1;
+}
+
+} // namespace
+
+WorkerPool::WorkerPool(size_t threads) {
+    threads = std::max<size_t>(1, threads);
+    for (size_t i = 0; i < threads; ++i) {
+        workers_.emplace_back([this]() { worker_loop(); });
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    stop();
+}
+
+void WorkerPool::submit(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopping_) {
+            return;
+        }
+        queue_.push_back(std::move(task));
+    }
+    cv_.notify_one();
+}
+
+void WorkerPool::stop() {
+    std::deque<std::function<void()>> dropped;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+        dropped.swap(queue_);
+    }
+    cv_.notify_all();
+    for (auto& t : workers_) {
+        if (t.joinable()) t.join();
+    }
+    workers_.clear();
+}
+
+void WorkerPool::worker_loop() {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this]() { return stopping_ || !queue_.empty(); });
+            if (stopping_) {
+                return;
+            }
+            task = std::move(queue_.front());
+            queue_.pop_front();
+        }
+        task();
+    }
+}
+
+ServerConnection::ServerConnection(SyncServer& server, int socket, uint64_t id)
+    : server_(server)
+    , socket_(socket)
+    , id_(id)
+    , last_activity_(std::chrono::steady_clock::now()) {
+}
+
+void ServerConnection::run(Lane lane, std::function<void()> task, std::function<void()> done) {
+    lanes_[lane_index(lane)].queued.emplace_back(std::move(task), std::move(done));
+    start_next(lane);
+}
+
+void ServerConnection::start_next(Lane lane) {
+    LaneState& state = lanes_[lane_index(lane)];
+    if (closed_ || state.busy || state.queued.empty()) {
+        return;
+    }
+    auto next = std::move(state.queued.front());
+    state.queued.pop_front();
+    state.busy = true;
+    server_.submit(shared_from_this(), lane, std::move(next.first), std::move(next.second));
+}
+
+bool ServerConnection::busy(Lane lane) const {
+    const LaneState& state = lanes_[lane_index(lane)];
+    return state.busy || !state.queued.empty();
+}
+
+void ServerConnection::send(FrameType type, const crypto::SecureString& payload) {
+    struct iovec piece = {const_cast<char*>(payload.data()), payload.size()};
+    send(type, &piece, 1);
+}
+
+void ServerConnection::send(FrameType type, const struct iovec* pieces, size_t count) {
+    std::lock_guard<std::mutex> lock(encoder_mutex_);
+    crypto::SecureBytes frames = take_spare();
+    encoder_.encode(type, pieces, count, frames);
+    append_output(std::move(frames));
+}
+
+crypto::SecureBytes ServerConnection::take_spare() {
+    std::lock_guard<std::mutex> lock(output_mutex_);
+    if (spare_.empty()) {
+        return crypto::SecureBytes();
+    }
+    crypto::SecureBytes buffer = std::move(spare_.back());
+    spare_.pop_back();
+    return buffer;
+}
+
+void ServerConnection::send_raw(const std::string& data) {
+    std::lock_guard<std::mutex> lock(encoder_mutex_);
+    append_output(crypto::SecureBytes(data.begin(), data.end()));
+}
+
+void ServerConnection::append_output(crypto::SecureBytes&& data) {
+    std::lock_guard<std::mutex> lock(output_mutex_);
+    pending_bytes_ += data.size();
+    bytes_sent_ += data.size();
+    output_.push_back(std::move(data));
+}
+
+void ServerConnection::set_compression(Compression compression) {
+    {
+        std::lock_guard<std::mutex> lock(encoder_mutex_);
+        encoder_.set_compression(compression);
+    }
+    reader_.enable_decompression(compression);
+}
+
+void ServerConnection::set_ciphers(std::unique_ptr<RecordCipher> send, std::unique_ptr<RecordCipher> receive) {
+    {
+        std::lock_guard<std::mutex> lock(encoder_mutex_);
+        encoder_.set_cipher(std::move(send));
+    }
+
+    // Frames held back for the keys may complete messages right away
+    reader_.enable_decryption(std::move(receive));
+    Message message;
+    while (reader_.next(message)) {
+        inbox_.push_back(std::move(message));
+    }
+}
+
+void ServerConnection::close_after_flush() {
+    closing_ = true;
+    inbox_.clear();
+}
+
+void ServerConnection::abort() {
+    server_.close_connection(*this);
+}
+
+SyncServer::SyncServer(SessionHandler& handler, size_t max_connections, size_t worker_threads,
+                       std::chrono::seconds idle_timeout)
+    : handler_(handler)
+    , max_connections_(max_connections)
+    , idle_timeout_(idle_timeout)
+    , pool_(worker_threads)
+    , next_id_(WAKE_ID + 1)
+    , read_buffer_(READ_CHUNK) {
+}
+
+SyncServer::~SyncServer() {
+    stop();
+}
+
+bool SyncServer::start(int port) {
+    if (running_ || thread_.joinable()) {
+        return false;
+    }
+
+    // Dual-stack where the host has IPv6, so peers found on an IPv6-only
+    // link can connect; IPv4 clients arrive as mapped addresses
+    listen_fd_ = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    bool ipv6 = listen_fd_ >= 0;
+    if (!ipv6) {
+        listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    }
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    bool ok = listen_fd_ >= 0 && epoll_fd_ >= 0 && wake_fd_ >= 0;
+
+    int reuse = 1;
+    ok = ok && setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == 0;
+
+    if (ipv6) {
+        int v6_only = 0;
+        ok = ok && setsockopt(listen_fd_, IPPROTO_IPV6, IPV6_V6ONLY, &v6_only, sizeof(v6_only)) == 0;
+        struct sockaddr_in6 addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sin6_family = AF_INET6;
+        addr.sin6_addr = in6addr_any;
+        addr.sin6_port = htons(port);
+        ok = ok && bind(listen_fd_, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == 0;
+    } else {
+        struct sockaddr_in addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = INADDR_ANY;
+        addr.sin_port = htons(port);
+        ok = ok && bind(listen_fd_, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == 0;
+    }
+    ok = ok && listen(listen_fd_, static_cast<int>(max_connections_)) == 0;
+
+    struct epoll_event ev {};
+    ev.events = EPOLLIN;
+    ev.data.u64 = LISTEN_ID;
+    ok = ok && epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev) == 0;
+    ev.data.u64 = WAKE_ID;
+    ok = ok && epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev) == 0;
+
+    if (!ok) {
+        for (int* fd : {&listen_fd_, &epoll_fd_, &wake_fd_}) {
+            if (*fd >= 0) {
+                close(*fd);
+                *fd = -1;
+            }
+        }
+        return false;
+    }
+
+    running_ = true;
+    thread_ = std::thread([this]() { loop(); });
+    return true;
+}
+
+void SyncServer::stop() {
+    if (!thread_.joinable()) {
+        return;
+    }
+
+    running_ = false;
+    wake();
+    thread_.join();
+
+    // Tasks may still hold connections; let them finish before closing
+    pool_.stop();
+
+    auto connections = connections_;
+    for (auto& entry : connections) {
+        close_connection(*entry.second);
+    }
+    connections_.clear();
+    {
+        std::lock_guard<std::mutex> lock(completions_mutex_);
+        completions_.clear();
+    }
+
+    for (int* fd : {&listen_fd_, &epoll_fd_, &wake_fd_}) {
+        if (*fd >= 0) {
+            close(*fd);
+            *fd = -1;
+        }
+    }
+}
+
+void SyncServer::loop() {
+    struct epoll_event events[MAX_EVENTS];
+
+    while (running_) {
+        int timeout = connections_.empty() ? -1 : IDLE_CHECK_MS;
+        int n = epoll_wait(epoll_fd_, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "Sync server poll failed: " << std::strerror(errno) << std::endl;
+            break;
+        }
+
+        for (int i = 0; i < n && running_; ++i) {
+            uint64_t id = events[i].data.u64;
+            if (id == LISTEN_ID) {
+                accept_clients();
+                continue;
+            }
+            if (id == WAKE_ID) {
+                uint64_t count;
+                while (read(wake_fd_, &count, sizeof(count)) > 0) {
+                }
+                continue;
+            }
+
+            auto it = connections_.find(id);
+            if (it == connections_.end()) {
+                continue;
+            }
+            auto connection = it->second;
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                close_connection(*connection);
+                continue;
+            }
+            if (events[i].events & EPOLLIN) {
+                read_from(*connection);
+            }
+            pump(*connection);
+        }
+
+        run_completions();
+        close_idle();
+    }
+}
+
+void SyncServer::accept_clients() {
+    while (true) {
+        int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;  // EAGAIN, or out of descriptors until a client leaves
+        }
+
+        if (connections_.size() >= max_connections_) {
+            // Best effort: the client reads this in place of SYNC_ACCEPT
+            crypto::SecureBytes frames;
+            FrameEncoder encoder;
+            encoder.encode(FrameType::ERROR, SERVER_BUSY, sizeof(SERVER_BUSY) - 1, frames);
+            send(fd, frames.data(), frames.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+            close(fd);
+            continue;
+        }
+
+        uint64_t id = next_id_++;
+        std::shared_ptr<ServerConnection> connection(new ServerConnection(*this, fd, id));
+        connection->events_ = EPOLLIN;
+
+        struct epoll_event ev {};
+        ev.events = connection->events_;
+        ev.data.u64 = id;
+        if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close(fd);
+            continue;
+        }
+
+        connections_[id] = connection;
+        handler_.on_open(*connection);
+        pump(*connection);
+    }
+}
+
+void SyncServer::read_from(ServerConnection& connection) {
+    size_t budget = READ_BUDGET;
+    while (budget > 0 && connection.inbox_.empty()) {
+        ssize_t received = recv(connection.socket_, read_buffer_.data(), read_buffer_.size(), 0);
+        if (received > 0) {
+            connection.last_activity_ = std::chrono::steady_clock::now();
+            connection.bytes_received_ += received;
+            budget -= std::min(budget, static_cast<size_t>(received));
+            try {
+                connection.reader_.feed(read_buffer_.data(), received);
+            } catch (const std::exception& e) {
+                std::cerr << "Closing sync connection: " << e.what() << std::endl;
+                close_connection(connection);
+                return;
+            }
+
+            if (connection.reader_.legacy_peer()) {
+                connection.input_closed_ = true;
+                handler_.on_legacy_peer(connection);
+                return;
+            }
+
+            Message message;
+            while (connection.reader_.next(message)) {
+                connection.inbox_.push_back(std::move(message));
+            }
+            continue;
+        }
+
+        if (received == 0) {
+            connection.input_closed_ = true;
+            return;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            close_connection(connection);
+        }
+        return;
+    }
+}
+
+void SyncServer::write_to(ServerConnection& connection) {
+    std::unique_lock<std::mutex> lock(connection.output_mutex_);
+    while (!connection.output_.empty()) {
+        struct iovec iov[MAX_WRITE_IOV];
+        int count = 0;
+        size_t offset = connection.output_offset_;
+        for (auto it = connection.output_.begin(); it != connection.output_.end() && count < MAX_WRITE_IOV; ++it) {
+            iov[count].iov_base = it->data() + offset;
+            iov[count].iov_len = it->size() - offset;
+            offset = 0;
+            ++count;
+        }
+
+        struct msghdr msg {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t sent = sendmsg(connection.socket_, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            lock.unlock();
+            close_connection(connection);
+            return;
+        }
+
+        connection.last_activity_ = std::chrono::steady_clock::now();
+        connection.pending_bytes_ -= sent;
+        size_t remaining = sent;
+        while (remaining > 0) {
+            size_t available = connection.output_.front().size() - connection.output_offset_;
+            if (remaining < available) {
+                connection.output_offset_ += remaining;
+                break;
+            }
+            remaining -= available;
+            // Written buffers are kept for the next messages to encode into
+            crypto::SecureBytes& written = connection.output_.front();
+            if (connection.spare_.size() < MAX_SPARE_OUTPUT && written.capacity() <= MAX_SPARE_CAPACITY) {
+                written.clear();
+                connection.spare_.push_back(std::move(written));
+            }
+            connection.output_.pop_front();
+            connection.output_offset_ = 0;
+        }
+    }
+}
+
+// Deliver messages, ask for output, write, and close when finished
+void SyncServer::pump(ServerConnection& connection) {
+    using Lane = ServerConnection::Lane;
+
+    while (!connection.closed_ && !connection.closing_ &&
+           !connection.busy(Lane::INPUT) && !connection.inbox_.empty()) {
+        Message message = std::move(connection.inbox_.front());
+        connection.inbox_.pop_front();
+        handler_.on_message(connection, message);
+    }
+
+    // Write first so output drained by this wakeup counts toward the low
+    // water mark; otherwise EPOLLOUT could go quiet before more is asked for
+    if (!connection.closed_) {
+        write_to(connection);
+    }
+    if (!connection.closed_ && !connection.closing_ && !connection.busy(Lane::OUTPUT) &&
+        connection.pending_output() < OUTPUT_LOW_WATER) {
+        handler_.on_writable(connection);
+        if (!connection.closed_) {
+            write_to(connection);
+        }
+    }
+    if (connection.closed_) {
+        return;
+    }
+
+    bool flushed = connection.pending_output() == 0 && !connection.busy(Lane::OUTPUT);
+    bool peer_gone = connection.input_closed_ && connection.inbox_.empty() &&
+                     !connection.busy(Lane::INPUT);
+    if ((connection.closing_ && flushed) || (peer_gone && !connection.closing_)) {
+        close_connection(connection);
+        return;
+    }
+
+    update_interest(connection);
+}
+
+void SyncServer::update_interest(ServerConnection& connection) {
+    // Stop reading while messages wait for the handler: TCP then pushes back
+    uint32_t events = 0;
+    if (!connection.input_closed_ && !connection.closing_ && connection.inbox_.empty()) {
+        events |= EPOLLIN;
+    }
+    if (connection.pending_output() > 0) {
+        events |= EPOLLOUT;
+    }
+    if (events == connection.events_) {
+        return;
+    }
+
+    struct epoll_event ev {};
+    ev.events = events;
+    ev.data.u64 = connection.id_;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, connection.socket_, &ev) == 0) {
+        connection.events_ = events;
+    }
+}
+
+void SyncServer::close_connection(ServerConnection& connection) {
+    if (connection.closed_) {
+        return;
+    }
+    connection.closed_ = true;
+
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, connection.socket_, nullptr);
+    close(connection.socket_);
+    connection.socket_ = -1;
+    connection.inbox_.clear();
+    for (auto& lane : connection.lanes_) {
+        lane.queued.clear();
+    }
+
+    handler_.on_close(connection);
+    connections_.erase(connection.id_);
+}
+
+void SyncServer::close_idle() {
+    using Lane = ServerConnection::Lane;
+    auto now = std::chrono::steady_clock::now();
+
+    std::vector<std::shared_ptr<ServerConnection>> idle;
+    for (const auto& entry : connections_) {
+        const auto& connection = entry.second;
+        if (!connection->busy(Lane::INPUT) && !connection->busy(Lane::OUTPUT) &&
+            now - connection->last_activity_ > idle_timeout_) {
+            idle.push_back(connection);
+        }
+    }
+    for (auto& connection : idle) {
+        std::cerr << "Closing idle sync connection" << std::endl;
+        close_connection(*connection);
+    }
+}
+
+void SyncServer::submit(std::shared_ptr<ServerConnection> connection, ServerConnection::Lane lane,
+                        std::function<void()> task, std::function<void()> done) {
+    pool_.submit([this, connection, lane, task = std::move(task), done = std::move(done)]() {
+        std::exception_ptr error;
+        try {
+            task();
+        } catch (...) {
+            error = std::current_exception();
+        }
+
+        post([this, connection, lane, done, error]() {
+            connection->lanes_[lane_index(lane)].busy = false;
+            if (connection->closed_) {
+                return;
+            }
+            connection->last_activity_ = std::chrono::steady_clock::now();
+
+            if (error) {
+                try {
+                    std::rethrow_exception(error);
+                } catch (const std::exception& e) {
+                    std::cerr << "Error handling sync client: " << e.what() << std::endl;
+                } catch (...) {
+                    std::cerr << "Error handling sync client" << std::endl;
+                }
+                close_connection(*connection);
+                return;
+            }
+
+            if (done) {
+                done();
+            }
+            if (!connection->closed_) {
+                connection->start_next(lane);
+                pump(*connection);
+            }
+        });
+    });
+}
+
+void SyncServer::post(Completion completion) {
+    {
+        std::lock_guard<std::mutex> lock(completions_mutex_);
+        completions_.push_back(std::move(completion));
+    }
+    wake();
+}
+
+void SyncServer::run_completions() {
+    std::vector<Completion> ready;
+    {
+        std::lock_guard<std::mutex> lock(completions_mutex_);
+        ready.swap(completions_);
+    }
+    for (auto& completion : ready) {
+        completion();
+    }
+}
+
+void SyncServer::wake() {
+    uint64_t one = 1;
+    ssize_t written = write(wake_fd_, &one, sizeof(one));
+    (void)written;  // A full counter already means a pending wakeup
+}
+
+} // namespace sync
+} // namespace localpdub
@@ -112,6 +112,27 @@ EOF
     echo -e "${GREEN}✓ Argon2 built successfully${NC}"
 }
 
+# Build zlib for ARM64
+build_zlib() {
+    echo -e "${YELLOW}Building zlib for ARM64...${NC}"
+
+    if [ ! -f zlib-1.3.1.tar.gz ]; then
+        wget https://zlib.net/fossils/zlib-1.3.1.tar.gz
+    fi
+
+    rm -rf zlib-1.3.1
+    tar -xzf zlib-1.3.1.tar.gz
+    cd zlib-1.3.1
+
+    # zlib's configure reads CC/AR/RANLIB from the environment
+    ./configure --prefix="$PREFIX" --static
+    make -j$(nproc)
+    make install
+
+    cd ..
+    echo -e "${GREEN}✓ zlib built successfully${NC}"
+}
+
 # Build nlohmann-json (header-only, just copy)
 install_nlohmann_json() {
     echo -e "${YELLOW}Installing nlohmann-json...${NC}"
@@ -150,6 +171,7 @@ main() {
     # Build dependencies
     build_openssl
     build_argon2
+    build_zlib
     install_nlohmann_json
 
     echo -e "${GREEN}==================================="